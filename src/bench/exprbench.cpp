@@ -0,0 +1,956 @@
+// exprbench.cpp
+//
+// Performance harness for the exprparse library
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <regex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace {
+    // Expression corpora used by the parsing benchmarks. Each benchmark is
+    // registered once per shape, so results can be compared shape by shape
+    // between releases.
+    typedef enum { SMALL, DEEP, LONG } Shape;
+
+    // Short hand written formulas, including scientific notation
+    vector<string> make_small_corpus() {
+        return { "1",
+                 "-5",
+                 " 10.0",
+                 "10.0 + 5.0",
+                 "2.5*5.0",
+                 "5.0-3.0*5.0",
+                 "5.0+4.0**-0.5",
+                 "3.0^2.0^3.0",
+                 "(12.0+4.0)^-0.5",
+                 "(12.0+4.0)^0.5/5.0",
+                 "-10.0/+3.0",
+                 "10.0E+05*2.0-.2E+05",
+                 "[1.5 + 2.25] * (3.125 - .5) / 7e-3",
+                 "((((1+2)*3)-4)/5)^2" };
+    }
+
+    // Nested brackets of both kinds, right associative power chains and
+    // runs of unary minus, a few hundred levels deep
+    vector<string> make_deep_corpus() {
+        vector<string> corpus;
+        for (int depth : { 16, 64, 256 }) {
+            string nested;
+            for (int i = 0; i < depth; i++) nested += (i % 2 ? "[" : "(") + to_string(i + 1) + "*";
+            nested += "1";
+            for (int i = depth - 1; i >= 0; i--) nested += (i % 2 ? "]" : ")");
+            corpus.push_back(nested);
+
+            string power;
+            for (int i = 0; i < depth; i++) power += "1.0001^";
+            corpus.push_back(power + "2");
+
+            string minus;
+            for (int i = 0; i < depth; i++) minus += "-";
+            corpus.push_back(minus + "3.5");
+        }
+        return corpus;
+    }
+
+    // Flat machine generated expressions of a few thousand characters
+    vector<string> make_long_corpus() {
+        vector<string> corpus;
+        for (int terms : { 200, 2000 }) {
+            string sum;
+            for (int i = 0; i < terms; i++) {
+                if (i) sum += (i % 3 == 0) ? " - " : " + ";
+                sum += to_string(i) + "." + to_string(i % 7) + "e-" + to_string(i % 4);
+            }
+            corpus.push_back(sum);
+
+            string product;
+            for (int i = 0; i < terms; i++) {
+                if (i) product += (i % 2 == 0) ? " * " : " / ";
+                product += to_string(1.0 + (double)(i % 9) / 8.0);
+            }
+            corpus.push_back(product);
+        }
+        return corpus;
+    }
+
+    const vector<string>& get_corpus(Shape shape) {
+        static const vector<string> corpora[] = { make_small_corpus(), make_deep_corpus(), make_long_corpus() };
+        return corpora[shape];
+    }
+
+    size_t count_bytes(const vector<string>& corpus) {
+        size_t bytes = 0;
+        for (const string& expr : corpus) bytes += expr.size();
+        return bytes;
+    }
+
+    // The std::regex tokenizer exprparse used before the hand written lexer.
+    // Kept here so the two can be compared on the same corpus.
+    struct ReferenceRegex {
+        exprparse::TokenType ttype;
+        regex regexpr;
+    };
+
+    const ReferenceRegex g_reference_reg[] = {
+        { exprparse::NUMBER, regex(R"(^([0-9]+\.?|\.[0-9]+)[0-9]*([eE][+-]?[0-9]+)?)") },
+        { exprparse::OPERATOR, regex(R"(^\*\*)") },
+        { exprparse::OPERATOR, regex(R"(^\^)") },
+        { exprparse::OPERATOR, regex(R"(^\*)") },
+        { exprparse::OPERATOR, regex(R"(^/)") },
+        { exprparse::OPERATOR, regex(R"(^\+)") },
+        { exprparse::OPERATOR, regex(R"(^\-)") },
+        { exprparse::LEFT_BRACKET, regex(R"(^\()") },
+        { exprparse::LEFT_BRACKET, regex(R"(^\[)") },
+        { exprparse::RIGHT_BRACKET, regex(R"a(^\))a") },
+        { exprparse::RIGHT_BRACKET, regex(R"(^\])") }
+    };
+
+    // Returns number of tokens found, or 0 on an unknown token
+    size_t reference_tokenize(const string& expression, double* checksum) {
+        size_t num_tokens = 0;
+        string::const_iterator expr_iter = expression.begin();
+        smatch matches;
+        for (;;) {
+            while (expr_iter != expression.end() &&
+                   (*expr_iter == ' ' || *expr_iter == '\t' || *expr_iter == '\r' ||
+                    *expr_iter == '\f' || *expr_iter == '\n'))
+                expr_iter++;
+            if (expr_iter == expression.end()) break;
+
+            bool match_found = false;
+            for (const ReferenceRegex& tok_reg : g_reference_reg) {
+                if (regex_search(expr_iter, expression.end(), matches, tok_reg.regexpr)) {
+                    expr_iter += matches[0].length();
+                    if (tok_reg.ttype == exprparse::NUMBER)
+                        *checksum += atof(matches[0].str().c_str());
+                    num_tokens++;
+                    match_found = true;
+                    break;
+                }
+            }
+            if (!match_found) return 0;
+        }
+        return num_tokens;
+    }
+
+    size_t lexer_tokenize(const string& expression, exprparse::ParseArena* arena, double* checksum) {
+        arena->reset();
+        exprparse::TokenList tokens((exprparse::ArenaAllocator<exprparse::Token>(arena)));
+        size_t num_tokens = 0;
+        if (exprparse::tokenize_expr(expression, tokens) == exprparse::Status::SUCCESS) {
+            num_tokens = tokens.size();
+            for (const exprparse::Token& tok : tokens) {
+                if (tok.ttype == exprparse::NUMBER) *checksum += tok.number;
+            }
+        }
+        return num_tokens;
+    }
+
+    // Token and RPN lists for each expression of a corpus, all held in arena
+    vector<exprparse::TokenList> tokenize_corpus(const vector<string>& corpus, exprparse::ParseArena* arena) {
+        vector<exprparse::TokenList> lists;
+        for (const string& expr : corpus) {
+            lists.emplace_back(exprparse::ArenaAllocator<exprparse::Token>(arena));
+            exprparse::tokenize_expr(expr, lists.back());
+        }
+        return lists;
+    }
+
+    vector<exprparse::TokenList> convert_corpus(const vector<exprparse::TokenList>& token_lists, exprparse::ParseArena* arena) {
+        vector<exprparse::TokenList> lists;
+        for (const exprparse::TokenList& tokens : token_lists) {
+            lists.emplace_back(exprparse::ArenaAllocator<exprparse::Token>(arena));
+            exprparse::convert_tokens_to_rpn(tokens, lists.back());
+        }
+        return lists;
+    }
+
+    // Turns the expression cache off for the lifetime of the object
+    class CacheDisabled {
+    public:
+        CacheDisabled() {
+            exprparse::set_expression_cache_capacity(0);
+        }
+        ~CacheDisabled() {
+            exprparse::set_expression_cache_capacity(1024);
+        }
+    };
+
+    // Columns shared by the batch and engine benchmarks
+    const size_t BATCH_ROWS = 1 << 20;
+    const string BATCH_EXPRESSION = "3.2*(x+1) - y/2 + x^2 - x*y";
+
+    typedef struct Columns {
+        vector<double> x;
+        vector<double> y;
+    } Columns;
+
+    const Columns& get_columns(size_t n_rows) {
+        static Columns columns;
+        if (columns.x.size() < n_rows) {
+            columns.x.resize(n_rows);
+            columns.y.resize(n_rows);
+            for (size_t i = 0; i < n_rows; i++) {
+                columns.x[i] = 0.001 * (double)(i % 5000);
+                columns.y[i] = 1.0 + (double)(i % 17);
+            }
+        }
+        return columns;
+    }
+
+    // Tokenizing with the old std::regex tokenizer, as a baseline for the lexer
+    void BM_TokenizeRegex(benchmark::State& state, Shape shape) {
+        const vector<string>& corpus = get_corpus(shape);
+        exprparse::ParseArena arena;
+        double checksum_ref = 0.0, checksum_lex = 0.0;
+        size_t tokens_ref = 0, tokens_lex = 0;
+        for (const string& expr : corpus) {
+            tokens_ref += reference_tokenize(expr, &checksum_ref);
+            tokens_lex += lexer_tokenize(expr, &arena, &checksum_lex);
+        }
+        if (tokens_ref != tokens_lex || checksum_ref != checksum_lex) {
+            state.SkipWithError("regex and lexer tokens differ");
+            return;
+        }
+
+        double checksum = 0.0;
+        for (auto _ : state) {
+            for (const string& expr : corpus) reference_tokenize(expr, &checksum);
+        }
+        benchmark::DoNotOptimize(checksum);
+        state.SetItemsProcessed((int64_t)(state.iterations() * tokens_ref));
+        state.SetBytesProcessed((int64_t)(state.iterations() * count_bytes(corpus)));
+    }
+
+    void BM_Tokenize(benchmark::State& state, Shape shape) {
+        const vector<string>& corpus = get_corpus(shape);
+        exprparse::ParseArena arena;
+        double checksum = 0.0;
+        size_t num_tokens = 0;
+        for (auto _ : state) {
+            num_tokens = 0;
+            for (const string& expr : corpus) num_tokens += lexer_tokenize(expr, &arena, &checksum);
+        }
+        benchmark::DoNotOptimize(checksum);
+        state.SetItemsProcessed((int64_t)(state.iterations() * num_tokens));
+        state.SetBytesProcessed((int64_t)(state.iterations() * count_bytes(corpus)));
+    }
+
+    // Shunting yard conversion of already tokenized expressions
+    void BM_ConvertToRpn(benchmark::State& state, Shape shape) {
+        exprparse::ParseArena token_arena, rpn_arena;
+        vector<exprparse::TokenList> token_lists = tokenize_corpus(get_corpus(shape), &token_arena);
+        size_t num_tokens = 0;
+        for (const exprparse::TokenList& tokens : token_lists) num_tokens += tokens.size();
+
+        for (auto _ : state) {
+            rpn_arena.reset();
+            for (const exprparse::TokenList& tokens : token_lists) {
+                exprparse::TokenList rpn_tokens((exprparse::ArenaAllocator<exprparse::Token>(&rpn_arena)));
+                exprparse::convert_tokens_to_rpn(tokens, rpn_tokens);
+                benchmark::DoNotOptimize(rpn_tokens.data());
+            }
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * num_tokens));
+    }
+
+    // Evaluation of already converted RPN token lists
+    void BM_EvaluateRpn(benchmark::State& state, Shape shape) {
+        exprparse::ParseArena token_arena, rpn_arena;
+        vector<exprparse::TokenList> token_lists = tokenize_corpus(get_corpus(shape), &token_arena);
+        vector<exprparse::TokenList> rpn_lists = convert_corpus(token_lists, &rpn_arena);
+
+        double result;
+        for (auto _ : state) {
+            for (const exprparse::TokenList& rpn_tokens : rpn_lists) {
+                exprparse::eval_rpn_tokens(rpn_tokens, NULL, &result);
+                benchmark::DoNotOptimize(result);
+            }
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * rpn_lists.size()));
+    }
+
+    // parse_expression from text to result, without the cache
+    void BM_ParseExpression(benchmark::State& state, Shape shape) {
+        const vector<string>& corpus = get_corpus(shape);
+        CacheDisabled cache_disabled;
+        double result;
+        for (auto _ : state) {
+            for (const string& expr : corpus) {
+                exprparse::parse_expression(expr, &result);
+                benchmark::DoNotOptimize(result);
+            }
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * corpus.size()));
+        state.SetBytesProcessed((int64_t)(state.iterations() * count_bytes(corpus)));
+    }
+
+    void BM_ParseExpressionArena(benchmark::State& state, Shape shape) {
+        const vector<string>& corpus = get_corpus(shape);
+        CacheDisabled cache_disabled;
+        exprparse::ParseArena arena;
+        double result;
+        for (auto _ : state) {
+            for (const string& expr : corpus) {
+                exprparse::parse_expression(expr, &arena, &result);
+                benchmark::DoNotOptimize(result);
+            }
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * corpus.size()));
+        state.SetBytesProcessed((int64_t)(state.iterations() * count_bytes(corpus)));
+    }
+
+    void BM_ParseExpressionCached(benchmark::State& state, Shape shape) {
+        const vector<string>& corpus = get_corpus(shape);
+        exprparse::clear_expression_cache();
+        double result;
+        for (auto _ : state) {
+            for (const string& expr : corpus) {
+                exprparse::parse_expression(expr, &result);
+                benchmark::DoNotOptimize(result);
+            }
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * corpus.size()));
+        state.SetBytesProcessed((int64_t)(state.iterations() * count_bytes(corpus)));
+    }
+
+    void BM_EvaluateCompiled(benchmark::State& state, Shape shape) {
+        const vector<string>& corpus = get_corpus(shape);
+        vector<exprparse::CompiledExpression> compiled(corpus.size());
+        size_t unoptimized_size = 0, optimized_size = 0;
+        for (size_t i = 0; i < corpus.size(); i++) {
+            if (exprparse::compile_expression(corpus[i], &compiled[i]) != exprparse::Status::SUCCESS) {
+                state.SkipWithError(("failed to compile " + corpus[i]).c_str());
+                return;
+            }
+            unoptimized_size += compiled[i].unoptimized_size();
+            optimized_size += compiled[i].size();
+        }
+
+        double result;
+        for (auto _ : state) {
+            for (const exprparse::CompiledExpression& expr : compiled) {
+                expr.evaluate(&result);
+                benchmark::DoNotOptimize(result);
+            }
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * corpus.size()));
+        state.counters["instructions"] = (double)optimized_size;
+        state.counters["unoptimized_instructions"] = (double)unoptimized_size;
+    }
+
+#define EXPRPARSE_SHAPES(func)                                                                   \
+    BENCHMARK_CAPTURE(func, small, SMALL);                                                       \
+    BENCHMARK_CAPTURE(func, deep, DEEP);                                                         \
+    BENCHMARK_CAPTURE(func, long, LONG)
+
+    // std::regex takes seconds on the long corpus, so that shape is skipped
+    BENCHMARK_CAPTURE(BM_TokenizeRegex, small, SMALL);
+    BENCHMARK_CAPTURE(BM_TokenizeRegex, deep, DEEP);
+    EXPRPARSE_SHAPES(BM_Tokenize);
+    EXPRPARSE_SHAPES(BM_ConvertToRpn);
+    EXPRPARSE_SHAPES(BM_EvaluateRpn);
+    EXPRPARSE_SHAPES(BM_ParseExpression);
+    EXPRPARSE_SHAPES(BM_ParseExpressionArena);
+    EXPRPARSE_SHAPES(BM_ParseExpressionCached);
+    EXPRPARSE_SHAPES(BM_EvaluateCompiled);
+
+    // One row at a time through CompiledExpression::evaluate, interpreted
+    // or as machine code
+    void BM_EvaluateRow(benchmark::State& state, bool native) {
+        const Columns& columns = get_columns(BATCH_ROWS);
+        double x_value, y_value;
+        exprparse::SymbolTable symbols;
+        symbols.bind("x", &x_value);
+        symbols.bind("y", &y_value);
+        exprparse::CompiledExpression compiled;
+        if (exprparse::compile_expression(BATCH_EXPRESSION, symbols, &compiled) != exprparse::Status::SUCCESS) {
+            state.SkipWithError("failed to compile");
+            return;
+        }
+        if (native && compiled.compile_native() != exprparse::Status::SUCCESS) {
+            state.SkipWithError("JIT not supported");
+            return;
+        }
+
+        vector<double> out(BATCH_ROWS);
+        for (auto _ : state) {
+            for (size_t i = 0; i < BATCH_ROWS; i++) {
+                x_value = columns.x[i];
+                y_value = columns.y[i];
+                compiled.evaluate(&out[i]);
+            }
+            benchmark::DoNotOptimize(out.data());
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * BATCH_ROWS));
+    }
+    BENCHMARK_CAPTURE(BM_EvaluateRow, interpreted, false);
+    BENCHMARK_CAPTURE(BM_EvaluateRow, native, true);
+
+    // An expression nested 200 deep, too deep for the buffer evaluate keeps
+    // on the stack, evaluated with a stack from the heap each call or with
+    // one given by the caller
+    void BM_EvaluateDeepStack(benchmark::State& state, bool caller_stack) {
+        string expression;
+        for (int i = 0; i < 200; i++) expression += "x*(1 + ";
+        expression += "x";
+        for (int i = 0; i < 200; i++) expression += ")";
+        double x_value = 0.5, result;
+        exprparse::SymbolTable symbols;
+        symbols.bind("x", &x_value);
+        exprparse::CompiledExpression compiled;
+        exprparse::compile_expression(expression, symbols, &compiled);
+        vector<double> stack(compiled.stack_depth());
+        for (auto _ : state) {
+            if (caller_stack)
+                compiled.evaluate(&result, stack.data(), stack.size());
+            else
+                compiled.evaluate(&result);
+            benchmark::DoNotOptimize(result);
+        }
+        state.counters["depth"] = (double)compiled.stack_depth();
+    }
+    BENCHMARK_CAPTURE(BM_EvaluateDeepStack, heap, false);
+    BENCHMARK_CAPTURE(BM_EvaluateDeepStack, caller, true);
+
+    // evaluate_batch at each SimdLevel, on columns of T
+    template <class T = double> void run_batch(benchmark::State& state, const string& expression) {
+        exprparse::SimdLevel level = (exprparse::SimdLevel)state.range(0);
+        if (exprparse::set_simd_level(level) != exprparse::Status::SUCCESS) {
+            state.SkipWithError("instruction set not supported");
+            return;
+        }
+        const Columns& columns = get_columns(BATCH_ROWS);
+        exprparse::CompiledExpression compiled;
+        exprparse::compile_expression(expression, &compiled);
+        vector<T> x(columns.x.begin(), columns.x.end()), y(columns.y.begin(), columns.y.end());
+        const T* column_ptrs[] = { x.data(), y.data() };
+        vector<T> out(BATCH_ROWS);
+        for (auto _ : state) {
+            exprparse::evaluate_batch(compiled, column_ptrs, BATCH_ROWS, out.data());
+            benchmark::DoNotOptimize(out.data());
+        }
+        exprparse::set_simd_level(exprparse::get_max_simd_level());
+        state.SetItemsProcessed((int64_t)(state.iterations() * BATCH_ROWS));
+    }
+
+    void BM_EvaluateBatch(benchmark::State& state) {
+        run_batch(state, BATCH_EXPRESSION);
+    }
+    BENCHMARK(BM_EvaluateBatch)->DenseRange(exprparse::SIMD_SCALAR, exprparse::SIMD_AVX512)->ArgName("level");
+
+    // Built in functions with vector kernels, called directly by the program
+    void BM_EvaluateBatchFunctions(benchmark::State& state) {
+        run_batch(state, "max(x, y, 0.5) + sqrt(abs(x)) - sum(x, y, x*y, 1)");
+    }
+    BENCHMARK(BM_EvaluateBatchFunctions)->DenseRange(exprparse::SIMD_SCALAR, exprparse::SIMD_AVX512)->ArgName("level");
+
+    // The same as BM_EvaluateBatch on floats, with x^2 computed in double
+    void BM_EvaluateBatchFloat(benchmark::State& state) {
+        run_batch<float>(state, BATCH_EXPRESSION);
+    }
+    BENCHMARK(BM_EvaluateBatchFloat)->DenseRange(exprparse::SIMD_SCALAR, exprparse::SIMD_AVX512)->ArgName("level");
+
+    // Only float kernels, no conversion to double
+    void BM_EvaluateBatchFloatOperators(benchmark::State& state) {
+        run_batch<float>(state, "3.2*(x+1) - y/2 + x*x - x*y");
+    }
+    BENCHMARK(BM_EvaluateBatchFloatOperators)
+        ->DenseRange(exprparse::SIMD_SCALAR, exprparse::SIMD_AVX512)
+        ->ArgName("level");
+
+    // A filter over a table stored in zones of 1024 rows, each with the
+    // minimum and maximum of every column. Every zone is evaluated, or the
+    // zones are first bounded by evaluate_bounds_batch and only those that
+    // may pass are evaluated. With t sorted the zones cover narrow ranges
+    // of t and most are skipped. Shuffled, every zone covers all of t and
+    // none are.
+    void BM_ZoneMapFilter(benchmark::State& state) {
+        const size_t n_rows = 1 << 20, zone_rows = 1024, n_zones = n_rows / zone_rows;
+        const double threshold = 60.0;
+        bool prune = state.range(0) != 0, sorted = state.range(1) != 0;
+        mt19937_64 rng(22);
+        uniform_real_distribution<double> unit(0.0, 1.0);
+        vector<double> t(n_rows), v(n_rows);
+        for (size_t i = 0; i < n_rows; i++) {
+            t[i] = 1000.0 * (double)i / (double)n_rows;
+            v[i] = unit(rng);
+        }
+        if (!sorted) shuffle(t.begin(), t.end(), rng);
+
+        vector<double> t_lo(n_zones), t_hi(n_zones), v_lo(n_zones), v_hi(n_zones);
+        for (size_t zone = 0; zone < n_zones; zone++) {
+            auto t_range = minmax_element(t.begin() + zone * zone_rows, t.begin() + (zone + 1) * zone_rows);
+            auto v_range = minmax_element(v.begin() + zone * zone_rows, v.begin() + (zone + 1) * zone_rows);
+            t_lo[zone] = *t_range.first;
+            t_hi[zone] = *t_range.second;
+            v_lo[zone] = *v_range.first;
+            v_hi[zone] = *v_range.second;
+        }
+
+        exprparse::CompiledExpression compiled;
+        exprparse::compile_expression("sqrt(t) * 2 + v^2 - 1 / (1 + t)", &compiled);
+        const double* lo_columns[] = { t_lo.data(), v_lo.data() };
+        const double* hi_columns[] = { t_hi.data(), v_hi.data() };
+        vector<double> zone_lo(n_zones), zone_hi(n_zones, INFINITY), out(zone_rows);
+        size_t matches = 0, skipped = 0;
+        for (auto _ : state) {
+            matches = 0;
+            skipped = 0;
+            if (prune) {
+                exprparse::evaluate_bounds_batch(compiled, lo_columns, hi_columns, n_zones, zone_lo.data(),
+                                                 zone_hi.data());
+            }
+            for (size_t zone = 0; zone < n_zones; zone++) {
+                if (!(zone_hi[zone] > threshold)) {
+                    skipped++;
+                    continue;
+                }
+                const double* columns[] = { t.data() + zone * zone_rows, v.data() + zone * zone_rows };
+                exprparse::evaluate_batch(compiled, columns, zone_rows, out.data());
+                for (double value : out) matches += value > threshold;
+            }
+            benchmark::DoNotOptimize(matches);
+        }
+        state.counters["skipped"] = (double)skipped / (double)n_zones;
+        state.counters["matches"] = (double)matches;
+        state.SetItemsProcessed((int64_t)(state.iterations() * n_rows));
+    }
+    BENCHMARK(BM_ZoneMapFilter)
+        ->Args({ 0, 1 })
+        ->Args({ 1, 1 })
+        ->Args({ 0, 0 })
+        ->Args({ 1, 0 })
+        ->ArgNames({ "prune", "sorted" })
+        ->Unit(benchmark::kMillisecond);
+
+    // Scaling of EvaluationEngine from 1 to 64 threads on one long batch
+    void BM_EngineBatch(benchmark::State& state) {
+        const size_t n_rows = 4 * BATCH_ROWS;
+        const Columns& columns = get_columns(n_rows);
+        exprparse::CompiledExpression compiled;
+        exprparse::compile_expression(BATCH_EXPRESSION, &compiled);
+        const double* column_ptrs[] = { columns.x.data(), columns.y.data() };
+        vector<double> out(n_rows);
+        exprparse::EvaluationEngine engine((size_t)state.range(0));
+        for (auto _ : state) {
+            engine.evaluate_batch(compiled, column_ptrs, n_rows, out.data());
+            benchmark::DoNotOptimize(out.data());
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * n_rows));
+    }
+    BENCHMARK(BM_EngineBatch)->RangeMultiplier(2)->Range(1, 64)->ArgName("threads")->UseRealTime();
+
+    // Same on a set of expressions over the same columns
+    void BM_EngineExpressionSet(benchmark::State& state) {
+        const vector<string> sources = { "3.2*(x+1) - y/2 + x^2 - x*y",
+                                         "x*x + y*y",
+                                         "(x - y)/(x + y + 1)",
+                                         "x^0.5 * y^1.5",
+                                         "-x + 2*y - 3*x*y",
+                                         "((x+1)*(y+2)*(x+3))/(y+4)",
+                                         "x/y",
+                                         "y^x" };
+        const size_t n_rows = 4 * BATCH_ROWS / sources.size();
+        const Columns& columns = get_columns(n_rows);
+        exprparse::SymbolTable column_table;
+        column_table.bind("x", columns.x.data());
+        column_table.bind("y", columns.y.data());
+
+        vector<exprparse::CompiledExpression> expressions(sources.size());
+        for (size_t i = 0; i < sources.size(); i++) exprparse::compile_expression(sources[i], &expressions[i]);
+        vector<vector<double>> results(sources.size(), vector<double>(n_rows));
+        vector<double*> out;
+        for (vector<double>& result : results) out.push_back(result.data());
+
+        exprparse::EvaluationEngine engine((size_t)state.range(0));
+        for (auto _ : state) {
+            engine.evaluate_batch(expressions, column_table, n_rows, out.data());
+            benchmark::DoNotOptimize(out.data());
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * n_rows * sources.size()));
+    }
+    BENCHMARK(BM_EngineExpressionSet)->RangeMultiplier(2)->Range(1, 64)->ArgName("threads")->UseRealTime();
+
+    // Features derived from the same inputs, which repeat each other's
+    // subexpressions. Evaluated one expression at a time with
+    // evaluate_batch, and as one ExpressionSet computing each shared
+    // subexpression once.
+    void BM_SharedSubexpressions(benchmark::State& state) {
+        const vector<string> sources = { "sqrt(x*x + y*y)",
+                                         "sqrt(x*x + y*y) / (abs(x) + 1)",
+                                         "log(1 + sqrt(x*x + y*y)) * (x - y)",
+                                         "(x - y) / (x + y + 1) + sqrt(x*x + y*y)",
+                                         "exp(-(x - y)^2) * log(1 + sqrt(x*x + y*y))",
+                                         "max(x - y, (x - y) / (x + y + 1), 0)",
+                                         "exp(-(x - y)^2) + (x - y)^2",
+                                         "abs(x) + 1 - exp(-(x - y)^2)" };
+        const size_t n_rows = BATCH_ROWS;
+        const Columns& columns = get_columns(n_rows);
+        exprparse::SymbolTable column_table;
+        column_table.bind("x", columns.x.data());
+        column_table.bind("y", columns.y.data());
+        vector<vector<double>> results(sources.size(), vector<double>(n_rows));
+        vector<double*> out;
+        for (vector<double>& result : results) out.push_back(result.data());
+
+        if (state.range(0) == 0) {
+            vector<exprparse::CompiledExpression> expressions(sources.size());
+            for (size_t i = 0; i < sources.size(); i++) exprparse::compile_expression(sources[i], &expressions[i]);
+            for (auto _ : state) {
+                for (size_t i = 0; i < sources.size(); i++) {
+                    const double* column_ptrs[2];
+                    for (size_t slot = 0; slot < expressions[i].num_variables(); slot++)
+                        column_ptrs[slot] = column_table.find(expressions[i].variable_name(slot));
+                    exprparse::evaluate_batch(expressions[i], column_ptrs, n_rows, out[i]);
+                }
+                benchmark::DoNotOptimize(out.data());
+            }
+        } else {
+            exprparse::ExpressionSet set;
+            exprparse::compile_expression_set(sources, &set);
+            exprparse::SharingReport report = set.sharing();
+            for (auto _ : state) {
+                set.evaluate_batch(column_table, n_rows, out.data());
+                benchmark::DoNotOptimize(out.data());
+            }
+            state.counters["instructions"] = (double)report.instructions;
+            state.counters["nodes"] = (double)report.nodes;
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * n_rows * sources.size()));
+    }
+    BENCHMARK(BM_SharedSubexpressions)->Arg(0)->Arg(1)->ArgName("shared");
+
+    // A sheet of formulas over a few thousand cells, of which 10 change each
+    // tick. Ticks are run by parsing every formula again, by evaluating the
+    // whole ExpressionSet, and by an IncrementalEvaluator recomputing only
+    // what the changed cells feed.
+    void BM_SheetTick(benchmark::State& state) {
+        const size_t n_cells = 4000;
+        const size_t n_formulas = 20000;
+        mt19937_64 rng(19);
+        vector<string> sources;
+        for (size_t i = 0; i < n_formulas; i++) {
+            string a = "c" + to_string(rng() % n_cells), b = "c" + to_string(rng() % n_cells);
+            sources.push_back(a + " * (1 + rate) - " + b + " / 2 + max(" + a + ", " + b + ", 0)");
+        }
+        vector<double> cells(n_cells + 1, 1.0);
+        vector<string> names;
+        exprparse::SymbolTable symbols;
+        for (size_t i = 0; i < n_cells; i++) {
+            names.push_back("c" + to_string(i));
+            symbols.bind(names.back(), &cells[i]);
+        }
+        symbols.bind("rate", &cells[n_cells]);
+
+        exprparse::ExpressionSet set;
+        exprparse::compile_expression_set(sources, &set);
+        exprparse::IncrementalEvaluator evaluator(set, symbols);
+        vector<double> results(n_formulas);
+        evaluator.evaluate(results.data());
+        size_t recomputed = 0;
+        for (auto _ : state) {
+            for (size_t i = 0; i < 10; i++) {
+                size_t cell = rng() % n_cells;
+                cells[cell] += 1.0;
+                evaluator.mark_changed(names[cell]);
+            }
+            if (state.range(0) == 0) {
+                for (size_t i = 0; i < n_formulas; i++) exprparse::parse_expression(sources[i], symbols, &results[i]);
+            } else if (state.range(0) == 1) {
+                set.evaluate(symbols, results.data());
+            } else {
+                size_t tick_recomputed;
+                evaluator.evaluate(results.data(), NULL, &tick_recomputed);
+                recomputed += tick_recomputed;
+            }
+            benchmark::DoNotOptimize(results.data());
+        }
+        if (state.range(0) == 2) state.counters["recomputed"] = (double)recomputed / (double)state.iterations();
+        state.counters["nodes"] = (double)set.sharing().nodes;
+    }
+    BENCHMARK(BM_SheetTick)->Arg(0)->Arg(1)->Arg(2)->ArgName("mode")->Unit(benchmark::kMicrosecond);
+
+    // Catalog of formulas a worker loads at startup, shaped like pricing
+    // rules: a few variables, constants, calls and brackets each
+    const size_t CATALOG_FORMULAS = 200000;
+    const char* const CATALOG_VARIABLES[] = { "price", "qty", "rate", "fee", "tax", "discount" };
+    const double CATALOG_VALUES[] = { 10.0, 3.0, 0.05, 1.5, 0.2, 5.0 };
+
+    const vector<string>& get_catalog_formulas() {
+        static vector<string> formulas;
+        if (formulas.empty()) {
+            mt19937_64 rng(17);
+            for (size_t i = 0; i < CATALOG_FORMULAS; i++) {
+                string a = CATALOG_VARIABLES[rng() % 6];
+                string b = CATALOG_VARIABLES[rng() % 6];
+                string c = CATALOG_VARIABLES[rng() % 6];
+                string k1 = to_string(rng() % 1000) + "." + to_string(rng() % 100);
+                string k2 = to_string(rng() % 50 + 1) + "e-" + to_string(rng() % 4);
+                switch (i % 4) {
+                case 0:
+                    formulas.push_back(a + " * (1 + " + b + ") - " + k1 + " / " + c);
+                    break;
+                case 1:
+                    formulas.push_back("max(" + a + " - " + k2 + ", 0) * " + b + " + min(" + c + ", " + k1 + ")");
+                    break;
+                case 2:
+                    formulas.push_back("[" + a + " + " + b + "]^2 * " + k2 + " - sqrt(abs(" + c + " - " + k1 + "))");
+                    break;
+                default:
+                    formulas.push_back(a + " * " + b + " * (1 - " + c + " / 100) + " + k1 + " * " + k2);
+                    break;
+                }
+            }
+        }
+        return formulas;
+    }
+
+    // Worker start up from the formula text: every formula is compiled,
+    // then evaluated once like those of the catalog below
+    void BM_ColdStartSource(benchmark::State& state) {
+        const vector<string>& formulas = get_catalog_formulas();
+        CacheDisabled cache_disabled;
+        exprparse::SymbolTable symbols;
+        for (size_t i = 0; i < 6; i++) symbols.bind(CATALOG_VARIABLES[i], &CATALOG_VALUES[i]);
+        for (auto _ : state) {
+            vector<exprparse::CompiledExpression> compiled(formulas.size());
+            double result;
+            for (size_t i = 0; i < formulas.size(); i++) {
+                exprparse::compile_expression(formulas[i], symbols, &compiled[i]);
+                compiled[i].evaluate(&result);
+                benchmark::DoNotOptimize(result);
+            }
+            benchmark::DoNotOptimize(compiled.data());
+        }
+        state.SetItemsProcessed((int64_t)(state.iterations() * formulas.size()));
+        state.SetBytesProcessed((int64_t)(state.iterations() * count_bytes(formulas)));
+    }
+    BENCHMARK(BM_ColdStartSource)->Unit(benchmark::kMillisecond);
+
+    // Worker start up from a bytecode catalog of the same formulas, mapped
+    // and checked, then each formula evaluated once so that every page of
+    // the catalog is touched
+    void BM_ColdStartBytecode(benchmark::State& state) {
+        const vector<string>& formulas = get_catalog_formulas();
+        vector<exprparse::CompiledExpression> compiled(formulas.size());
+        for (size_t i = 0; i < formulas.size(); i++) exprparse::compile_expression(formulas[i], &compiled[i]);
+        string bytecode;
+        exprparse::write_bytecode(compiled, &bytecode);
+        compiled.clear();
+        const string path = "exprbench_catalog.bin";
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == NULL || fwrite(bytecode.data(), 1, bytecode.size(), file) != bytecode.size()) {
+            if (file != NULL) fclose(file);
+            state.SkipWithError("failed to write the catalog");
+            return;
+        }
+        fclose(file);
+
+        const double* bindings[] = { &CATALOG_VALUES[0], &CATALOG_VALUES[1], &CATALOG_VALUES[2],
+                                     &CATALOG_VALUES[3], &CATALOG_VALUES[4], &CATALOG_VALUES[5] };
+        for (auto _ : state) {
+            exprparse::BytecodeCatalog catalog;
+            if (catalog.load_file(path) != exprparse::Status::SUCCESS) {
+                state.SkipWithError("failed to load the catalog");
+                break;
+            }
+            double result;
+            for (size_t i = 0; i < catalog.size(); i++) {
+                catalog.evaluate(i, bindings, &result);
+                benchmark::DoNotOptimize(result);
+            }
+        }
+        remove(path.c_str());
+        state.SetItemsProcessed((int64_t)(state.iterations() * formulas.size()));
+        state.counters["catalog_bytes"] = (double)bytecode.size();
+    }
+    BENCHMARK(BM_ColdStartBytecode)->Unit(benchmark::kMillisecond);
+
+    // parse_expression with and without the expression cache, called from
+    // several threads on keys drawn from a Zipf distribution
+    const size_t ZIPF_KEYS = 10000;
+
+    const vector<string>& get_zipf_keys() {
+        static vector<string> keys;
+        if (keys.empty()) {
+            for (size_t i = 0; i < ZIPF_KEYS; i++)
+                keys.push_back("(" + to_string(i) + ".5*3 + 7)^0.5 / " + to_string(i % 13 + 1) + " - [2.25*" +
+                               to_string(i % 101) + "]");
+        }
+        return keys;
+    }
+
+    void BM_CacheZipf(benchmark::State& state) {
+        const vector<string>& keys = get_zipf_keys();
+        if (state.thread_index() == 0) {
+            exprparse::set_expression_cache_capacity((size_t)state.range(0));
+            exprparse::clear_expression_cache();
+        }
+
+        // Cumulative distribution of P(k) proportional to 1/k
+        vector<double> cdf(ZIPF_KEYS);
+        double total = 0.0;
+        for (size_t i = 0; i < ZIPF_KEYS; i++) cdf[i] = total += 1.0 / (double)(i + 1);
+        for (double& c : cdf) c /= total;
+        vector<size_t> sequence(1 << 15);
+        mt19937_64 rng((uint64_t)state.thread_index() + 1);
+        uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (size_t& key : sequence) key = lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+
+        size_t next = 0;
+        double result;
+        for (auto _ : state) {
+            exprparse::parse_expression(keys[sequence[next]], &result);
+            benchmark::DoNotOptimize(result);
+            if (++next == sequence.size()) next = 0;
+        }
+        state.SetItemsProcessed((int64_t)state.iterations());
+
+        if (state.thread_index() == 0) {
+            exprparse::ExpressionCacheStats stats = exprparse::get_expression_cache_stats();
+            if (stats.hits + stats.misses != 0)
+                state.counters["hit_rate"] = (double)stats.hits / (double)(stats.hits + stats.misses);
+            state.counters["evictions"] = (double)stats.evictions;
+            exprparse::set_expression_cache_capacity(1024);
+        }
+    }
+    BENCHMARK(BM_CacheZipf)->Arg(0)->Arg(1024)->ArgName("capacity")->ThreadRange(1, 8)->UseRealTime();
+
+    // Readers evaluating formulas while writer threads keep replacing them.
+    // Mode 0 reads through an ExpressionRegistry, mode 1 through a map of
+    // shared pointers behind a reader writer lock, for comparison.
+    const size_t REGISTRY_IDS = 1024;
+
+    typedef struct RegistryChurn {
+        double x = 0.5, y = 2.0;
+        exprparse::SymbolTable symbols;
+        vector<exprparse::CompiledExpression> pool; // Versions writers publish
+        exprparse::ExpressionRegistry registry;
+        shared_mutex lock;
+        unordered_map<uint64_t, shared_ptr<const exprparse::CompiledExpression>> map;
+        atomic<bool> stop;
+        atomic<uint64_t> publishes;
+        vector<thread> writers;
+    } RegistryChurn;
+
+    // Never destroyed, as readers of one run may outlive it
+    RegistryChurn& get_registry_churn() {
+        static RegistryChurn* churn = [] {
+            RegistryChurn* created = new RegistryChurn;
+            created->symbols.bind("x", &created->x);
+            created->symbols.bind("y", &created->y);
+            for (int i = 0; i < 16; i++) {
+                exprparse::CompiledExpression compiled;
+                exprparse::compile_expression(to_string(i) + "*x + y^2 - x/y", created->symbols, &compiled);
+                created->pool.push_back(compiled);
+            }
+            for (uint64_t id = 0; id < REGISTRY_IDS; id++) {
+                created->registry.publish(id, created->pool[id % 16]);
+                created->map[id] = make_shared<const exprparse::CompiledExpression>(created->pool[id % 16]);
+            }
+            return created;
+        }();
+        return *churn;
+    }
+
+    void churn_writer(RegistryChurn* churn, int mode, uint64_t seed) {
+        mt19937_64 rng(seed);
+        while (!churn->stop.load(memory_order_relaxed)) {
+            uint64_t id = rng() % REGISTRY_IDS;
+            const exprparse::CompiledExpression& compiled = churn->pool[rng() % churn->pool.size()];
+            if (mode == 0) {
+                churn->registry.publish(id, compiled);
+            } else {
+                shared_ptr<const exprparse::CompiledExpression> version =
+                make_shared<const exprparse::CompiledExpression>(compiled);
+                unique_lock<shared_mutex> guard(churn->lock);
+                churn->map[id].swap(version);
+            }
+            churn->publishes.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    void BM_RegistryChurn(benchmark::State& state) {
+        RegistryChurn& churn = get_registry_churn();
+        int mode = (int)state.range(0);
+        if (state.thread_index() == 0) {
+            churn.stop.store(false);
+            churn.publishes.store(0);
+            for (int i = 0; i < state.range(1); i++) churn.writers.emplace_back(churn_writer, &churn, mode, i + 1);
+        }
+
+        exprparse::ExpressionRegistry::Reader reader(churn.registry);
+        uint64_t id = (uint64_t)state.thread_index() * 131;
+        double result;
+        for (auto _ : state) {
+            id = (id + 97) % REGISTRY_IDS;
+            if (mode == 0) {
+                reader.evaluate(id, &result);
+            } else {
+                shared_ptr<const exprparse::CompiledExpression> compiled;
+                {
+                    shared_lock<shared_mutex> guard(churn.lock);
+                    compiled = churn.map.find(id)->second;
+                }
+                compiled->evaluate(&result);
+            }
+            benchmark::DoNotOptimize(result);
+        }
+        state.SetItemsProcessed((int64_t)state.iterations());
+
+        if (state.thread_index() == 0) {
+            churn.stop.store(true);
+            for (thread& writer : churn.writers) writer.join();
+            churn.writers.clear();
+            state.counters["publishes"] =
+            benchmark::Counter((double)churn.publishes.load(), benchmark::Counter::kIsRate);
+        }
+    }
+    BENCHMARK(BM_RegistryChurn)
+        ->ArgsProduct({ { 0, 1 }, { 0, 1, 4 } })
+        ->ArgNames({ "mode", "writers" })
+        ->ThreadRange(1, 8)
+        ->UseRealTime();
+} // namespace
+
+BENCHMARK_MAIN();
@@ -25,29 +25,331 @@
 // SOFTWARE.
 
 #include "exprparse.h"
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define EXPRCALC_MMAP
+#endif
 
 using namespace std;
 
+namespace {
+    // Input is split into chunks of about this many bytes, ending at a newline
+    const size_t CHUNK_SIZE = 1 << 20;
+
+    // A run of whole lines of input, and the output for them
+    typedef struct Chunk {
+        const char* begin;
+        const char* end;
+        vector<char> data; // Holds the lines when they are read rather than mapped
+        string out;
+        size_t lines;
+        size_t errors;
+        bool done;
+    } Chunk;
+
+    // Hands out the input one chunk at a time, either from memory the
+    // whole file is mapped into or by reading a stream
+    class ChunkReader {
+    public:
+        ChunkReader(const char* data, size_t size) : data_(data), size_(size), offset_(0), file_(NULL), eof_(false) {
+        }
+
+        explicit ChunkReader(FILE* file) : data_(NULL), size_(0), offset_(0), file_(file), eof_(false) {
+        }
+
+        // Points chunk at the next lines of input. Returns false at the end.
+        bool next(Chunk* chunk) {
+            return file_ ? read_next(chunk) : map_next(chunk);
+        }
+
+    private:
+        bool map_next(Chunk* chunk) {
+            if (offset_ == size_) return false;
+            size_t end = min(offset_ + CHUNK_SIZE, size_);
+            if (end != size_) {
+                const char* newline = static_cast<const char*>(memchr(data_ + end, '\n', size_ - end));
+                end = newline ? newline - data_ + 1 : size_;
+            }
+            chunk->begin = data_ + offset_;
+            chunk->end = data_ + end;
+            offset_ = end;
+            return true;
+        }
+
+        bool read_next(Chunk* chunk) {
+            // Start with the partial line left over from the last chunk, and
+            // read until there is at least one whole line
+            vector<char>& data = chunk->data;
+            data.swap(carry_);
+            carry_.clear();
+            size_t last_line = 0;
+            for (;;) {
+                size_t searched = data.size();
+                if (!eof_) {
+                    data.resize(searched + CHUNK_SIZE);
+                    size_t count = fread(data.data() + searched, 1, CHUNK_SIZE, file_);
+                    data.resize(searched + count);
+                    eof_ = count < CHUNK_SIZE;
+                }
+                for (size_t i = data.size(); i > searched; i--) {
+                    if (data[i - 1] == '\n') {
+                        last_line = i;
+                        break;
+                    }
+                }
+                if (last_line != 0 || eof_) break;
+            }
+            if (eof_) last_line = data.size();
+            if (last_line == 0) return false;
+
+            carry_.assign(data.begin() + last_line, data.end());
+            data.resize(last_line);
+            chunk->begin = data.data();
+            chunk->end = data.data() + data.size();
+            return true;
+        }
+
+        const char* data_;
+        size_t size_;
+        size_t offset_;
+        FILE* file_;
+        vector<char> carry_;
+        bool eof_;
+    };
+
+    // Evaluates each line of chunk into chunk->out, one line of output per
+    // line of input. Lines are parsed where they are, without copying.
+    void evaluate_chunk(Chunk* chunk, const vector<string>& status_lines, int precision, exprparse::ParseArena* arena) {
+        chunk->out.clear();
+        chunk->lines = 0;
+        chunk->errors = 0;
+        const char* line_start = chunk->begin;
+        while (line_start != chunk->end) {
+            const char* newline = static_cast<const char*>(memchr(line_start, '\n', chunk->end - line_start));
+            const char* line_end = newline ? newline : chunk->end;
+            const char* next_line = newline ? newline + 1 : chunk->end;
+            if (line_end != line_start && line_end[-1] == '\r') line_end--;
+
+            double result;
+            char buffer[64];
+            int length = 0;
+            exprparse::Status res_stat = exprparse::parse_expression(line_start, line_end - line_start, arena, &result);
+            if (res_stat == exprparse::Status::SUCCESS) {
+                length = snprintf(buffer, sizeof(buffer), "%.*g\n", precision, result);
+                if (length < 0 || (size_t)length >= sizeof(buffer)) res_stat = exprparse::Status::ERROR;
+            }
+            if (res_stat == exprparse::Status::SUCCESS) {
+                chunk->out.append(buffer, length);
+            } else {
+                chunk->out += status_lines[res_stat];
+                chunk->errors++;
+            }
+            chunk->lines++;
+            line_start = next_line;
+        }
+    }
+
+    typedef struct StreamTotals {
+        size_t bytes;
+        size_t lines;
+        size_t errors;
+    } StreamTotals;
+
+    // Evaluates the input on num_threads threads, a chunk at a time, while
+    // the calling thread writes finished chunks to out in input order. At
+    // most a few chunks per thread are in flight at once.
+    StreamTotals evaluate_stream(ChunkReader& reader, size_t num_threads, int precision, FILE* out) {
+        vector<string> status_lines;
+        for (size_t istatus = 0; istatus < exprparse::NUM_STATUS_CODES; istatus++)
+            status_lines.push_back(exprparse::get_status_string((exprparse::Status)istatus) + "\n");
+
+        const size_t window = 4 * num_threads;
+        vector<Chunk> slots(window);
+        mutex lock;
+        condition_variable changed;
+        size_t num_read = 0, num_written = 0;
+        bool input_done = false;
+
+        vector<thread> threads;
+        for (size_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&]() {
+                exprparse::ParseArena arena;
+                unique_lock<mutex> guard(lock);
+                for (;;) {
+                    while (!input_done && num_read - num_written == window) changed.wait(guard);
+                    if (input_done) return;
+                    Chunk& chunk = slots[num_read % window];
+                    if (!reader.next(&chunk)) {
+                        input_done = true;
+                        changed.notify_all();
+                        return;
+                    }
+                    num_read++;
+
+                    guard.unlock();
+                    evaluate_chunk(&chunk, status_lines, precision, &arena);
+                    guard.lock();
+                    chunk.done = true;
+                    changed.notify_all();
+                }
+            });
+        }
+
+        StreamTotals totals = { 0, 0, 0 };
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            Chunk& chunk = slots[num_written % window];
+            while (!(num_written < num_read && chunk.done) && !(input_done && num_written == num_read))
+                changed.wait(guard);
+            if (!chunk.done) break;
+
+            guard.unlock();
+            fwrite(chunk.out.data(), 1, chunk.out.size(), out);
+            totals.bytes += chunk.end - chunk.begin;
+            totals.lines += chunk.lines;
+            totals.errors += chunk.errors;
+            guard.lock();
+            chunk.done = false;
+            num_written++;
+            changed.notify_all();
+        }
+        guard.unlock();
+        for (thread& th : threads) th.join();
+        fflush(out);
+        return totals;
+    }
+
+    int run_stream(const char* path, size_t num_threads, int precision) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        StreamTotals totals;
+
+        // Lines of a stream are mostly different expressions, and compiling
+        // each one for the cache costs more than just parsing it
+        exprparse::set_expression_cache_capacity(0);
+        if (path == NULL || strcmp(path, "-") == 0) {
+            ChunkReader reader(stdin);
+            totals = evaluate_stream(reader, num_threads, precision, stdout);
+        } else {
+#if defined(EXPRCALC_MMAP)
+            int fd = open(path, O_RDONLY);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0) {
+                perror(path);
+                if (fd >= 0) close(fd);
+                return 1;
+            }
+            size_t size = (size_t)info.st_size;
+            void* data = NULL;
+            if (size != 0) {
+                data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    perror(path);
+                    close(fd);
+                    return 1;
+                }
+                madvise(data, size, MADV_SEQUENTIAL);
+            }
+            ChunkReader reader(static_cast<const char*>(data), size);
+            totals = evaluate_stream(reader, num_threads, precision, stdout);
+            if (data != NULL) munmap(data, size);
+            close(fd);
+#else
+            FILE* file = fopen(path, "rb");
+            if (file == NULL) {
+                perror(path);
+                return 1;
+            }
+            ChunkReader reader(file);
+            totals = evaluate_stream(reader, num_threads, precision, stdout);
+            fclose(file);
+#endif
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (seconds <= 0.0) seconds = 1e-9;
+        fprintf(stderr, "exprcalc: %zu expressions (%zu errors), %.1f MB in %.3f s: %.1f MB/s, %.0f expressions/s\n",
+                totals.lines, totals.errors, totals.bytes / 1e6, seconds, totals.bytes / 1e6 / seconds,
+                totals.lines / seconds);
+        return ferror(stdout) ? 1 : 0;
+    }
+
+    int run_interactive() {
+        cout << "ExprCalc - Simple Calculator" << endl;
+        cout << "    Version " << exprparse::get_version() << endl;
+
+        // Main loop, until the end of input
+        for (;;) {
+            double result;
+            exprparse::Status res_stat;
+            string expr;
+            cout << "Enter simple math expression: ";
+            if (!getline(cin, expr)) break;
+            res_stat = exprparse::parse_expression(expr, &result);
+            if (res_stat == exprparse::Status::SUCCESS) {
+                cout << result << endl;
+            } else {
+                cout << exprparse::get_status_string(res_stat) << endl;
+            }
+        }
+        cout << endl;
+        return 0;
+    }
+
+    void print_usage(const char* program) {
+        cerr << "Usage: " << program << " [--stream [-j threads] [-p precision] [file]]" << endl
+             << endl
+             << "Without --stream, reads one expression at a time from a prompt." << endl
+             << "With --stream, evaluates each line of file, or of standard input if file is" << endl
+             << "missing or -, and writes one result per line in the same order. A summary" << endl
+             << "goes to standard error. -j sets the number of threads, one per hardware" << endl
+             << "thread by default. -p sets the significant digits printed, from 1 to " << DBL_DECIMAL_DIG << endl
+             << "and 6 by default." << endl;
+    }
+} // namespace
+
 int main(int argc, char* argv[]) {
-    cout << "ExprCalc - Simple Calculator" << endl;
-    cout << "    Version " << exprparse::get_version() << endl;
-
-    // Main loop
-    for (;;) {
-        double result;
-        exprparse::Status res_stat;
-        string expr;
-        cout << "Enter simple math expression: ";
-        getline(cin, expr);
-        res_stat = exprparse::parse_expression(expr, &result);
-        if (res_stat == exprparse::Status::SUCCESS) {
-            cout << result << endl;
+    bool stream = false;
+    const char* path = NULL;
+    size_t num_threads = thread::hardware_concurrency();
+    int precision = 6;
+    for (int iarg = 1; iarg < argc; iarg++) {
+        string arg = argv[iarg];
+        if (arg == "--stream" || arg == "-s") {
+            stream = true;
+        } else if ((arg == "-j" || arg == "-p") && iarg + 1 < argc) {
+            int value = atoi(argv[++iarg]);
+            if (value <= 0 || (arg == "-p" && value > DBL_DECIMAL_DIG)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (arg == "-j")
+                num_threads = (size_t)value;
+            else
+                precision = value;
+        } else if (stream && path == NULL && (arg == "-" || arg[0] != '-')) {
+            path = argv[iarg];
         } else {
-            cout << exprparse::get_status_string(res_stat) << endl;
+            print_usage(argv[0]);
+            return arg == "-h" || arg == "--help" ? 0 : 1;
         }
     }
+    if (num_threads == 0) num_threads = 1;
 
-    exit(1);
+    return stream ? run_stream(path, num_threads, precision) : run_interactive();
 }
@@ -0,0 +1,371 @@
+// exprbatch.cpp
+//
+// Evaluation of compiled expressions over columns of data
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <cstddef>
+#include <limits>
+#include <math.h>
+#include <vector>
+
+using namespace std;
+
+namespace exprparse {
+    // Calls a function that has no batch version once for each row
+    Status call_function_rows(const Function& function,
+                              const double* const args[],
+                              size_t num_args,
+                              size_t count,
+                              double* result) {
+        Status ret_val = Status::SUCCESS;
+        double inline_row[INLINE_CALL_ARGS];
+        vector<double> heap_row;
+        double* row = inline_row;
+        if (num_args > INLINE_CALL_ARGS) {
+            heap_row.resize(num_args);
+            row = heap_row.data();
+        }
+        for (size_t irow = 0; irow < count; irow++) {
+            for (size_t iarg = 0; iarg < num_args; iarg++) row[iarg] = args[iarg][irow];
+            Status row_val = function.eval(row, num_args, result + irow);
+            if (ret_val == Status::SUCCESS) ret_val = row_val;
+        }
+        return ret_val;
+    }
+
+    // Kernels that evaluate blocks of rows of type T
+    template <class T>
+    struct BlockKernels;
+
+    template <>
+    struct BlockKernels<double> {
+        typedef BatchOperation OperatorKernel;
+        typedef ExpressionBatchFunction FunctionKernel;
+
+        static const OperatorKernel* operators(SimdLevel level) {
+            return get_batch_kernels(level);
+        }
+        static FunctionKernel function(const Function& function, SimdLevel level) {
+            return function.batch[level];
+        }
+    };
+
+    template <>
+    struct BlockKernels<float> {
+        typedef FloatBatchOperation OperatorKernel;
+        typedef FloatBatchFunction FunctionKernel;
+
+        static const OperatorKernel* operators(SimdLevel level) {
+            return get_float_batch_kernels(level);
+        }
+        static FunctionKernel function(const Function& function, SimdLevel level) {
+            return function.float_batch[level];
+        }
+    };
+
+    // Runs an operator or function over a block of rows with the double
+    // kernels, or row by row for functions that have no batch version
+    Status eval_double_block(const Instruction& instr,
+                             SimdLevel level,
+                             const double* const args[],
+                             size_t num_args,
+                             size_t count,
+                             double* result) {
+        if (instr.code == InstructionCode::APPLY_OPERATOR) {
+            return get_batch_kernels(level)[instr.operand](args, count, result);
+        }
+        const Function* function = get_function(instr.operand);
+        ExpressionBatchFunction batch = function->batch[level];
+        if (batch) return batch(args, num_args, count, result);
+        return call_function_rows(*function, args, num_args, count, result);
+    }
+
+    // Runs an operator or function that the kernels of the block's type
+    // have no version of. Doubles go straight to eval_double_block.
+    Status eval_in_double(const Instruction& instr,
+                          SimdLevel level,
+                          const double* const args[],
+                          size_t num_args,
+                          size_t count,
+                          vector<double>*,
+                          double* result) {
+        return eval_double_block(instr, level, args, num_args, count, result);
+    }
+
+    // Floats are converted to double, which is exact, and the results are
+    // rounded back to float, as eval_program<float> does for each row
+    //
+    // Arguments:
+    //  wide: scratch space for the double arguments and result, grown as needed
+    Status eval_in_double(const Instruction& instr,
+                          SimdLevel level,
+                          const float* const args[],
+                          size_t num_args,
+                          size_t count,
+                          vector<double>* wide,
+                          float* result) {
+        if (wide->size() < (num_args + 1) * BATCH_BLOCK_SIZE) wide->resize((num_args + 1) * BATCH_BLOCK_SIZE);
+        const double* inline_args[INLINE_CALL_ARGS];
+        vector<const double*> heap_args;
+        const double** wide_args = inline_args;
+        if (num_args > INLINE_CALL_ARGS) {
+            heap_args.resize(num_args);
+            wide_args = heap_args.data();
+        }
+
+        // result may be args[0], so every argument is copied first
+        double* wide_result = wide->data();
+        for (size_t iarg = 0; iarg < num_args; iarg++) {
+            double* wide_arg = wide_result + (iarg + 1) * BATCH_BLOCK_SIZE;
+            for (size_t irow = 0; irow < count; irow++) wide_arg[irow] = args[iarg][irow];
+            wide_args[iarg] = wide_arg;
+        }
+        Status ret_val = eval_double_block(instr, level, wide_args, num_args, count, wide_result);
+        for (size_t irow = 0; irow < count; irow++) result[irow] = (float)wide_result[irow];
+        return ret_val;
+    }
+
+    // Evaluates one block of rows of a program, running each instruction
+    // across the whole block before moving on to the next one.
+    //
+    // Arguments:
+    //  program: successfully built program
+    //  level: instruction set whose kernels are used
+    //  columns: values of each variable, indexed by slot
+    //  first_row: index of the first row of the block
+    //  count: number of rows in the block, at most BATCH_BLOCK_SIZE
+    //  stack: scratch space for program.max_depth * BATCH_BLOCK_SIZE values
+    //  wide: scratch space for eval_in_double
+    //  out: array used to store count results
+    template <class T>
+    Status eval_program_block(const Program& program,
+                              SimdLevel level,
+                              const T* const columns[],
+                              size_t first_row,
+                              size_t count,
+                              T* stack,
+                              vector<double>* wide,
+                              T* out) {
+        typedef BlockKernels<T> Kernels;
+        const typename Kernels::OperatorKernel* kernels = Kernels::operators(level);
+        Status ret_val = Status::SUCCESS;
+        T* top = stack; // One past the top of the stack
+        const T* inline_args[INLINE_CALL_ARGS];
+        vector<const T*> heap_args;
+        for (const Instruction& instr : program.code) {
+            if (instr.code == InstructionCode::PUSH_NUMBER) {
+                T value = (T)program.constants[instr.operand];
+                for (size_t irow = 0; irow < count; irow++) top[irow] = value;
+                top += BATCH_BLOCK_SIZE;
+                continue;
+            } else if (instr.code == InstructionCode::PUSH_VARIABLE) {
+                const T* column = columns[instr.operand] + first_row;
+                for (size_t irow = 0; irow < count; irow++) top[irow] = column[irow];
+                top += BATCH_BLOCK_SIZE;
+                continue;
+            }
+
+            // The arguments are the top blocks of the stack, and the result
+            // replaces the first of them
+            size_t num_args = instruction_args(instr);
+            const T** args = inline_args;
+            if (num_args > INLINE_CALL_ARGS) {
+                heap_args.resize(num_args);
+                args = heap_args.data();
+            }
+            top -= num_args * BATCH_BLOCK_SIZE;
+            for (size_t iarg = 0; iarg < num_args; iarg++) args[iarg] = top + iarg * BATCH_BLOCK_SIZE;
+
+            Status op_val;
+            if (instr.code == InstructionCode::APPLY_OPERATOR) {
+                typename Kernels::OperatorKernel kernel = kernels[instr.operand];
+                op_val = kernel ? kernel(args, count, top)
+                                : eval_in_double(instr, level, args, num_args, count, wide, top);
+            } else {
+                typename Kernels::FunctionKernel batch = Kernels::function(*get_function(instr.operand), level);
+                op_val = batch ? batch(args, num_args, count, top)
+                               : eval_in_double(instr, level, args, num_args, count, wide, top);
+            }
+            if (ret_val == Status::SUCCESS) ret_val = op_val;
+            top += BATCH_BLOCK_SIZE;
+        }
+
+        for (size_t irow = 0; irow < count; irow++) out[irow] = stack[irow];
+        return ret_val;
+    }
+
+    template <class T>
+    Status eval_batch_rows(const Program& program,
+                           SimdLevel level,
+                           const T* const columns[],
+                           size_t first_row,
+                           size_t n_rows,
+                           T* stack,
+                           T* out) {
+        Status ret_val = Status::SUCCESS;
+        vector<double> wide;
+        size_t end_row = first_row + n_rows;
+        for (size_t block_row = first_row; block_row < end_row; block_row += BATCH_BLOCK_SIZE) {
+            size_t count = end_row - block_row < BATCH_BLOCK_SIZE ? end_row - block_row : BATCH_BLOCK_SIZE;
+            Status block_val =
+            eval_program_block(program, level, columns, block_row, count, stack, &wide, out + block_row);
+            if (block_val == Status::SUCCESS) continue;
+
+            // Something in this block failed. Errors are rare, so redo the
+            // block one row at a time to find out which rows are affected.
+            // The others keep their block results, as the kernels compute
+            // every row, so no row depends on the others. Each row's values
+            // are copied into doubles, which hold floats exactly, for
+            // eval_program to read.
+            vector<double> row_values(program.variables.size());
+            vector<const double*> row_bindings(program.variables.size());
+            for (size_t slot = 0; slot < row_bindings.size(); slot++) row_bindings[slot] = &row_values[slot];
+            for (size_t irow = block_row; irow < block_row + count; irow++) {
+                for (size_t slot = 0; slot < row_values.size(); slot++) row_values[slot] = columns[slot][irow];
+                T row_result;
+                Status row_val = eval_program(program, row_bindings.data(), stack, &row_result);
+                if (row_val != Status::SUCCESS) {
+                    out[irow] = numeric_limits<T>::quiet_NaN();
+                    if (ret_val == Status::SUCCESS) ret_val = row_val;
+                }
+            }
+        }
+        return ret_val;
+    }
+
+    template Status eval_batch_rows<double>(const Program& program,
+                                            SimdLevel level,
+                                            const double* const columns[],
+                                            size_t first_row,
+                                            size_t n_rows,
+                                            double* stack,
+                                            double* out);
+    template Status eval_batch_rows<float>(const Program& program,
+                                           SimdLevel level,
+                                           const float* const columns[],
+                                           size_t first_row,
+                                           size_t n_rows,
+                                           float* stack,
+                                           float* out);
+
+    template <class T>
+    Status evaluate_columns(const CompiledExpression& compiled, const T* const columns[], size_t n_rows, T* out) {
+        const Program* program = ProgramAccess::program(compiled);
+        if (program == NULL) return Status::EMPTY_EXPRESSION;
+        for (size_t slot = 0; slot < program->variables.size(); slot++) {
+            if (columns == NULL || columns[slot] == NULL) return Status::UNBOUND_VARIABLE;
+        }
+
+        vector<T> stack(program->max_depth * BATCH_BLOCK_SIZE);
+        return eval_batch_rows(*program, get_simd_level(), columns, 0, n_rows, stack.data(), out);
+    }
+
+    Status evaluate_batch(const CompiledExpression& compiled,
+                          const double* const columns[],
+                          size_t n_rows,
+                          double* out) {
+        return evaluate_columns(compiled, columns, n_rows, out);
+    }
+
+    Status evaluate_batch(const CompiledExpression& compiled, const float* const columns[], size_t n_rows, float* out) {
+        return evaluate_columns(compiled, columns, n_rows, out);
+    }
+
+    //****************** Define batch versions of operations ******************//
+
+    template <class T>
+    Status add_batch(const T* const args[], const size_t& count, T* result) {
+        const T* lhs = args[0];
+        const T* rhs = args[1];
+        for (size_t i = 0; i < count; i++) result[i] = lhs[i] + rhs[i];
+        return Status::SUCCESS;
+    }
+
+    template <class T>
+    Status subtract_batch(const T* const args[], const size_t& count, T* result) {
+        const T* lhs = args[0];
+        const T* rhs = args[1];
+        for (size_t i = 0; i < count; i++) result[i] = lhs[i] - rhs[i];
+        return Status::SUCCESS;
+    }
+
+    template <class T>
+    Status multiply_batch(const T* const args[], const size_t& count, T* result) {
+        const T* lhs = args[0];
+        const T* rhs = args[1];
+        for (size_t i = 0; i < count; i++) result[i] = lhs[i] * rhs[i];
+        return Status::SUCCESS;
+    }
+
+    // Divides every row, and reports DIVIDE_BY_ZERO if any divisor was
+    // close to zero
+    template <class T>
+    Status divide_batch(const T* const args[], const size_t& count, T* result) {
+        const T* lhs = args[0];
+        const T* rhs = args[1];
+        bool zero_found = false;
+        for (size_t i = 0; i < count; i++) {
+            zero_found |= fabs(rhs[i]) < ALMOST_ZERO;
+            result[i] = lhs[i] / rhs[i];
+        }
+        return zero_found ? Status::DIVIDE_BY_ZERO : Status::SUCCESS;
+    }
+
+    Status power_batch(const double* const args[], const size_t& count, double* result) {
+        const double* lhs = args[0];
+        const double* rhs = args[1];
+        for (size_t i = 0; i < count; i++) result[i] = pow(lhs[i], rhs[i]);
+        return Status::SUCCESS;
+    }
+
+    template <class T>
+    Status unary_minus_batch(const T* const args[], const size_t& count, T* result) {
+        const T* arg = args[0];
+        for (size_t i = 0; i < count; i++) result[i] = -arg[i];
+        return Status::SUCCESS;
+    }
+
+    template <class T>
+    Status unary_plus_batch(const T* const args[], const size_t& count, T* result) {
+        const T* arg = args[0];
+        if (result != arg) {
+            for (size_t i = 0; i < count; i++) result[i] = arg[i];
+        }
+        return Status::SUCCESS;
+    }
+
+    // Portable kernels, used when no vector instruction set is available
+    const BatchOperation g_scalar_kernels[NUM_OPERATORS] = { add_batch<double>,         subtract_batch<double>,
+                                                             multiply_batch<double>,    divide_batch<double>,
+                                                             power_batch,               unary_minus_batch<double>,
+                                                             unary_plus_batch<double> };
+
+    // Powers of floats are computed in double
+    const FloatBatchOperation g_scalar_float_kernels[NUM_OPERATORS] = { add_batch<float>,      subtract_batch<float>,
+                                                                        multiply_batch<float>, divide_batch<float>,
+                                                                        NULL,                  unary_minus_batch<float>,
+                                                                        unary_plus_batch<float> };
+} // namespace exprparse
@@ -0,0 +1,595 @@
+// exprbounds.cpp
+//
+// Interval arithmetic on compiled expressions, bounding their results over
+// ranges of inputs
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Rounding to nearest never reverses the order of two values, so the
+// bounds of +, -, *, / and the exactly rounded functions are found by
+// applying them to the ends of the intervals, rounded the same way as the
+// rows themselves. Results of the C library and of the vector pow are only
+// accurate to a few ulps, so their bounds are widened a little.
+//
+// Rows whose result is NaN, or fails, are not bounded. A NaN only turns
+// back into a number in pow(NaN, 0), pow(1, NaN) and hypot(inf, NaN), which
+// are allowed for explicitly, and in registered functions, which are
+// unbounded.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <math.h>
+#include <vector>
+
+using namespace std;
+
+namespace exprparse {
+    namespace {
+        const double INF = numeric_limits<double>::infinity();
+        const double PI = 3.14159265358979323846;
+
+        // Relative error allowed for results of the C library, which are
+        // within a few ulps, and of the vector pow, which is within 1.6e-13
+        const double LIBRARY_TOLERANCE = 2.5e-13;
+
+        inline bool is_empty(double lo, double hi) {
+            return !(lo <= hi);
+        }
+
+        // Smallest and largest of two values, ignoring a NaN unless both are
+        inline double min_num(double a, double b) {
+            return (b < a || a != a) ? b : a;
+        }
+
+        inline double max_num(double a, double b) {
+            return (b > a || a != a) ? b : a;
+        }
+
+        // Writes the bounds of row i. NaN bounds, as from inf + -inf, are
+        // widened to the whole line.
+        inline void store(double* out_lo, double* out_hi, size_t i, bool empty, double lo, double hi) {
+            out_lo[i] = empty ? INF : (lo == lo ? lo : -INF);
+            out_hi[i] = empty ? -INF : (hi == hi ? hi : INF);
+        }
+
+        // Widens bounds computed by the C library to cover its rounding error
+        inline double widen_down(double x) {
+            return isfinite(x) ? x - (fabs(x) * LIBRARY_TOLERANCE + numeric_limits<double>::denorm_min()) : x;
+        }
+
+        inline double widen_up(double x) {
+            return isfinite(x) ? x + (fabs(x) * LIBRARY_TOLERANCE + numeric_limits<double>::denorm_min()) : x;
+        }
+
+        // Smallest and largest absolute value in [lo, hi]
+        inline double min_abs(double lo, double hi) {
+            return lo > 0 ? lo : (hi < 0 ? -hi : 0.0);
+        }
+
+        inline double max_abs(double lo, double hi) {
+            return -lo > hi ? -lo : hi;
+        }
+
+        //******************************* Operators *******************************//
+
+        void add_bounds(const double* const lo[],
+                        const double* const hi[],
+                        size_t,
+                        size_t count,
+                        double* out_lo,
+                        double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i], c = lo[1][i], d = hi[1][i];
+                store(out_lo, out_hi, i, is_empty(a, b) || is_empty(c, d), a + c, b + d);
+            }
+        }
+
+        void subtract_bounds(const double* const lo[],
+                             const double* const hi[],
+                             size_t,
+                             size_t count,
+                             double* out_lo,
+                             double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i], c = lo[1][i], d = hi[1][i];
+                store(out_lo, out_hi, i, is_empty(a, b) || is_empty(c, d), a - d, b - c);
+            }
+        }
+
+        // The extremes of a product are at the corners. A corner is NaN only
+        // where 0 meets an infinity, and the values around it are then
+        // covered by the neighbouring corners.
+        void multiply_bounds(const double* const lo[],
+                             const double* const hi[],
+                             size_t,
+                             size_t count,
+                             double* out_lo,
+                             double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i], c = lo[1][i], d = hi[1][i];
+                double ac = a * c, ad = a * d, bc = b * c, bd = b * d;
+                store(out_lo, out_hi, i, is_empty(a, b) || is_empty(c, d), min_num(min_num(ac, ad), min_num(bc, bd)),
+                      max_num(max_num(ac, ad), max_num(bc, bd)));
+            }
+        }
+
+        // Bounds of [a, b] / [c, d] for divisors of a single sign. Quotients
+        // are only NaN for inf / inf, so if every corner is then the quotient
+        // is unknown.
+        inline void divide_part(double a, double b, double c, double d, double* lo, double* hi) {
+            double ac = a / c, ad = a / d, bc = b / c, bd = b / d;
+            double part_lo = min_num(min_num(ac, ad), min_num(bc, bd));
+            double part_hi = max_num(max_num(ac, ad), max_num(bc, bd));
+            *lo = part_lo == part_lo ? part_lo : -INF;
+            *hi = part_hi == part_hi ? part_hi : INF;
+        }
+
+        // Divisors closer to zero than ALMOST_ZERO fail, so only the
+        // negative and positive parts of the divisor outside that gap give
+        // results. Either part may be missing, and if both are no row has a
+        // result.
+        void divide_bounds(const double* const lo[],
+                           const double* const hi[],
+                           size_t,
+                           size_t count,
+                           double* out_lo,
+                           double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i], c = lo[1][i], d = hi[1][i];
+                bool negative = c <= -ALMOST_ZERO;
+                bool positive = d >= ALMOST_ZERO;
+                double neg_lo, neg_hi, pos_lo, pos_hi;
+                divide_part(a, b, c, d < -ALMOST_ZERO ? d : -ALMOST_ZERO, &neg_lo, &neg_hi);
+                divide_part(a, b, c > ALMOST_ZERO ? c : ALMOST_ZERO, d, &pos_lo, &pos_hi);
+                double q_lo = negative ? (positive ? min_num(neg_lo, pos_lo) : neg_lo) : pos_lo;
+                double q_hi = negative ? (positive ? max_num(neg_hi, pos_hi) : neg_hi) : pos_hi;
+                store(out_lo, out_hi, i, is_empty(a, b) || is_empty(c, d) || !(negative || positive), q_lo, q_hi);
+            }
+        }
+
+        // First and last even, or odd, whole numbers no less than c and no
+        // greater than d. Infinities are left as they are, and numbers too
+        // large to have a fraction all count as even.
+        inline double first_whole(double c, bool odd) {
+            if (!isfinite(c)) return c;
+            double k = ceil(c);
+            return (fmod(k, 2.0) != 0) == odd ? k : k + 1;
+        }
+
+        inline double last_whole(double d, bool odd) {
+            if (!isfinite(d)) return d;
+            double k = floor(d);
+            return (fmod(k, 2.0) != 0) == odd ? k : k - 1;
+        }
+
+        // Bounds of pow over bases [a, b] and exponents [c, d].
+        //
+        // For bases of at least zero pow is monotonic in each argument, so
+        // the extremes are at the corners. A negative base only has results
+        // for whole exponents, giving |x|^y when y is even and -|x|^y when it
+        // is odd. Zero counts as a negative base too, as it may be -0, and
+        // -inf and -0 also give inf or +0 for exponents that are not whole.
+        void pow_bounds(double a, double b, double c, double d, double* lo, double* hi) {
+            double p_lo = INF, p_hi = -INF;
+            if (!is_empty(a, b) && !is_empty(c, d)) {
+                if (b >= 0) {
+                    double base = a > 0 ? a : 0.0;
+                    double ac = pow(base, c), ad = pow(base, d), bc = pow(b, c), bd = pow(b, d);
+                    p_lo = min_num(min_num(ac, ad), min_num(bc, bd));
+                    p_hi = max_num(max_num(ac, ad), max_num(bc, bd));
+                }
+                if (a <= 0) {
+                    double small = b < 0 ? -b : 0.0, large = -a;
+                    for (bool odd : { false, true }) {
+                        double first = first_whole(c, odd), last = last_whole(d, odd);
+                        if (first > last) continue;
+                        double sf = pow(small, first), sl = pow(small, last);
+                        double lf = pow(large, first), ll = pow(large, last);
+                        double m_lo = min_num(min_num(sf, sl), min_num(lf, ll));
+                        double m_hi = max_num(max_num(sf, sl), max_num(lf, ll));
+                        p_lo = min_num(p_lo, odd ? -m_hi : m_lo);
+                        p_hi = max_num(p_hi, odd ? -m_lo : m_hi);
+                    }
+                    if (a == -INF && c < 0) {
+                        p_lo = min_num(p_lo, 0.0);
+                        p_hi = max_num(p_hi, 0.0);
+                    }
+                    if (a == -INF && d > 0) p_hi = INF;
+                }
+            }
+
+            // pow(x, 0) and pow(1, y) are 1 even when the other argument is NaN
+            if ((a <= 1 && 1 <= b) || (c <= 0 && 0 <= d)) {
+                p_lo = min_num(p_lo, 1.0);
+                p_hi = max_num(p_hi, 1.0);
+            }
+            *lo = widen_down(p_lo);
+            *hi = widen_up(p_hi);
+        }
+
+        void power_bounds(const double* const lo[],
+                          const double* const hi[],
+                          size_t,
+                          size_t count,
+                          double* out_lo,
+                          double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double p_lo, p_hi;
+                pow_bounds(lo[0][i], hi[0][i], lo[1][i], hi[1][i], &p_lo, &p_hi);
+                store(out_lo, out_hi, i, is_empty(p_lo, p_hi), p_lo, p_hi);
+            }
+        }
+
+        void unary_minus_bounds(const double* const lo[],
+                                const double* const hi[],
+                                size_t,
+                                size_t count,
+                                double* out_lo,
+                                double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i];
+                store(out_lo, out_hi, i, is_empty(a, b), -b, -a);
+            }
+        }
+
+        void unary_plus_bounds(const double* const lo[],
+                               const double* const hi[],
+                               size_t,
+                               size_t count,
+                               double* out_lo,
+                               double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i];
+                store(out_lo, out_hi, i, is_empty(a, b), a, b);
+            }
+        }
+
+        // Indexed by OperatorId
+        const IntervalOperation g_operator_bounds[NUM_OPERATORS] = {
+            add_bounds,   subtract_bounds,    multiply_bounds,  divide_bounds,
+            power_bounds, unary_minus_bounds, unary_plus_bounds
+        };
+
+        //******************************* Functions *******************************//
+
+        // Arguments for which a function of one argument is a number
+        typedef enum { ALL_NUMBERS, NOT_NEGATIVE, UNIT } Domain;
+
+        // Bounds of a monotonic function of one argument. EXACT functions
+        // are correctly rounded, so need no widening.
+        template <double (*F)(double), Domain D, bool INCREASING, bool EXACT>
+        void monotonic_bounds(const double* const lo[],
+                              const double* const hi[],
+                              size_t,
+                              size_t count,
+                              double* out_lo,
+                              double* out_hi) {
+            const double domain_lo = D == ALL_NUMBERS ? -INF : (D == NOT_NEGATIVE ? 0.0 : -1.0);
+            const double domain_hi = D == UNIT ? 1.0 : INF;
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i] < domain_lo ? domain_lo : lo[0][i];
+                double b = hi[0][i] > domain_hi ? domain_hi : hi[0][i];
+                double f_lo = F(INCREASING ? a : b), f_hi = F(INCREASING ? b : a);
+                if (!EXACT) {
+                    f_lo = widen_down(f_lo);
+                    f_hi = widen_up(f_hi);
+                }
+                store(out_lo, out_hi, i, is_empty(a, b), f_lo, f_hi);
+            }
+        }
+
+        // Bounds of a function of one argument that is smallest at 0 and
+        // grows with the distance from it
+        template <double (*F)(double), bool EXACT>
+        void even_bounds(const double* const lo[],
+                         const double* const hi[],
+                         size_t,
+                         size_t count,
+                         double* out_lo,
+                         double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i];
+                double f_lo = F(min_abs(a, b)), f_hi = F(max_abs(a, b));
+                if (!EXACT) {
+                    f_lo = widen_down(f_lo);
+                    f_hi = widen_up(f_hi);
+                }
+                store(out_lo, out_hi, i, is_empty(a, b), f_lo, f_hi);
+            }
+        }
+
+        // Ranges of the functions that are bounded whatever their arguments
+        typedef enum { UNIT_RANGE, ANGLE_RANGE, ANY_RANGE } Range;
+
+        // Bounds of a function whose results lie within a fixed range, such
+        // as sin, or of one about which nothing is known but that is NaN
+        // when an argument is, such as tan
+        template <Range R>
+        void range_bounds(const double* const lo[],
+                          const double* const hi[],
+                          size_t num_args,
+                          size_t count,
+                          double* out_lo,
+                          double* out_hi) {
+            const double range = R == UNIT_RANGE ? 1.0 : (R == ANGLE_RANGE ? widen_up(PI) : INF);
+            for (size_t i = 0; i < count; i++) {
+                bool empty = false;
+                for (size_t iarg = 0; iarg < num_args; iarg++) empty = empty || is_empty(lo[iarg][i], hi[iarg][i]);
+                store(out_lo, out_hi, i, empty, -range, range);
+            }
+        }
+
+        // hypot(inf, NaN) is inf, so an infinite argument gives inf even when
+        // the other argument is empty
+        void hypot_bounds(const double* const lo[],
+                          const double* const hi[],
+                          size_t,
+                          size_t count,
+                          double* out_lo,
+                          double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double a = lo[0][i], b = hi[0][i], c = lo[1][i], d = hi[1][i];
+                bool x_empty = is_empty(a, b), y_empty = is_empty(c, d);
+                bool infinite = (x_empty && !y_empty && max_abs(c, d) == INF) ||
+                                (y_empty && !x_empty && max_abs(a, b) == INF);
+                double h_lo = infinite ? INF : widen_down(hypot(min_abs(a, b), min_abs(c, d)));
+                double h_hi = infinite ? INF : widen_up(hypot(max_abs(a, b), max_abs(c, d)));
+                store(out_lo, out_hi, i, (x_empty || y_empty) && !infinite, h_lo, h_hi);
+            }
+        }
+
+        // min and max are NaN if any argument is, and otherwise between the
+        // min or max of the lower bounds and of the upper bounds. sum adds
+        // the bounds left to right, the same way the rows are added.
+        template <double (*F)(double, double)>
+        void fold_bounds(const double* const lo[],
+                         const double* const hi[],
+                         size_t num_args,
+                         size_t count,
+                         double* out_lo,
+                         double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                double f_lo = lo[0][i], f_hi = hi[0][i];
+                bool empty = is_empty(f_lo, f_hi);
+                for (size_t iarg = 1; iarg < num_args; iarg++) {
+                    empty = empty || is_empty(lo[iarg][i], hi[iarg][i]);
+                    f_lo = F(f_lo, lo[iarg][i]);
+                    f_hi = F(f_hi, hi[iarg][i]);
+                }
+                store(out_lo, out_hi, i, empty, f_lo, f_hi);
+            }
+        }
+
+        double min_value(double a, double b) {
+            return b < a ? b : a;
+        }
+
+        double max_value(double a, double b) {
+            return a < b ? b : a;
+        }
+
+        double sum_value(double a, double b) {
+            return a + b;
+        }
+
+        typedef struct BuiltinBounds {
+            const char* name;
+            IntervalOperation bounds;
+        } BuiltinBounds;
+
+        const BuiltinBounds g_builtin_bounds[] = {
+            { "sin", range_bounds<UNIT_RANGE> },
+            { "cos", range_bounds<UNIT_RANGE> },
+            { "tan", range_bounds<ANY_RANGE> },
+            { "asin", monotonic_bounds<asin, UNIT, true, false> },
+            { "acos", monotonic_bounds<acos, UNIT, false, false> },
+            { "atan", monotonic_bounds<atan, ALL_NUMBERS, true, false> },
+            { "sinh", monotonic_bounds<sinh, ALL_NUMBERS, true, false> },
+            { "cosh", even_bounds<cosh, false> },
+            { "tanh", monotonic_bounds<tanh, ALL_NUMBERS, true, false> },
+            { "exp", monotonic_bounds<exp, ALL_NUMBERS, true, false> },
+            { "log", monotonic_bounds<log, NOT_NEGATIVE, true, false> },
+            { "log2", monotonic_bounds<log2, NOT_NEGATIVE, true, false> },
+            { "log10", monotonic_bounds<log10, NOT_NEGATIVE, true, false> },
+            { "sqrt", monotonic_bounds<sqrt, NOT_NEGATIVE, true, true> },
+            { "cbrt", monotonic_bounds<cbrt, ALL_NUMBERS, true, false> },
+            { "abs", even_bounds<fabs, true> },
+            { "floor", monotonic_bounds<floor, ALL_NUMBERS, true, true> },
+            { "ceil", monotonic_bounds<ceil, ALL_NUMBERS, true, true> },
+            { "round", monotonic_bounds<round, ALL_NUMBERS, true, true> },
+            { "atan2", range_bounds<ANGLE_RANGE> },
+            { "hypot", hypot_bounds },
+            { "pow", power_bounds },
+            { "min", fold_bounds<min_value> },
+            { "max", fold_bounds<max_value> },
+            { "sum", fold_bounds<sum_value> },
+        };
+
+        // Registered functions may return anything, even for NaN arguments
+        void unknown_bounds(const double* const[],
+                            const double* const[],
+                            size_t,
+                            size_t count,
+                            double* out_lo,
+                            double* out_hi) {
+            for (size_t i = 0; i < count; i++) {
+                out_lo[i] = -INF;
+                out_hi[i] = INF;
+            }
+        }
+
+        //******************************* Evaluation ******************************//
+
+        // Variable bounds given as one Interval per variable
+        struct IntervalVariables {
+            const Interval* bounds;
+
+            double lo(size_t slot, size_t) const {
+                return bounds[slot].lo;
+            }
+
+            double hi(size_t slot, size_t) const {
+                return bounds[slot].hi;
+            }
+        };
+
+        // Variable bounds given as columns of lower and upper bounds
+        struct ColumnVariables {
+            const double* const* lo_columns;
+            const double* const* hi_columns;
+            size_t first;
+
+            double lo(size_t slot, size_t i) const {
+                return lo_columns[slot][first + i];
+            }
+
+            double hi(size_t slot, size_t i) const {
+                return hi_columns[slot][first + i];
+            }
+        };
+
+        // Bounds count sets of variables, running each instruction across
+        // all of them before moving on to the next one, in the same way as
+        // eval_program_block.
+        //
+        // Arguments:
+        //  program: successfully built program
+        //  variables: bounds of each variable, for count sets
+        //  count: number of sets of bounds, at most stride
+        //  stride: distance between the stack entries of one instruction
+        //  stack_lo, stack_hi: scratch space for program.max_depth * stride values each
+        //  out_lo, out_hi: arrays used to store count bounds
+        template <class Variables>
+        void eval_bounds_block(const Program& program,
+                               const Variables& variables,
+                               size_t count,
+                               size_t stride,
+                               double* stack_lo,
+                               double* stack_hi,
+                               double* out_lo,
+                               double* out_hi) {
+            size_t top = 0; // Offset one past the top of the stacks
+            const double* inline_lo[INLINE_CALL_ARGS];
+            const double* inline_hi[INLINE_CALL_ARGS];
+            vector<const double*> heap_lo, heap_hi;
+            for (const Instruction& instr : program.code) {
+                double* top_lo = stack_lo + top;
+                double* top_hi = stack_hi + top;
+                if (instr.code == InstructionCode::PUSH_NUMBER) {
+                    double value = program.constants[instr.operand];
+                    for (size_t i = 0; i < count; i++) top_lo[i] = top_hi[i] = value;
+                    top += stride;
+                    continue;
+                } else if (instr.code == InstructionCode::PUSH_VARIABLE) {
+                    for (size_t i = 0; i < count; i++) {
+                        top_lo[i] = variables.lo(instr.operand, i);
+                        top_hi[i] = variables.hi(instr.operand, i);
+                    }
+                    top += stride;
+                    continue;
+                }
+
+                // The arguments are the top entries of the stacks, and the
+                // result replaces the first of them
+                size_t num_args = instruction_args(instr);
+                const double** args_lo = inline_lo;
+                const double** args_hi = inline_hi;
+                if (num_args > INLINE_CALL_ARGS) {
+                    heap_lo.resize(num_args);
+                    heap_hi.resize(num_args);
+                    args_lo = heap_lo.data();
+                    args_hi = heap_hi.data();
+                }
+                top -= num_args * stride;
+                for (size_t iarg = 0; iarg < num_args; iarg++) {
+                    args_lo[iarg] = stack_lo + top + iarg * stride;
+                    args_hi[iarg] = stack_hi + top + iarg * stride;
+                }
+
+                IntervalOperation bounds;
+                if (instr.code == InstructionCode::APPLY_OPERATOR) {
+                    bounds = g_operator_bounds[instr.operand];
+                } else {
+                    bounds = get_function(instr.operand)->bounds;
+                    if (bounds == NULL) bounds = unknown_bounds;
+                }
+                bounds(args_lo, args_hi, num_args, count, stack_lo + top, stack_hi + top);
+                top += stride;
+            }
+
+            memcpy(out_lo, stack_lo, count * sizeof(double));
+            memcpy(out_hi, stack_hi, count * sizeof(double));
+        }
+    } // namespace
+
+    IntervalOperation get_builtin_bounds(const char* name) {
+        for (const BuiltinBounds& builtin : g_builtin_bounds) {
+            if (strcmp(builtin.name, name) == 0) return builtin.bounds;
+        }
+        return NULL;
+    }
+
+    Status evaluate_bounds(const CompiledExpression& compiled, const Interval bounds[], Interval* result) {
+        const Program* program = ProgramAccess::program(compiled);
+        if (program == NULL) return Status::EMPTY_EXPRESSION;
+        if (bounds == NULL && !program->variables.empty()) return Status::UNBOUND_VARIABLE;
+
+        IntervalVariables variables = { bounds };
+        if (program->max_depth <= EVAL_INLINE_STACK) {
+            double stack_lo[EVAL_INLINE_STACK], stack_hi[EVAL_INLINE_STACK];
+            eval_bounds_block(*program, variables, 1, 1, stack_lo, stack_hi, &result->lo, &result->hi);
+        } else {
+            vector<double> stack(2 * program->max_depth);
+            eval_bounds_block(*program, variables, 1, 1, stack.data(), stack.data() + program->max_depth, &result->lo,
+                              &result->hi);
+        }
+        return Status::SUCCESS;
+    }
+
+    Status evaluate_bounds_batch(const CompiledExpression& compiled,
+                                 const double* const lo[],
+                                 const double* const hi[],
+                                 size_t n_blocks,
+                                 double* out_lo,
+                                 double* out_hi) {
+        const Program* program = ProgramAccess::program(compiled);
+        if (program == NULL) return Status::EMPTY_EXPRESSION;
+        for (size_t slot = 0; slot < program->variables.size(); slot++) {
+            if (lo == NULL || hi == NULL || lo[slot] == NULL || hi[slot] == NULL) return Status::UNBOUND_VARIABLE;
+        }
+
+        size_t stack_size = program->max_depth * BATCH_BLOCK_SIZE;
+        vector<double> stack(2 * stack_size);
+        for (size_t first = 0; first < n_blocks; first += BATCH_BLOCK_SIZE) {
+            size_t count = n_blocks - first < BATCH_BLOCK_SIZE ? n_blocks - first : BATCH_BLOCK_SIZE;
+            ColumnVariables variables = { lo, hi, first };
+            eval_bounds_block(*program, variables, count, BATCH_BLOCK_SIZE, stack.data(), stack.data() + stack_size,
+                              out_lo + first, out_hi + first);
+        }
+        return Status::SUCCESS;
+    }
+} // namespace exprparse
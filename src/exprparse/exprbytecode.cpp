@@ -0,0 +1,467 @@
+// exprbytecode.cpp
+//
+// Binary format for catalogs of compiled expressions
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#if defined(EXPRPARSE_HAVE_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// A catalog is a header followed by six sections, each starting on an 8 byte
+// boundary, in this order:
+//
+//   double      constants[num_constants]        constant pools of all expressions
+//   Expression  expressions[num_expressions]
+//   Instruction code[num_instructions]          instruction streams of all expressions
+//   Name        variables[num_variables]        variable slots of all expressions
+//   Name        functions[num_functions]        functions called, by name
+//   char        strings[string_bytes]           names, not null terminated
+//
+// Every value is stored in the byte order of the writer, which is recorded
+// in the header. Instructions are stored as they are in a Program, except
+// that the operand of PUSH_NUMBER is relative to the expression's first
+// constant and that of CALL_FUNCTION is an index into functions.
+namespace exprparse {
+    namespace {
+        const char BYTECODE_MAGIC[8] = { 'E', 'X', 'P', 'R', 'B', 'Y', 'T', 'E' };
+        const uint32_t BYTECODE_VERSION = 1;
+        const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+        typedef struct BytecodeHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint32_t num_expressions;
+            uint32_t num_functions;
+            uint32_t num_instructions;
+            uint32_t num_constants;
+            uint32_t num_variables;
+            uint32_t string_bytes;
+            uint64_t file_size;
+        } BytecodeHeader;
+
+        typedef struct BytecodeExpression {
+            uint32_t first_instruction;
+            uint32_t num_instructions; // 0 for an empty expression
+            uint32_t first_constant;
+            uint32_t num_constants;
+            uint32_t first_variable;
+            uint32_t num_variables;
+            uint32_t max_depth;
+            uint32_t unoptimized_size;
+        } BytecodeExpression;
+
+        typedef struct BytecodeName {
+            uint32_t offset; // Into strings
+            uint32_t length;
+        } BytecodeName;
+
+        static_assert(sizeof(BytecodeHeader) == 48, "header layout is part of the format");
+        static_assert(sizeof(BytecodeExpression) == 32, "expression layout is part of the format");
+        static_assert(sizeof(Instruction) == 12, "instruction layout is part of the format");
+        static_assert(sizeof(BytecodeName) == 8, "name layout is part of the format");
+
+        size_t align8(size_t offset) {
+            return (offset + 7) & ~(size_t)7;
+        }
+
+        // Offsets of the sections, worked out from the counts in the header
+        typedef struct BytecodeLayout {
+            size_t constants;
+            size_t expressions;
+            size_t code;
+            size_t variables;
+            size_t functions;
+            size_t strings;
+            size_t end;
+        } BytecodeLayout;
+
+        BytecodeLayout get_layout(const BytecodeHeader& header) {
+            BytecodeLayout layout;
+            layout.constants = sizeof(BytecodeHeader);
+            layout.expressions = align8(layout.constants + (size_t)header.num_constants * sizeof(double));
+            layout.code = align8(layout.expressions + (size_t)header.num_expressions * sizeof(BytecodeExpression));
+            layout.variables = align8(layout.code + (size_t)header.num_instructions * sizeof(Instruction));
+            layout.functions = align8(layout.variables + (size_t)header.num_variables * sizeof(BytecodeName));
+            layout.strings = align8(layout.functions + (size_t)header.num_functions * sizeof(BytecodeName));
+            layout.end = align8(layout.strings + header.string_bytes);
+            return layout;
+        }
+
+        bool fits_uint32(size_t value) {
+            return value <= UINT32_MAX;
+        }
+
+        // Builds the sections of a catalog, giving each distinct name and
+        // function one entry
+        struct BytecodeWriter {
+            vector<double> constants;
+            vector<BytecodeExpression> expressions;
+            vector<Instruction> code;
+            vector<BytecodeName> variables;
+            vector<BytecodeName> functions;
+            string strings;
+            unordered_map<string, uint32_t> string_offsets;
+            unordered_map<uint32_t, uint32_t> function_indexes; // Registry id to index in functions
+
+            BytecodeName add_string(const string& name) {
+                auto iter = string_offsets.find(name);
+                if (iter == string_offsets.end()) {
+                    iter = string_offsets.emplace(name, (uint32_t)strings.size()).first;
+                    strings += name;
+                }
+                BytecodeName entry = { iter->second, (uint32_t)name.size() };
+                return entry;
+            }
+
+            uint32_t add_function(uint32_t id) {
+                auto iter = function_indexes.find(id);
+                if (iter == function_indexes.end()) {
+                    iter = function_indexes.emplace(id, (uint32_t)functions.size()).first;
+                    functions.push_back(add_string(get_function(id)->name));
+                }
+                return iter->second;
+            }
+
+            void add(const Program* program) {
+                BytecodeExpression entry = { (uint32_t)code.size(), 0, (uint32_t)constants.size(), 0,
+                                             (uint32_t)variables.size(), 0, 0, 0 };
+                if (program != NULL) {
+                    entry.num_instructions = (uint32_t)program->code.size();
+                    entry.num_constants = (uint32_t)program->constants.size();
+                    entry.num_variables = (uint32_t)program->variables.size();
+                    entry.max_depth = (uint32_t)program->max_depth;
+                    entry.unoptimized_size = (uint32_t)program->unoptimized_size;
+                    for (const Instruction& instr : program->code) {
+                        Instruction stored = instr;
+                        if (instr.code == InstructionCode::CALL_FUNCTION) stored.operand = add_function(instr.operand);
+                        code.push_back(stored);
+                    }
+                    constants.insert(constants.end(), program->constants.begin(), program->constants.end());
+                    for (const string& name : program->variables) variables.push_back(add_string(name));
+                }
+                expressions.push_back(entry);
+            }
+        };
+
+        template <class T> void write_section(string* bytecode, size_t offset, const vector<T>& section) {
+            if (!section.empty()) memcpy(&(*bytecode)[offset], section.data(), section.size() * sizeof(T));
+        }
+
+        // Replays the stack effect of an expression's code, checking every
+        // operand against the catalog so that evaluation can trust it
+        Status check_code(const Instruction* code,
+                          const BytecodeExpression& entry,
+                          const vector<const Function*>& functions) {
+            size_t depth = 0;
+            size_t max_depth = 0;
+            for (const Instruction* instr = code; instr != code + entry.num_instructions; instr++) {
+                size_t num_args = 0;
+                if (instr->code == InstructionCode::PUSH_NUMBER) {
+                    if (instr->operand >= entry.num_constants || instr->num_args != 0) return Status::ERROR;
+                } else if (instr->code == InstructionCode::PUSH_VARIABLE) {
+                    if (instr->operand >= entry.num_variables || instr->num_args != 0) return Status::ERROR;
+                } else if (instr->code == InstructionCode::APPLY_OPERATOR) {
+                    if (instr->operand >= NUM_OPERATORS || instr->num_args != 0) return Status::ERROR;
+                    num_args = g_operators[instr->operand]->num_arg;
+                } else if (instr->code == InstructionCode::CALL_FUNCTION) {
+                    if (instr->operand >= functions.size()) return Status::ERROR;
+                    const Function* function = functions[instr->operand];
+                    num_args = instr->num_args;
+                    if (num_args < function->min_args || num_args > function->max_args) return Status::ERROR;
+                } else {
+                    return Status::ERROR;
+                }
+                if (depth < num_args) return Status::ERROR;
+                depth = depth - num_args + 1;
+                if (depth > max_depth) max_depth = depth;
+            }
+            if (depth != 1 || max_depth != entry.max_depth) return Status::ERROR;
+            return Status::SUCCESS;
+        }
+    } // namespace
+
+    Status write_bytecode(const vector<CompiledExpression>& expressions, string* bytecode) {
+        BytecodeWriter writer;
+        for (const CompiledExpression& compiled : expressions) writer.add(ProgramAccess::program(compiled));
+        if (!fits_uint32(writer.expressions.size()) || !fits_uint32(writer.code.size()) ||
+            !fits_uint32(writer.constants.size()) || !fits_uint32(writer.variables.size()) ||
+            !fits_uint32(writer.strings.size())) {
+            return Status::ERROR;
+        }
+
+        BytecodeHeader header;
+        memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+        header.version = BYTECODE_VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        header.num_expressions = (uint32_t)writer.expressions.size();
+        header.num_functions = (uint32_t)writer.functions.size();
+        header.num_instructions = (uint32_t)writer.code.size();
+        header.num_constants = (uint32_t)writer.constants.size();
+        header.num_variables = (uint32_t)writer.variables.size();
+        header.string_bytes = (uint32_t)writer.strings.size();
+        BytecodeLayout layout = get_layout(header);
+        header.file_size = layout.end;
+
+        bytecode->assign(layout.end, '\0');
+        memcpy(&(*bytecode)[0], &header, sizeof(header));
+        write_section(bytecode, layout.constants, writer.constants);
+        write_section(bytecode, layout.expressions, writer.expressions);
+        write_section(bytecode, layout.code, writer.code);
+        write_section(bytecode, layout.variables, writer.variables);
+        write_section(bytecode, layout.functions, writer.functions);
+        if (!writer.strings.empty()) memcpy(&(*bytecode)[layout.strings], writer.strings.data(), writer.strings.size());
+        return Status::SUCCESS;
+    }
+
+    struct BytecodeCatalog::Impl {
+        const double* constants;
+        const BytecodeExpression* expressions;
+        const Instruction* code;
+        const BytecodeName* variables;
+        const char* strings;
+        size_t num_expressions;
+        vector<const Function*> functions; // Looked up once for the whole catalog
+
+        vector<uint64_t> copy; // Aligned copy of bytecode that was not aligned
+        void* mapping;         // Memory mapped by load_file
+        size_t mapping_size;
+
+        Impl() : mapping(NULL), mapping_size(0) {
+            clear();
+        }
+
+        ~Impl() {
+            unmap();
+        }
+
+        void clear() {
+            constants = NULL;
+            expressions = NULL;
+            code = NULL;
+            variables = NULL;
+            strings = NULL;
+            num_expressions = 0;
+            functions.clear();
+        }
+
+        void unmap() {
+#if defined(EXPRPARSE_HAVE_MMAP)
+            if (mapping != NULL) munmap(mapping, mapping_size);
+#endif
+            mapping = NULL;
+            mapping_size = 0;
+        }
+
+        Status load(const char* data, size_t size) {
+            clear();
+            BytecodeHeader header;
+            if (size < sizeof(header)) return Status::ERROR;
+            memcpy(&header, data, sizeof(header));
+            if (memcmp(header.magic, BYTECODE_MAGIC, sizeof(header.magic)) != 0 ||
+                header.version != BYTECODE_VERSION || header.byte_order != BYTE_ORDER_MARK) {
+                return Status::ERROR;
+            }
+            BytecodeLayout layout = get_layout(header);
+            if (header.file_size != layout.end || size < layout.end) return Status::ERROR;
+
+            const BytecodeName* function_names = (const BytecodeName*)(data + layout.functions);
+            const char* string_data = data + layout.strings;
+            vector<const Function*> found(header.num_functions);
+            for (size_t ifunction = 0; ifunction < header.num_functions; ifunction++) {
+                const BytecodeName& name = function_names[ifunction];
+                if ((size_t)name.offset + name.length > header.string_bytes) return Status::ERROR;
+                found[ifunction] = find_function(string_data + name.offset, name.length);
+                if (found[ifunction] == NULL) return Status::UNKNOWN_TOKEN;
+            }
+
+            const BytecodeExpression* entries = (const BytecodeExpression*)(data + layout.expressions);
+            const Instruction* all_code = (const Instruction*)(data + layout.code);
+            const BytecodeName* all_variables = (const BytecodeName*)(data + layout.variables);
+            for (size_t iexpr = 0; iexpr < header.num_expressions; iexpr++) {
+                const BytecodeExpression& entry = entries[iexpr];
+                if ((size_t)entry.first_instruction + entry.num_instructions > header.num_instructions ||
+                    (size_t)entry.first_constant + entry.num_constants > header.num_constants ||
+                    (size_t)entry.first_variable + entry.num_variables > header.num_variables) {
+                    return Status::ERROR;
+                }
+                for (size_t slot = 0; slot < entry.num_variables; slot++) {
+                    const BytecodeName& name = all_variables[entry.first_variable + slot];
+                    if (name.length == 0 || (size_t)name.offset + name.length > header.string_bytes)
+                        return Status::ERROR;
+                }
+                if (entry.num_instructions == 0) {
+                    if (entry.num_constants != 0 || entry.num_variables != 0) return Status::ERROR;
+                    continue;
+                }
+                Status ret_val = check_code(all_code + entry.first_instruction, entry, found);
+                if (ret_val != Status::SUCCESS) return ret_val;
+            }
+
+            constants = (const double*)(data + layout.constants);
+            expressions = entries;
+            code = all_code;
+            variables = all_variables;
+            strings = string_data;
+            num_expressions = header.num_expressions;
+            functions.swap(found);
+            return Status::SUCCESS;
+        }
+
+        const BytecodeExpression* find(size_t index) const {
+            return index < num_expressions ? &expressions[index] : NULL;
+        }
+    };
+
+    BytecodeCatalog::BytecodeCatalog() : impl_(new Impl()) {
+    }
+
+    BytecodeCatalog::~BytecodeCatalog() {
+    }
+
+    Status BytecodeCatalog::load(const void* data, size_t size) {
+        Impl& impl = *impl_;
+        impl.unmap();
+        impl.copy.clear();
+        if (((uintptr_t)data & 7) != 0) {
+            impl.copy.resize((size + 7) / 8);
+            if (size != 0) memcpy(impl.copy.data(), data, size);
+            data = impl.copy.data();
+        }
+        return impl.load((const char*)data, size);
+    }
+
+    Status BytecodeCatalog::load_file(const string& path) {
+        Impl& impl = *impl_;
+        impl.unmap();
+        impl.copy.clear();
+        impl.clear();
+#if defined(EXPRPARSE_HAVE_MMAP)
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return Status::ERROR;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            close(fd);
+            return Status::ERROR;
+        }
+        size_t size = (size_t)info.st_size;
+        void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) return Status::ERROR;
+        impl.mapping = mapping;
+        impl.mapping_size = size;
+        return impl.load((const char*)mapping, size);
+#else
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == NULL) return Status::ERROR;
+        vector<char> contents;
+        char buffer[65536];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), file)) != 0) contents.insert(contents.end(), buffer, buffer + count);
+        bool failed = ferror(file) != 0;
+        fclose(file);
+        if (failed) return Status::ERROR;
+        impl.copy.resize((contents.size() + 7) / 8);
+        if (!contents.empty()) memcpy(impl.copy.data(), contents.data(), contents.size());
+        return impl.load((const char*)impl.copy.data(), contents.size());
+#endif
+    }
+
+    size_t BytecodeCatalog::size() const {
+        return impl_->num_expressions;
+    }
+
+    size_t BytecodeCatalog::num_variables(size_t index) const {
+        const BytecodeExpression* entry = impl_->find(index);
+        return entry ? entry->num_variables : 0;
+    }
+
+    string_view BytecodeCatalog::variable_name(size_t index, size_t slot) const {
+        const BytecodeExpression* entry = impl_->find(index);
+        if (entry == NULL || slot >= entry->num_variables) return string_view();
+        const BytecodeName& name = impl_->variables[entry->first_variable + slot];
+        return string_view(impl_->strings + name.offset, name.length);
+    }
+
+    Status BytecodeCatalog::evaluate(size_t index, const double* const values[], double* result) const {
+        *result = 0.0;
+        const BytecodeExpression* entry = impl_->find(index);
+        if (entry == NULL) return Status::ERROR;
+        if (entry->num_instructions == 0) return Status::EMPTY_EXPRESSION;
+        for (size_t slot = 0; slot < entry->num_variables; slot++) {
+            if (values == NULL || values[slot] == NULL) return Status::UNBOUND_VARIABLE;
+        }
+
+        const Instruction* code = impl_->code + entry->first_instruction;
+        const double* constants = impl_->constants + entry->first_constant;
+        if (entry->max_depth <= EVAL_INLINE_STACK) {
+            double stack[EVAL_INLINE_STACK];
+            return eval_code(code, entry->num_instructions, constants, impl_->functions.data(), values, stack, result);
+        }
+        vector<double> stack(entry->max_depth);
+        return eval_code(code, entry->num_instructions, constants, impl_->functions.data(), values, stack.data(),
+                         result);
+    }
+
+    Status BytecodeCatalog::get_expression(size_t index, CompiledExpression* compiled) const {
+        const BytecodeExpression* entry = impl_->find(index);
+        if (entry == NULL) return Status::ERROR;
+        if (entry->num_instructions == 0) {
+            ProgramAccess::set_program(compiled, shared_ptr<const Program>());
+            return Status::EMPTY_EXPRESSION;
+        }
+
+        shared_ptr<Program> program = make_shared<Program>();
+        const Instruction* code = impl_->code + entry->first_instruction;
+        program->code.assign(code, code + entry->num_instructions);
+        for (Instruction& instr : program->code) {
+            if (instr.code == InstructionCode::CALL_FUNCTION) instr.operand = impl_->functions[instr.operand]->id;
+        }
+        const double* constants = impl_->constants + entry->first_constant;
+        program->constants.assign(constants, constants + entry->num_constants);
+        for (size_t slot = 0; slot < entry->num_variables; slot++)
+            program->variables.emplace_back(variable_name(index, slot));
+        program->max_depth = entry->max_depth;
+        program->unoptimized_size = entry->unoptimized_size;
+        ProgramAccess::set_program(compiled, program);
+        return Status::SUCCESS;
+    }
+} // namespace exprparse
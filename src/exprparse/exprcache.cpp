@@ -0,0 +1,159 @@
+// exprcache.cpp
+//
+// Cache of compiled expressions used by parse_expression
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using namespace std;
+
+namespace exprparse {
+    namespace {
+        // Keys are spread over the shards by hash, each shard being a separate
+        // LRU list with its own lock
+        const size_t CACHE_SHARDS = 16;
+        const size_t DEFAULT_CACHE_CAPACITY = 1024;
+
+        typedef struct CacheEntry {
+            string expression;
+            shared_ptr<const Program> program;
+        } CacheEntry;
+
+        typedef struct CacheShard {
+            mutex lock;
+            list<CacheEntry> entries; // Most recently used first
+            unordered_map<string_view, list<CacheEntry>::iterator> index; // Keys point into entries
+            size_t capacity;
+            size_t hits;
+            size_t misses;
+            size_t evictions;
+
+            CacheShard() : capacity(DEFAULT_CACHE_CAPACITY / CACHE_SHARDS), hits(0), misses(0), evictions(0) {
+            }
+
+            // Drops least recently used entries until there are at most capacity
+            void trim() {
+                while (entries.size() > capacity) {
+                    index.erase(entries.back().expression);
+                    entries.pop_back();
+                    evictions++;
+                }
+            }
+        } CacheShard;
+
+        atomic<size_t> g_cache_capacity(DEFAULT_CACHE_CAPACITY);
+
+        // Created on first use, so parse_expression works during static
+        // initialization of other files
+        CacheShard* get_shards() {
+            static CacheShard shards[CACHE_SHARDS];
+            return shards;
+        }
+
+        CacheShard& get_shard(string_view expression) {
+            return get_shards()[hash<string_view>()(expression) % CACHE_SHARDS];
+        }
+    } // namespace
+
+    bool expression_cache_enabled() {
+        return g_cache_capacity.load(memory_order_relaxed) != 0;
+    }
+
+    shared_ptr<const Program> find_cached_program(string_view expression) {
+        CacheShard& shard = get_shard(expression);
+        lock_guard<mutex> guard(shard.lock);
+        auto iter = shard.index.find(expression);
+        if (iter == shard.index.end()) {
+            shard.misses++;
+            return shared_ptr<const Program>();
+        }
+        shard.hits++;
+        shard.entries.splice(shard.entries.begin(), shard.entries, iter->second);
+        return iter->second->program;
+    }
+
+    void cache_program(string_view expression, const shared_ptr<const Program>& program) {
+        CacheShard& shard = get_shard(expression);
+        lock_guard<mutex> guard(shard.lock);
+        if (shard.capacity == 0) return;
+
+        // Another thread may have compiled the same expression meanwhile
+        auto iter = shard.index.find(expression);
+        if (iter != shard.index.end()) {
+            shard.entries.splice(shard.entries.begin(), shard.entries, iter->second);
+            return;
+        }
+
+        CacheEntry entry = { string(expression), program };
+        shard.entries.push_front(entry);
+        shard.index[shard.entries.front().expression] = shard.entries.begin();
+        shard.trim();
+    }
+
+    void set_expression_cache_capacity(size_t capacity) {
+        g_cache_capacity = capacity;
+        CacheShard* shards = get_shards();
+        for (size_t ishard = 0; ishard < CACHE_SHARDS; ishard++) {
+            lock_guard<mutex> guard(shards[ishard].lock);
+            shards[ishard].capacity = capacity / CACHE_SHARDS + (ishard < capacity % CACHE_SHARDS ? 1 : 0);
+            shards[ishard].trim();
+        }
+    }
+
+    ExpressionCacheStats get_expression_cache_stats() {
+        ExpressionCacheStats stats = { 0, 0, 0, 0, 0 };
+        CacheShard* shards = get_shards();
+        for (size_t ishard = 0; ishard < CACHE_SHARDS; ishard++) {
+            lock_guard<mutex> guard(shards[ishard].lock);
+            stats.hits += shards[ishard].hits;
+            stats.misses += shards[ishard].misses;
+            stats.evictions += shards[ishard].evictions;
+            stats.size += shards[ishard].entries.size();
+            stats.capacity += shards[ishard].capacity;
+        }
+        return stats;
+    }
+
+    void clear_expression_cache() {
+        CacheShard* shards = get_shards();
+        for (size_t ishard = 0; ishard < CACHE_SHARDS; ishard++) {
+            lock_guard<mutex> guard(shards[ishard].lock);
+            shards[ishard].index.clear();
+            shards[ishard].entries.clear();
+            shards[ishard].hits = 0;
+            shards[ishard].misses = 0;
+            shards[ishard].evictions = 0;
+        }
+    }
+} // namespace exprparse
@@ -0,0 +1,1094 @@
+// exprconstexpr.h
+//
+// Parsing and evaluation of expressions at compile time
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXPRCONSTEXPR_H
+#define EXPRCONSTEXPR_H
+
+#include "exprparse.h"
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <math.h>
+#include <string_view>
+#include <utility>
+
+// Expressions written into the source can be parsed by the compiler rather
+// than at runtime:
+//
+//    constexpr double area = exprparse::ct_eval("2*(3+4)^2");   // 98
+//
+//    using namespace exprparse::literals;
+//    constexpr double volume = "2*(3+4)^2 * 1.5"_expr;
+//
+// An expression with variables is compiled into a program once, and
+// ct_evaluate turns the program into straight line code for it, with the
+// variables given in order of first appearance:
+//
+//    static constexpr auto g_rate = exprparse::ct_compile("x * (1 + r)^n");
+//    double result;
+//    exprparse::Status status = exprparse::ct_evaluate<g_rate>(&result, x, r, n);
+//
+// The grammar, precedence and associativity are those of parse_expression,
+// and so are the statuses. Errors found while compiling, including calls of
+// functions that are not available at compile time, fail the build. Only
+// min, max, sum and abs can be called.
+//
+// ct_evaluate does the arithmetic with the same operations as
+// CompiledExpression::evaluate, so results are bit for bit the same.
+// ct_eval and the _expr literal have to do it with constant expressions
+// instead. These agree with the C library except for ^, which can be one
+// unit in the last place off. Whole number exponents are computed by
+// squaring in double double and rounded correctly, which the C library pow
+// does not always do. Other exponents, and whole ones too large to square,
+// are computed in long double.
+namespace exprparse {
+    // A compiled expression held in fixed size arrays, so that it can be a
+    // constant. Capacity bounds the number of instructions and is the size
+    // of the source array for ct_compile.
+    template <size_t Capacity> struct ConstantProgram;
+
+    namespace ct_detail {
+        constexpr double ALMOST_ZERO = 1.0E-10;
+
+        // Capacity used by ct_eval, which has no array to size it from
+        constexpr size_t MAX_EVAL_INSTRUCTIONS = 256;
+
+        typedef enum { CT_PUSH_NUMBER, CT_PUSH_VARIABLE, CT_APPLY_OPERATOR, CT_CALL_FUNCTION } InstructionCode;
+
+        typedef enum {
+            CT_ADD,
+            CT_SUBTRACT,
+            CT_MULTIPLY,
+            CT_DIVIDE,
+            CT_POWER,
+            CT_UNARY_MINUS,
+            CT_UNARY_PLUS
+        } OperatorId;
+
+        typedef enum { CT_ABS, CT_MIN, CT_MAX, CT_SUM } FunctionId;
+
+        typedef struct Instruction {
+            InstructionCode code;
+            int operand;     // OperatorId, FunctionId, constant or variable slot
+            size_t num_args; // Values taken from the stack
+            size_t top;      // Stack slot of the first argument, where the result goes
+        } Instruction;
+
+        typedef struct FunctionInfo {
+            std::string_view name;
+            size_t min_args;
+            size_t max_args;
+            FunctionId id;
+        } FunctionInfo;
+
+        constexpr FunctionInfo FUNCTIONS[] = {
+            { "abs", 1, 1, CT_ABS },
+            { "min", 1, ANY_NUMBER_OF_ARGS, CT_MIN },
+            { "max", 1, ANY_NUMBER_OF_ARGS, CT_MAX },
+            { "sum", 1, ANY_NUMBER_OF_ARGS, CT_SUM },
+        };
+
+        constexpr int precedence(OperatorId op) {
+            return op <= CT_SUBTRACT ? 1 : op <= CT_DIVIDE ? 2 : 3;
+        }
+
+        constexpr bool right_associative(OperatorId op) {
+            return op >= CT_POWER;
+        }
+
+        constexpr size_t operator_args(OperatorId op) {
+            return op >= CT_UNARY_MINUS ? 1 : 2;
+        }
+
+        // Not constexpr, so calling either of these while the compiler
+        // evaluates a constant stops the build. The error names the function.
+        inline void expression_does_not_compile(Status) {
+        }
+
+        inline void expression_does_not_evaluate(Status) {
+        }
+
+        // Character classes of the lexer in exprparse.cpp
+
+        constexpr bool is_digit(char c) {
+            return c >= '0' && c <= '9';
+        }
+
+        constexpr bool is_identifier_start(char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        }
+
+        constexpr bool is_identifier_char(char c) {
+            return is_identifier_start(c) || is_digit(c);
+        }
+
+        constexpr bool is_whitespace(char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\n';
+        }
+
+        constexpr size_t skip_whitespace(std::string_view text, size_t pos) {
+            while (pos < text.size() && is_whitespace(text[pos])) pos++;
+            return pos;
+        }
+
+        // Returns the end of the number starting at pos, or pos if there is
+        // none. Same grammar as scan_number.
+        constexpr size_t scan_number(std::string_view text, size_t pos) {
+            size_t end = pos;
+            if (end < text.size() && is_digit(text[end])) {
+                while (end < text.size() && is_digit(text[end])) end++;
+                if (end < text.size() && text[end] == '.') end++;
+            } else if (end + 1 < text.size() && text[end] == '.' && is_digit(text[end + 1])) {
+                end++;
+            } else {
+                return pos;
+            }
+            while (end < text.size() && is_digit(text[end])) end++;
+
+            if (end < text.size() && (text[end] == 'e' || text[end] == 'E')) {
+                size_t exp_end = end + 1;
+                if (exp_end < text.size() && (text[exp_end] == '+' || text[exp_end] == '-')) exp_end++;
+                if (exp_end < text.size() && is_digit(text[exp_end])) {
+                    while (exp_end < text.size() && is_digit(text[exp_end])) exp_end++;
+                    end = exp_end;
+                }
+            }
+            return end;
+        }
+
+        // Floating point in constant expressions. Results that overflow, and
+        // NaNs made from numbers, are not constants, so those cases are
+        // worked out before the operation and the value returned directly.
+
+        constexpr double INF = std::numeric_limits<double>::infinity();
+        constexpr double NAN_VALUE = std::numeric_limits<double>::quiet_NaN();
+
+        constexpr bool is_nan(double x) {
+            return x != x;
+        }
+
+        constexpr bool is_inf(double x) {
+            return x == INF || x == -INF;
+        }
+
+        constexpr bool sign_bit(double x) {
+#if defined(__GNUC__)
+            return __builtin_signbit(x);
+#else
+            return x < 0; // Negative zero reads as positive
+#endif
+        }
+
+        constexpr double abs_value(double x) {
+            return x == 0 ? 0.0 : x < 0 ? -x : x;
+        }
+
+        // Smallest magnitude that rounds to infinity as a double, halfway
+        // between DBL_MAX and 2^1024. Exact results are compared with it in
+        // long double. Where long double is no wider than double the limit is
+        // DBL_MAX, and results close to overflowing fail the build instead.
+        constexpr long double overflow_limit() {
+            if (std::numeric_limits<long double>::max_exponent > std::numeric_limits<double>::max_exponent) {
+                long double half_ulp = 1.0L;
+                for (int i = 0; i < DBL_MAX_EXP - DBL_MANT_DIG; i++) half_ulp *= 2;
+                return (long double)DBL_MAX + half_ulp;
+            }
+            return DBL_MAX;
+        }
+
+        constexpr long double OVERFLOW_LIMIT = overflow_limit();
+
+        constexpr bool overflows(long double wide) {
+            return wide >= OVERFLOW_LIMIT || wide <= -OVERFLOW_LIMIT;
+        }
+
+        constexpr double add(double a, double b) {
+            if (is_nan(a) || is_nan(b)) return a + b;
+            if (is_inf(a) && is_inf(b) && a != b) return NAN_VALUE;
+            if (is_inf(a) || is_inf(b)) return a + b;
+            if (overflows((long double)a + b)) return a > 0 ? INF : -INF;
+            return a + b;
+        }
+
+        constexpr double multiply(double a, double b) {
+            if (is_nan(a) || is_nan(b)) return a * b;
+            if (is_inf(a) || is_inf(b)) return (a == 0 || b == 0) ? NAN_VALUE : a * b;
+            if (overflows((long double)a * b)) return (a < 0) != (b < 0) ? -INF : INF;
+            return a * b;
+        }
+
+        // b is not zero, divide checks that first
+        constexpr double divide(double a, double b) {
+            if (is_nan(a) || is_nan(b)) return a / b;
+            if (is_inf(a) && is_inf(b)) return NAN_VALUE;
+            if (is_inf(a) || is_inf(b)) return a / b;
+            if (overflows((long double)a / b)) return (a < 0) != (b < 0) ? -INF : INF;
+            return a / b;
+        }
+
+        // Rounds a long double result to double
+        constexpr double narrow(long double wide) {
+            if (overflows(wide)) return wide > 0 ? INF : -INF;
+            return (double)wide;
+        }
+
+        constexpr long double LN2 = 0.693147180559945309417232121458176568L;
+
+        // Natural logarithm of a positive finite x, in long double
+        constexpr long double log_wide(double x) {
+            // x = m * 2^k with m in [sqrt(1/2), sqrt(2)), scaling by 2 being exact
+            long double m = x;
+            int k = 0;
+            while (m >= 1.4142135623730950488L) {
+                m /= 2;
+                k++;
+            }
+            while (m < 0.70710678118654752440L) {
+                m *= 2;
+                k--;
+            }
+
+            // log(m) = 2 atanh(s) = 2 (s + s^3/3 + s^5/5 + ...) with |s| < 0.172
+            long double s = (m - 1) / (m + 1);
+            long double s2 = s * s;
+            long double term = s;
+            long double sum = 0;
+            for (int i = 1; i < 50; i += 2) {
+                sum += term / i;
+                term *= s2;
+            }
+            return k * LN2 + 2 * sum;
+        }
+
+        // e^t rounded to double
+        constexpr double exp_narrow(long double t) {
+            if (t > 710) return INF;
+            if (t < -746) return 0.0;
+
+            // e^t = 2^k e^r with |r| <= log(2)/2
+            long k = (long)(t / LN2 + (t < 0 ? -0.5L : 0.5L));
+            long double r = t - k * LN2;
+            long double value = 1;
+            long double term = 1;
+            for (int i = 1; i < 25; i++) {
+                term *= r / i;
+                value += term;
+            }
+            for (; k > 0; k--) value *= 2;
+            for (; k < 0; k++) value /= 2;
+            return narrow(value);
+        }
+
+        // A number held as the unevaluated sum hi + lo of two doubles, with
+        // |lo| at most half a unit in the last place of hi, which gives
+        // about 106 bits. Every product in the operations below is exact, so
+        // contracting them into fused multiply adds changes nothing.
+        typedef struct DoubleDouble {
+            double hi;
+            double lo;
+        } DoubleDouble;
+
+        // a + b exactly, for |a| >= |b|
+        constexpr DoubleDouble fast_two_sum(double a, double b) {
+            double sum = a + b;
+            return { sum, b - (sum - a) };
+        }
+
+        // a * b exactly, for |a| and |b| well inside the normal range. Each
+        // is split into halves of 26 bits, whose products are exact.
+        constexpr DoubleDouble two_product(double a, double b) {
+            double product = a * b;
+            double a_big = 134217729.0 * a;
+            double a_hi = a_big - (a_big - a);
+            double a_lo = a - a_hi;
+            double b_big = 134217729.0 * b;
+            double b_hi = b_big - (b_big - b);
+            double b_lo = b - b_hi;
+            return { product, ((a_hi * b_hi - product) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo };
+        }
+
+        constexpr DoubleDouble dd_multiply(DoubleDouble a, DoubleDouble b) {
+            DoubleDouble product = two_product(a.hi, b.hi);
+            return fast_two_sum(product.hi, product.lo + (a.hi * b.lo + a.lo * b.hi));
+        }
+
+        // 1 / a for a in [1, 2)
+        constexpr DoubleDouble dd_reciprocal(DoubleDouble a) {
+            double quotient = 1 / a.hi;
+            DoubleDouble product = dd_multiply(a, { quotient, 0.0 });
+            double remainder = (1 - product.hi) - product.lo;
+            return fast_two_sum(quotient, remainder / a.hi);
+        }
+
+        // Halves a until a.hi is below 2, adding to the power of two in
+        // exponent, which is exact
+        constexpr DoubleDouble dd_normalize(DoubleDouble a, long* exponent) {
+            while (a.hi >= 2) {
+                a.hi /= 2;
+                a.lo /= 2;
+                (*exponent)++;
+            }
+            while (a.hi < 1) {
+                a.hi *= 2;
+                a.lo *= 2;
+                (*exponent)--;
+            }
+            return a;
+        }
+
+        // 2^k for k from -1074 to 1023
+        constexpr double power_of_two(long k) {
+            double value = 1.0;
+            for (; k > 0; k--) value *= 2;
+            for (; k < 0; k++) value /= 2;
+            return value;
+        }
+
+        // (a.hi + a.lo) * 2^exponent correctly rounded to double, for a.hi in
+        // [1, 2)
+        constexpr double dd_narrow(DoubleDouble a, long exponent) {
+            a = fast_two_sum(a.hi, a.lo); // a.hi is now a.hi + a.lo rounded
+            if (exponent > DBL_MAX_EXP - 1 || (exponent == DBL_MAX_EXP - 1 && a.hi >= 2)) return INF;
+            if (exponent >= DBL_MIN_EXP - 1) return a.hi * power_of_two(exponent);
+            if (exponent < DBL_MIN_EXP - DBL_MANT_DIG - 2) return 0.0;
+
+            // Below the normal range only the bits of a.hi down to 2^-1074
+            // are kept. As those are a whole number of units in the last
+            // place of a.hi, which is more than |a.lo|, a.lo can only decide
+            // which way a tie between them rounds.
+            const double min_normal = power_of_two(DBL_MIN_EXP - 1);
+            double rounded = a.hi * min_normal * power_of_two(exponent - (DBL_MIN_EXP - 1));
+            double dropped = a.hi - rounded / min_normal * power_of_two((DBL_MIN_EXP - 1) - exponent);
+            double half_step = power_of_two(DBL_MIN_EXP - DBL_MANT_DIG - 1 - exponent);
+            double step = power_of_two(DBL_MIN_EXP - DBL_MANT_DIG);
+            if (dropped == half_step && a.lo > 0) rounded += step;
+            if (dropped == -half_step && a.lo < 0) rounded -= step;
+            return rounded;
+        }
+
+        // x^n for a whole number n with |n| < 2^53, by squaring in double
+        // double, which rounds correctly but for results within about 2^-100
+        // of halfway between two doubles
+        constexpr double integer_power(double x, double n) {
+            bool negative_exponent = n < 0;
+            unsigned long long bits = (unsigned long long)(negative_exponent ? -n : n);
+            bool negative = x < 0 && (bits & 1) != 0;
+
+            // |x| = m * 2^e with m in [1, 2), so |x|^n lies between 2^(e n)
+            // and 2^((e + 1) n). Each squaring doubles the rounding error, so
+            // it is only used while one of those is within 2^8000, beyond
+            // which the result is out of range of a double unless |x| is
+            // close to 1.
+            double m = abs_value(x);
+            long e = 0;
+            while (m >= 2) {
+                m /= 2;
+                e++;
+            }
+            while (m < 1) {
+                m *= 2;
+                e--;
+            }
+            long double bound = (long double)(e < 0 ? -e : e + 1) * bits;
+            if (bound > 8000) {
+                double value = 0.0;
+                if (e == 0 || e == -1) {
+                    value = exp_narrow(n * log_wide(abs_value(x)));
+                } else {
+                    value = (e > 0) != negative_exponent ? INF : 0.0;
+                }
+                return negative ? -value : value;
+            }
+
+            // |x| is base * 2^base_exponent and the result so far is
+            // value * 2^exponent, with base and value kept in [1, 2)
+            DoubleDouble base = { m, 0.0 };
+            long base_exponent = e;
+            DoubleDouble value = { 1.0, 0.0 };
+            long exponent = 0;
+            while (bits != 0) {
+                if ((bits & 1) != 0) {
+                    exponent += base_exponent;
+                    value = dd_normalize(dd_multiply(value, base), &exponent);
+                }
+                bits >>= 1;
+                if (bits != 0) {
+                    base_exponent *= 2;
+                    base = dd_normalize(dd_multiply(base, base), &base_exponent);
+                }
+            }
+            if (negative_exponent) {
+                exponent = -exponent;
+                value = dd_normalize(dd_reciprocal(value), &exponent);
+            }
+            double result = dd_narrow(value, exponent);
+            return negative ? -result : result;
+        }
+
+        constexpr bool is_integer(double y) {
+            return !is_nan(y) && !is_inf(y) && (abs_value(y) >= 9007199254740992.0 || (double)(long long)y == y);
+        }
+
+        constexpr bool is_odd_integer(double y) {
+            return is_integer(y) && abs_value(y) < 9007199254740992.0 && ((long long)y & 1) != 0;
+        }
+
+        // pow with the special cases of the C library
+        constexpr double power(double x, double y) {
+            if (y == 0 || x == 1) return 1.0;
+            if (is_nan(x) || is_nan(y)) return x + y;
+            if (is_inf(y)) {
+                if (x == -1) return 1.0;
+                bool grows = abs_value(x) > 1;
+                return grows == (y > 0) ? INF : 0.0;
+            }
+            if (x == 0) {
+                bool odd = is_odd_integer(y);
+                if (y < 0) return (odd && sign_bit(x)) ? -INF : INF;
+                return odd ? x : 0.0;
+            }
+            if (is_inf(x)) {
+                bool negative = x < 0 && is_odd_integer(y);
+                if (y < 0) return negative ? -0.0 : 0.0;
+                return negative ? -INF : INF;
+            }
+            if (is_integer(y)) {
+                if (abs_value(y) < 9007199254740992.0) return integer_power(x, y);
+                // Even, and far too large for the result to be in range
+                bool grows = abs_value(x) > 1;
+                return grows == (y > 0) ? INF : 0.0;
+            }
+            if (x < 0) return NAN_VALUE;
+            return exp_narrow(y * log_wide(x));
+        }
+
+        // Exact powers of ten, used for numbers that convert exactly
+        constexpr double EXACT_POWERS_OF_TEN[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                                   1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                                   1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+        // Significant digits of a number that are converted exactly. Any
+        // after these only count as being more than zero.
+        constexpr int MAX_NUMBER_DIGITS = 100;
+
+        // Unsigned integer large enough for every number convert_number
+        // works with: 100 digits times the powers of ten needed to reach the
+        // smallest subnormal, plus 56 bits of quotient
+        constexpr size_t BIG_NUMBER_LIMBS = 64;
+
+        struct BigNumber {
+            uint32_t limbs[BIG_NUMBER_LIMBS]{}; // Least significant first
+            size_t size = 0;                    // Limbs in use, the last one not zero
+
+            // Sets this to this * factor + addend
+            constexpr void multiply_add(uint32_t factor, uint32_t addend) {
+                uint64_t carry = addend;
+                for (size_t i = 0; i < size; i++) {
+                    uint64_t value = (uint64_t)limbs[i] * factor + carry;
+                    limbs[i] = (uint32_t)value;
+                    carry = value >> 32;
+                }
+                if (carry != 0) limbs[size++] = (uint32_t)carry;
+            }
+
+            constexpr size_t bit_length() const {
+                if (size == 0) return 0;
+                size_t bits = (size - 1) * 32;
+                for (uint32_t top = limbs[size - 1]; top != 0; top >>= 1) bits++;
+                return bits;
+            }
+
+            // Returns true if any of the lowest count bits is set
+            constexpr bool any_below(size_t count) const {
+                for (size_t i = 0; i < size && i * 32 < count; i++) {
+                    uint32_t mask = count - i * 32 >= 32 ? ~0u : (1u << (count - i * 32)) - 1;
+                    if ((limbs[i] & mask) != 0) return true;
+                }
+                return false;
+            }
+
+            constexpr BigNumber shifted_left(size_t bits) const {
+                BigNumber result;
+                if (size == 0) return result;
+                size_t limb_shift = bits / 32;
+                size_t bit_shift = bits % 32;
+                for (size_t i = 0; i < size; i++) {
+                    uint64_t value = (uint64_t)limbs[i] << bit_shift;
+                    result.limbs[i + limb_shift] |= (uint32_t)value;
+                    if ((value >> 32) != 0) result.limbs[i + limb_shift + 1] |= (uint32_t)(value >> 32);
+                }
+                result.size = size + limb_shift + 1;
+                while (result.size > 0 && result.limbs[result.size - 1] == 0) result.size--;
+                return result;
+            }
+
+            constexpr BigNumber shifted_right(size_t bits) const {
+                BigNumber result;
+                size_t limb_shift = bits / 32;
+                size_t bit_shift = bits % 32;
+                for (size_t i = limb_shift; i < size; i++) {
+                    uint64_t value = limbs[i];
+                    if (i + 1 < size) value |= (uint64_t)limbs[i + 1] << 32;
+                    result.limbs[i - limb_shift] = (uint32_t)(value >> bit_shift);
+                }
+                result.size = size > limb_shift ? size - limb_shift : 0;
+                while (result.size > 0 && result.limbs[result.size - 1] == 0) result.size--;
+                return result;
+            }
+
+            constexpr bool less_than(const BigNumber& other) const {
+                if (size != other.size) return size < other.size;
+                for (size_t i = size; i > 0; i--) {
+                    if (limbs[i - 1] != other.limbs[i - 1]) return limbs[i - 1] < other.limbs[i - 1];
+                }
+                return false;
+            }
+
+            // Subtracts other, which must not be larger
+            constexpr void subtract(const BigNumber& other) {
+                int64_t borrow = 0;
+                for (size_t i = 0; i < size; i++) {
+                    int64_t value = (int64_t)limbs[i] - (i < other.size ? other.limbs[i] : 0) - borrow;
+                    borrow = value < 0 ? 1 : 0;
+                    limbs[i] = (uint32_t)(value + (borrow << 32));
+                }
+                while (size > 0 && limbs[size - 1] == 0) size--;
+            }
+
+            // Value of a number below 2^64
+            constexpr uint64_t to_uint64() const {
+                return (size > 0 ? limbs[0] : 0) | (size > 1 ? (uint64_t)limbs[1] << 32 : 0);
+            }
+        };
+
+        // Rounds (n + f) * 2^exponent to the nearest double, ties to even,
+        // where f is between 0 and 1 if sticky is set, and 0 otherwise. If
+        // sticky is set n must have at least 55 bits, so that f only decides
+        // ties.
+        constexpr double round_to_double(uint64_t n, long exponent, bool sticky) {
+            long length = 0;
+            for (uint64_t bits = n; bits != 0; bits >>= 1) length++;
+            long drop = length - DBL_MANT_DIG;
+            if (exponent + drop < DBL_MIN_EXP - DBL_MANT_DIG) drop = DBL_MIN_EXP - DBL_MANT_DIG - exponent;
+            if (drop > length) return 0.0; // Below half the smallest subnormal
+            if (drop > 0) {
+                bool round = ((n >> (drop - 1)) & 1) != 0;
+                bool rest = sticky || (n & ((1ULL << (drop - 1)) - 1)) != 0;
+                n = drop == 64 ? 0 : n >> drop;
+                if (round && (rest || (n & 1) != 0)) n++;
+                exponent += drop;
+                length = 0;
+                for (uint64_t bits = n; bits != 0; bits >>= 1) length++;
+            }
+            if (exponent + length > DBL_MAX_EXP) return INF;
+
+            // Scaling by 2 is exact, every step being at least as large as the result
+            double value = (double)n;
+            for (; exponent > 0; exponent--) value *= 2;
+            for (; exponent < 0; exponent++) value /= 2;
+            return value;
+        }
+
+        // Converts a number found by scan_number to the nearest double, as
+        // from_chars does. Numbers whose digits fit in 53 bits and have a
+        // small exponent are converted with one division or multiplication,
+        // the rest with integer arithmetic. Only numbers of more than 100
+        // significant digits can round differently.
+        constexpr double convert_number(std::string_view number) {
+            BigNumber digits;
+            long exponent = 0;
+            int significant = 0;
+            bool truncated = false;
+            bool fraction = false;
+            size_t pos = 0;
+            for (; pos < number.size() && number[pos] != 'e' && number[pos] != 'E'; pos++) {
+                char c = number[pos];
+                if (c == '.') {
+                    fraction = true;
+                } else if (significant < MAX_NUMBER_DIGITS) {
+                    if (digits.size != 0 || c != '0') {
+                        digits.multiply_add(10, (uint32_t)(c - '0'));
+                        significant++;
+                    }
+                    if (fraction) exponent--;
+                } else {
+                    if (c != '0') truncated = true;
+                    if (!fraction) exponent++;
+                }
+            }
+            if (pos < number.size()) {
+                pos++;
+                bool negative = false;
+                if (number[pos] == '+' || number[pos] == '-') negative = number[pos++] == '-';
+                long written = 0;
+                for (; pos < number.size(); pos++) {
+                    if (written < 100000) written = written * 10 + (number[pos] - '0');
+                }
+                exponent += negative ? -written : written;
+            }
+
+            if (digits.size == 0) return 0.0;
+            if (exponent + significant > DBL_MAX_10_EXP + 2) return INF;
+            if (exponent + significant < DBL_MIN_10_EXP - 20) return 0.0;
+
+            uint64_t mantissa = digits.to_uint64();
+            if (!truncated && digits.size <= 2 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+                double value = (double)mantissa;
+                return exponent < 0 ? value / EXACT_POWERS_OF_TEN[-exponent]
+                                    : value * EXACT_POWERS_OF_TEN[exponent];
+            }
+
+            if (exponent >= 0) {
+                for (long i = 0; i < exponent; i++) digits.multiply_add(10, 0);
+                size_t length = digits.bit_length();
+                size_t shift = length > 64 ? length - 64 : 0;
+                return round_to_double(digits.shifted_right(shift).to_uint64(), (long)shift,
+                                       truncated || digits.any_below(shift));
+            }
+
+            // digits / 10^-exponent, scaled by a power of two to give a
+            // quotient of 56 bits
+            BigNumber divisor;
+            divisor.multiply_add(1, 1);
+            for (long i = 0; i < -exponent; i++) divisor.multiply_add(10, 0);
+            long shift = 55 + (long)divisor.bit_length() - (long)digits.bit_length();
+            bool sticky = truncated;
+            BigNumber remainder;
+            if (shift >= 0) {
+                remainder = digits.shifted_left((size_t)shift);
+            } else {
+                sticky = sticky || digits.any_below((size_t)-shift);
+                remainder = digits.shifted_right((size_t)-shift);
+            }
+            uint64_t quotient = 0;
+            for (long bit = (long)remainder.bit_length() - (long)divisor.bit_length(); bit >= 0; bit--) {
+                BigNumber part = divisor.shifted_left((size_t)bit);
+                if (!remainder.less_than(part)) {
+                    remainder.subtract(part);
+                    quotient |= 1ULL << bit;
+                }
+            }
+            return round_to_double(quotient, -shift, sticky || remainder.size != 0);
+        }
+
+        constexpr int find_function(std::string_view name) {
+            for (const FunctionInfo& function : FUNCTIONS) {
+                if (function.name == name) return (int)(&function - FUNCTIONS);
+            }
+            return -1;
+        }
+
+        // Checks that the whole expression tokenizes, so that UNKNOWN_TOKEN
+        // is reported ahead of any other error, as the runtime parser does
+        constexpr Status check_tokens(std::string_view text) {
+            size_t pos = skip_whitespace(text, 0);
+            while (pos < text.size()) {
+                size_t number_end = scan_number(text, pos);
+                if (number_end != pos) {
+                    if (number_end < text.size() && is_identifier_char(text[number_end])) return Status::UNKNOWN_TOKEN;
+                    pos = number_end;
+                } else if (is_identifier_start(text[pos])) {
+                    while (pos < text.size() && is_identifier_char(text[pos])) pos++;
+                } else {
+                    switch (text[pos]) {
+                    case '*':
+                    case '^':
+                    case '/':
+                    case '+':
+                    case '-':
+                    case '(':
+                    case '[':
+                    case ')':
+                    case ']':
+                    case ',':
+                        break;
+                    default:
+                        return Status::UNKNOWN_TOKEN;
+                    }
+                    pos++;
+                }
+                pos = skip_whitespace(text, pos);
+            }
+            return Status::SUCCESS;
+        }
+
+        // Entry of the operator stack of the shunting yard
+        typedef enum { PENDING_OPERATOR, PENDING_FUNCTION, PENDING_BRACKET } PendingKind;
+
+        typedef struct Pending {
+            PendingKind kind;
+            int id;          // OperatorId or index into FUNCTIONS
+            size_t num_args; // For brackets, arguments seen so far if it belongs to a call, otherwise 0
+        } Pending;
+
+        // What the previous token was, which decides whether + and - are unary
+        typedef enum { PREVIOUS_NONE, PREVIOUS_VALUE, PREVIOUS_LEFT_BRACKET, PREVIOUS_OTHER } Previous;
+    } // namespace ct_detail
+
+    template <size_t Capacity> struct ConstantProgram {
+        ct_detail::Instruction code[Capacity]{};
+        double constants[Capacity]{};
+        std::string_view variables[Capacity]{}; // Names in order of first appearance
+        size_t size = 0;
+        size_t num_constants = 0;
+        size_t num_variables = 0;
+        size_t max_depth = 0;
+        Status status = Status::SUCCESS;
+
+        // Returns the slot of the named variable, which is the position of
+        // its value in the arguments of ct_evaluate, or num_variables if the
+        // expression does not use it
+        constexpr size_t slot(std::string_view name) const {
+            size_t islot = 0;
+            while (islot < num_variables && variables[islot] != name) islot++;
+            return islot;
+        }
+
+        // Adds an instruction that takes num_args values from the stack.
+        // Like build_program, a missing argument is remembered in structure
+        // and the rest of the expression is still read, so that errors found
+        // later while parsing take priority.
+        constexpr Status emit(ct_detail::InstructionCode instr_code,
+                              int operand,
+                              size_t num_args,
+                              size_t& depth,
+                              Status& structure) {
+            if (size == Capacity) return Status::ERROR;
+            if (depth < num_args) {
+                if (structure == Status::SUCCESS) structure = Status::TOO_FEW_ARGUMENTS;
+                depth = 0;
+            } else {
+                depth -= num_args;
+            }
+            code[size++] = ct_detail::Instruction{ instr_code, operand, num_args, depth };
+            depth++;
+            if (depth > max_depth) max_depth = depth;
+            return Status::SUCCESS;
+        }
+
+        constexpr Status emit_pending(const ct_detail::Pending& pending, size_t& depth, Status& structure) {
+            if (pending.kind == ct_detail::PENDING_FUNCTION) {
+                return emit(ct_detail::CT_CALL_FUNCTION, pending.id, pending.num_args, depth, structure);
+            }
+            return emit(ct_detail::CT_APPLY_OPERATOR, pending.id,
+                        ct_detail::operator_args((ct_detail::OperatorId)pending.id), depth, structure);
+        }
+
+        // Parses text with the shunting yard of convert_tokens_to_rpn,
+        // emitting instructions as build_program would from its output
+        constexpr Status parse(std::string_view text) {
+            using namespace ct_detail;
+            if (text.empty()) return Status::EMPTY_EXPRESSION;
+            Status ret_val = check_tokens(text);
+            if (ret_val != Status::SUCCESS) return ret_val;
+
+            Pending stack[Capacity]{};
+            size_t stack_size = 0;
+            Status structure = Status::SUCCESS;
+            size_t depth = 0;
+            Previous previous = PREVIOUS_NONE;
+            size_t pos = skip_whitespace(text, 0);
+            while (pos < text.size()) {
+                size_t number_end = scan_number(text, pos);
+                if (number_end != pos) {
+                    if (num_constants == Capacity) return Status::ERROR;
+                    constants[num_constants] = convert_number(text.substr(pos, number_end - pos));
+                    ret_val = emit(CT_PUSH_NUMBER, (int)num_constants++, 0, depth, structure);
+                    if (ret_val != Status::SUCCESS) return ret_val;
+                    previous = PREVIOUS_VALUE;
+                    pos = skip_whitespace(text, number_end);
+                    continue;
+                }
+
+                if (is_identifier_start(text[pos])) {
+                    size_t name_end = pos;
+                    while (name_end < text.size() && is_identifier_char(text[name_end])) name_end++;
+                    std::string_view name = text.substr(pos, name_end - pos);
+                    pos = skip_whitespace(text, name_end);
+                    if (pos < text.size() && (text[pos] == '(' || text[pos] == '[')) {
+                        int function = find_function(name);
+                        if (function < 0) return Status::UNKNOWN_TOKEN;
+                        if (stack_size == Capacity) return Status::ERROR;
+                        stack[stack_size++] = Pending{ PENDING_FUNCTION, function, 0 };
+                        previous = PREVIOUS_OTHER;
+                    } else {
+                        size_t islot = slot(name);
+                        if (islot == num_variables) variables[num_variables++] = name;
+                        ret_val = emit(CT_PUSH_VARIABLE, (int)islot, 0, depth, structure);
+                        if (ret_val != Status::SUCCESS) return ret_val;
+                        previous = PREVIOUS_VALUE;
+                    }
+                    continue;
+                }
+
+                char c = text[pos++];
+                if (c == '(' || c == '[') {
+                    bool call = stack_size > 0 && stack[stack_size - 1].kind == PENDING_FUNCTION;
+                    if (stack_size == Capacity) return Status::ERROR;
+                    stack[stack_size++] = Pending{ PENDING_BRACKET, 0, call ? (size_t)1 : 0 };
+                    previous = PREVIOUS_LEFT_BRACKET;
+                } else if (c == ',' || c == ')' || c == ']') {
+                    while (stack_size > 0 && stack[stack_size - 1].kind != PENDING_BRACKET) {
+                        ret_val = emit_pending(stack[--stack_size], depth, structure);
+                        if (ret_val != Status::SUCCESS) return ret_val;
+                    }
+                    if (c == ',') {
+                        // A comma anywhere else separates values nothing takes
+                        if (stack_size == 0 || stack[stack_size - 1].num_args == 0) return Status::TOO_MANY_ARGUMENTS;
+                        stack[stack_size - 1].num_args++;
+                        previous = PREVIOUS_OTHER;
+                    } else {
+                        if (stack_size == 0) return Status::UNMATCHED_BRACKETS;
+                        size_t num_args = stack[--stack_size].num_args;
+                        if (num_args != 0) {
+                            Pending call = stack[--stack_size];
+                            call.num_args = previous == PREVIOUS_LEFT_BRACKET ? 0 : num_args;
+                            if (call.num_args < FUNCTIONS[call.id].min_args) return Status::TOO_FEW_ARGUMENTS;
+                            if (call.num_args > FUNCTIONS[call.id].max_args) return Status::TOO_MANY_ARGUMENTS;
+                            ret_val = emit_pending(call, depth, structure);
+                            if (ret_val != Status::SUCCESS) return ret_val;
+                        }
+                        previous = PREVIOUS_VALUE;
+                    }
+                } else {
+                    OperatorId op = CT_ADD;
+                    if (c == '*' && pos < text.size() && text[pos] == '*') {
+                        pos++;
+                        op = CT_POWER;
+                    } else if (c == '*') {
+                        op = CT_MULTIPLY;
+                    } else if (c == '^') {
+                        op = CT_POWER;
+                    } else if (c == '/') {
+                        op = CT_DIVIDE;
+                    } else {
+                        bool unary = previous != PREVIOUS_VALUE;
+                        op = c == '-' ? (unary ? CT_UNARY_MINUS : CT_SUBTRACT) : (unary ? CT_UNARY_PLUS : CT_ADD);
+                    }
+
+                    while (stack_size > 0 && stack[stack_size - 1].kind != PENDING_BRACKET) {
+                        const Pending& top = stack[stack_size - 1];
+                        if (top.kind == PENDING_FUNCTION || precedence(op) < precedence((OperatorId)top.id) ||
+                            (precedence(op) == precedence((OperatorId)top.id) &&
+                             !right_associative((OperatorId)top.id))) {
+                            ret_val = emit_pending(stack[--stack_size], depth, structure);
+                            if (ret_val != Status::SUCCESS) return ret_val;
+                        } else {
+                            break;
+                        }
+                    }
+                    if (stack_size == Capacity) return Status::ERROR;
+                    stack[stack_size++] = Pending{ PENDING_OPERATOR, op, 0 };
+                    previous = PREVIOUS_OTHER;
+                }
+                pos = skip_whitespace(text, pos);
+            }
+
+            while (stack_size > 0) {
+                if (stack[stack_size - 1].kind == PENDING_BRACKET) return Status::UNMATCHED_BRACKETS;
+                ret_val = emit_pending(stack[--stack_size], depth, structure);
+                if (ret_val != Status::SUCCESS) return ret_val;
+            }
+
+            if (structure == Status::SUCCESS && depth != 1) {
+                structure = depth > 1 ? Status::TOO_MANY_ARGUMENTS : Status::TOO_FEW_ARGUMENTS;
+            }
+            return structure;
+        }
+
+        // Evaluates the program with constant expressions, taking variables
+        // from values by slot
+        constexpr Status evaluate(const double values[], double* result) const {
+            using namespace ct_detail;
+            *result = 0.0;
+            double stack[Capacity]{};
+            for (size_t pc = 0; pc < size; pc++) {
+                const Instruction& instr = code[pc];
+                double* args = stack + instr.top;
+                if (instr.code == CT_PUSH_NUMBER) {
+                    args[0] = constants[instr.operand];
+                } else if (instr.code == CT_PUSH_VARIABLE) {
+                    args[0] = values[instr.operand];
+                } else if (instr.code == CT_APPLY_OPERATOR) {
+                    switch ((OperatorId)instr.operand) {
+                    case CT_ADD:
+                        args[0] = add(args[0], args[1]);
+                        break;
+                    case CT_SUBTRACT:
+                        args[0] = add(args[0], -args[1]);
+                        break;
+                    case CT_MULTIPLY:
+                        args[0] = multiply(args[0], args[1]);
+                        break;
+                    case CT_DIVIDE:
+                        if (abs_value(args[1]) < ALMOST_ZERO) return Status::DIVIDE_BY_ZERO;
+                        args[0] = divide(args[0], args[1]);
+                        break;
+                    case CT_POWER:
+                        args[0] = power(args[0], args[1]);
+                        break;
+                    case CT_UNARY_MINUS:
+                        args[0] = -args[0];
+                        break;
+                    case CT_UNARY_PLUS:
+                        break;
+                    }
+                } else {
+                    double value = args[0];
+                    for (size_t iarg = 1; iarg < instr.num_args; iarg++) {
+                        double arg = args[iarg];
+                        if (instr.operand == CT_MIN) value = (arg < value || is_nan(arg)) ? arg : value;
+                        if (instr.operand == CT_MAX) value = (value < arg || is_nan(arg)) ? arg : value;
+                        if (instr.operand == CT_SUM) value = add(value, arg);
+                    }
+                    args[0] = instr.operand == CT_ABS ? abs_value(value) : value;
+                }
+            }
+            *result = stack[0];
+            return Status::SUCCESS;
+        }
+    };
+
+    namespace ct_detail {
+        template <size_t Capacity> constexpr ConstantProgram<Capacity> compile(std::string_view expression) {
+            ConstantProgram<Capacity> program;
+            program.status = program.parse(expression);
+            if (program.status != Status::SUCCESS) {
+                program.size = 0;
+                expression_does_not_compile(program.status);
+            }
+            return program;
+        }
+
+        // Runs instruction Pc of Program on values in stack. Everything but
+        // the values is known to the compiler, so each instruction becomes a
+        // few lines of straight code.
+        template <const auto& Program, size_t Pc>
+        inline bool run_instruction(double* stack, const double* values, Status* status) {
+            constexpr Instruction instr = Program.code[Pc];
+            double* args = stack + instr.top;
+            if constexpr (instr.code == CT_PUSH_NUMBER) {
+                args[0] = Program.constants[instr.operand];
+            } else if constexpr (instr.code == CT_PUSH_VARIABLE) {
+                args[0] = values[instr.operand];
+            } else if constexpr (instr.code == CT_APPLY_OPERATOR) {
+                if constexpr (instr.operand == CT_ADD) {
+                    args[0] = args[0] + args[1];
+                } else if constexpr (instr.operand == CT_SUBTRACT) {
+                    args[0] = args[0] - args[1];
+                } else if constexpr (instr.operand == CT_MULTIPLY) {
+                    args[0] = args[0] * args[1];
+                } else if constexpr (instr.operand == CT_DIVIDE) {
+                    if (fabs(args[1]) < ALMOST_ZERO) {
+                        *status = Status::DIVIDE_BY_ZERO;
+                        return false;
+                    }
+                    args[0] = args[0] / args[1];
+                } else if constexpr (instr.operand == CT_POWER) {
+                    args[0] = pow(args[0], args[1]);
+                } else if constexpr (instr.operand == CT_UNARY_MINUS) {
+                    args[0] = -args[0];
+                }
+            } else if constexpr (instr.operand == CT_ABS) {
+                args[0] = fabs(args[0]);
+            } else {
+                double value = args[0];
+                for (size_t iarg = 1; iarg < instr.num_args; iarg++) {
+                    double arg = args[iarg];
+                    if constexpr (instr.operand == CT_MIN) value = (arg < value || isnan(arg)) ? arg : value;
+                    if constexpr (instr.operand == CT_MAX) value = (value < arg || isnan(arg)) ? arg : value;
+                    if constexpr (instr.operand == CT_SUM) value = value + arg;
+                }
+                args[0] = value;
+            }
+            return true;
+        }
+
+        template <const auto& Program, size_t... Pc>
+        inline Status run(double* stack, const double* values, std::index_sequence<Pc...>) {
+            Status status = Status::SUCCESS;
+            (run_instruction<Program, Pc>(stack, values, &status) && ...);
+            return status;
+        }
+    } // namespace ct_detail
+
+    // Compiles an expression at compile time. Assigned to a constexpr
+    // variable, errors in the expression fail the build. Otherwise they are
+    // left in the status of the program, which then has no instructions.
+    template <size_t N> constexpr ConstantProgram<N> ct_compile(const char (&expression)[N]) {
+        return ct_detail::compile<N>(std::string_view(expression, N - 1));
+    }
+
+    // Evaluates a constant expression without variables. Used in a constant
+    // expression, errors fail the build, including errors such as
+    // DIVIDE_BY_ZERO. Otherwise errors give NaN. Expressions are limited to
+    // 256 numbers, operators and calls.
+    constexpr double ct_eval(std::string_view expression) {
+        ConstantProgram<ct_detail::MAX_EVAL_INSTRUCTIONS> program =
+            ct_detail::compile<ct_detail::MAX_EVAL_INSTRUCTIONS>(expression);
+        double result = 0.0;
+        Status status = program.status;
+        if (status == Status::SUCCESS && program.num_variables != 0) status = Status::UNBOUND_VARIABLE;
+        if (status == Status::SUCCESS) status = program.evaluate(NULL, &result);
+        if (status != Status::SUCCESS) {
+            ct_detail::expression_does_not_evaluate(status);
+            return ct_detail::NAN_VALUE;
+        }
+        return result;
+    }
+
+    namespace literals {
+        // "2*(3+4)^2"_expr is ct_eval("2*(3+4)^2")
+        constexpr double operator""_expr(const char* expression, size_t length) {
+            return ct_eval(std::string_view(expression, length));
+        }
+    } // namespace literals
+
+    // Evaluates a program from ct_compile, which must have static storage
+    // duration, with one value for each of its variables in slot order. No
+    // parsing or decoding of instructions happens at runtime. Only errors
+    // that depend on the values, such as DIVIDE_BY_ZERO, are returned.
+    //
+    // Arguments:
+    //  result: double used to store the result of the computation
+    //  values: value of each variable, in order of first appearance
+    //
+    template <const auto& Program, class... Values> inline Status ct_evaluate(double* result, Values... values) {
+        static_assert(Program.status == Status::SUCCESS, "the program did not compile");
+        static_assert(sizeof...(Values) == Program.num_variables,
+                      "one value is needed for each variable of the expression");
+        const double value_array[sizeof...(Values) + 1] = { (double)values..., 0.0 };
+        double stack[Program.max_depth];
+        *result = 0.0;
+        Status ret_val =
+            ct_detail::run<Program>(stack, value_array, std::make_index_sequence<Program.size>());
+        if (ret_val == Status::SUCCESS) *result = stack[0];
+        return ret_val;
+    }
+} // namespace exprparse
+
+#endif // EXPRCONSTEXPR_H
@@ -0,0 +1,280 @@
+// exprengine.cpp
+//
+// Multi-threaded evaluation of compiled expressions over columns of data
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace exprparse {
+    namespace {
+        // Rows in each task. A multiple of BATCH_BLOCK_SIZE, so tasks split the
+        // rows at the same block boundaries evaluate_batch uses.
+        const size_t TASK_ROWS = 16 * BATCH_BLOCK_SIZE;
+
+        typedef struct Task {
+            size_t expr;
+            size_t first_row;
+            size_t n_rows;
+        } Task;
+    } // namespace
+
+    struct EvaluationEngine::Impl {
+        // Each worker owns a range of the task list. It takes tasks from the
+        // front of its range, and when that is empty, steals the back half of
+        // another worker's range.
+        typedef struct Worker {
+            mutex lock;
+            size_t begin;
+            size_t end;
+            vector<double> stack; // Allocated by the worker's own thread
+            thread handle;
+        } Worker;
+
+        vector<unique_ptr<Worker>> workers; // workers[0] is the calling thread
+
+        mutex run_lock; // Held for the whole of a call to evaluate_batch
+        mutex state_lock;
+        condition_variable start_cv;
+        condition_variable done_cv;
+        uint64_t generation;
+        size_t num_finished;
+        bool shutdown;
+
+        // The job being run
+        SimdLevel level;
+        vector<const Program*> programs;
+        vector<vector<const double*>> columns;
+        double* const* out;
+        vector<Task> tasks;
+        vector<Status> task_status;
+        size_t max_depth;
+
+        bool next_task(size_t index, size_t* task);
+        void work(size_t index);
+        void worker_main(size_t index);
+        Status run(size_t n_rows, Status statuses[]);
+    };
+
+    bool EvaluationEngine::Impl::next_task(size_t index, size_t* task) {
+        Worker& self = *workers[index];
+        {
+            lock_guard<mutex> guard(self.lock);
+            if (self.begin < self.end) {
+                *task = self.begin++;
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < workers.size(); i++) {
+            Worker& victim = *workers[(index + i) % workers.size()];
+            size_t begin, end;
+            {
+                lock_guard<mutex> guard(victim.lock);
+                size_t available = victim.end - victim.begin;
+                if (available == 0) continue;
+                end = victim.end;
+                begin = end - (available + 1) / 2;
+                victim.end = begin;
+            }
+            *task = begin;
+            lock_guard<mutex> guard(self.lock);
+            self.begin = begin + 1;
+            self.end = end;
+            return true;
+        }
+        return false;
+    }
+
+    void EvaluationEngine::Impl::work(size_t index) {
+        Worker& self = *workers[index];
+        if (self.stack.size() < max_depth * BATCH_BLOCK_SIZE) self.stack.resize(max_depth * BATCH_BLOCK_SIZE);
+
+        size_t itask;
+        while (next_task(index, &itask)) {
+            const Task& task = tasks[itask];
+            task_status[itask] = eval_batch_rows(*programs[task.expr],
+                                                 level,
+                                                 columns[task.expr].data(),
+                                                 task.first_row,
+                                                 task.n_rows,
+                                                 self.stack.data(),
+                                                 out[task.expr]);
+        }
+    }
+
+    void EvaluationEngine::Impl::worker_main(size_t index) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                unique_lock<mutex> guard(state_lock);
+                start_cv.wait(guard, [&]() { return shutdown || generation != seen; });
+                if (shutdown) return;
+                seen = generation;
+            }
+            work(index);
+            {
+                lock_guard<mutex> guard(state_lock);
+                num_finished++;
+            }
+            done_cv.notify_one();
+        }
+    }
+
+    // Runs every expression in programs that has a status of SUCCESS, and
+    // stores the status of each expression in statuses
+    Status EvaluationEngine::Impl::run(size_t n_rows, Status statuses[]) {
+        tasks.clear();
+        max_depth = 0;
+        for (size_t iexpr = 0; iexpr < programs.size(); iexpr++) {
+            if (statuses[iexpr] != Status::SUCCESS) continue;
+            for (size_t first_row = 0; first_row < n_rows; first_row += TASK_ROWS) {
+                Task task = { iexpr, first_row, n_rows - first_row < TASK_ROWS ? n_rows - first_row : TASK_ROWS };
+                tasks.push_back(task);
+            }
+            if (programs[iexpr]->max_depth > max_depth) max_depth = programs[iexpr]->max_depth;
+        }
+        task_status.assign(tasks.size(), Status::SUCCESS);
+        level = get_simd_level();
+
+        // Start each worker on its own contiguous share of the tasks
+        size_t num_workers = tasks.size() < workers.size() ? tasks.size() : workers.size();
+        for (size_t i = 0; i < workers.size(); i++) {
+            lock_guard<mutex> guard(workers[i]->lock);
+            workers[i]->begin = i < num_workers ? tasks.size() * i / num_workers : tasks.size();
+            workers[i]->end = i < num_workers ? tasks.size() * (i + 1) / num_workers : tasks.size();
+        }
+
+        if (num_workers > 1) {
+            {
+                lock_guard<mutex> guard(state_lock);
+                generation++;
+                num_finished = 0;
+            }
+            start_cv.notify_all();
+            work(0);
+            unique_lock<mutex> guard(state_lock);
+            done_cv.wait(guard, [&]() { return num_finished == workers.size() - 1; });
+        } else if (num_workers == 1) {
+            work(0);
+        }
+
+        // Tasks are in row order, so the first error of each expression is
+        // the one evaluate_batch would return
+        for (size_t itask = 0; itask < tasks.size(); itask++) {
+            Status& expr_status = statuses[tasks[itask].expr];
+            if (expr_status == Status::SUCCESS) expr_status = task_status[itask];
+        }
+
+        Status ret_val = Status::SUCCESS;
+        for (size_t iexpr = 0; iexpr < programs.size() && ret_val == Status::SUCCESS; iexpr++)
+            ret_val = statuses[iexpr];
+        return ret_val;
+    }
+
+    EvaluationEngine::EvaluationEngine(size_t num_threads) : impl_(new Impl) {
+        if (num_threads == 0) num_threads = thread::hardware_concurrency();
+        if (num_threads == 0) num_threads = 1;
+
+        impl_->generation = 0;
+        impl_->num_finished = 0;
+        impl_->shutdown = false;
+        for (size_t i = 0; i < num_threads; i++) {
+            impl_->workers.emplace_back(new Impl::Worker);
+            impl_->workers[i]->begin = 0;
+            impl_->workers[i]->end = 0;
+        }
+        for (size_t i = 1; i < num_threads; i++)
+            impl_->workers[i]->handle = thread(&Impl::worker_main, impl_.get(), i);
+    }
+
+    EvaluationEngine::~EvaluationEngine() {
+        {
+            lock_guard<mutex> guard(impl_->state_lock);
+            impl_->shutdown = true;
+        }
+        impl_->start_cv.notify_all();
+        for (size_t i = 1; i < impl_->workers.size(); i++) impl_->workers[i]->handle.join();
+    }
+
+    size_t EvaluationEngine::num_threads() const {
+        return impl_->workers.size();
+    }
+
+    Status EvaluationEngine::evaluate_batch(const CompiledExpression& compiled,
+                                            const double* const columns[],
+                                            size_t n_rows,
+                                            double* out) {
+        const Program* program = ProgramAccess::program(compiled);
+        if (program == NULL) return Status::EMPTY_EXPRESSION;
+        for (size_t slot = 0; slot < program->variables.size(); slot++) {
+            if (columns == NULL || columns[slot] == NULL) return Status::UNBOUND_VARIABLE;
+        }
+
+        lock_guard<mutex> guard(impl_->run_lock);
+        impl_->programs.assign(1, program);
+        impl_->columns.resize(1);
+        impl_->columns[0].assign(columns, columns + program->variables.size());
+        impl_->out = &out;
+        Status status = Status::SUCCESS;
+        return impl_->run(n_rows, &status);
+    }
+
+    Status EvaluationEngine::evaluate_batch(const vector<CompiledExpression>& expressions,
+                                            const SymbolTable& columns,
+                                            size_t n_rows,
+                                            double* const out[],
+                                            Status statuses[]) {
+        vector<Status> local_statuses;
+        if (statuses == NULL) {
+            local_statuses.resize(expressions.size());
+            statuses = local_statuses.data();
+        }
+
+        lock_guard<mutex> guard(impl_->run_lock);
+        impl_->programs.resize(expressions.size());
+        impl_->columns.resize(expressions.size());
+        for (size_t iexpr = 0; iexpr < expressions.size(); iexpr++) {
+            const Program* program = ProgramAccess::program(expressions[iexpr]);
+            impl_->programs[iexpr] = program;
+            if (program == NULL) {
+                statuses[iexpr] = Status::EMPTY_EXPRESSION;
+                continue;
+            }
+            impl_->columns[iexpr].resize(program->variables.size());
+            statuses[iexpr] = resolve_bindings(*program, &columns, impl_->columns[iexpr].data());
+        }
+        impl_->out = out;
+        return impl_->run(n_rows, statuses);
+    }
+} // namespace exprparse
@@ -0,0 +1,248 @@
+// exprfunctions.cpp
+//
+// Built in functions and the registry of functions callable from expressions
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <math.h>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+namespace exprparse {
+    namespace {
+        // Functions are kept in a fixed array, so that the parser can look
+        // them up without a lock while another thread registers one
+        const size_t MAX_FUNCTIONS = 1024;
+
+        template <double (*F)(double)> Status unary_function(const double args[], size_t, double* result) {
+            *result = F(args[0]);
+            return Status::SUCCESS;
+        }
+
+        template <double (*F)(double, double)> Status binary_function(const double args[], size_t, double* result) {
+            *result = F(args[0], args[1]);
+            return Status::SUCCESS;
+        }
+
+        template <double (*F)(double)>
+        Status unary_function_batch(const double* const args[], size_t, size_t count, double* result) {
+            const double* arg = args[0];
+            for (size_t i = 0; i < count; i++) result[i] = F(arg[i]);
+            return Status::SUCCESS;
+        }
+
+        template <double (*F)(double, double)>
+        Status binary_function_batch(const double* const args[], size_t, size_t count, double* result) {
+            const double* lhs = args[0];
+            const double* rhs = args[1];
+            for (size_t i = 0; i < count; i++) result[i] = F(lhs[i], rhs[i]);
+            return Status::SUCCESS;
+        }
+
+        // min and max keep the NaN when either value is one, so that the
+        // result is NaN if any argument is. The vector kernels make the same
+        // comparisons.
+        double min_of(double a, double b) {
+            return (b < a || isnan(b)) ? b : a;
+        }
+
+        double max_of(double a, double b) {
+            return (a < b || isnan(b)) ? b : a;
+        }
+
+        double sum_of(double a, double b) {
+            return a + b;
+        }
+
+        // Combines the arguments left to right with F
+        template <double (*F)(double, double)>
+        Status fold_function(const double args[], size_t num_args, double* result) {
+            double value = args[0];
+            for (size_t iarg = 1; iarg < num_args; iarg++) value = F(value, args[iarg]);
+            *result = value;
+            return Status::SUCCESS;
+        }
+
+        template <double (*F)(double, double)>
+        Status fold_function_batch(const double* const args[], size_t num_args, size_t count, double* result) {
+            for (size_t i = 0; i < count; i++) {
+                double value = args[0][i];
+                for (size_t iarg = 1; iarg < num_args; iarg++) value = F(value, args[iarg][i]);
+                result[i] = value;
+            }
+            return Status::SUCCESS;
+        }
+
+        typedef struct BuiltinFunction {
+            const char* name;
+            size_t min_args;
+            size_t max_args;
+            ExpressionFunction eval;
+            ExpressionBatchFunction batch;
+            int kernel; // FunctionKernelId of the vector kernels, or -1 if there are none
+        } BuiltinFunction;
+
+        const BuiltinFunction g_builtins[] = {
+            { "sin", 1, 1, unary_function<sin>, unary_function_batch<sin>, -1 },
+            { "cos", 1, 1, unary_function<cos>, unary_function_batch<cos>, -1 },
+            { "tan", 1, 1, unary_function<tan>, unary_function_batch<tan>, -1 },
+            { "asin", 1, 1, unary_function<asin>, unary_function_batch<asin>, -1 },
+            { "acos", 1, 1, unary_function<acos>, unary_function_batch<acos>, -1 },
+            { "atan", 1, 1, unary_function<atan>, unary_function_batch<atan>, -1 },
+            { "sinh", 1, 1, unary_function<sinh>, unary_function_batch<sinh>, -1 },
+            { "cosh", 1, 1, unary_function<cosh>, unary_function_batch<cosh>, -1 },
+            { "tanh", 1, 1, unary_function<tanh>, unary_function_batch<tanh>, -1 },
+            { "exp", 1, 1, unary_function<exp>, unary_function_batch<exp>, -1 },
+            { "log", 1, 1, unary_function<log>, unary_function_batch<log>, -1 },
+            { "log2", 1, 1, unary_function<log2>, unary_function_batch<log2>, -1 },
+            { "log10", 1, 1, unary_function<log10>, unary_function_batch<log10>, -1 },
+            { "sqrt", 1, 1, unary_function<sqrt>, unary_function_batch<sqrt>, FN_SQRT },
+            { "cbrt", 1, 1, unary_function<cbrt>, unary_function_batch<cbrt>, -1 },
+            { "abs", 1, 1, unary_function<fabs>, unary_function_batch<fabs>, FN_ABS },
+            { "floor", 1, 1, unary_function<floor>, unary_function_batch<floor>, -1 },
+            { "ceil", 1, 1, unary_function<ceil>, unary_function_batch<ceil>, -1 },
+            { "round", 1, 1, unary_function<round>, unary_function_batch<round>, -1 },
+            { "atan2", 2, 2, binary_function<atan2>, binary_function_batch<atan2>, -1 },
+            { "hypot", 2, 2, binary_function<hypot>, binary_function_batch<hypot>, -1 },
+            { "pow", 2, 2, binary_function<pow>, binary_function_batch<pow>, -1 },
+            { "min", 1, ANY_NUMBER_OF_ARGS, fold_function<min_of>, fold_function_batch<min_of>, FN_MIN },
+            { "max", 1, ANY_NUMBER_OF_ARGS, fold_function<max_of>, fold_function_batch<max_of>, FN_MAX },
+            { "sum", 1, ANY_NUMBER_OF_ARGS, fold_function<sum_of>, fold_function_batch<sum_of>, FN_SUM },
+        };
+
+        bool is_function_name(const string& name) {
+            if (name.empty()) return false;
+            for (size_t i = 0; i < name.size(); i++) {
+                char c = name[i];
+                bool letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+                if (!letter && (i == 0 || c < '0' || c > '9')) return false;
+            }
+            return true;
+        }
+
+        struct FunctionRegistry {
+            Function functions[MAX_FUNCTIONS];
+            atomic<size_t> size; // Functions below size are complete and never change
+            mutex lock;          // Held while adding a function
+
+            FunctionRegistry() : size(0) {
+                for (const BuiltinFunction& builtin : g_builtins) {
+                    ExpressionBatchFunction batch[NUM_SIMD_LEVELS];
+                    FloatBatchFunction float_batch[NUM_SIMD_LEVELS];
+                    for (size_t level = 0; level < NUM_SIMD_LEVELS; level++) {
+                        batch[level] = builtin.kernel < 0 ? builtin.batch
+                                                          : get_function_kernels((SimdLevel)level)[builtin.kernel];
+                        float_batch[level] =
+                        builtin.kernel < 0 ? NULL : get_float_function_kernels((SimdLevel)level)[builtin.kernel];
+                    }
+                    add(builtin.name, builtin.min_args, builtin.max_args, builtin.eval, batch, float_batch, true,
+                        get_builtin_bounds(builtin.name));
+                }
+            }
+
+            Status add(const string& name,
+                       size_t min_args,
+                       size_t max_args,
+                       ExpressionFunction eval,
+                       const ExpressionBatchFunction batch[],
+                       const FloatBatchFunction float_batch[],
+                       bool pure,
+                       IntervalOperation bounds) {
+                lock_guard<mutex> guard(lock);
+                size_t count = size.load(memory_order_relaxed);
+                if (count == MAX_FUNCTIONS) return Status::ERROR;
+                for (size_t i = 0; i < count; i++) {
+                    if (functions[i].name == name) return Status::ERROR;
+                }
+
+                Function& function = functions[count];
+                function.name = name;
+                function.eval = eval;
+                for (size_t level = 0; level < NUM_SIMD_LEVELS; level++) {
+                    function.batch[level] = batch[level];
+                    function.float_batch[level] = float_batch[level];
+                }
+                function.min_args = min_args;
+                function.max_args = max_args;
+                function.pure = pure;
+                function.bounds = bounds;
+                function.id = (uint32_t)count;
+                size.store(count + 1, memory_order_release);
+                return Status::SUCCESS;
+            }
+        };
+
+        // Created on first use, so functions can be registered and parsed
+        // during static initialization of other files
+        FunctionRegistry& get_registry() {
+            static FunctionRegistry registry;
+            return registry;
+        }
+    } // namespace
+
+    // Scalar kernels for the functions that also have vector kernels
+    const ExpressionBatchFunction g_scalar_function_kernels[NUM_FUNCTION_KERNELS] = {
+        unary_function_batch<sqrt>, unary_function_batch<fabs>, fold_function_batch<min_of>,
+        fold_function_batch<max_of>, fold_function_batch<sum_of>
+    };
+
+    // There are no portable float kernels. Computing these functions in
+    // double and rounding gives the same results.
+    const FloatBatchFunction g_scalar_float_function_kernels[NUM_FUNCTION_KERNELS] = { NULL, NULL, NULL, NULL, NULL };
+
+    const Function* find_function(const char* name, size_t length) {
+        FunctionRegistry& registry = get_registry();
+        size_t size = registry.size.load(memory_order_acquire);
+        for (size_t i = 0; i < size; i++) {
+            const Function& function = registry.functions[i];
+            if (function.name.size() == length && memcmp(function.name.data(), name, length) == 0) return &function;
+        }
+        return NULL;
+    }
+
+    const Function* get_function(uint32_t id) {
+        return &get_registry().functions[id];
+    }
+
+    Status register_function(const string& name,
+                             size_t min_args,
+                             size_t max_args,
+                             ExpressionFunction function,
+                             ExpressionBatchFunction batch_function) {
+        if (!is_function_name(name) || function == NULL || min_args > max_args) return Status::ERROR;
+        ExpressionBatchFunction batch[NUM_SIMD_LEVELS];
+        FloatBatchFunction float_batch[NUM_SIMD_LEVELS];
+        for (size_t level = 0; level < NUM_SIMD_LEVELS; level++) {
+            batch[level] = batch_function;
+            float_batch[level] = NULL;
+        }
+        return get_registry().add(name, min_args, max_args, function, batch, float_batch, false, NULL);
+    }
+} // namespace exprparse
@@ -0,0 +1,305 @@
+// exprjit.cpp
+//
+// Compiles programs to native x86-64 code
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <math.h>
+#include <memory>
+#include <vector>
+
+#if defined(EXPRPARSE_JIT_X86)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace exprparse {
+#if defined(EXPRPARSE_JIT_X86)
+    namespace {
+        // Value stack slot i lives in register xmmi. xmm14 and xmm15 are
+        // scratch, so deeper programs are left to the interpreter.
+        const size_t MAX_JIT_DEPTH = 14;
+
+        // Bytes reserved below the saved registers to keep values across
+        // calls. Slot i of the stack is kept at [rsp + 8*i], and the slot
+        // after the deepest one takes the result of a function. 8 more than
+        // a multiple of 16 keeps calls aligned.
+        const int32_t SPILL_AREA = 8 * MAX_JIT_DEPTH + 8;
+
+        // Machine code under construction, with helpers for the few
+        // instructions the JIT needs. Registers are numbered as in the
+        // instruction encoding: rax 0, rbx 3, rbp 5, rsp 4, xmm0-xmm15 0-15.
+        class CodeBuffer {
+        public:
+            vector<uint8_t> code;
+
+            void emit(std::initializer_list<uint8_t> bytes) {
+                code.insert(code.end(), bytes);
+            }
+
+            void emit32(uint32_t value) {
+                for (int i = 0; i < 4; i++) code.push_back((uint8_t)(value >> (8 * i)));
+            }
+
+            void emit64(uint64_t value) {
+                for (int i = 0; i < 8; i++) code.push_back((uint8_t)(value >> (8 * i)));
+            }
+
+            // prefix [rex] 0F op, between two xmm registers
+            void sse(uint8_t prefix, uint8_t op, int reg, int rm) {
+                code.push_back(prefix);
+                if (reg >= 8 || rm >= 8) code.push_back((uint8_t)(0x40 | ((reg >> 3) << 2) | (rm >> 3)));
+                emit({ 0x0F, op, (uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)) });
+            }
+
+            // movsd xmm, [rsp + disp] (op 0x10) or movsd [rsp + disp], xmm (op 0x11)
+            void movsd_rsp(uint8_t op, int xmm, int32_t disp) {
+                code.push_back(0xF2);
+                if (xmm >= 8) code.push_back(0x44);
+                emit({ 0x0F, op, (uint8_t)(0x84 | ((xmm & 7) << 3)), 0x24 });
+                emit32((uint32_t)disp);
+            }
+
+            // movq xmm, rax
+            void movq_to_xmm(int xmm) {
+                emit({ 0x66, (uint8_t)(0x48 | ((xmm >> 3) << 2)), 0x0F, 0x6E, (uint8_t)(0xC0 | ((xmm & 7) << 3)) });
+            }
+
+            // movq rax, xmm
+            void movq_from_xmm(int xmm) {
+                emit({ 0x66, (uint8_t)(0x48 | ((xmm >> 3) << 2)), 0x0F, 0x7E, (uint8_t)(0xC0 | ((xmm & 7) << 3)) });
+            }
+
+            // lea reg, [rsp + disp]
+            void lea_rsp(int reg, int32_t disp) {
+                emit({ 0x48, 0x8D, (uint8_t)(0x84 | (reg << 3)), 0x24 });
+                emit32((uint32_t)disp);
+            }
+
+            // mov rax, imm64
+            void mov_rax(uint64_t value) {
+                emit({ 0x48, 0xB8 });
+                emit64(value);
+            }
+
+            // Loads the bits of a double into an xmm register
+            void load_constant(int xmm, double value) {
+                uint64_t bits;
+                memcpy(&bits, &value, sizeof(bits));
+                mov_rax(bits);
+                movq_to_xmm(xmm);
+            }
+
+            // Emits a 32 bit jump offset to be filled in by patch
+            size_t jump_target() {
+                emit32(0);
+                return code.size() - 4;
+            }
+
+            void patch(size_t at, size_t target) {
+                uint32_t rel = (uint32_t)(target - (at + 4));
+                memcpy(&code[at], &rel, sizeof(rel));
+            }
+        };
+
+        typedef Status (*NativeFunction)(const double* const* bindings, double* result);
+
+        // Emits code computing program. Follows the System V calling
+        // convention as a NativeFunction: bindings in rdi, result in rsi.
+        void emit_program(const Program& program, CodeBuffer& buf) {
+            double (*pow_function)(double, double) = pow;
+
+            // Keep bindings in rbx and result in rbp, both callee saved, so
+            // they survive calls to pow. *result is 0 unless evaluation succeeds.
+            buf.emit({ 0x53, 0x55, 0x48, 0x89, 0xFB, 0x48, 0x89, 0xF5 }); // push rbx; push rbp; mov rbx, rdi; mov rbp, rsi
+            buf.emit({ 0x48, 0x81, 0xEC }); // sub rsp, SPILL_AREA
+            buf.emit32((uint32_t)SPILL_AREA);
+            buf.emit({ 0x48, 0xC7, 0x45, 0x00, 0x00, 0x00, 0x00, 0x00 }); // mov qword [rbp], 0
+
+            vector<size_t> divide_jumps;
+            vector<size_t> error_jumps; // Taken with the status already in eax
+            int depth = 0;
+            for (const Instruction& instr : program.code) {
+                if (instr.code == InstructionCode::PUSH_NUMBER) {
+                    buf.load_constant(depth++, program.constants[instr.operand]);
+                    continue;
+                } else if (instr.code == InstructionCode::PUSH_VARIABLE) {
+                    buf.emit({ 0x48, 0x8B, 0x83 }); // mov rax, [rbx + 8 * slot]
+                    buf.emit32(8 * instr.operand);
+                    int xmm = depth++;
+                    buf.code.push_back(0xF2); // movsd xmm, [rax]
+                    if (xmm >= 8) buf.code.push_back(0x44);
+                    buf.emit({ 0x0F, 0x10, (uint8_t)((xmm & 7) << 3) });
+                    continue;
+                } else if (instr.code == InstructionCode::CALL_FUNCTION) {
+                    // Every register is lost across the call. The arguments
+                    // are the top slots, so once spilled they form the array
+                    // the function takes.
+                    ExpressionFunction function = get_function(instr.operand)->eval;
+                    int first = depth - (int)instr.num_args;
+                    for (int i = 0; i < depth; i++) buf.movsd_rsp(0x11, i, 8 * i);
+                    buf.lea_rsp(7, 8 * first); // lea rdi, args
+                    buf.emit({ 0xBE });        // mov esi, num_args
+                    buf.emit32(instr.num_args);
+                    buf.lea_rsp(2, 8 * (int32_t)MAX_JIT_DEPTH); // lea rdx, result slot
+                    buf.mov_rax((uint64_t)(uintptr_t)function);
+                    buf.emit({ 0xFF, 0xD0 });       // call rax
+                    buf.emit({ 0x85, 0xC0 });       // test eax, eax
+                    buf.emit({ 0x0F, 0x85 });       // jnz error
+                    error_jumps.push_back(buf.jump_target());
+                    buf.movsd_rsp(0x10, first, 8 * (int32_t)MAX_JIT_DEPTH);
+                    for (int i = 0; i < first; i++) buf.movsd_rsp(0x10, i, 8 * i);
+                    depth = first + 1;
+                    continue;
+                }
+
+                int lhs = depth - 2, rhs = depth - 1;
+                switch (instr.operand) {
+                case OperatorId::OP_ADD:
+                    buf.sse(0xF2, 0x58, lhs, rhs);
+                    break;
+                case OperatorId::OP_SUBTRACT:
+                    buf.sse(0xF2, 0x5C, lhs, rhs);
+                    break;
+                case OperatorId::OP_MULTIPLY:
+                    buf.sse(0xF2, 0x59, lhs, rhs);
+                    break;
+                case OperatorId::OP_DIVIDE:
+                    // Same test as divide: fabs(rhs) < ALMOST_ZERO, false for NaN
+                    buf.movq_from_xmm(rhs);
+                    buf.emit({ 0x48, 0x0F, 0xBA, 0xF0, 0x3F }); // btr rax, 63
+                    buf.movq_to_xmm(14);
+                    buf.load_constant(15, ALMOST_ZERO);
+                    buf.sse(0x66, 0x2E, 15, 14);   // ucomisd xmm15, xmm14
+                    buf.emit({ 0x0F, 0x87 });      // ja divide_by_zero
+                    divide_jumps.push_back(buf.jump_target());
+                    buf.sse(0xF2, 0x5E, lhs, rhs);
+                    break;
+                case OperatorId::OP_POWER:
+                    // Everything below the arguments is lost across the call
+                    for (int i = 0; i < lhs; i++) buf.movsd_rsp(0x11, i, 8 * i);
+                    if (lhs != 0) buf.sse(0x66, 0x28, 0, lhs); // movapd xmm0, lhs
+                    if (rhs != 1) buf.sse(0x66, 0x28, 1, rhs); // movapd xmm1, rhs
+                    buf.mov_rax((uint64_t)(uintptr_t)pow_function);
+                    buf.emit({ 0xFF, 0xD0 }); // call rax
+                    if (lhs != 0) buf.sse(0x66, 0x28, lhs, 0); // movapd lhs, xmm0
+                    for (int i = 0; i < lhs; i++) buf.movsd_rsp(0x10, i, 8 * i);
+                    break;
+                case OperatorId::OP_UNARY_MINUS:
+                    // Flip the sign bit, as negation does
+                    buf.movq_from_xmm(rhs);
+                    buf.emit({ 0x48, 0x0F, 0xBA, 0xF8, 0x3F }); // btc rax, 63
+                    buf.movq_to_xmm(rhs);
+                    break;
+                default:
+                    break; // Unary plus leaves the value as it is
+                }
+                depth -= (int)g_operators[instr.operand]->num_arg - 1;
+            }
+
+            // Success: store the result and return SUCCESS
+            buf.emit({ 0xF2, 0x0F, 0x11, 0x45, 0x00 }); // movsd [rbp], xmm0
+            buf.emit({ 0xB8 });                          // mov eax, SUCCESS
+            buf.emit32(Status::SUCCESS);
+            size_t epilogue = buf.code.size();
+            buf.emit({ 0x48, 0x81, 0xC4 }); // add rsp, SPILL_AREA
+            buf.emit32((uint32_t)SPILL_AREA);
+            buf.emit({ 0x5D, 0x5B, 0xC3 }); // pop rbp; pop rbx; ret
+            for (size_t at : error_jumps) buf.patch(at, epilogue);
+
+            if (!divide_jumps.empty()) {
+                for (size_t at : divide_jumps) buf.patch(at, buf.code.size());
+                buf.emit({ 0xB8 }); // mov eax, DIVIDE_BY_ZERO
+                buf.emit32(Status::DIVIDE_BY_ZERO);
+                buf.emit({ 0xE9 }); // jmp epilogue
+                buf.patch(buf.jump_target(), epilogue);
+            }
+        }
+    } // namespace
+
+    struct NativeCode {
+        void* memory;
+        size_t size;
+        NativeFunction function;
+
+        ~NativeCode() {
+            munmap(memory, size);
+        }
+    };
+
+    bool is_jit_supported() {
+        return true;
+    }
+
+    Status compile_native(const Program& program, std::shared_ptr<const NativeCode>* native) {
+        if (program.max_depth > MAX_JIT_DEPTH) return Status::ERROR;
+
+        CodeBuffer buf;
+        emit_program(program, buf);
+
+        // Write the code, then make it executable and read only
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t size = (buf.code.size() + page_size - 1) / page_size * page_size;
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return Status::ERROR;
+        memcpy(memory, buf.code.data(), buf.code.size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, size);
+            return Status::ERROR;
+        }
+
+        shared_ptr<NativeCode> code = make_shared<NativeCode>();
+        code->memory = memory;
+        code->size = size;
+        code->function = reinterpret_cast<NativeFunction>(memory);
+        *native = code;
+        return Status::SUCCESS;
+    }
+
+    Status eval_native(const NativeCode& native, const double* const* bindings, double* result) {
+        return native.function(bindings, result);
+    }
+#else
+    struct NativeCode {};
+
+    bool is_jit_supported() {
+        return false;
+    }
+
+    Status compile_native(const Program&, std::shared_ptr<const NativeCode>*) {
+        return Status::ERROR;
+    }
+
+    Status eval_native(const NativeCode&, const double* const*, double*) {
+        return Status::ERROR;
+    }
+#endif
+} // namespace exprparse
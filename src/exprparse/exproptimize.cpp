@@ -0,0 +1,189 @@
+// exproptimize.cpp
+//
+// Constant folding and algebraic simplification of compiled programs
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+namespace exprparse {
+    namespace {
+        // An operand on the stack while the program is rewritten. Its code
+        // runs from start to the end of the output, as it is always the top
+        // of the stack when it is looked at.
+        typedef struct Operand {
+            size_t start;
+            bool constant; // Set when the operand is a single PUSH_NUMBER
+            double value;
+        } Operand;
+
+        bool is_constant(const Operand& operand, double value) {
+            return operand.constant && operand.value == value && signbit(operand.value) == signbit(value);
+        }
+
+        // Returns true if the operator applied to lhs and rhs always gives
+        // back the other operand unchanged, bit for bit. drop_rhs says which
+        // operand to drop. x + 0 is not one of these, as it turns -0 into +0.
+        bool is_identity(OperatorId id, const Operand& lhs, const Operand& rhs, bool* drop_rhs) {
+            *drop_rhs = true;
+            switch (id) {
+            case OperatorId::OP_ADD:
+                if (is_constant(rhs, -0.0)) return true;
+                *drop_rhs = false;
+                return is_constant(lhs, -0.0);
+            case OperatorId::OP_SUBTRACT:
+                return is_constant(rhs, 0.0);
+            case OperatorId::OP_MULTIPLY:
+                if (is_constant(rhs, 1.0)) return true;
+                *drop_rhs = false;
+                return is_constant(lhs, 1.0);
+            case OperatorId::OP_DIVIDE:
+            case OperatorId::OP_POWER:
+                return is_constant(rhs, 1.0);
+            default:
+                return false;
+            }
+        }
+    } // namespace
+
+    // Rewrites a program built by build_program so that it does less work
+    // while giving exactly the same results and errors:
+    //
+    //  - operators and built in functions whose arguments are all constants
+    //    are evaluated now, with the same evals used at runtime. Ones that
+    //    fail, such as a division by zero, are left in so the error is still
+    //    reported. Registered functions may not always give the same result,
+    //    so they are always called at runtime.
+    //  - unary plus is dropped, and so are pairs of unary minus
+    //  - x*1, 1*x, x/1, x^1, x-0, x+(-0) and (-0)+x become x
+    //
+    // Operands are never reordered or regrouped, so x*2*3 is left alone.
+    void optimize_program(Program* program) {
+        vector<Instruction> code;
+        vector<double> values; // Value of each PUSH_NUMBER, indexed by its operand
+        vector<Operand> operands;
+        vector<double> args;
+        code.reserve(program->code.size());
+
+        for (const Instruction& instr : program->code) {
+            if (instr.code == InstructionCode::PUSH_NUMBER) {
+                Operand operand = { code.size(), true, program->constants[instr.operand] };
+                Instruction push = { InstructionCode::PUSH_NUMBER, (uint32_t)values.size(), 0 };
+                operands.push_back(operand);
+                code.push_back(push);
+                values.push_back(operand.value);
+                continue;
+            } else if (instr.code == InstructionCode::PUSH_VARIABLE) {
+                Operand operand = { code.size(), false, 0.0 };
+                operands.push_back(operand);
+                code.push_back(instr);
+                continue;
+            }
+
+            // Operators and pure functions whose arguments are all constants
+            // are worked out now. A call with no arguments starts right here.
+            bool is_call = instr.code == InstructionCode::CALL_FUNCTION;
+            const Operator* op = is_call ? NULL : g_operators[instr.operand];
+            const Function* function = is_call ? get_function(instr.operand) : NULL;
+            size_t num_args = instruction_args(instr);
+            size_t first_arg = operands.size() - num_args;
+            size_t start = num_args == 0 ? code.size() : operands[first_arg].start;
+            bool all_constant = !is_call || function->pure;
+            args.clear();
+            for (size_t iarg = 0; iarg < num_args; iarg++) {
+                all_constant = all_constant && operands[first_arg + iarg].constant;
+                args.push_back(operands[first_arg + iarg].value);
+            }
+
+            double folded;
+            Status fold_val = Status::ERROR;
+            if (all_constant) {
+                fold_val = is_call ? function->eval(args.data(), num_args, &folded)
+                                   : op->eval(args.data(), num_args, &folded);
+            }
+            if (fold_val == Status::SUCCESS) {
+                Operand operand = { start, true, folded };
+                Instruction push = { InstructionCode::PUSH_NUMBER, (uint32_t)values.size(), 0 };
+                code.resize(operand.start);
+                operands.resize(first_arg);
+                operands.push_back(operand);
+                code.push_back(push);
+                values.push_back(folded);
+                continue;
+            }
+
+            if (!is_call) {
+                if (instr.operand == OperatorId::OP_UNARY_PLUS) continue;
+                if (instr.operand == OperatorId::OP_UNARY_MINUS && code.back().code == InstructionCode::APPLY_OPERATOR &&
+                    code.back().operand == OperatorId::OP_UNARY_MINUS) {
+                    code.pop_back();
+                    continue;
+                }
+
+                bool drop_rhs;
+                if (op->num_arg == 2 &&
+                    is_identity((OperatorId)instr.operand, operands[first_arg], operands[first_arg + 1], &drop_rhs)) {
+                    if (drop_rhs) {
+                        code.pop_back();
+                        operands.pop_back();
+                    } else {
+                        code.erase(code.begin() + operands[first_arg].start);
+                        operands[first_arg + 1].start = operands[first_arg].start;
+                        operands.erase(operands.begin() + first_arg);
+                    }
+                    continue;
+                }
+            }
+
+            Operand operand = { start, false, 0.0 };
+            operands.resize(first_arg);
+            operands.push_back(operand);
+            code.push_back(instr);
+        }
+
+        // Keep only the constants still in use, and work out the new depth
+        program->constants.clear();
+        program->max_depth = 0;
+        size_t depth = 0;
+        for (Instruction& instr : code) {
+            if (instr.code == InstructionCode::PUSH_NUMBER) {
+                double value = values[instr.operand];
+                instr.operand = (uint32_t)program->constants.size();
+                program->constants.push_back(value);
+                depth++;
+            } else if (instr.code == InstructionCode::PUSH_VARIABLE) {
+                depth++;
+            } else {
+                depth = depth + 1 - instruction_args(instr);
+            }
+            if (depth > program->max_depth) program->max_depth = depth;
+        }
+        program->code.swap(code);
+    }
+} // namespace exprparse
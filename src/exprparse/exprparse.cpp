@@ -25,14 +25,19 @@
 // SOFTWARE.
 
 #include "exprparse.h"
+#include "exprparse_internal.h"
+#include <atomic>
+#include <charconv>
 #include <cstddef>
+#include <cstdlib>
 #include <cstring>
-#include <list>
+#include <cstdint>
+#include <memory>
 #include <math.h>
-#include <queue>
-#include <regex>
 #include <sstream>
-#include <stack>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
@@ -43,84 +48,56 @@ using namespace std;
 namespace exprparse {
     // Tolerance for determining if number is close to zero
     const double ALMOST_ZERO = 1.0E-10;
+    const float ALMOST_ZERO_FLOAT = 1.0E-10f; // Rounded up
 
-    typedef enum TokenType { NUMBER, OPERATOR, FUNCTION, LEFT_BRACKET, RIGHT_BRACKET } TokenType;
-
-
-    typedef struct TokenRegex {
-        TokenType ttype;
-        regex regexpr;
-        void* data;
-    } TokenRegex;
-
-    typedef Status (*Operation)(const double[], const size_t&, double*);
-
-    typedef enum OperatorAssoc { RIGHT, LEFT } OperatorAssoc;
-
-    typedef struct Operator {
-        Operation eval;
-        uint16_t precedance;
-        size_t num_arg;
-        OperatorAssoc op_assoc;
-    } Operator;
-
-    // Typedefs for parsed token data
-    typedef struct Token {
-        TokenType ttype;
-        void* data;
-    } Token;
-
-    typedef struct OperatorData {
-        Operator* op;
-    } OperatorData;
-
-    typedef struct NumberData {
-        double number;
-    } NumberData;
-
-    // Declare all operations
-    Status add(const double args[], const size_t& num_args, double* result);
-    Status subtract(const double args[], const size_t& num_args, double* result);
-    Status multiply(const double args[], const size_t& num_args, double* result);
-    Status divide(const double args[], const size_t& num_args, double* result);
-    Status power(const double args[], const size_t& num_args, double* result);
-    Status unary_minus(const double args[], const size_t& num_args, double* result);
-    Status unary_plus(const double args[], const size_t& num_args, double* result);
-
-    // Declare helper functions
-    void destroy_tokens(list<Token*>& tokens);
-
-    Operator g_add_op = { add, 1, 2, OperatorAssoc::LEFT };
-    Operator g_sub_op = { subtract, 1, 2, OperatorAssoc::LEFT };
-    Operator g_mult_op = { multiply, 2, 2, OperatorAssoc::LEFT };
-    Operator g_divide_op = { divide, 2, 2, OperatorAssoc::LEFT };
-    Operator g_power_op = { power, 3, 2, OperatorAssoc::RIGHT };
-    Operator g_unary_minus = { unary_minus, 3, 1, OperatorAssoc::RIGHT };
-    Operator g_unary_plus = { unary_plus, 3, 1, OperatorAssoc::RIGHT };
-
-    // This could be put in an initialization function to avoid hardcoding
-    const size_t MAX_OPERATOR_ARGS = 2;
-
-    TokenRegex g_tokens_reg[] = { { NUMBER, regex(R"(^([0-9]+\.?|\.[0-9]+)[0-9]*([eE][+-]?[0-9]+)?)"), NULL },
-                                  { OPERATOR, regex(R"(^\*\*)"), &g_power_op },
-                                  { OPERATOR, regex(R"(^\^)"), &g_power_op },
-                                  { OPERATOR, regex(R"(^\*)"), &g_mult_op },
-                                  { OPERATOR, regex(R"(^/)"), &g_divide_op },
-                                  { OPERATOR, regex(R"(^\+)"), &g_add_op },
-                                  { OPERATOR, regex(R"(^\-)"), &g_sub_op },
-                                  { LEFT_BRACKET, regex(R"(^\()"), NULL },
-                                  { LEFT_BRACKET, regex(R"(^\[)"), NULL },
-                                  { RIGHT_BRACKET, regex(R"a(^\))a"), NULL },
-                                  { RIGHT_BRACKET, regex(R"(^\])"), NULL } };
+    // Declare all operations, for each type eval_code computes in
+    template <class T> Status add(const T args[], const size_t& num_args, T* result);
+    template <class T> Status subtract(const T args[], const size_t& num_args, T* result);
+    template <class T> Status multiply(const T args[], const size_t& num_args, T* result);
+    template <class T> Status divide(const T args[], const size_t& num_args, T* result);
+    template <class T> Status power(const T args[], const size_t& num_args, T* result);
+    template <class T> Status unary_minus(const T args[], const size_t& num_args, T* result);
+    template <class T> Status unary_plus(const T args[], const size_t& num_args, T* result);
+
+    Operator g_add_op = { add<double>, 1, 2, OperatorAssoc::LEFT, OperatorId::OP_ADD };
+    Operator g_sub_op = { subtract<double>, 1, 2, OperatorAssoc::LEFT, OperatorId::OP_SUBTRACT };
+    Operator g_mult_op = { multiply<double>, 2, 2, OperatorAssoc::LEFT, OperatorId::OP_MULTIPLY };
+    Operator g_divide_op = { divide<double>, 2, 2, OperatorAssoc::LEFT, OperatorId::OP_DIVIDE };
+    Operator g_power_op = { power<double>, 3, 2, OperatorAssoc::RIGHT, OperatorId::OP_POWER };
+    Operator g_unary_minus = { unary_minus<double>, 3, 1, OperatorAssoc::RIGHT, OperatorId::OP_UNARY_MINUS };
+    Operator g_unary_plus = { unary_plus<double>, 3, 1, OperatorAssoc::RIGHT, OperatorId::OP_UNARY_PLUS };
+
+    // Operators indexed by OperatorId, used to decode compiled programs
+    const Operator* const g_operators[NUM_OPERATORS] = { &g_add_op,    &g_sub_op,   &g_mult_op,
+                                                         &g_divide_op, &g_power_op, &g_unary_minus,
+                                                         &g_unary_plus };
+
+    // Character classes used by the lexer. These are deliberately not the
+    // <cctype> functions, which are locale dependent.
+    inline bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    inline bool is_identifier_start(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    inline bool is_identifier_char(char c) {
+        return is_identifier_start(c) || is_digit(c);
+    }
+
+    inline bool is_whitespace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\n';
+    }
 
     // Function to skip whitespace characters in input string
     // This function will offset the input character pointer such
     // that it points to first character that is not whitespace
     //
     // Returns: 1 if whitespace successfully skipped, 0 if end of string was hit
-    short skip_whitespace(string::const_iterator& str_itr, const string::const_iterator& end_iter) {
+    short skip_whitespace(const char*& str_itr, const char* end_iter) {
         while (str_itr != end_iter) {
-            if (*str_itr == ' ' || *str_itr == '\t' || *str_itr == '\r' || *str_itr == '\f' || *str_itr == '\n') {
+            if (is_whitespace(*str_itr)) {
                 str_itr++;
             } else {
                 return 1;
@@ -129,192 +106,1262 @@ namespace exprparse {
         return 0;
     }
 
+    // Finds the end of the number starting at str_itr. Numbers have the form
+    //
+    //    ([0-9]+\.?|\.[0-9]+)[0-9]*([eE][+-]?[0-9]+)?
+    //
+    // Returns: pointer one past the last character of the number, or str_itr
+    // if no number starts there
+    const char* scan_number(const char* str_itr, const char* end_iter) {
+        const char* pos = str_itr;
+        if (pos != end_iter && is_digit(*pos)) {
+            while (pos != end_iter && is_digit(*pos)) pos++;
+            if (pos != end_iter && *pos == '.') pos++;
+        } else if (pos != end_iter && *pos == '.' && pos + 1 != end_iter && is_digit(pos[1])) {
+            pos++;
+        } else {
+            return str_itr;
+        }
+        while (pos != end_iter && is_digit(*pos)) pos++;
+
+        // The exponent is only part of the number if at least one digit follows
+        if (pos != end_iter && (*pos == 'e' || *pos == 'E')) {
+            const char* exp_pos = pos + 1;
+            if (exp_pos != end_iter && (*exp_pos == '+' || *exp_pos == '-')) exp_pos++;
+            if (exp_pos != end_iter && is_digit(*exp_pos)) {
+                while (exp_pos != end_iter && is_digit(*exp_pos)) exp_pos++;
+                pos = exp_pos;
+            }
+        }
+        return pos;
+    }
+
+    // Converts the characters [first, last) found by scan_number to a double
+    // without copying them. Values out of the range of a double saturate to
+    // infinity or zero, the same as atof.
+    double convert_number(const char* first, const char* last) {
+        double value = 0.0;
+#if defined(__cpp_lib_to_chars)
+        from_chars_result res = from_chars(first, last, value);
+        if (res.ec == errc()) return value;
+#endif
+        // Slow path, strtod needs a null terminated copy
+        string number(first, last);
+        return strtod(number.c_str(), NULL);
+    }
+
     // Function to convert a string expression into a list of tokens
     //
-    // Caller must call destroy_tokens to clean up list when done with the tokens
-    Status tokenize_expr(const string& expression, list<Token*>& tokens) {
+    // The input is scanned once, left to right, looking only at the current
+    // character (and the one after it for '**' and leading decimal points).
+    // Variable names are a letter or underscore followed by any number of
+    // letters, digits and underscores.
+    //
+    // Tokens are appended to a vector that lives in the caller's arena, so
+    // tokenizing does not allocate anything per token.
+    Status tokenize_expr(string_view expression, TokenList& tokens) {
+        EXPRPARSE_STATS(StageTimer timer(STAGE_TOKENIZE));
+
         // Check for empty expression
         if (expression.empty()) return Status::EMPTY_EXPRESSION;
 
-        // Initialize string iterator
-        string::const_iterator expr_iter = expression.begin();
-
         // Clear out tokens
         tokens.clear();
 
+        Status ret_val = append_tokens(expression.data(), expression.data() + expression.size(), tokens);
+        EXPRPARSE_STATS(if (ret_val == Status::SUCCESS) record_tokens(tokens.size()));
+        return ret_val;
+    }
+
+    // Scans the token that starts at expr_iter, which must not be
+    // whitespace. + and - are always given as the binary operators, as
+    // whether they are unary depends on what came before.
+    //
+    // Returns: pointer one past the token, or NULL if no token starts there
+    const char* scan_token(const char* expr_iter, const char* expr_end, Token* tok) {
+        const char* number_end = scan_number(expr_iter, expr_end);
+        if (number_end != expr_iter) {
+            // A number running straight into a name, like 1e.1 or 2x, is malformed
+            if (number_end != expr_end && is_identifier_char(*number_end)) return NULL;
+            tok->ttype = TokenType::NUMBER;
+            tok->number = convert_number(expr_iter, number_end);
+            return number_end;
+        }
+
+        if (is_identifier_start(*expr_iter)) {
+            const char* name_start = expr_iter;
+            while (expr_iter != expr_end && is_identifier_char(*expr_iter)) expr_iter++;
+            tok->ttype = TokenType::VARIABLE;
+            tok->name = name_start;
+            tok->name_length = expr_iter - name_start;
+            return expr_iter;
+        }
+
+        tok->op = NULL;
+        switch (*expr_iter) {
+        case '*':
+            if (expr_iter + 1 != expr_end && expr_iter[1] == '*') {
+                expr_iter++;
+                tok->op = &g_power_op;
+            } else {
+                tok->op = &g_mult_op;
+            }
+            tok->ttype = TokenType::OPERATOR;
+            break;
+        case '^':
+            tok->ttype = TokenType::OPERATOR;
+            tok->op = &g_power_op;
+            break;
+        case '/':
+            tok->ttype = TokenType::OPERATOR;
+            tok->op = &g_divide_op;
+            break;
+        case '+':
+            tok->ttype = TokenType::OPERATOR;
+            tok->op = &g_add_op;
+            break;
+        case '-':
+            tok->ttype = TokenType::OPERATOR;
+            tok->op = &g_sub_op;
+            break;
+        case '(':
+        case '[':
+            tok->ttype = TokenType::LEFT_BRACKET;
+            break;
+        case ')':
+        case ']':
+            tok->ttype = TokenType::RIGHT_BRACKET;
+            break;
+        case ',':
+            tok->ttype = TokenType::COMMA;
+            break;
+        default:
+            return NULL;
+        }
+        return expr_iter + 1;
+    }
+
+    // Returns the unary version of a binary operator, or NULL if it has none
+    const Operator* unary_operator(const Operator* op) {
+        if (op == &g_sub_op) return &g_unary_minus;
+        if (op == &g_add_op) return &g_unary_plus;
+        return NULL;
+    }
+
+    // Returns the binary version of a unary operator, or op if it is binary
+    const Operator* binary_operator(const Operator* op) {
+        if (op == &g_unary_minus) return &g_sub_op;
+        if (op == &g_unary_plus) return &g_add_op;
+        return op;
+    }
+
+    // Tokenizes the characters [expr_iter, expr_end), adding to the end of
+    // tokens. Whether a leading + or - is unary depends on the tokens already
+    // there.
+    Status append_tokens(const char* expr_iter, const char* expr_end, TokenList& tokens) {
         // Enter the parsing loop
-        Status ret_value = Status::SUCCESS;
-        smatch matches;
-        while (skip_whitespace(expr_iter, expression.end()) && ret_value == Status::SUCCESS) {
-            // Try to match each possible token
-            bool match_found = false;
-            for (size_t itok = 0; itok < sizeof(g_tokens_reg) / sizeof(g_tokens_reg[0]); itok++) {
-                TokenRegex* tok_reg = &g_tokens_reg[itok];
-                if (regex_search(expr_iter, expression.end(), matches, tok_reg->regexpr)) {
-                    expr_iter += matches[0].length();
-                    Token* tok = new Token;
-                    tok->ttype = tok_reg->ttype;
-                    if (tok->ttype == TokenType::NUMBER) {
-                        NumberData* num = new NumberData;
-                        num->number = atof(matches[0].str().c_str());
-                        tok->data = num;
-                    } else if (tok->ttype == TokenType::OPERATOR) {
-                        bool isUnary = tokens.empty() || (tokens.back()->ttype != TokenType::NUMBER &&
-                                                          tokens.back()->ttype != TokenType::RIGHT_BRACKET);
-                        OperatorData* data = new OperatorData;
-                        if (!isUnary || (tok_reg->data != &g_sub_op && tok_reg->data != &g_add_op))
-                            data->op = (Operator*)tok_reg->data;
-                        else {
-                            if (tok_reg->data == &g_sub_op)
-                                data->op = &g_unary_minus;
-                            else
-                                data->op = &g_unary_plus;
-                        }
-                        tok->data = data;
-                    } else {
-                        tok->data = tok_reg->data;
-                    }
-                    tokens.push_back(tok);
-                    match_found = true;
-                    break;
-                }
+        while (skip_whitespace(expr_iter, expr_end)) {
+            Token tok;
+            expr_iter = scan_token(expr_iter, expr_end, &tok);
+            if (expr_iter == NULL) return Status::UNKNOWN_TOKEN;
+
+            if (tok.ttype == TokenType::OPERATOR) {
+                bool isUnary = tokens.empty() || (tokens.back().ttype != TokenType::NUMBER &&
+                                                  tokens.back().ttype != TokenType::VARIABLE &&
+                                                  tokens.back().ttype != TokenType::RIGHT_BRACKET);
+                if (isUnary && unary_operator(tok.op)) tok.op = unary_operator(tok.op);
             }
-            if (!match_found) ret_value = Status::UNKNOWN_TOKEN;
+            tokens.push_back(tok);
         }
 
         // Return
-        return ret_value;
+        return Status::SUCCESS;
+    }
+
+    // True if a token can run on from character a into character b, where
+    // before is the character ahead of a, or 0. The input can be cut
+    // anywhere else and tokenized in pieces, giving the same tokens.
+    bool tokens_can_span(char before, char a, char b) {
+        bool a_word = is_identifier_char(a) || a == '.';
+        bool b_word = is_identifier_char(b) || b == '.';
+        if (a_word && b_word) return true;                                   // Numbers and names
+        if ((a == 'e' || a == 'E') && (b == '+' || b == '-')) return true; // Exponent sign
+        if ((a == '+' || a == '-') && (before == 'e' || before == 'E') && b_word) return true;
+        return a == '*' && b == '*';
+    }
+
+    // Same as above, for a character a at the end of the input so far
+    bool token_can_continue(char before, char a) {
+        return is_identifier_char(a) || a == '.' || a == '*' ||
+               ((a == '+' || a == '-') && (before == 'e' || before == 'E'));
+    }
+
+    struct IncrementalParser::Impl {
+        ParseArena arena;
+        TokenList tokens;
+        string pending; // End of the input that may be the start of a longer token
+        size_t length;  // Characters fed so far
+        Status status;
+        size_t open_brackets; // Left brackets less right ones in tokens
+        size_t max_open_brackets;
+
+        Impl()
+            : tokens(ArenaAllocator<Token>(&arena)),
+              length(0),
+              status(Status::SUCCESS),
+              open_brackets(0),
+              max_open_brackets(0) {
+        }
+
+        // Tokenizes [first, last), which is only valid for this call, so the
+        // names of variables are copied into the arena
+        Status tokenize(const char* first, const char* last) {
+            size_t first_token = tokens.size();
+            Status ret_val = append_tokens(first, last, tokens);
+            for (size_t itok = first_token; itok < tokens.size(); itok++) {
+                Token& tok = tokens[itok];
+                if (tok.ttype == TokenType::LEFT_BRACKET && ++open_brackets > max_open_brackets)
+                    max_open_brackets = open_brackets;
+                if (tok.ttype == TokenType::RIGHT_BRACKET && open_brackets > 0) open_brackets--;
+                if (tok.ttype != TokenType::VARIABLE) continue;
+                char* name = static_cast<char*>(arena.allocate(tok.name_length, 1));
+                memcpy(name, tok.name, tok.name_length);
+                tok.name = name;
+            }
+            return ret_val;
+        }
+
+        Status flush_pending() {
+            Status ret_val = tokenize(pending.data(), pending.data() + pending.size());
+            pending.clear();
+            return ret_val;
+        }
+
+        Status finish(const SymbolTable* symbols, double* result) {
+            Status ret_val = status;
+            if (ret_val == Status::SUCCESS && !pending.empty()) ret_val = flush_pending();
+            if (ret_val == Status::SUCCESS && length == 0) ret_val = Status::EMPTY_EXPRESSION;
+
+            // parse_expression reports brackets nested too deeply ahead of
+            // any error after them, including an unknown token. Brackets
+            // can only be that deep if this many are open at once.
+            TokenList rpn_tokens((ArenaAllocator<Token>(&arena)));
+            size_t max_depth = get_max_nesting_depth();
+            if ((ret_val == Status::SUCCESS || ret_val == Status::UNKNOWN_TOKEN) && max_open_brackets > max_depth) {
+                bool truncated = ret_val == Status::UNKNOWN_TOKEN;
+                if (parse_tokens_single_pass(tokens, truncated, max_depth, rpn_tokens) == Status::NESTING_TOO_DEEP)
+                    ret_val = Status::NESTING_TOO_DEEP;
+            }
+
+            if (ret_val == Status::SUCCESS) {
+                ret_val = convert_tokens_to_rpn(tokens, rpn_tokens);
+                if (ret_val == Status::SUCCESS) ret_val = eval_rpn_tokens(rpn_tokens, symbols, result);
+            }
+            reset();
+            return ret_val;
+        }
+
+        void reset() {
+            // The token memory is given back with the rest of the arena
+            tokens = TokenList(ArenaAllocator<Token>(&arena));
+            arena.reset();
+            pending.clear();
+            length = 0;
+            status = Status::SUCCESS;
+            open_brackets = 0;
+            max_open_brackets = 0;
+        }
+    };
+
+    IncrementalParser::IncrementalParser() : impl_(new Impl) {
+    }
+
+    IncrementalParser::~IncrementalParser() {
+    }
+
+    Status IncrementalParser::feed(string_view fragment) {
+        Impl& impl = *impl_;
+        if (impl.status != Status::SUCCESS || fragment.empty()) return impl.status;
+        impl.length += fragment.size();
+        const char* first = fragment.data();
+        const char* last = first + fragment.size();
+
+        // Complete the token held back from the last fragment, if any
+        if (!impl.pending.empty()) {
+            const char* split = first;
+            char before = impl.pending.size() > 1 ? impl.pending[impl.pending.size() - 2] : 0;
+            char a = impl.pending.back();
+            while (split != last && tokens_can_span(before, a, *split)) {
+                before = a;
+                a = *split++;
+            }
+            impl.pending.append(first, split);
+            if (split == last) return Status::SUCCESS;
+            impl.status = impl.flush_pending();
+            if (impl.status != Status::SUCCESS) return impl.status;
+            first = split;
+        }
+
+        // Hold back the end of the fragment if the next one could continue it
+        const char* split = last;
+        if (token_can_continue(last - first > 1 ? last[-2] : 0, last[-1])) {
+            split--;
+            while (split != first && tokens_can_span(split - first > 1 ? split[-2] : 0, split[-1], *split)) split--;
+        }
+        impl.pending.assign(split, last);
+        impl.status = impl.tokenize(first, split);
+        return impl.status;
+    }
+
+    Status IncrementalParser::feed(const char* fragment, size_t length) {
+        return feed(string_view(fragment, length));
+    }
+
+    Status IncrementalParser::finish(double* result) {
+        return impl_->finish(NULL, result);
+    }
+
+    Status IncrementalParser::finish(const SymbolTable& symbols, double* result) {
+        return impl_->finish(&symbols, result);
+    }
+
+    void IncrementalParser::reset() {
+        impl_->reset();
     }
 
     // Parses list of tokens into reverse polish notation
     //
+    // A name followed by a bracket is a call. The name's FUNCTION token is
+    // held on the operator stack under the bracket and goes out after the
+    // arguments, with their number, when the bracket closes. Commas are only
+    // allowed directly inside the brackets of a call.
+    //
     // Arguments:
     //  tokens: List of tokens using infix notation
-    //  rpn_tokens: stack containing tokens in reverse polish notation
-    Status convert_tokens_to_rpn(const list<Token*>& tokens, queue<Token*>& rpn_tokens) {
-        stack<Token*> operator_stack;
-
-        for (auto iter = tokens.begin(); iter != tokens.end(); iter++) {
-            Token* tok = *iter;
-            if (tok->ttype == TokenType::NUMBER) {
-                rpn_tokens.push(tok);
-            } else if (tok->ttype == TokenType::FUNCTION || tok->ttype == TokenType::LEFT_BRACKET) {
-                operator_stack.push(tok);
-            } else if (tok->ttype == TokenType::OPERATOR) {
-                OperatorData* op_data_current = (OperatorData*)tok->data;
-                while (!operator_stack.empty() && operator_stack.top()->ttype != TokenType::LEFT_BRACKET) {
-                    OperatorData* op_data_top = NULL;
-                    if (operator_stack.top()->ttype == OPERATOR)
-                        op_data_top = (OperatorData*)operator_stack.top()->data;
-
-                    if (operator_stack.top()->ttype == TokenType::FUNCTION ||
-                        op_data_current->op->precedance < op_data_top->op->precedance ||
-                        (op_data_current->op->precedance == op_data_top->op->precedance &&
-                         op_data_top->op->op_assoc == OperatorAssoc::LEFT)) {
-                        rpn_tokens.push(operator_stack.top());
-                        operator_stack.pop();
+    //  rpn_tokens: tokens in reverse polish notation
+    Status convert_tokens_to_rpn(const TokenList& tokens, TokenList& rpn_tokens) {
+        EXPRPARSE_STATS(StageTimer timer(STAGE_CONVERT_TO_RPN));
+        EXPRPARSE_STATS(size_t max_depth = 0);
+
+        // Neither list can outgrow the input, so reserving up front means each
+        // takes exactly one allocation from the arena
+        TokenList operator_stack(tokens.get_allocator());
+        operator_stack.reserve(tokens.size());
+        rpn_tokens.clear();
+        rpn_tokens.reserve(tokens.size());
+
+        // For each open bracket, the number of arguments seen so far if it
+        // belongs to a call, otherwise 0
+        ArenaVector<size_t> arg_counts(tokens.get_allocator());
+
+        for (size_t itok = 0; itok < tokens.size(); itok++) {
+            const Token& tok = tokens[itok];
+            if (tok.ttype == TokenType::VARIABLE && itok + 1 < tokens.size() &&
+                tokens[itok + 1].ttype == TokenType::LEFT_BRACKET) {
+                Token call;
+                call.ttype = TokenType::FUNCTION;
+                call.function = find_function(tok.name, tok.name_length);
+                call.num_args = 0;
+                if (call.function == NULL) return Status::UNKNOWN_TOKEN;
+                operator_stack.push_back(call);
+                EXPRPARSE_STATS(if (operator_stack.size() > max_depth) max_depth = operator_stack.size());
+            } else if (tok.ttype == TokenType::NUMBER || tok.ttype == TokenType::VARIABLE) {
+                rpn_tokens.push_back(tok);
+            } else if (tok.ttype == TokenType::LEFT_BRACKET) {
+                bool call = !operator_stack.empty() && operator_stack.back().ttype == TokenType::FUNCTION;
+                arg_counts.push_back(call ? 1 : 0);
+                operator_stack.push_back(tok);
+                EXPRPARSE_STATS(if (operator_stack.size() > max_depth) max_depth = operator_stack.size());
+            } else if (tok.ttype == TokenType::OPERATOR) {
+                while (!operator_stack.empty() && operator_stack.back().ttype != TokenType::LEFT_BRACKET) {
+                    const Token& top = operator_stack.back();
+                    if (top.ttype == TokenType::FUNCTION || tok.op->precedance < top.op->precedance ||
+                        (tok.op->precedance == top.op->precedance && top.op->op_assoc == OperatorAssoc::LEFT)) {
+                        rpn_tokens.push_back(top);
+                        operator_stack.pop_back();
                     } else {
                         break;
                     }
                 }
-                operator_stack.push(tok);
-            } else if (tok->ttype == TokenType::RIGHT_BRACKET) {
-                while (!operator_stack.empty() && operator_stack.top()->ttype != TokenType::LEFT_BRACKET) {
-                    rpn_tokens.push(operator_stack.top());
-                    operator_stack.pop();
+                operator_stack.push_back(tok);
+                EXPRPARSE_STATS(if (operator_stack.size() > max_depth) max_depth = operator_stack.size());
+            } else if (tok.ttype == TokenType::COMMA) {
+                while (!operator_stack.empty() && operator_stack.back().ttype != TokenType::LEFT_BRACKET) {
+                    rpn_tokens.push_back(operator_stack.back());
+                    operator_stack.pop_back();
+                }
+                // A comma anywhere else separates values nothing takes
+                if (operator_stack.empty() || arg_counts.back() == 0) return Status::TOO_MANY_ARGUMENTS;
+                arg_counts.back()++;
+            } else if (tok.ttype == TokenType::RIGHT_BRACKET) {
+                while (!operator_stack.empty() && operator_stack.back().ttype != TokenType::LEFT_BRACKET) {
+                    rpn_tokens.push_back(operator_stack.back());
+                    operator_stack.pop_back();
                 }
                 if (operator_stack.empty()) {
                     return Status::UNMATCHED_BRACKETS;
                 }
                 // Remove the left bracket from the stack
-                operator_stack.pop();
+                operator_stack.pop_back();
+                size_t num_args = arg_counts.back();
+                arg_counts.pop_back();
+
+                // Close the call the bracket belongs to. Empty brackets are a
+                // call with no arguments.
+                if (num_args != 0) {
+                    Token call = operator_stack.back();
+                    operator_stack.pop_back();
+                    call.num_args = tokens[itok - 1].ttype == TokenType::LEFT_BRACKET ? 0 : num_args;
+                    if (call.num_args < call.function->min_args) return Status::TOO_FEW_ARGUMENTS;
+                    if (call.num_args > call.function->max_args) return Status::TOO_MANY_ARGUMENTS;
+                    rpn_tokens.push_back(call);
+                }
             }
         }
 
+        EXPRPARSE_STATS(record_operator_depth(max_depth));
+
         // No more tokens, remove all remaining operators
         while (!operator_stack.empty()) {
-            Token* tok = operator_stack.top();
-            operator_stack.pop();
-            if (tok->ttype == TokenType::LEFT_BRACKET || tok->ttype == TokenType::RIGHT_BRACKET) {
+            const Token& tok = operator_stack.back();
+            if (tok.ttype == TokenType::LEFT_BRACKET || tok.ttype == TokenType::RIGHT_BRACKET) {
                 return Status::UNMATCHED_BRACKETS;
             }
-            rpn_tokens.push(tok);
+            rpn_tokens.push_back(tok);
+            operator_stack.pop_back();
         }
 
         return Status::SUCCESS;
     }
 
-    // Function to evaluate a queue of tokens in reverse polish notation
+    // Expressions with more distinct variables than this find their slots
+    // through a hash table rather than by comparing names in order
+    const size_t LINEAR_SLOT_SEARCH = 16;
+
+    // Flattens tokens in reverse polish notation into a program.
+    //
+    // The arguments each operator will find on the stack are checked here,
+    // once, so that eval_program does not have to. If the check fails the
+    // program is still filled in so the error can be replayed.
     //
     // Arguments:
-    //  rpn_tokens: queue of tokens in reverse polish notation, will be modified
-    //  result: double to store result of calculation
-    Status eval_rpn_tokens(queue<Token*>& rpn_tokens, double* result) {
-        stack<double> argument_stack;
-        double* args = new double[MAX_OPERATOR_ARGS];
-        *result = 0.0;
-        Status ret_val = Status::SUCCESS;
+    //  rpn_tokens: tokens in reverse polish notation
+    //  program: program to fill in
+    Status build_program(const TokenList& rpn_tokens, Program* program) {
+        program->code.clear();
+        program->constants.clear();
+        program->variables.clear();
+        program->max_depth = 0;
+        program->unoptimized_size = 0;
 
-        while (!rpn_tokens.empty() && ret_val == Status::SUCCESS) {
-            Token* tok = rpn_tokens.front();
-            rpn_tokens.pop();
-
-            if (tok->ttype == TokenType::NUMBER) {
-                argument_stack.push(((NumberData*)tok->data)->number);
-            } else if (tok->ttype == TokenType::OPERATOR) {
-                Operator* op = ((OperatorData*)tok->data)->op;
-                for (int iarg = (int)op->num_arg - 1; iarg >= 0; iarg--) {
-                    if (argument_stack.empty()) {
-                        return Status::TOO_FEW_ARGUMENTS;
+        Status ret_val = Status::SUCCESS;
+        size_t depth = 0;
+        unordered_map<string_view, size_t> slots; // Slot of each variable, once there are many
+        program->code.reserve(rpn_tokens.size());
+        for (const Token& tok : rpn_tokens) {
+            Instruction instr;
+            size_t num_args = 0;
+            instr.num_args = 0;
+            if (tok.ttype == TokenType::NUMBER) {
+                instr.code = InstructionCode::PUSH_NUMBER;
+                instr.operand = (uint32_t)program->constants.size();
+                program->constants.push_back(tok.number);
+                depth++;
+            } else if (tok.ttype == TokenType::VARIABLE) {
+                // Each distinct name gets one slot, in order of first use
+                string_view name(tok.name, tok.name_length);
+                size_t slot = 0;
+                if (slots.empty()) {
+                    while (slot < program->variables.size() && program->variables[slot] != name) slot++;
+                } else {
+                    auto found = slots.find(name);
+                    slot = found != slots.end() ? found->second : program->variables.size();
+                }
+                if (slot == program->variables.size()) {
+                    if (slot == LINEAR_SLOT_SEARCH) {
+                        // No name moves once there is room for every token,
+                        // so the table can point at them
+                        program->variables.reserve(rpn_tokens.size());
+                        for (size_t i = 0; i < slot; i++) slots.emplace(program->variables[i], i);
                     }
-                    args[iarg] = argument_stack.top();
-                    argument_stack.pop();
+                    program->variables.emplace_back(name);
+                    if (!slots.empty()) slots.emplace(program->variables.back(), slot);
                 }
-                if (ret_val == Status::SUCCESS) {
-                    double eval_result;
-                    ret_val = op->eval(args, op->num_arg, &eval_result);
-                    argument_stack.push(eval_result);
+                instr.code = InstructionCode::PUSH_VARIABLE;
+                instr.operand = (uint32_t)slot;
+                depth++;
+            } else if (tok.ttype == TokenType::OPERATOR || tok.ttype == TokenType::FUNCTION) {
+                if (tok.ttype == TokenType::OPERATOR) {
+                    instr.code = InstructionCode::APPLY_OPERATOR;
+                    instr.operand = tok.op->id;
+                    num_args = tok.op->num_arg;
+                } else {
+                    instr.code = InstructionCode::CALL_FUNCTION;
+                    instr.operand = tok.function->id;
+                    instr.num_args = (uint32_t)tok.num_args;
+                    num_args = tok.num_args;
                 }
+                if (depth < num_args) {
+                    if (ret_val == Status::SUCCESS) ret_val = Status::TOO_FEW_ARGUMENTS;
+                    depth = 0;
+                } else {
+                    depth -= num_args;
+                }
+                depth++;
             } else {
-                ret_val = Status::UNKNOWN_TOKEN;
+                return Status::UNKNOWN_TOKEN;
             }
+            if (depth > program->max_depth) program->max_depth = depth;
+            program->code.push_back(instr);
         }
+        program->unoptimized_size = program->code.size();
+        if (!slots.empty()) program->variables.shrink_to_fit();
 
-        if (ret_val == Status::SUCCESS) {
-            if (argument_stack.size() == 1) {
-                *result = argument_stack.top();
-            } else if (argument_stack.size() > 1) {
-                ret_val = Status::TOO_MANY_ARGUMENTS;
+        if (ret_val == Status::SUCCESS && depth != 1) {
+            ret_val = depth > 1 ? Status::TOO_MANY_ARGUMENTS : Status::TOO_FEW_ARGUMENTS;
+        }
+        return ret_val;
+    }
+
+    // Operators computed in T, indexed by OperatorId like g_operators
+    template <class T> using TypedOperation = Status (*)(const T[], const size_t&, T*);
+    template <class T>
+    const TypedOperation<T> g_typed_operators[NUM_OPERATORS] = { add<T>,   subtract<T>,    multiply<T>,  divide<T>,
+                                                                 power<T>, unary_minus<T>, unary_plus<T> };
+
+    // Calls function on num_args values of type T, which are converted to
+    // double and back unless T is double
+    template <class T> Status call_function(const Function* function, const T* args, size_t num_args, T* result) {
+        if constexpr (is_same<T, double>::value) {
+            return function->eval(args, num_args, result);
+        } else {
+            double inline_args[INLINE_CALL_ARGS];
+            vector<double> heap_args;
+            double* wide_args = inline_args;
+            if (num_args > INLINE_CALL_ARGS) {
+                heap_args.resize(num_args);
+                wide_args = heap_args.data();
+            }
+            for (size_t iarg = 0; iarg < num_args; iarg++) wide_args[iarg] = (double)args[iarg];
+            double wide_result;
+            Status ret_val = function->eval(wide_args, num_args, &wide_result);
+            *result = (T)wide_result;
+            return ret_val;
+        }
+    }
+
+    // Function to evaluate instructions made by build_program
+    //
+    // Arguments:
+    //  code: size instructions that build_program would accept
+    //  constants: values of the PUSH_NUMBER operands
+    //  functions: function of each CALL_FUNCTION operand, or NULL if the
+    //             operands are ids in the function registry
+    //  bindings: pointer to the value of each of the program's variables
+    //  stack: scratch space for at least as many values as the code pushes
+    //  result: value to store result of calculation
+    template <class T>
+    Status eval_code(const Instruction* code,
+                     size_t size,
+                     const double* constants,
+                     const Function* const* functions,
+                     const double* const* bindings,
+                     T* stack,
+                     T* result) {
+        *result = 0.0;
+        size_t sp = 0;
+        for (const Instruction* instr = code; instr != code + size; instr++) {
+            if (instr->code == InstructionCode::PUSH_NUMBER) {
+                stack[sp++] = (T)constants[instr->operand];
+            } else if (instr->code == InstructionCode::PUSH_VARIABLE) {
+                stack[sp++] = (T)*bindings[instr->operand];
+            } else if (instr->code == InstructionCode::APPLY_OPERATOR) {
+                const size_t num_arg = g_operators[instr->operand]->num_arg;
+                T eval_result;
+                sp -= num_arg;
+                Status ret_val = g_typed_operators<T>[instr->operand](stack + sp, num_arg, &eval_result);
+                if (ret_val != Status::SUCCESS) return ret_val;
+                stack[sp++] = eval_result;
+            } else {
+                const Function* function = functions ? functions[instr->operand] : get_function(instr->operand);
+                T eval_result;
+                sp -= instr->num_args;
+                Status ret_val = call_function(function, stack + sp, instr->num_args, &eval_result);
+                if (ret_val != Status::SUCCESS) return ret_val;
+                stack[sp++] = eval_result;
+            }
+        }
+        *result = stack[0];
+        return Status::SUCCESS;
+    }
+
+    // Function to evaluate a program built by build_program
+    //
+    // Arguments:
+    //  program: successfully built program
+    //  bindings: pointer to the value of each of the program's variables
+    //  stack: scratch space for at least program.max_depth values
+    //  result: value to store result of calculation
+    template <class T>
+    Status eval_program(const Program& program, const double* const* bindings, T* stack, T* result) {
+        return eval_code(program.code.data(), program.code.size(), program.constants.data(), NULL, bindings, stack,
+                         result);
+    }
+
+    // Evaluates program using a stack buffer when the program is shallow
+    // enough, so that evaluation does not touch the heap
+    template <class T> Status eval_program(const Program& program, const double* const* bindings, T* result) {
+        if (program.max_depth <= EVAL_INLINE_STACK) {
+            T stack[EVAL_INLINE_STACK];
+            return eval_program(program, bindings, stack, result);
+        }
+        vector<T> stack(program.max_depth);
+        return eval_program(program, bindings, stack.data(), result);
+    }
+
+    template Status eval_code<float>(const Instruction*, size_t, const double*, const Function* const*,
+                                     const double* const*, float*, float*);
+    template Status eval_code<double>(const Instruction*, size_t, const double*, const Function* const*,
+                                      const double* const*, double*, double*);
+    template Status eval_code<long double>(const Instruction*, size_t, const double*, const Function* const*,
+                                           const double* const*, long double*, long double*);
+    template Status eval_program<float>(const Program&, const double* const*, float*, float*);
+    template Status eval_program<double>(const Program&, const double* const*, double*, double*);
+    template Status eval_program<long double>(const Program&, const double* const*, long double*, long double*);
+    template Status eval_program<float>(const Program&, const double* const*, float*);
+    template Status eval_program<double>(const Program&, const double* const*, double*);
+    template Status eval_program<long double>(const Program&, const double* const*, long double*);
+
+    // Evaluates tokens in reverse polish notation directly, without building
+    // a program. All scratch space comes from the arena the tokens live in.
+    //
+    // If every operator has its arguments, variables are all looked up before
+    // anything is computed, so a missing one is reported as UNBOUND_VARIABLE
+    // ahead of any other error, the same as for a compiled expression.
+    // Otherwise the tokens are evaluated in order, checking the stack at every
+    // step, so that e.g. a division by zero that happens before the missing
+    // argument is needed is the error reported.
+    Status eval_rpn_tokens(const TokenList& rpn_tokens, const SymbolTable* symbols, double* result) {
+        EXPRPARSE_STATS(StageTimer timer(STAGE_EVALUATE));
+        ArenaAllocator<double> allocator(rpn_tokens.get_allocator());
+        ArenaVector<const double*> bindings(rpn_tokens.size(), NULL, allocator);
+        ArenaVector<double> argument_stack(allocator);
+        argument_stack.reserve(rpn_tokens.size());
+        *result = 0.0;
+
+        // Check the arguments of each operator, and find each variable
+        bool structure_ok = true;
+        bool all_bound = true;
+        size_t depth = 0;
+        for (size_t itok = 0; itok < rpn_tokens.size(); itok++) {
+            const Token& tok = rpn_tokens[itok];
+            if (tok.ttype == TokenType::OPERATOR || tok.ttype == TokenType::FUNCTION) {
+                size_t num_args = tok.ttype == TokenType::OPERATOR ? tok.op->num_arg : tok.num_args;
+                if (depth < num_args) structure_ok = false;
+                depth = depth < num_args ? 1 : depth - num_args + 1;
+            } else {
+                if (tok.ttype == TokenType::VARIABLE) {
+                    bindings[itok] = symbols ? symbols->find(tok.name, tok.name_length) : NULL;
+                    if (bindings[itok] == NULL) all_bound = false;
+                }
+                depth++;
+            }
+        }
+        if (structure_ok && depth == 1 && !all_bound) return Status::UNBOUND_VARIABLE;
+
+        for (size_t itok = 0; itok < rpn_tokens.size(); itok++) {
+            const Token& tok = rpn_tokens[itok];
+            if (tok.ttype == TokenType::NUMBER) {
+                argument_stack.push_back(tok.number);
+            } else if (tok.ttype == TokenType::VARIABLE) {
+                if (bindings[itok] == NULL) return Status::UNBOUND_VARIABLE;
+                argument_stack.push_back(*bindings[itok]);
             } else {
-                ret_val = Status::TOO_FEW_ARGUMENTS;
+                size_t num_args = tok.ttype == TokenType::OPERATOR ? tok.op->num_arg : tok.num_args;
+                if (argument_stack.size() < num_args) return Status::TOO_FEW_ARGUMENTS;
+                double eval_result;
+                size_t first_arg = argument_stack.size() - num_args;
+                Status ret_val = tok.ttype == TokenType::OPERATOR
+                                 ? tok.op->eval(argument_stack.data() + first_arg, num_args, &eval_result)
+                                 : tok.function->eval(argument_stack.data() + first_arg, num_args, &eval_result);
+                if (ret_val != Status::SUCCESS) return ret_val;
+                argument_stack.resize(first_arg);
+                argument_stack.push_back(eval_result);
             }
         }
 
-        delete[] args;
+        if (argument_stack.size() == 1) {
+            *result = argument_stack.back();
+            return Status::SUCCESS;
+        }
+        return argument_stack.empty() ? Status::TOO_FEW_ARGUMENTS : Status::TOO_MANY_ARGUMENTS;
+    }
+
+    namespace {
+        atomic<size_t> g_max_nesting_depth(DEFAULT_MAX_NESTING_DEPTH);
+
+        // Pratt parser that reads the expression once, pulling one token at a
+        // time from the lexer and writing reverse polish notation straight
+        // out, with no list of tokens in between.
+        //
+        // Each operand may be preceded by unary operators and followed by a
+        // binary one. Operators wait on a stack until one that binds less
+        // tightly comes along, with the same binding powers and associativity
+        // as convert_tokens_to_rpn, so the output is the same. Keeping them on
+        // a stack rather than the call stack means long chains such as
+        // 2^2^2^... or - - -x need no recursion. Only brackets, each a nested
+        // expression, recurse, and their depth is limited.
+        //
+        // Anything the grammar does not allow is only reported as a syntax
+        // error. The caller then runs the separate stages, which find the
+        // exact error, so malformed expressions get the same status as
+        // before.
+        class PrattParser {
+        public:
+            PrattParser(string_view expression, size_t max_depth, TokenList& rpn_tokens)
+                : iter_(expression.data()),
+                  end_(expression.data() + expression.size()),
+                  max_depth_(max_depth),
+                  rpn_(rpn_tokens),
+                  next_token_(NULL),
+                  last_token_(NULL),
+                  truncated_(false),
+                  operators_(ArenaAllocator<const Operator*>(rpn_tokens.get_allocator())),
+                  syntax_error_(false),
+                  num_tokens_(0),
+                  open_(0),
+                  max_open_(0) {
+                // Most expressions have fewer tokens than half their length
+                rpn_.clear();
+                rpn_.reserve(expression.size() / 2 + 2);
+                operators_.reserve(expression.size() / 4 + 2);
+            }
+
+            // Reads tokens made by append_tokens instead of text. If truncated,
+            // the tokens stop at one the lexer rejected, which is a syntax
+            // error like any other.
+            PrattParser(const TokenList& tokens, bool truncated, size_t max_depth, TokenList& rpn_tokens)
+                : iter_(NULL),
+                  end_(NULL),
+                  max_depth_(max_depth),
+                  rpn_(rpn_tokens),
+                  next_token_(tokens.data()),
+                  last_token_(tokens.data() + tokens.size()),
+                  truncated_(truncated),
+                  operators_(ArenaAllocator<const Operator*>(rpn_tokens.get_allocator())),
+                  syntax_error_(false),
+                  num_tokens_(0),
+                  open_(0),
+                  max_open_(0) {
+                rpn_.clear();
+                rpn_.reserve(tokens.size() + 2);
+                operators_.reserve(tokens.size() / 2 + 2);
+            }
+
+            // Returns: SUCCESS, NESTING_TOO_DEEP, or ERROR for a syntax error
+            Status parse() {
+                advance();
+                Status ret_val = parse_brackets(0);
+                if (ret_val == Status::SUCCESS && (have_token_ || syntax_error_)) ret_val = Status::ERROR;
+                return ret_val;
+            }
+
+            size_t num_tokens() const {
+                return num_tokens_;
+            }
+
+            // Most operators, brackets and calls waiting at once, counted
+            // the way convert_tokens_to_rpn's operator stack would hold them
+            size_t max_operator_depth() const {
+                return max_open_;
+            }
+
+        private:
+            // Moves on to the next token, if there is one and it is valid
+            void advance() {
+                have_token_ = false;
+                if (syntax_error_) return;
+                if (next_token_ != last_token_) {
+                    // append_tokens has already made leading signs unary,
+                    // which is decided here
+                    token_ = *next_token_++;
+                    if (token_.ttype == TokenType::OPERATOR) token_.op = binary_operator(token_.op);
+                    have_token_ = true;
+                    num_tokens_++;
+                    return;
+                }
+                if (next_token_ != NULL) {
+                    syntax_error_ = truncated_;
+                    return;
+                }
+                if (!skip_whitespace(iter_, end_)) return;
+                iter_ = scan_token(iter_, end_, &token_);
+                if (iter_ == NULL) {
+                    syntax_error_ = true;
+                    return;
+                }
+                have_token_ = true;
+                num_tokens_++;
+            }
+
+            bool at(TokenType ttype) const {
+                return have_token_ && token_.ttype == ttype;
+            }
+
+            void push_operator(const Operator* op) {
+                operators_.push_back(op);
+                if (operators_.size() + open_ > max_open_) max_open_ = operators_.size() + open_;
+            }
+
+            // Moves the operators above base to the output
+            void pop_operators(size_t base) {
+                while (operators_.size() > base) {
+                    Token tok;
+                    tok.ttype = TokenType::OPERATOR;
+                    tok.op = operators_.back();
+                    rpn_.push_back(tok);
+                    operators_.pop_back();
+                }
+            }
+
+            // Parses operands joined by operators, up to a closing bracket,
+            // a comma or the end, at the given depth of brackets
+            Status parse_brackets(size_t depth) {
+                size_t base = operators_.size();
+                for (;;) {
+                    // Unary operators bind tighter than anything already
+                    // waiting, so they always wait for their operand
+                    while (at(TokenType::OPERATOR) && unary_operator(token_.op)) {
+                        push_operator(unary_operator(token_.op));
+                        advance();
+                    }
+
+                    Status ret_val = parse_operand(depth);
+                    if (ret_val != Status::SUCCESS) return ret_val;
+
+                    if (!at(TokenType::OPERATOR)) break;
+                    const Operator* op = token_.op;
+                    while (operators_.size() > base) {
+                        const Operator* top = operators_.back();
+                        if (op->precedance > top->precedance ||
+                            (op->precedance == top->precedance && top->op_assoc == OperatorAssoc::RIGHT))
+                            break;
+                        pop_operators(operators_.size() - 1);
+                    }
+                    push_operator(op);
+                    advance();
+                }
+                pop_operators(base);
+                return Status::SUCCESS;
+            }
+
+            // Parses a number, a variable, a call or an expression in brackets
+            Status parse_operand(size_t depth) {
+                if (at(TokenType::NUMBER)) {
+                    rpn_.push_back(token_);
+                    advance();
+                    return Status::SUCCESS;
+                }
+                if (at(TokenType::LEFT_BRACKET)) {
+                    if (depth >= max_depth_) return Status::NESTING_TOO_DEEP;
+                    open_++;
+                    advance();
+                    Status ret_val = parse_brackets(depth + 1);
+                    if (ret_val != Status::SUCCESS) return ret_val;
+                    if (!at(TokenType::RIGHT_BRACKET)) return Status::ERROR;
+                    open_--;
+                    advance();
+                    return Status::SUCCESS;
+                }
+                if (!at(TokenType::VARIABLE)) return Status::ERROR;
+
+                Token name = token_;
+                advance();
+                if (!at(TokenType::LEFT_BRACKET)) {
+                    rpn_.push_back(name);
+                    return Status::SUCCESS;
+                }
+                return parse_call(name, depth);
+            }
+
+            // Parses the arguments of a call, the current token being the
+            // bracket after the function's name
+            Status parse_call(const Token& name, size_t depth) {
+                Token call;
+                call.ttype = TokenType::FUNCTION;
+                call.function = find_function(name.name, name.name_length);
+                call.num_args = 0;
+                if (call.function == NULL) return Status::ERROR;
+                if (depth >= max_depth_) return Status::NESTING_TOO_DEEP;
+
+                // The function and its bracket
+                open_ += 2;
+                advance();
+                if (!at(TokenType::RIGHT_BRACKET)) {
+                    for (;;) {
+                        Status ret_val = parse_brackets(depth + 1);
+                        if (ret_val != Status::SUCCESS) return ret_val;
+                        call.num_args++;
+                        if (!at(TokenType::COMMA)) break;
+                        advance();
+                    }
+                    if (!at(TokenType::RIGHT_BRACKET)) return Status::ERROR;
+                }
+                if (call.num_args < call.function->min_args || call.num_args > call.function->max_args)
+                    return Status::ERROR;
+                open_ -= 2;
+                advance();
+                rpn_.push_back(call);
+                return Status::SUCCESS;
+            }
+
+            const char* iter_;
+            const char* end_;
+            size_t max_depth_;
+            TokenList& rpn_;
+            const Token* next_token_; // NULL when reading text
+            const Token* last_token_;
+            bool truncated_;
+            ArenaVector<const Operator*> operators_;
+            Token token_;
+            bool have_token_;
+            bool syntax_error_;
+            size_t num_tokens_;
+            size_t open_; // Brackets and calls open, as convert_tokens_to_rpn counts them
+            size_t max_open_;
+        };
+    } // namespace
+
+    // Parses expression into reverse polish notation in a single pass,
+    // allowing brackets to nest max_depth deep
+    //
+    // Returns: ERROR for any syntax error, whose exact status is found by
+    // running the tokenizer and convert_tokens_to_rpn
+    Status parse_single_pass(string_view expression, size_t max_depth, TokenList& rpn_tokens) {
+        EXPRPARSE_STATS(StageTimer timer(STAGE_CONVERT_TO_RPN));
+        PrattParser parser(expression, max_depth, rpn_tokens);
+        Status ret_val = parser.parse();
+        EXPRPARSE_STATS(if (ret_val == Status::ERROR) timer.cancel());
+        EXPRPARSE_STATS(if (ret_val != Status::ERROR) record_tokens(parser.num_tokens()));
+        EXPRPARSE_STATS(if (ret_val != Status::ERROR) record_operator_depth(parser.max_operator_depth()));
         return ret_val;
     }
 
-    Status parse_expression(const string& expression, double* result) {
-        list<Token*> tokens;
-        Status ret_val;
+    Status parse_tokens_single_pass(const TokenList& tokens,
+                                    bool truncated,
+                                    size_t max_depth,
+                                    TokenList& rpn_tokens) {
+        PrattParser parser(tokens, truncated, max_depth, rpn_tokens);
+        return parser.parse();
+    }
+
+    void set_max_nesting_depth(size_t depth) {
+        g_max_nesting_depth = depth;
+    }
+
+    size_t get_max_nesting_depth() {
+        return g_max_nesting_depth.load(memory_order_relaxed);
+    }
+
+    // Size of the buffer on the stack that parsing starts out with. Most
+    // expressions fit and never touch the heap.
+    const size_t PARSE_INLINE_ARENA = 4096;
+
+    // Parses expression into reverse polish notation. Expressions are read
+    // in a single pass by PrattParser, and only those with a syntax error
+    // are run through the tokenizer and convert_tokens_to_rpn, which report
+    // the exact error.
+    Status parse_to_rpn(string_view expression, ParseArena* arena, TokenList& rpn_tokens) {
+        Status ret_val = parse_single_pass(expression, get_max_nesting_depth(), rpn_tokens);
+        if (ret_val != Status::ERROR) return ret_val;
+
+        TokenList tokens((ArenaAllocator<Token>(arena)));
         ret_val = tokenize_expr(expression, tokens);
 
         // Now that the tokens exist, parse into reverse polish notation
-        queue<Token*> output_stack;
         if (ret_val == Status::SUCCESS) {
-            ret_val = convert_tokens_to_rpn(tokens, output_stack);
+            ret_val = convert_tokens_to_rpn(tokens, rpn_tokens);
+        }
+        return ret_val;
+    }
+
+    // Runs all parsing stages on expression and builds program from the result
+    Status compile_program(string_view expression, Program* program) {
+        alignas(double) char buffer[PARSE_INLINE_ARENA];
+        ParseArena arena(buffer, sizeof(buffer));
+        TokenList rpn_tokens((ArenaAllocator<Token>(&arena)));
+        Status ret_val = parse_to_rpn(expression, &arena, rpn_tokens);
+
+        // Now flatten the reverse polish tokens
+        if (ret_val == Status::SUCCESS) {
+            ret_val = build_program(rpn_tokens, program);
+        }
+
+        // The program will be evaluated many times, so it is worth simplifying
+        if (ret_val == Status::SUCCESS) {
+            optimize_program(program);
+        }
+        return ret_val;
+    }
+
+    // Looks up each of the program's variables in symbols. Variables that
+    // are not found get a NULL binding.
+    //
+    // Returns: UNBOUND_VARIABLE if any variable was not found
+    Status resolve_bindings(const Program& program, const SymbolTable* symbols, const double** bindings) {
+        Status ret_val = Status::SUCCESS;
+        for (size_t slot = 0; slot < program.variables.size(); slot++) {
+            bindings[slot] = symbols ? symbols->find(program.variables[slot]) : NULL;
+            if (bindings[slot] == NULL) ret_val = Status::UNBOUND_VARIABLE;
+        }
+        return ret_val;
+    }
+
+    // Evaluates a successfully compiled program taken from the cache
+    Status eval_cached_program(const Program& program, const SymbolTable* symbols, double* result) {
+        EXPRPARSE_STATS(StageTimer timer(STAGE_EVALUATE));
+        const size_t INLINE_BINDINGS = 16;
+        const double* inline_bindings[INLINE_BINDINGS];
+        vector<const double*> heap_bindings;
+        const double** bindings = inline_bindings;
+        if (program.variables.size() > INLINE_BINDINGS) {
+            heap_bindings.resize(program.variables.size());
+            bindings = heap_bindings.data();
+        }
+
+        *result = 0.0;
+        Status ret_val = resolve_bindings(program, symbols, bindings);
+        if (ret_val == Status::SUCCESS) ret_val = eval_program(program, bindings, result);
+        return ret_val;
+    }
+
+    Status parse_stages(string_view expression, const SymbolTable* symbols, ParseArena* arena, double* result) {
+        if (expression_cache_enabled()) {
+            shared_ptr<const Program> program = find_cached_program(expression);
+            if (!program) {
+                shared_ptr<Program> compiled = make_shared<Program>();
+                if (compile_program(expression, compiled.get()) == Status::SUCCESS) {
+                    program = compiled;
+                    cache_program(expression, program);
+                }
+            }
+            // Expressions that do not compile are evaluated from their tokens
+            // below, which reports the error in the right order
+            if (program) return eval_cached_program(*program, symbols, result);
+        }
+
+        arena->reset();
+        TokenList rpn_tokens((ArenaAllocator<Token>(arena)));
+        Status ret_val = parse_to_rpn(expression, arena, rpn_tokens);
+        if (ret_val == Status::SUCCESS) ret_val = eval_rpn_tokens(rpn_tokens, symbols, result);
+        return ret_val;
+    }
+
+    Status parse_with_symbols(string_view expression, const SymbolTable* symbols, ParseArena* arena, double* result) {
+        Status ret_val = parse_stages(expression, symbols, arena, result);
+        EXPRPARSE_STATS(record_status(ret_val));
+        return ret_val;
+    }
+
+    Status parse_expression(string_view expression, double* result) {
+        alignas(double) char buffer[PARSE_INLINE_ARENA];
+        ParseArena arena(buffer, sizeof(buffer));
+        return parse_with_symbols(expression, NULL, &arena, result);
+    }
+
+    Status parse_expression(const char* expression, size_t length, double* result) {
+        return parse_expression(string_view(expression, length), result);
+    }
+
+    Status parse_expression(string_view expression, ParseArena* arena, double* result) {
+        return parse_with_symbols(expression, NULL, arena, result);
+    }
+
+    Status parse_expression(const char* expression, size_t length, ParseArena* arena, double* result) {
+        return parse_with_symbols(string_view(expression, length), NULL, arena, result);
+    }
+
+    Status parse_expression(string_view expression, const SymbolTable& symbols, double* result) {
+        alignas(double) char buffer[PARSE_INLINE_ARENA];
+        ParseArena arena(buffer, sizeof(buffer));
+        return parse_with_symbols(expression, &symbols, &arena, result);
+    }
+
+    Status parse_expression(string_view expression, const SymbolTable& symbols, ParseArena* arena, double* result) {
+        return parse_with_symbols(expression, &symbols, arena, result);
+    }
+
+    Status parse_expression(const char* expression, size_t length, const SymbolTable& symbols, double* result) {
+        return parse_expression(string_view(expression, length), symbols, result);
+    }
+
+    Status parse_expression(const char* expression,
+                            size_t length,
+                            const SymbolTable& symbols,
+                            ParseArena* arena,
+                            double* result) {
+        return parse_with_symbols(string_view(expression, length), &symbols, arena, result);
+    }
+
+    ParseArena::ParseArena(size_t block_size) : block_size_(block_size), current_(0), offset_(0) {
+        buffer_.data = NULL;
+        buffer_.size = 0;
+    }
+
+    ParseArena::ParseArena(void* buffer, size_t size, size_t block_size)
+        : block_size_(block_size), current_(0), offset_(0) {
+        buffer_.data = static_cast<char*>(buffer);
+        buffer_.size = size;
+    }
+
+    ParseArena::~ParseArena() {
+        for (Block& block : blocks_) ::operator delete(block.data);
+    }
+
+    void* ParseArena::allocate(size_t size, size_t alignment) {
+        for (;;) {
+            const Block& block = current_ == 0 ? buffer_ : blocks_[current_ - 1];
+            uintptr_t start = reinterpret_cast<uintptr_t>(block.data);
+            uintptr_t aligned = (start + offset_ + alignment - 1) & ~(uintptr_t)(alignment - 1);
+            if (block.data != NULL && aligned + size <= start + block.size) {
+                offset_ = aligned + size - start;
+                return reinterpret_cast<void*>(aligned);
+            }
+
+            // Move on to the next block kept from before the last reset, or
+            // allocate a new one
+            if (current_ == blocks_.size()) {
+                size_t block_size = blocks_.empty() ? block_size_ : 2 * blocks_.back().size;
+                if (block_size < size + alignment) block_size = size + alignment;
+                Block new_block = { static_cast<char*>(::operator new(block_size)), block_size };
+                blocks_.push_back(new_block);
+            }
+            current_++;
+            offset_ = 0;
         }
+    }
+
+    void ParseArena::reset() {
+        current_ = 0;
+        offset_ = 0;
+    }
+
+    size_t ParseArena::capacity() const {
+        size_t total = buffer_.size;
+        for (const Block& block : blocks_) total += block.size;
+        return total;
+    }
+
+    void SymbolTable::bind(const string& name, const double* value) {
+        symbols_[name] = value;
+    }
+
+    void SymbolTable::unbind(const string& name) {
+        symbols_.erase(name);
+    }
 
-        // Now evaluate the reverse polish tokens
+    const double* SymbolTable::find(const string& name) const {
+        return find(name.data(), name.size());
+    }
+
+    const double* SymbolTable::find(const char* name, size_t length) const {
+        auto iter = symbols_.find(string_view(name, length));
+        return iter == symbols_.end() ? NULL : iter->second;
+    }
+
+    Status compile_expression(string_view expression, CompiledExpression* compiled) {
+        shared_ptr<Program> program = make_shared<Program>();
+        Status ret_val = compile_program(expression, program.get());
+        EXPRPARSE_STATS(record_status(ret_val));
         if (ret_val == Status::SUCCESS) {
-            ret_val = eval_rpn_tokens(output_stack, result);
+            compiled->program_ = program;
+        } else {
+            compiled->program_.reset();
         }
+        compiled->native_.reset();
+        compiled->bindings_.assign(compiled->num_variables(), NULL);
+        compiled->bound_ = compiled->bindings_.empty();
+        return ret_val;
+    }
+
+    Status compile_expression(string_view expression, const SymbolTable& symbols, CompiledExpression* compiled) {
+        Status ret_val = compile_expression(expression, compiled);
+        if (ret_val == Status::SUCCESS) ret_val = compiled->bind(symbols);
+        return ret_val;
+    }
 
-        // Done with tokens, clean them up
-        destroy_tokens(tokens);
+    CompiledExpression::CompiledExpression() : bound_(false) {
+    }
+
+    Status CompiledExpression::bind(const SymbolTable& symbols) {
+        if (!program_) return Status::EMPTY_EXPRESSION;
+        Status ret_val = resolve_bindings(*program_, &symbols, bindings_.data());
+        bound_ = ret_val == Status::SUCCESS;
         return ret_val;
     }
 
+    Status CompiledExpression::evaluate(double* result) const {
+        if (!program_) return Status::EMPTY_EXPRESSION;
+        if (!bound_) return Status::UNBOUND_VARIABLE;
+        if (native_) return eval_native(*native_, bindings_.data(), result);
+        return eval_program(*program_, bindings_.data(), result);
+    }
+
+    // Native code computes in double, so it is not used here
+    Status CompiledExpression::evaluate(float* result) const {
+        if (!program_) return Status::EMPTY_EXPRESSION;
+        if (!bound_) return Status::UNBOUND_VARIABLE;
+        return eval_program(*program_, bindings_.data(), result);
+    }
+
+    Status CompiledExpression::evaluate(long double* result) const {
+        if (!program_) return Status::EMPTY_EXPRESSION;
+        if (!bound_) return Status::UNBOUND_VARIABLE;
+        return eval_program(*program_, bindings_.data(), result);
+    }
+
+    Status CompiledExpression::evaluate(double* result, double* stack, size_t stack_size) const {
+        if (!program_) return Status::EMPTY_EXPRESSION;
+        if (!bound_) return Status::UNBOUND_VARIABLE;
+        if (stack_size < program_->max_depth) return Status::ERROR;
+        if (native_) return eval_native(*native_, bindings_.data(), result);
+        return eval_program(*program_, bindings_.data(), stack, result);
+    }
+
+    size_t CompiledExpression::stack_depth() const {
+        return program_ ? program_->max_depth : 0;
+    }
+
+    Status CompiledExpression::compile_native() {
+        if (!program_) return Status::EMPTY_EXPRESSION;
+        if (native_) return Status::SUCCESS;
+        return exprparse::compile_native(*program_, &native_);
+    }
+
+    bool CompiledExpression::is_native() const {
+        return native_ != NULL;
+    }
+
+    bool CompiledExpression::empty() const {
+        return !program_;
+    }
+
+    size_t CompiledExpression::size() const {
+        return program_ ? program_->code.size() : 0;
+    }
+
+    size_t CompiledExpression::unoptimized_size() const {
+        return program_ ? program_->unoptimized_size : 0;
+    }
+
+    size_t CompiledExpression::num_variables() const {
+        return program_ ? program_->variables.size() : 0;
+    }
+
+    const string& CompiledExpression::variable_name(size_t slot) const {
+        return program_->variables.at(slot);
+    }
+
     std::string get_status_string(const Status& status) {
         switch (status) {
         case Status::SUCCESS:
@@ -333,6 +1380,10 @@ namespace exprparse {
             return string("Not enough arguments found for operator");
         case Status::TOO_MANY_ARGUMENTS:
             return string("Too many arguments found for operations");
+        case Status::UNBOUND_VARIABLE:
+            return string("Variable not bound to a value");
+        case Status::NESTING_TOO_DEEP:
+            return string("Brackets nested too deeply");
         default:
             return string("Unknown Status");
         }
@@ -345,69 +1396,66 @@ namespace exprparse {
         return o.str();
     }
 
-    // Method to free all tokens in list
-    void destroy_tokens(list<Token*>& tokens) {
-        Token* tok;
-        while (tokens.size() > 0) {
-            tok = tokens.front();
-            tokens.pop_front();
-
-            if (tok->ttype == TokenType::NUMBER && tok->data != NULL) {
-                delete static_cast<NumberData*>(tok->data);
-            } else if (tok->ttype == TokenType::OPERATOR && tok->data != NULL) {
-                delete static_cast<OperatorData*>(tok->data);
-            }
-
-            delete tok;
-        }
-    }
-
     //********************* Define all operations *****************************//
 
     // Addition operator
-    Status add(const double args[], const size_t& num_args, double* result) {
+    template <class T> Status add(const T args[], const size_t& num_args, T* result) {
         if (num_args != 2) return Status::ERROR;
         *result = args[0] + args[1];
         return Status::SUCCESS;
     }
 
     // Subtraction operator
-    Status subtract(const double args[], const size_t& num_args, double* result) {
+    template <class T> Status subtract(const T args[], const size_t& num_args, T* result) {
         if (num_args != 2) return Status::ERROR;
         *result = args[0] - args[1];
         return Status::SUCCESS;
     }
 
     // Multiplication Operation
-    Status multiply(const double args[], const size_t& num_args, double* result) {
+    template <class T> Status multiply(const T args[], const size_t& num_args, T* result) {
         if (num_args != 2) return Status::ERROR;
         *result = args[0] * args[1];
         return Status::SUCCESS;
     }
 
     // Define division operator
-    Status divide(const double args[], const size_t& num_args, double* result) {
+    template <class T> Status divide(const T args[], const size_t& num_args, T* result) {
         if (num_args != 2) return Status::ERROR;
         if (fabs(args[1]) < ALMOST_ZERO) return Status::DIVIDE_BY_ZERO;
         *result = args[0] / args[1];
         return Status();
     }
 
+    // Powers of floats are computed in double and rounded, as the float
+    // batch kernels do
+    inline double power_of(double base, double exponent) {
+        return pow(base, exponent);
+    }
+
+    inline float power_of(float base, float exponent) {
+        return (float)pow((double)base, (double)exponent);
+    }
+
+    inline long double power_of(long double base, long double exponent) {
+        return powl(base, exponent);
+    }
+
     // Method to raise number to a power
-    Status power(const double args[], const size_t& num_args, double* result) {
+    template <class T> Status power(const T args[], const size_t& num_args, T* result) {
         if (num_args != 2) return Status::ERROR;
-        *result = pow(args[0], args[1]);
+        *result = power_of(args[0], args[1]);
         return Status::SUCCESS;
     }
 
     // Method to handle unary minus sign
-    Status unary_minus(const double args[], const size_t& num_args, double* result) {
+    template <class T> Status unary_minus(const T args[], const size_t& num_args, T* result) {
         if (num_args != 1) return Status::ERROR;
-        *result = -1.0 * args[0];
+        *result = -args[0];
         return Status::SUCCESS;
     }
 
-    Status unary_plus(const double args[], const size_t& num_args, double* result) {
+    template <class T> Status unary_plus(const T args[], const size_t& num_args, T* result) {
         if (num_args != 1) return Status::ERROR;
         *result = args[0];
         return Status::SUCCESS;
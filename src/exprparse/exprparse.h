@@ -27,7 +27,14 @@
 #ifndef EXPRPARSE_H
 #define EXPRPARSE_H
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace exprparse {
     typedef enum {
@@ -38,17 +45,828 @@ namespace exprparse {
         UNKNOWN_TOKEN,
         UNMATCHED_BRACKETS,
         TOO_FEW_ARGUMENTS,
-        TOO_MANY_ARGUMENTS
+        TOO_MANY_ARGUMENTS,
+        UNBOUND_VARIABLE,
+        NESTING_TOO_DEEP
     } Status;
 
     // Function to parse a simple match expression and compute
-    // its value.
+    // its value. Expressions seen recently are taken from a cache instead
+    // of being parsed again, see set_expression_cache_capacity.
+    //
+    // The expression is only read in place, so it can point straight into
+    // an input buffer. std::string and string literals convert to it.
     //
     // Arguments:
     //  expression: string that contains a mathematical expression
     //  result: double used to store the result of the computation
     //
-    Status parse_expression(const std::string& expression, double* result);
+    Status parse_expression(std::string_view expression, double* result);
+
+    // Same as above, for the length characters at expression, which need not
+    // be null terminated
+    Status parse_expression(const char* expression, size_t length, double* result);
+
+    // Bump allocator for the scratch memory used while parsing. Memory is
+    // handed out in order from a list of blocks and only given back, all at
+    // once, by reset. The blocks are kept, so parsing similar expressions
+    // again with the same arena allocates nothing.
+    //
+    // An arena must not be used by more than one thread at a time.
+    class ParseArena {
+    public:
+        // block_size is the size of the first block, later blocks double in size
+        explicit ParseArena(size_t block_size = 4096);
+
+        // Hands out buffer first, before allocating any blocks. buffer must
+        // outlive the arena.
+        ParseArena(void* buffer, size_t size, size_t block_size = 4096);
+
+        ~ParseArena();
+
+        ParseArena(const ParseArena&) = delete;
+        ParseArena& operator=(const ParseArena&) = delete;
+
+        // Returns size bytes aligned to alignment, which must be a power of two
+        void* allocate(size_t size, size_t alignment);
+
+        // Makes all memory handed out so far available again
+        void reset();
+
+        // Returns the total size of the blocks held, including buffer
+        size_t capacity() const;
+
+    private:
+        typedef struct Block {
+            char* data;
+            size_t size;
+        } Block;
+
+        Block buffer_;              // Caller's buffer, handed out first
+        std::vector<Block> blocks_; // Blocks allocated by the arena
+        size_t block_size_;
+        size_t current_; // Block being handed out, 0 for buffer_ and i for blocks_[i - 1]
+        size_t offset_;  // Bytes of the current block handed out
+    };
+
+    // Same as above, but all scratch memory comes from arena, which is reset
+    // first. Once arena has grown large enough, parsing does not touch the
+    // heap.
+    Status parse_expression(std::string_view expression, ParseArena* arena, double* result);
+    Status parse_expression(const char* expression, size_t length, ParseArena* arena, double* result);
+
+    // Maps variable names to the doubles that hold their values. Only the
+    // pointers are stored, so the values can change between evaluations
+    // without rebuilding the table or recompiling expressions.
+    class SymbolTable {
+    public:
+        // Binds name to the double at value, replacing any earlier binding
+        void bind(const std::string& name, const double* value);
+
+        // Removes the binding for name, if there is one
+        void unbind(const std::string& name);
+
+        // Returns the pointer bound to name, or NULL if it is not bound
+        const double* find(const std::string& name) const;
+
+        // Same as above for the length characters at name, which need not
+        // be null terminated. Does not allocate.
+        const double* find(const char* name, size_t length) const;
+
+    private:
+        std::map<std::string, const double*, std::less<>> symbols_;
+    };
+
+    // Same as above, but variables in the expression take their values from
+    // symbols. Returns UNBOUND_VARIABLE if a variable is not in symbols.
+    Status parse_expression(std::string_view expression, const SymbolTable& symbols, double* result);
+    Status parse_expression(std::string_view expression, const SymbolTable& symbols, ParseArena* arena, double* result);
+    Status parse_expression(const char* expression, size_t length, const SymbolTable& symbols, double* result);
+    Status parse_expression(const char* expression,
+                            size_t length,
+                            const SymbolTable& symbols,
+                            ParseArena* arena,
+                            double* result);
+
+    // Default of set_max_nesting_depth
+    const size_t DEFAULT_MAX_NESTING_DEPTH = 1024;
+
+    // Sets how deeply brackets, including those of function calls, may be
+    // nested in expressions given to parse_expression, compile_expression and
+    // IncrementalParser.
+    // Expressions nested deeper fail with NESTING_TOO_DEEP as soon as the
+    // limit is passed, which bounds the stack the parser uses on hostile
+    // input. Expressions already in the expression cache are not parsed
+    // again, so are not affected.
+    void set_max_nesting_depth(size_t depth);
+
+    // Returns the current nesting limit
+    size_t get_max_nesting_depth();
+
+    // Signature of a function that can be called from expressions, as in
+    // max(x, 2*y, 3). args holds the num_args values the function is called
+    // with. Errors returned are reported by whatever evaluated the call.
+    typedef Status (*ExpressionFunction)(const double args[], size_t num_args, double* result);
+
+    // Computes a function for count rows at once, for evaluate_batch.
+    // args[i] points at the count values of argument i. result may be the
+    // same array as args[0]. Should compute every row and return the first
+    // error.
+    typedef Status (*ExpressionBatchFunction)(const double* const args[], size_t num_args, size_t count, double* result);
+
+    // max_args of a function that takes any number of arguments
+    const size_t ANY_NUMBER_OF_ARGS = SIZE_MAX;
+
+    // Makes a function callable from expressions by name. Calls with fewer
+    // than min_args or more than max_args arguments fail to parse with
+    // TOO_FEW_ARGUMENTS or TOO_MANY_ARGUMENTS. evaluate_batch uses
+    // batch_function if given, otherwise it calls function row by row.
+    // Functions stay registered for the life of the program, and may be
+    // registered while other threads are parsing.
+    //
+    // These are built in:
+    //
+    //  sin cos tan asin acos atan sinh cosh tanh exp log log2 log10 sqrt
+    //  cbrt abs floor ceil round      one argument, as in the C library
+    //  atan2 hypot pow                two arguments, as in the C library
+    //  min max                        smallest or largest of one or more
+    //                                 arguments, NaN if any argument is
+    //  sum                            sum of one or more arguments, added
+    //                                 left to right
+    //
+    // A name followed by a bracket is always a function call, and is an
+    // UNKNOWN_TOKEN if no function has that name. Elsewhere a name is a
+    // variable, so variables may share the names of functions.
+    //
+    // Returns: ERROR if name is not a valid variable name or is already
+    // taken, function is NULL, min_args is greater than max_args, or 1024
+    // functions, the built in ones included, are already registered
+    Status register_function(const std::string& name,
+                             size_t min_args,
+                             size_t max_args,
+                             ExpressionFunction function,
+                             ExpressionBatchFunction batch_function = NULL);
+
+    // Parses an expression that arrives in pieces, for example from several
+    // reads of a socket, without joining the pieces first. Each fragment is
+    // tokenized as it is fed in and only a token cut off by the end of a
+    // fragment, such as the "1.2" of "1.2" "5e3", is held back for the next.
+    // Memory comes from an arena kept by the parser, so parsing expressions
+    // of similar size again does not allocate.
+    //
+    // A parser must not be used by more than one thread at a time.
+    class IncrementalParser {
+    public:
+        IncrementalParser();
+        ~IncrementalParser();
+
+        IncrementalParser(const IncrementalParser&) = delete;
+        IncrementalParser& operator=(const IncrementalParser&) = delete;
+
+        // Tokenizes the next fragment of the expression. Returns
+        // UNKNOWN_TOKEN as soon as the input can not be an expression, and
+        // keeps returning it until reset. finish may still report brackets
+        // before the unknown token as NESTING_TOO_DEEP, as parse_expression
+        // does. The fragment is not needed once this returns.
+        Status feed(std::string_view fragment);
+        Status feed(const char* fragment, size_t length);
+
+        // Parses and evaluates the fragments fed since the last reset, with
+        // the same result and status parse_expression gives for the joined
+        // text, then resets for the next expression.
+        Status finish(double* result);
+        Status finish(const SymbolTable& symbols, double* result);
+
+        // Drops everything fed since the last reset
+        void reset();
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Internal representation of a compiled expression
+    struct Program;
+    struct NativeCode;
+
+    // A math expression that has been parsed once so that it can be
+    // evaluated many times. Copies share the same compiled program.
+    class CompiledExpression {
+    public:
+        CompiledExpression();
+
+        // Computes the value of the compiled expression, reading the current
+        // value of each bound variable. This does no parsing and, for
+        // expressions nested less than 64 operands deep, no heap allocation.
+        // Only errors that depend on the values involved, such as
+        // DIVIDE_BY_ZERO, are reported here.
+        //
+        // Arguments:
+        //  result: double used to store the result of the computation
+        //
+        Status evaluate(double* result) const;
+
+        // Same as above, but computing the operators in float or long double.
+        // Numbers in the expression and variables are read as doubles and
+        // converted, and functions and powers of floats are computed in
+        // double and rounded. Native code from compile_native is not used.
+        //
+        // Float trades accuracy for the throughput of evaluate_batch, whose
+        // float rows match evaluate(float*). Its relative error is around
+        // 1e-7 per operation, against 1e-16 for double, and grows quickly
+        // when nearly equal values are subtracted. Long double serves as a
+        // more accurate reference.
+        Status evaluate(float* result) const;
+        Status evaluate(long double* result) const;
+
+        // Same as above, but with the stack_size doubles at stack as the
+        // evaluation stack, so that expressions of any depth are evaluated
+        // without touching the heap. A buffer of stack_depth() doubles is
+        // always enough.
+        //
+        // Returns: ERROR, without evaluating, if stack_size is less than
+        // stack_depth()
+        Status evaluate(double* result, double* stack, size_t stack_size) const;
+
+        // Returns the largest number of values on the evaluation stack at
+        // once, worked out exactly when the expression was compiled. 0 if
+        // nothing has been compiled.
+        size_t stack_depth() const;
+
+        // Points each variable in the expression at its value in symbols.
+        // Returns UNBOUND_VARIABLE if any variable is missing from symbols,
+        // in which case evaluate will fail until bind succeeds.
+        Status bind(const SymbolTable& symbols);
+
+        // Generates x86-64 machine code for the expression, which evaluate
+        // then runs instead of interpreting the program. Results and errors
+        // are bit for bit the same, other than the sign of NaN results.
+        // Returns ERROR, and keeps using the interpreter, if the JIT is not
+        // supported or the expression is nested more than 14 operands deep.
+        Status compile_native();
+
+        // Returns true if evaluate runs machine code made by compile_native
+        bool is_native() const;
+
+        // Returns true if nothing has been successfully compiled
+        bool empty() const;
+
+        // Returns the number of instructions in the compiled program
+        size_t size() const;
+
+        // Returns the number of instructions the program had before constant
+        // subexpressions were folded and operations that do nothing removed
+        size_t unoptimized_size() const;
+
+        // Returns the number of distinct variables in the expression
+        size_t num_variables() const;
+
+        // Returns the name of a variable. Slots are numbered from 0 in order
+        // of first appearance in the expression.
+        const std::string& variable_name(size_t slot) const;
+
+    private:
+        friend Status compile_expression(std::string_view expression, CompiledExpression* compiled);
+        friend struct ProgramAccess;
+
+        std::shared_ptr<const Program> program_;
+        std::shared_ptr<const NativeCode> native_;
+        std::vector<const double*> bindings_;
+        bool bound_;
+    };
+
+    // Function to parse a simple math expression into a form that can be
+    // evaluated repeatedly. Errors in the expression itself, such as
+    // UNMATCHED_BRACKETS or TOO_FEW_ARGUMENTS, are reported here.
+    //
+    // Arguments:
+    //  expression: string that contains a mathematical expression
+    //  compiled: object used to store the compiled expression, left empty on error
+    //
+    Status compile_expression(std::string_view expression, CompiledExpression* compiled);
+
+    // Same as above, and then binds the expression's variables to symbols.
+    // If a variable is missing from symbols, UNBOUND_VARIABLE is returned and
+    // compiled holds the unbound expression.
+    Status compile_expression(std::string_view expression, const SymbolTable& symbols, CompiledExpression* compiled);
+
+    // Writes compiled expressions in the bytecode format read by
+    // BytecodeCatalog, so that they can be loaded later without parsing.
+    // Empty expressions are kept, and stay empty when loaded. Functions are
+    // written by name and looked up again when the catalog is loaded.
+    //
+    // Arguments:
+    //  expressions: expressions to write, indexed the same in the catalog
+    //  bytecode: string the catalog is written to, replacing its contents
+    //
+    // Returns: ERROR if the expressions are too large for the format, which
+    // holds up to 2^32 - 1 of each instruction, constant and variable
+    Status write_bytecode(const std::vector<CompiledExpression>& expressions, std::string* bytecode);
+
+    // A set of compiled expressions read from the bytecode written by
+    // write_bytecode. The bytecode is used in place, so loading does no
+    // allocation per expression, and a catalog loaded from a file is mapped
+    // into memory rather than read. The whole catalog is checked when it is
+    // loaded, so that corrupt or hostile bytecode can not make evaluation
+    // read outside it.
+    //
+    // The format has a version number, and catalogs are only read by builds
+    // with the same version and byte order as the one that wrote them.
+    class BytecodeCatalog {
+    public:
+        BytecodeCatalog();
+        ~BytecodeCatalog();
+
+        BytecodeCatalog(const BytecodeCatalog&) = delete;
+        BytecodeCatalog& operator=(const BytecodeCatalog&) = delete;
+
+        // Checks and loads size bytes of bytecode, which must stay unchanged
+        // and outlive the catalog. Bytecode that is not 8 byte aligned is
+        // copied first. Replaces anything loaded before, even on error.
+        //
+        // Returns: ERROR if the bytecode is not valid, UNKNOWN_TOKEN if it
+        // calls a function that is not registered
+        Status load(const void* data, size_t size);
+
+        // Same as above for the contents of a file, which is mapped into
+        // memory where the platform allows it
+        Status load_file(const std::string& path);
+
+        // Returns the number of expressions, including empty ones
+        size_t size() const;
+
+        // Returns the number of distinct variables of an expression
+        size_t num_variables(size_t index) const;
+
+        // Returns the name of a variable of an expression, by slot. Slots are
+        // numbered as in CompiledExpression. The name points into the
+        // bytecode.
+        std::string_view variable_name(size_t index, size_t slot) const;
+
+        // Evaluates an expression straight from the bytecode, with the same
+        // result and status as CompiledExpression::evaluate
+        //
+        // Arguments:
+        //  index: expression to evaluate
+        //  values: pointer to the value of each variable, indexed by slot
+        //  result: double used to store the result of the computation
+        //
+        // Returns: ERROR if index is out of range, EMPTY_EXPRESSION if the
+        // expression is empty, UNBOUND_VARIABLE if a value is NULL
+        Status evaluate(size_t index, const double* const values[], double* result) const;
+
+        // Copies an expression into compiled, for the uses that need a
+        // CompiledExpression such as evaluate_batch or compile_native. This
+        // allocates, unlike the rest of the catalog. compiled is left
+        // unbound.
+        Status get_expression(size_t index, CompiledExpression* compiled) const;
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Function to evaluate a compiled expression over many rows of input.
+    // Each instruction is run across a block of rows at a time, so the cost
+    // of interpreting the expression is shared by the whole block.
+    //
+    // Rows that fail, for example with DIVIDE_BY_ZERO, are set to NaN and
+    // the remaining rows are still computed. The error of the first failed
+    // row is returned.
+    //
+    // Arguments:
+    //  compiled: expression to evaluate, its variable bindings are ignored
+    //  columns: n_rows values for each variable, indexed by variable slot
+    //  n_rows: number of rows to evaluate
+    //  out: array of n_rows doubles used to store the results
+    //
+    Status evaluate_batch(const CompiledExpression& compiled, const double* const columns[], size_t n_rows, double* out);
+
+    // Same as above for columns of floats, computed with float kernels that
+    // handle twice as many rows per instruction as those for doubles. The
+    // operators other than power are computed in float, and functions and
+    // powers in double, rounded to float. Each row gives the same result as
+    // CompiledExpression::evaluate(float*) with the row's values, except
+    // that powers differ as described in set_simd_level, and rows that fail
+    // are NaN.
+    Status evaluate_batch(const CompiledExpression& compiled, const float* const columns[], size_t n_rows, float* out);
+
+    // The values from lo to hi, both included. Empty if lo > hi.
+    typedef struct Interval {
+        double lo;
+        double hi;
+    } Interval;
+
+    // Function to bound the results of a compiled expression, given bounds
+    // on each of its variables, for example to skip blocks of rows that
+    // cannot pass a filter. Every row whose variables lie within bounds,
+    // and whose result is not NaN, has a result within the returned
+    // interval, as computed by evaluate or evaluate_batch. The interval is
+    // empty if no such row can exist, such as when every division would
+    // fail with DIVIDE_BY_ZERO. Bounds may be infinite, and empty or NaN
+    // bounds hold no values. Nothing is known of functions added with
+    // register_function, so their results are bounded by the whole number
+    // line.
+    //
+    // Arguments:
+    //  compiled: expression to bound, its variable bindings are ignored
+    //  bounds: range of each variable, indexed by variable slot
+    //  result: interval used to store the bounds of the result
+    //
+    Status evaluate_bounds(const CompiledExpression& compiled, const Interval bounds[], Interval* result);
+
+    // Same as above for many sets of bounds at once, such as the minimum
+    // and maximum of each column over each block of a table. Like the rows
+    // of evaluate_batch, each instruction is run across a few hundred sets
+    // of bounds at a time.
+    //
+    // Arguments:
+    //  lo, hi: n_blocks lower and upper bounds for each variable, indexed by slot
+    //  n_blocks: number of sets of bounds
+    //  out_lo, out_hi: arrays of n_blocks doubles used to store the bounds of the results
+    //
+    Status evaluate_bounds_batch(const CompiledExpression& compiled,
+                                 const double* const lo[],
+                                 const double* const hi[],
+                                 size_t n_blocks,
+                                 double* out_lo,
+                                 double* out_hi);
+
+    // Evaluates batches on a pool of threads. Work is split into tasks of a
+    // few thousand rows of one expression, which idle threads steal from
+    // busy ones. Every row is computed exactly as evaluate_batch would, so
+    // results and statuses do not depend on the number of threads.
+    //
+    // Calls on the same engine from several threads are run one at a time.
+    class EvaluationEngine {
+    public:
+        // Starts num_threads - 1 worker threads, the calling thread being the
+        // last one. 0 uses one thread per hardware thread.
+        explicit EvaluationEngine(size_t num_threads = 0);
+        ~EvaluationEngine();
+
+        EvaluationEngine(const EvaluationEngine&) = delete;
+        EvaluationEngine& operator=(const EvaluationEngine&) = delete;
+
+        // Returns the number of threads evaluating, including the caller
+        size_t num_threads() const;
+
+        // Same as the evaluate_batch function, split across the threads
+        Status evaluate_batch(const CompiledExpression& compiled,
+                              const double* const columns[],
+                              size_t n_rows,
+                              double* out);
+
+        // Evaluates a set of expressions over the same rows. Each expression
+        // reads its variables from the column of the same name in columns,
+        // which must point at n_rows values.
+        //
+        // Arguments:
+        //  expressions: expressions to evaluate, their variable bindings are ignored
+        //  columns: start of the column for each variable name
+        //  n_rows: number of rows to evaluate
+        //  out: array of n_rows doubles for each expression, to store the results
+        //  statuses: optional array receiving the status of each expression, as
+        //            evaluate_batch would return it
+        //
+        // Returns: the first error in order of the expressions
+        Status evaluate_batch(const std::vector<CompiledExpression>& expressions,
+                              const SymbolTable& columns,
+                              size_t n_rows,
+                              double* const out[],
+                              Status statuses[] = NULL);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // How much of a set of expressions compile_expression_set found in common
+    typedef struct SharingReport {
+        size_t expressions;  // Expressions that compiled
+        size_t instructions; // Instructions of those expressions compiled one by one
+        size_t nodes;        // Nodes left once common subexpressions are merged
+        size_t shared_nodes; // Nodes used more than once, by other nodes or as a result
+    } SharingReport;
+
+    // A set of expressions compiled together into one graph, in which
+    // subexpressions that appear more than once, in one expression or in
+    // several, are computed only once per row. Variables with the same name
+    // are the same variable in every expression. Calls to functions
+    // registered by the user are never merged, as they may not always give
+    // the same result.
+    //
+    // Each expression gets the same result and status as it would if it
+    // were compiled and evaluated on its own, by CompiledExpression::evaluate
+    // for single rows and by evaluate_batch for many.
+    class ExpressionSet {
+    public:
+        ExpressionSet();
+        ~ExpressionSet();
+
+        ExpressionSet(ExpressionSet&&);
+        ExpressionSet& operator=(ExpressionSet&&);
+
+        // Returns the number of expressions in the set, including those
+        // that failed to compile
+        size_t size() const;
+
+        // Returns the number of distinct variables in the set
+        size_t num_variables() const;
+
+        // Returns the name of a variable. Slots are numbered from 0 in order
+        // of first appearance in the expressions.
+        const std::string& variable_name(size_t slot) const;
+
+        // Returns how much the expressions had in common
+        SharingReport sharing() const;
+
+        // Computes every expression for one row, reading each variable from
+        // the double bound to its name in symbols. Expressions that fail
+        // have their result set to 0.
+        //
+        // Arguments:
+        //  symbols: value of each variable
+        //  results: array of size() doubles used to store the results
+        //  statuses: optional array receiving the status of each expression,
+        //            as CompiledExpression::evaluate would return it
+        //
+        // Returns: the first error in order of the expressions
+        Status evaluate(const SymbolTable& symbols, double results[], Status statuses[] = NULL) const;
+
+        // Computes every expression over n_rows rows. Each variable is read
+        // from the column of n_rows values bound to its name in columns.
+        // Rows that fail are set to NaN, and expressions that can not be
+        // evaluated at all, because they did not compile or a column is
+        // missing, leave their output untouched.
+        //
+        // Arguments:
+        //  columns: start of the column for each variable name
+        //  n_rows: number of rows to evaluate
+        //  out: array of n_rows doubles for each expression, to store the results
+        //  statuses: optional array receiving the status of each expression,
+        //            as evaluate_batch would return it
+        //
+        // Returns: the first error in order of the expressions
+        Status evaluate_batch(const SymbolTable& columns,
+                              size_t n_rows,
+                              double* const out[],
+                              Status statuses[] = NULL) const;
+
+    private:
+        friend Status compile_expression_set(const std::vector<std::string>& expressions,
+                                             ExpressionSet* set,
+                                             Status statuses[]);
+        friend class IncrementalEvaluator;
+
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Compiles a set of expressions into one graph with their common
+    // subexpressions merged. Every expression is compiled, even after one
+    // fails, and those that failed report their error again when evaluated.
+    //
+    // Arguments:
+    //  expressions: expressions to compile, indexed the same in set
+    //  set: object used to store the compiled expressions
+    //  statuses: optional array receiving the status of compiling each
+    //            expression, as compile_expression would return it
+    //
+    // Returns: the first error in order of the expressions
+    Status compile_expression_set(const std::vector<std::string>& expressions,
+                                  ExpressionSet* set,
+                                  Status statuses[] = NULL);
+
+    // Evaluates an ExpressionSet over and over as its variables change,
+    // keeping the value of every subexpression in between. Each
+    // subexpression knows which variables it reads, so after the caller
+    // marks some variables as changed only the subexpressions reading them
+    // are computed again. Results and statuses are those of
+    // ExpressionSet::evaluate.
+    //
+    // Registered functions are treated like built in ones here, and are
+    // only called again when one of their arguments changes.
+    //
+    // An evaluator must not be used by more than one thread at a time.
+    class IncrementalEvaluator {
+    public:
+        // Binds the variables of set to their values in symbols, as
+        // CompiledExpression::bind does. set is not copied, and must outlive
+        // the evaluator without being compiled again.
+        IncrementalEvaluator(const ExpressionSet& set, const SymbolTable& symbols);
+        ~IncrementalEvaluator();
+
+        IncrementalEvaluator(const IncrementalEvaluator&) = delete;
+        IncrementalEvaluator& operator=(const IncrementalEvaluator&) = delete;
+
+        // Binds the variables again, which marks them all as changed
+        void bind(const SymbolTable& symbols);
+
+        // Marks the variable in the given slot of the set, or with the given
+        // name, as changed since the last evaluation. Returns ERROR if the
+        // set has no such variable.
+        Status mark_changed(size_t slot);
+        Status mark_changed(const std::string& name);
+
+        // Marks every variable as changed
+        void mark_all_changed();
+
+        // Computes again the subexpressions that read a changed variable, and
+        // sets the result of every expression. The first evaluation
+        // computes everything.
+        //
+        // Arguments:
+        //  results: array of set.size() doubles used to store the results
+        //  statuses: optional array receiving the status of each expression
+        //  recomputed: optional count of the subexpressions computed, reads
+        //              of variables and constants included
+        //
+        // Returns: the first error in order of the expressions
+        Status evaluate(double results[], Status statuses[] = NULL, size_t* recomputed = NULL);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Maps formula ids to compiled expressions that can be replaced while
+    // other threads are evaluating them. Each thread reads through its own
+    // Reader, which never takes a lock or waits for a writer. A replaced or
+    // removed version is freed once no reader can still be using it.
+    //
+    // Writers may be called from any thread, and wait for each other.
+    // Readers must all be destroyed before the registry.
+    class ExpressionRegistry {
+    public:
+        ExpressionRegistry();
+        ~ExpressionRegistry();
+
+        ExpressionRegistry(const ExpressionRegistry&) = delete;
+        ExpressionRegistry& operator=(const ExpressionRegistry&) = delete;
+
+        // Makes a copy of compiled the current version of id, replacing any
+        // earlier one. Readers see either the old version or the new one.
+        // Returns EMPTY_EXPRESSION, leaving id as it was, if compiled is
+        // empty.
+        Status publish(uint64_t id, const CompiledExpression& compiled);
+
+        // Same as above, compiling expression and binding it to symbols.
+        // Returns the error, leaving id as it was, if either fails.
+        Status publish(uint64_t id, std::string_view expression, const SymbolTable& symbols);
+
+        // Removes id from the registry. Returns ERROR if it is not there.
+        Status remove(uint64_t id);
+
+        // Returns the number of ids in the registry
+        size_t size() const;
+
+        // Frees the versions no reader can still be using, which writers do
+        // themselves once a few dozen are waiting. Returns the number of
+        // versions left to free.
+        size_t reclaim();
+
+        // A thread's access to the registry, declared below
+        class Reader;
+
+    private:
+        struct Impl;
+        struct ReaderRecord;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // A thread's access to an ExpressionRegistry. A reader must not be used by
+    // more than one thread at a time.
+    class ExpressionRegistry::Reader {
+    public:
+        explicit Reader(const ExpressionRegistry& registry);
+        ~Reader();
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        // Returns the current version of id, or NULL if it is not in the
+        // registry. The expression stays valid, even if it is replaced,
+        // until the next call of find, evaluate or release.
+        //
+        // Arguments:
+        //  id: formula to look up
+        //  version: optional number that increases with each publish to
+        //           the registry, to tell versions apart
+        const CompiledExpression* find(uint64_t id, uint64_t* version = NULL);
+
+        // Lets the registry free the versions found so far. A reader
+        // that holds on to one delays freeing every version replaced
+        // since, so idle threads should release.
+        void release();
+
+        // Evaluates the current version of id, as CompiledExpression::evaluate
+        // does, and releases it. Returns ERROR if id is not in the registry.
+        Status evaluate(uint64_t id, double* result);
+
+    private:
+        const ExpressionRegistry* registry_;
+        ReaderRecord* record_;
+    };
+
+    // Counters of the cache parse_expression keeps of compiled expressions
+    typedef struct ExpressionCacheStats {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t size;     // Number of expressions in the cache
+        size_t capacity; // Largest number of expressions the cache holds
+    } ExpressionCacheStats;
+
+    // parse_expression compiles each expression it sees and keeps the most
+    // recently used ones, keyed by their exact text, so that repeated
+    // expressions are only parsed once. Expressions that fail to compile are
+    // not kept.
+    //
+    // Sets the number of expressions kept, 1024 by default, dropping the
+    // least recently used ones if there are more. 0 turns the cache off. The
+    // capacity is split evenly between 16 shards, chosen by hash of the
+    // expression, so each shard holds capacity / 16 expressions.
+    void set_expression_cache_capacity(size_t capacity);
+
+    // Returns the counters of the expression cache
+    ExpressionCacheStats get_expression_cache_stats();
+
+    // Drops every expression from the cache and zeroes the counters
+    void clear_expression_cache();
+
+    // Stages of parse_expression and compile_expression that are timed.
+    // Well formed expressions are tokenized and converted in a single pass,
+    // timed as STAGE_CONVERT_TO_RPN. Malformed ones go through the two
+    // stages separately to find their error.
+    typedef enum { STAGE_TOKENIZE, STAGE_CONVERT_TO_RPN, STAGE_EVALUATE, NUM_PARSE_STAGES } ParseStage;
+
+    // Number of values of Status, counting from SUCCESS
+    const size_t NUM_STATUS_CODES = (size_t)Status::NESTING_TOO_DEEP + 1;
+
+    // Histogram bucket i counts calls that took from 2^i up to 2^(i + 1)
+    // nanoseconds. Bucket 0 also holds calls under a nanosecond and the last
+    // bucket everything above 2^31 ns.
+    const size_t STATS_HISTOGRAM_BUCKETS = 32;
+
+    typedef struct StageStats {
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        uint64_t histogram[STATS_HISTOGRAM_BUCKETS];
+    } StageStats;
+
+    typedef struct ParseStats {
+        StageStats stages[NUM_PARSE_STAGES]; // Indexed by ParseStage
+        uint64_t tokens;                     // Tokens produced by the tokenizer
+        uint64_t max_operator_depth;         // Deepest operator stack in the RPN conversion
+        uint64_t statuses[NUM_STATUS_CODES]; // Calls that returned each Status
+    } ParseStats;
+
+    // Counters of where parse_expression and compile_expression spend
+    // their time, kept when the library is built with
+    // EXPRPARSE_ENABLE_STATS. Without it nothing is recorded and the
+    // parser carries no extra code. Expressions found in the expression
+    // cache skip the tokenize and RPN stages, and only parse_expression
+    // records the evaluate stage. Counters are updated atomically, so
+    // parsing may go on in other threads while they are read.
+    //
+    // Returns true if this build keeps the counters
+    bool is_stats_enabled();
+
+    // Returns a copy of the counters. Each counter is read atomically, but
+    // calls finishing meanwhile may be only partly included.
+    ParseStats get_parse_stats();
+
+    // Zeroes all the counters
+    void reset_parse_stats();
+
+    // Instruction sets evaluate_batch can use for the built in operators
+    typedef enum { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512 } SimdLevel;
+
+    // Returns the best instruction set supported by both this build and the
+    // cpu it is running on. evaluate_batch uses this level by default.
+    SimdLevel get_max_simd_level();
+
+    // Returns true if this build can compile expressions to machine code with
+    // CompiledExpression::compile_native. Needs an x86-64 build with
+    // EXPRPARSE_ENABLE_JIT on a system with mmap.
+    bool is_jit_supported();
+
+    // Returns the instruction set evaluate_batch is currently using
+    SimdLevel get_simd_level();
+
+    // Makes evaluate_batch use the given instruction set, for example to
+    // compare results against SIMD_SCALAR. Returns ERROR if level is higher
+    // than get_max_simd_level().
+    //
+    // All levels give identical results, except for the power operator,
+    // which is computed as exp(y*log(x)) by the vector levels. Its relative
+    // error there is at most (2 + |y*ln(x)|) * 2^-52, below 1.6e-13, instead
+    // of the C library pow used by SIMD_SCALAR. At any level a row's result
+    // depends only on the row's own values, not on where it falls in the
+    // batch or on whether other rows fail.
+    Status set_simd_level(SimdLevel level);
 
     // Returns string name of the status enum
     std::string get_status_string(const Status& status);
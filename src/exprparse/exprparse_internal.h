@@ -0,0 +1,422 @@
+// exprparse_internal.h
+//
+// Internal types shared between the exprparse library, its tests and
+// its benchmarks. Nothing in this header is part of the public api.
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EXPRPARSE_INTERNAL_H
+#define EXPRPARSE_INTERNAL_H
+
+#include "exprparse.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Wraps code that only exists in builds with EXPRPARSE_ENABLE_STATS
+#if defined(EXPRPARSE_ENABLE_STATS)
+#define EXPRPARSE_STATS(...) __VA_ARGS__
+#else
+#define EXPRPARSE_STATS(...)
+#endif
+
+namespace exprparse {
+    // Tolerance for determining if number is close to zero
+    extern const double ALMOST_ZERO;
+
+    // ALMOST_ZERO rounded up to a float, so that a float is below it exactly
+    // when it is below ALMOST_ZERO
+    extern const float ALMOST_ZERO_FLOAT;
+
+    typedef enum TokenType { NUMBER, OPERATOR, FUNCTION, LEFT_BRACKET, RIGHT_BRACKET, VARIABLE, COMMA } TokenType;
+
+    typedef Status (*Operation)(const double[], const size_t&, double*);
+
+    // Applies an operation to count rows at once. args[i] points to the
+    // count values of the i-th argument. result may be the same array as
+    // args[0]. Returns the first error, after computing every row.
+    typedef Status (*BatchOperation)(const double* const[], const size_t&, double*);
+
+    // Same as above for columns of floats
+    typedef Status (*FloatBatchOperation)(const float* const[], const size_t&, float*);
+    typedef Status (*FloatBatchFunction)(const float* const args[], size_t num_args, size_t count, float* result);
+
+    typedef enum OperatorAssoc { RIGHT, LEFT } OperatorAssoc;
+
+    // Index of each operator in g_operators
+    typedef enum OperatorId {
+        OP_ADD,
+        OP_SUBTRACT,
+        OP_MULTIPLY,
+        OP_DIVIDE,
+        OP_POWER,
+        OP_UNARY_MINUS,
+        OP_UNARY_PLUS,
+        NUM_OPERATORS
+    } OperatorId;
+
+    typedef struct Operator {
+        Operation eval;
+        uint16_t precedance;
+        size_t num_arg;
+        OperatorAssoc op_assoc;
+        OperatorId id;
+    } Operator;
+
+    extern const Operator* const g_operators[NUM_OPERATORS];
+
+    // Number of values of SimdLevel
+    const size_t NUM_SIMD_LEVELS = (size_t)SimdLevel::SIMD_AVX512 + 1;
+
+    // Bounds the results of an operator or function over count sets of
+    // bounds on its arguments, for evaluate_bounds. lo[i] and hi[i] point at
+    // the count bounds of argument i, which are empty if lo > hi. out_lo and
+    // out_hi may be the same arrays as lo[0] and hi[0].
+    typedef void (*IntervalOperation)(const double* const lo[],
+                                      const double* const hi[],
+                                      size_t num_args,
+                                      size_t count,
+                                      double* out_lo,
+                                      double* out_hi);
+
+    // A function callable from expressions, built in or added by
+    // register_function. Functions are never removed, so pointers to them
+    // and their ids stay valid.
+    typedef struct Function {
+        std::string name;
+        ExpressionFunction eval;
+        ExpressionBatchFunction batch[NUM_SIMD_LEVELS]; // Indexed by SimdLevel, NULL to call eval row by row
+        FloatBatchFunction float_batch[NUM_SIMD_LEVELS]; // Indexed by SimdLevel, NULL to compute in double
+        size_t min_args;
+        size_t max_args;
+        bool pure; // Same arguments always give the same result, so calls on constants can be folded
+        IntervalOperation bounds; // NULL if nothing is known of the results, as for registered functions
+        uint32_t id;
+    } Function;
+
+    // Returns the function called name, or NULL if there is none
+    const Function* find_function(const char* name, size_t length);
+
+    // Returns the function with the given id, which must have come from a
+    // function found earlier
+    const Function* get_function(uint32_t id);
+
+    // Returns the bounds of the built in function called name, or NULL if it
+    // has none
+    IntervalOperation get_builtin_bounds(const char* name);
+
+    // Vectorized built in functions, the index of each in the tables of
+    // function kernels
+    typedef enum FunctionKernelId { FN_SQRT, FN_ABS, FN_MIN, FN_MAX, FN_SUM, NUM_FUNCTION_KERNELS } FunctionKernelId;
+
+    // Allocator handing out memory from a ParseArena, so that standard
+    // containers can hold parse time data. Deallocation does nothing, the
+    // memory comes back when the arena is reset.
+    template <class T> class ArenaAllocator {
+    public:
+        typedef T value_type;
+
+        explicit ArenaAllocator(ParseArena* arena) : arena_(arena) {
+        }
+
+        template <class U> ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {
+        }
+
+        T* allocate(size_t count) {
+            return static_cast<T*>(arena_->allocate(count * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T*, size_t) {
+        }
+
+        ParseArena* arena() const {
+            return arena_;
+        }
+
+    private:
+        ParseArena* arena_;
+    };
+
+    template <class T, class U> bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+        return lhs.arena() == rhs.arena();
+    }
+
+    template <class T, class U> bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+        return lhs.arena() != rhs.arena();
+    }
+
+    template <class T> using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+    // A parsed token. Which member of the union is set depends on ttype.
+    typedef struct Token {
+        TokenType ttype;
+        union {
+            size_t name_length; // VARIABLE tokens
+            size_t num_args;    // FUNCTION tokens
+        };
+        union {
+            const Operator* op;       // OPERATOR tokens
+            const Function* function; // FUNCTION tokens
+            double number;            // NUMBER tokens
+            const char* name;         // VARIABLE tokens, points into the expression
+        };
+    } Token;
+
+    typedef ArenaVector<Token> TokenList;
+
+    // Function to convert a string expression into a list of tokens. The
+    // tokens point into expression, which must outlive them.
+    Status tokenize_expr(std::string_view expression, TokenList& tokens);
+
+    // Tokenizes the characters [first, last) onto the end of tokens
+    Status append_tokens(const char* first, const char* last, TokenList& tokens);
+
+    // Parses list of tokens into reverse polish notation. A name followed by
+    // a bracket becomes a FUNCTION token, placed after its arguments.
+    Status convert_tokens_to_rpn(const TokenList& tokens, TokenList& rpn_tokens);
+
+    // Parses expression into reverse polish notation in a single pass, with
+    // brackets nested at most max_depth deep. The output is the same as
+    // tokenize_expr followed by convert_tokens_to_rpn.
+    //
+    // Returns: NESTING_TOO_DEEP, or ERROR for any syntax error, whose exact
+    // status the two separate stages find
+    Status parse_single_pass(std::string_view expression, size_t max_depth, TokenList& rpn_tokens);
+
+    // Same as above for tokens made by append_tokens, which stop at a token
+    // the lexer rejected if truncated is set. Gives NESTING_TOO_DEEP for the
+    // same input as parse_single_pass does for the text.
+    Status parse_tokens_single_pass(const TokenList& tokens,
+                                    bool truncated,
+                                    size_t max_depth,
+                                    TokenList& rpn_tokens);
+
+    // Evaluates tokens in reverse polish notation, taking variables from
+    // symbols, which may be NULL
+    Status eval_rpn_tokens(const TokenList& rpn_tokens, const SymbolTable* symbols, double* result);
+
+#if defined(EXPRPARSE_ENABLE_STATS)
+    // Records the time from construction to destruction against a stage
+    class StageTimer {
+    public:
+        explicit StageTimer(ParseStage stage) : stage_(stage), start_(std::chrono::steady_clock::now()) {
+        }
+        ~StageTimer();
+
+        // Records nothing after all, for work that is thrown away
+        void cancel() {
+            stage_ = NUM_PARSE_STAGES;
+        }
+
+        StageTimer(const StageTimer&) = delete;
+        StageTimer& operator=(const StageTimer&) = delete;
+
+    private:
+        ParseStage stage_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    void record_tokens(size_t num_tokens);
+    void record_operator_depth(size_t depth);
+    void record_status(Status status);
+#endif
+
+    // Typedefs for compiled programs
+    typedef enum InstructionCode { PUSH_NUMBER, PUSH_VARIABLE, APPLY_OPERATOR, CALL_FUNCTION } InstructionCode;
+
+    // One step of a compiled program. The operand is an index into the
+    // program's constants for PUSH_NUMBER, a variable slot for PUSH_VARIABLE,
+    // an OperatorId for APPLY_OPERATOR and a Function id for CALL_FUNCTION.
+    typedef struct Instruction {
+        uint32_t code;
+        uint32_t operand;
+        uint32_t num_args; // Arguments of CALL_FUNCTION, 0 for the others
+    } Instruction;
+
+    // Returns the number of values an instruction takes off the stack
+    inline size_t instruction_args(const Instruction& instr) {
+        if (instr.code == InstructionCode::APPLY_OPERATOR) return g_operators[instr.operand]->num_arg;
+        return instr.num_args;
+    }
+
+    // Operators and functions with up to this many arguments are evaluated
+    // without allocating an array for them
+    const size_t INLINE_CALL_ARGS = 16;
+
+    // Reverse polish notation flattened into an array of instructions
+    typedef struct Program {
+        std::vector<Instruction> code;
+        std::vector<double> constants;
+        std::vector<std::string> variables; // Variable names, indexed by slot
+        size_t max_depth; // Largest number of values on the stack during evaluation
+        size_t unoptimized_size; // Number of instructions before optimize_program
+    } Program;
+
+    // Gives the rest of the library access to the program inside a
+    // CompiledExpression
+    struct ProgramAccess {
+        static const Program* program(const CompiledExpression& compiled) {
+            return compiled.program_.get();
+        }
+
+        // Replaces the program of compiled, which is left unbound
+        static void set_program(CompiledExpression* compiled, const std::shared_ptr<const Program>& program) {
+            compiled->program_ = program;
+            compiled->native_.reset();
+            compiled->bindings_.assign(program ? program->variables.size() : 0, NULL);
+            compiled->bound_ = compiled->bindings_.empty();
+        }
+    };
+
+    // Programs no deeper than this are evaluated on a stack allocated buffer
+    const size_t EVAL_INLINE_STACK = 64;
+
+    // Flattens tokens in reverse polish notation into a program
+    Status build_program(const TokenList& rpn_tokens, Program* program);
+
+    // Folds constants and removes operations that do nothing from a
+    // successfully built program
+    void optimize_program(Program* program);
+
+    // Runs all parsing stages on expression and builds program from the result
+    Status compile_program(std::string_view expression, Program* program);
+
+    // Looks up each of the program's variables in symbols, which may be NULL.
+    // Variables that are not found get a NULL binding.
+    Status resolve_bindings(const Program& program, const SymbolTable* symbols, const double** bindings);
+
+    // The cache of compiled programs used by parse_expression. find_cached_program
+    // returns an empty pointer if expression is not in the cache.
+    bool expression_cache_enabled();
+    std::shared_ptr<const Program> find_cached_program(std::string_view expression);
+    void cache_program(std::string_view expression, const std::shared_ptr<const Program>& program);
+
+    // Evaluates instructions that are not held in a Program, such as those
+    // of a bytecode catalog. functions maps CALL_FUNCTION operands to
+    // functions, or is NULL if they are registry ids.
+    //
+    // Operators are computed in T, which is float, double or long double.
+    // Constants and variables are converted from double, and functions are
+    // called on arguments converted to double, their results converted back.
+    template <class T>
+    Status eval_code(const Instruction* code,
+                     size_t size,
+                     const double* constants,
+                     const Function* const* functions,
+                     const double* const* bindings,
+                     T* stack,
+                     T* result);
+
+    // Function to evaluate a program built by build_program, in T as above
+    template <class T>
+    Status eval_program(const Program& program, const double* const* bindings, T* stack, T* result);
+    template <class T>
+    Status eval_program(const Program& program, const double* const* bindings, T* result);
+
+    // Generates native code for a program. Returns ERROR if this build has
+    // no JIT or the program is too deep for it.
+    Status compile_native(const Program& program, std::shared_ptr<const NativeCode>* native);
+
+    // Runs code made by compile_native, same as eval_program
+    Status eval_native(const NativeCode& native, const double* const* bindings, double* result);
+
+    // Number of rows evaluate_batch runs each instruction over at a time
+    const size_t BATCH_BLOCK_SIZE = 256;
+
+    // Evaluates n_rows rows of program, starting at first_row, in blocks of
+    // BATCH_BLOCK_SIZE. out is indexed by row, like the columns. stack must
+    // hold program.max_depth * BATCH_BLOCK_SIZE values.
+    //
+    // T is double or float. Float rows use the float kernels where there
+    // are some, and otherwise convert the block to double and back, so each
+    // row gives what eval_program<float> gives.
+    //
+    // Returns: the error of the first failed row, whose result is set to NaN
+    template <class T>
+    Status eval_batch_rows(const Program& program,
+                           SimdLevel level,
+                           const T* const columns[],
+                           size_t first_row,
+                           size_t n_rows,
+                           T* stack,
+                           T* out);
+
+    // Calls a function that has no batch version once for each of count
+    // rows, returning the first error
+    Status call_function_rows(const Function& function,
+                              const double* const args[],
+                              size_t num_args,
+                              size_t count,
+                              double* result);
+
+    // Batch kernels for every operator, indexed by OperatorId
+    extern const BatchOperation g_scalar_kernels[NUM_OPERATORS];
+#if defined(EXPRPARSE_SIMD_X86)
+    extern const BatchOperation g_sse2_kernels[NUM_OPERATORS];
+    extern const BatchOperation g_avx2_kernels[NUM_OPERATORS];
+    extern const BatchOperation g_avx512_kernels[NUM_OPERATORS];
+#endif
+
+    // Same as above for floats. Operators whose kernel is NULL are computed
+    // with the double kernel of the same level.
+    extern const FloatBatchOperation g_scalar_float_kernels[NUM_OPERATORS];
+#if defined(EXPRPARSE_SIMD_X86)
+    extern const FloatBatchOperation g_sse2_float_kernels[NUM_OPERATORS];
+    extern const FloatBatchOperation g_avx2_float_kernels[NUM_OPERATORS];
+    extern const FloatBatchOperation g_avx512_float_kernels[NUM_OPERATORS];
+#endif
+
+    // Batch kernels for the vectorized built in functions, indexed by
+    // FunctionKernelId
+    extern const ExpressionBatchFunction g_scalar_function_kernels[NUM_FUNCTION_KERNELS];
+#if defined(EXPRPARSE_SIMD_X86)
+    extern const ExpressionBatchFunction g_sse2_function_kernels[NUM_FUNCTION_KERNELS];
+    extern const ExpressionBatchFunction g_avx2_function_kernels[NUM_FUNCTION_KERNELS];
+    extern const ExpressionBatchFunction g_avx512_function_kernels[NUM_FUNCTION_KERNELS];
+#endif
+
+    // Same as above for floats, NULL for the functions computed in double
+    extern const FloatBatchFunction g_scalar_float_function_kernels[NUM_FUNCTION_KERNELS];
+#if defined(EXPRPARSE_SIMD_X86)
+    extern const FloatBatchFunction g_sse2_float_function_kernels[NUM_FUNCTION_KERNELS];
+    extern const FloatBatchFunction g_avx2_float_function_kernels[NUM_FUNCTION_KERNELS];
+    extern const FloatBatchFunction g_avx512_float_function_kernels[NUM_FUNCTION_KERNELS];
+#endif
+
+    // Returns the operator kernels for an instruction set. Levels this build
+    // has no kernels for get the scalar ones.
+    const BatchOperation* get_batch_kernels(SimdLevel level);
+
+    // Same as above, for the built in functions
+    const ExpressionBatchFunction* get_function_kernels(SimdLevel level);
+
+    // Same as the two above, for floats
+    const FloatBatchOperation* get_float_batch_kernels(SimdLevel level);
+    const FloatBatchFunction* get_float_function_kernels(SimdLevel level);
+} // namespace exprparse
+
+#endif // !EXPRPARSE_INTERNAL_H
@@ -0,0 +1,315 @@
+// exprregistry.cpp
+//
+// Registry of compiled expressions that can be replaced while being read
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Versions are reclaimed by epoch. The registry keeps a global epoch, and a
+// reader about to look something up stores the current epoch in its record,
+// which it sets back to 0 when it releases. A writer unlinks a version from
+// the table, then retires it with the epoch before advancing it, and frees
+// it once every record is 0 or newer than that. Writers free versions in
+// batches, see RECLAIM_BATCH.
+//
+// A reader storing its epoch and a writer unlinking are both followed by a
+// sequentially consistent fence, so either the writer sees the reader's
+// epoch, or the reader sees the table without the version. A reader that
+// stored an older epoch than the one it read only delays reclamation.
+//
+// The table is open addressed and never has a slot emptied, so readers can
+// probe it without synchronizing with writers. A removed id keeps its slot
+// with a NULL version until the table is rebuilt, which replaces the whole
+// table and retires the old one like a version.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+namespace exprparse {
+    namespace {
+        const size_t MIN_TABLE_CAPACITY = 16;
+
+        // Writers reclaim once this many versions are waiting, or twice as
+        // many as were left by the last time, so that a reader that holds on
+        // to a version does not make every write scan a growing list
+        const size_t RECLAIM_BATCH = 64;
+
+        typedef struct Version {
+            CompiledExpression compiled;
+            uint64_t number;
+        } Version;
+
+        typedef struct Slot {
+            atomic<bool> used{ false }; // Set once id is written, never cleared
+            uint64_t id = 0;
+            atomic<Version*> version{ NULL }; // NULL if id was removed
+        } Slot;
+
+        typedef struct Table {
+            size_t capacity; // A power of two
+            unique_ptr<Slot[]> slots;
+        } Table;
+
+        // A version or table waiting for readers to move past epoch
+        typedef struct Retired {
+            uint64_t epoch;
+            unique_ptr<Version> version;
+            unique_ptr<Table> table;
+        } Retired;
+
+        // Spreads ids that differ in a few bits over the table, the
+        // finalizer of splitmix64
+        size_t hash_id(uint64_t id) {
+            id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            id = (id ^ (id >> 27)) * 0x94d049bb133111ebULL;
+            return (size_t)(id ^ (id >> 31));
+        }
+
+        Table* new_table(size_t capacity) {
+            Table* table = new Table;
+            table->capacity = capacity;
+            table->slots.reset(new Slot[capacity]);
+            return table;
+        }
+
+        // Returns the slot holding id, or if there is none, with found set
+        // to false, the empty slot ending its probe
+        Slot* find_slot(const Table& table, uint64_t id, bool* found) {
+            size_t mask = table.capacity - 1;
+            for (size_t i = hash_id(id) & mask;; i = (i + 1) & mask) {
+                Slot* slot = &table.slots[i];
+                *found = slot->used.load(memory_order_acquire);
+                if (!*found || slot->id == id) return slot;
+            }
+        }
+    } // namespace
+
+    // Records are padded to a cache line, as every reader writes its own on
+    // each lookup
+    struct alignas(64) ExpressionRegistry::ReaderRecord {
+        atomic<uint64_t> epoch{ 0 }; // 0 when the reader holds nothing
+        atomic<bool> claimed{ true };
+        ReaderRecord* next = NULL;
+    };
+
+    struct ExpressionRegistry::Impl {
+        atomic<Table*> table;
+        atomic<uint64_t> epoch;
+        atomic<ReaderRecord*> readers; // Only ever pushed, and freed with the registry
+        atomic<size_t> size;
+
+        mutex write_lock; // Held by writers for all of the below
+        size_t used;      // Slots with an id, removed or not
+        uint64_t last_number;
+        vector<Retired> retired;
+        size_t reclaim_at; // Size of retired at which writers next reclaim
+
+        void insert(uint64_t id, Version* version);
+        void retire(Version* version, Table* table);
+        size_t reclaim();
+    };
+
+    void ExpressionRegistry::Impl::insert(uint64_t id, Version* version) {
+        Table* current = table.load(memory_order_relaxed);
+        bool found;
+        Slot* slot = find_slot(*current, id, &found);
+        if (found) {
+            Version* old = slot->version.exchange(version, memory_order_seq_cst);
+            if (old == NULL) size.fetch_add(1, memory_order_relaxed);
+            retire(old, NULL);
+            return;
+        }
+
+        // Keep the table at most half used, leaving room for as many ids
+        // again as are now live, and dropping removed ones
+        if (2 * (used + 1) > current->capacity) {
+            size_t capacity = MIN_TABLE_CAPACITY;
+            while (capacity < 4 * (size.load(memory_order_relaxed) + 1)) capacity *= 2;
+            Table* rebuilt = new_table(capacity);
+            used = 0;
+            for (size_t i = 0; i < current->capacity; i++) {
+                Version* live = current->slots[i].version.load(memory_order_relaxed);
+                if (live == NULL) continue;
+                Slot* to = find_slot(*rebuilt, current->slots[i].id, &found);
+                to->id = current->slots[i].id;
+                to->version.store(live, memory_order_relaxed);
+                to->used.store(true, memory_order_relaxed);
+                used++;
+            }
+            table.store(rebuilt, memory_order_seq_cst);
+            retire(NULL, current);
+            current = rebuilt;
+            slot = find_slot(*current, id, &found);
+        }
+
+        slot->id = id;
+        slot->version.store(version, memory_order_release);
+        slot->used.store(true, memory_order_release);
+        used++;
+        size.fetch_add(1, memory_order_relaxed);
+    }
+
+    void ExpressionRegistry::Impl::retire(Version* version, Table* old_table) {
+        if (version == NULL && old_table == NULL) return;
+        Retired item;
+        item.epoch = epoch.fetch_add(1, memory_order_seq_cst);
+        item.version.reset(version);
+        item.table.reset(old_table);
+        retired.push_back(std::move(item));
+        if (retired.size() >= reclaim_at) reclaim();
+    }
+
+    size_t ExpressionRegistry::Impl::reclaim() {
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t oldest = UINT64_MAX;
+        for (ReaderRecord* record = readers.load(memory_order_acquire); record != NULL; record = record->next) {
+            uint64_t reader_epoch = record->epoch.load(memory_order_seq_cst);
+            if (reader_epoch != 0 && reader_epoch < oldest) oldest = reader_epoch;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++) {
+            if (retired[i].epoch >= oldest) retired[kept++] = std::move(retired[i]);
+        }
+        retired.resize(kept);
+        reclaim_at = kept < RECLAIM_BATCH / 2 ? RECLAIM_BATCH : 2 * kept;
+        return kept;
+    }
+
+    ExpressionRegistry::ExpressionRegistry() : impl_(new Impl) {
+        impl_->table.store(new_table(MIN_TABLE_CAPACITY));
+        impl_->epoch.store(1);
+        impl_->readers.store(NULL);
+        impl_->size.store(0);
+        impl_->used = 0;
+        impl_->last_number = 0;
+        impl_->reclaim_at = RECLAIM_BATCH;
+    }
+
+    ExpressionRegistry::~ExpressionRegistry() {
+        Table* table = impl_->table.load();
+        for (size_t i = 0; i < table->capacity; i++) delete table->slots[i].version.load();
+        delete table;
+        ReaderRecord* record = impl_->readers.load();
+        while (record != NULL) {
+            ReaderRecord* next = record->next;
+            delete record;
+            record = next;
+        }
+    }
+
+    Status ExpressionRegistry::publish(uint64_t id, const CompiledExpression& compiled) {
+        if (ProgramAccess::program(compiled) == NULL) return Status::EMPTY_EXPRESSION;
+        unique_ptr<Version> version(new Version);
+        version->compiled = compiled;
+
+        lock_guard<mutex> guard(impl_->write_lock);
+        version->number = ++impl_->last_number;
+        impl_->insert(id, version.release());
+        return Status::SUCCESS;
+    }
+
+    Status ExpressionRegistry::publish(uint64_t id, string_view expression, const SymbolTable& symbols) {
+        CompiledExpression compiled;
+        Status ret_val = compile_expression(expression, symbols, &compiled);
+        if (ret_val != Status::SUCCESS) return ret_val;
+        return publish(id, compiled);
+    }
+
+    Status ExpressionRegistry::remove(uint64_t id) {
+        lock_guard<mutex> guard(impl_->write_lock);
+        bool found;
+        Slot* slot = find_slot(*impl_->table.load(memory_order_relaxed), id, &found);
+        if (!found) return Status::ERROR;
+        Version* old = slot->version.exchange(NULL, memory_order_seq_cst);
+        if (old == NULL) return Status::ERROR;
+        impl_->size.fetch_sub(1, memory_order_relaxed);
+        impl_->retire(old, NULL);
+        return Status::SUCCESS;
+    }
+
+    size_t ExpressionRegistry::size() const {
+        return impl_->size.load(memory_order_relaxed);
+    }
+
+    size_t ExpressionRegistry::reclaim() {
+        lock_guard<mutex> guard(impl_->write_lock);
+        return impl_->reclaim();
+    }
+
+    ExpressionRegistry::Reader::Reader(const ExpressionRegistry& registry) : registry_(&registry), record_(NULL) {
+        // Take over the record of a destroyed reader if there is one
+        Impl& impl = *registry.impl_;
+        for (ReaderRecord* record = impl.readers.load(memory_order_acquire); record != NULL; record = record->next) {
+            bool claimed = false;
+            if (!record->claimed.load(memory_order_relaxed) &&
+                record->claimed.compare_exchange_strong(claimed, true, memory_order_acquire)) {
+                record_ = record;
+                return;
+            }
+        }
+
+        record_ = new ReaderRecord;
+        ReaderRecord* head = impl.readers.load(memory_order_relaxed);
+        do {
+            record_->next = head;
+        } while (!impl.readers.compare_exchange_weak(head, record_, memory_order_release, memory_order_relaxed));
+    }
+
+    ExpressionRegistry::Reader::~Reader() {
+        release();
+        record_->claimed.store(false, memory_order_release);
+    }
+
+    const CompiledExpression* ExpressionRegistry::Reader::find(uint64_t id, uint64_t* version) {
+        Impl& impl = *registry_->impl_;
+        record_->epoch.store(impl.epoch.load(memory_order_acquire), memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        bool found;
+        const Slot* slot = find_slot(*impl.table.load(memory_order_acquire), id, &found);
+        const Version* current = found ? slot->version.load(memory_order_acquire) : NULL;
+        if (current == NULL) return NULL;
+        if (version) *version = current->number;
+        return &current->compiled;
+    }
+
+    void ExpressionRegistry::Reader::release() {
+        record_->epoch.store(0, memory_order_release);
+    }
+
+    Status ExpressionRegistry::Reader::evaluate(uint64_t id, double* result) {
+        const CompiledExpression* compiled = find(id);
+        Status ret_val = compiled ? compiled->evaluate(result) : Status::ERROR;
+        release();
+        return ret_val;
+    }
+} // namespace exprparse
@@ -0,0 +1,613 @@
+// exprset.cpp
+//
+// Sets of expressions compiled into one graph with common subexpressions merged
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace exprparse {
+    namespace {
+        // Marks a node that has no block of its own in the scratch space
+        const uint32_t NO_SLOT = UINT32_MAX;
+
+        // One computation in the graph. The nodes are kept in an order where
+        // every node comes after its arguments, so computing them in order
+        // always has the arguments ready.
+        typedef struct SetNode {
+            uint32_t code;      // InstructionCode
+            uint32_t operand;   // Operator id, variable slot, or index in constants
+            uint32_t first_arg; // Index in args of the first argument
+            uint32_t num_args;
+            uint32_t slot;                // Block of scratch space holding the node's values in a batch
+            const Function* function;     // Function called by CALL_FUNCTION nodes
+        } SetNode;
+
+        typedef struct SetExpression {
+            Status status;           // Status of compiling the expression
+            uint32_t root;           // Node computing the result
+            uint32_t first_variable; // Index in expression_variables of the first variable read
+            uint32_t num_variables;
+        } SetExpression;
+
+        // Appends the bytes of value to key
+        template <class T> void append_key(string* key, const T& value) {
+            key->append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+    } // namespace
+
+    struct ExpressionSet::Impl {
+        vector<SetNode> nodes;
+        vector<uint32_t> args;    // Arguments of every node, each node's in a run
+        vector<double> constants; // Values of the PUSH_NUMBER nodes
+        vector<string> variables;
+        unordered_map<string, uint32_t> variable_slots;
+        vector<SetExpression> expressions;
+        vector<uint32_t> expression_variables; // Variable slots read by each expression
+
+        // Expressions whose result is each node, sorted by node, so that a
+        // batch can copy results out as soon as they are computed
+        vector<pair<uint32_t, uint32_t>> roots;
+        size_t num_slots;
+        size_t instructions;
+
+        Impl() : num_slots(0), instructions(0) {
+        }
+
+        Status build(const vector<string>& sources, Status statuses[]);
+        void assign_slots();
+        void resolve(const SymbolTable& symbols, vector<const double*>* values, Status statuses[]) const;
+        void eval_node(uint32_t inode, const double* const values[], double* node_values, Status* node_statuses) const;
+        void eval_row(const double* const values[], double* node_values, Status* node_statuses) const;
+        Status collect_row(const double* node_values,
+                           const Status* node_statuses,
+                           double results[],
+                           Status statuses[]) const;
+        bool eval_block(const double* const columns[],
+                        size_t first_row,
+                        size_t count,
+                        double* scratch,
+                        bool* failed,
+                        const vector<bool>& evaluated,
+                        double* const out[]) const;
+    };
+
+    // Compiles each expression and merges its instructions into the graph.
+    // Nodes are looked up by a key made of their instruction and the nodes
+    // of their arguments, so that identical subexpressions, which have
+    // identical keys, become a single node.
+    Status ExpressionSet::Impl::build(const vector<string>& sources, Status statuses[]) {
+        Status ret_val = Status::SUCCESS;
+        unordered_map<string, uint32_t> node_ids;
+        vector<uint32_t> stack;
+        vector<uint32_t> local_slots;
+        string key;
+
+        expressions.resize(sources.size());
+        for (size_t iexpr = 0; iexpr < sources.size(); iexpr++) {
+            SetExpression& expression = expressions[iexpr];
+            Program program;
+            expression.status = compile_program(sources[iexpr], &program);
+            expression.root = 0;
+            expression.first_variable = (uint32_t)expression_variables.size();
+            expression.num_variables = 0;
+            if (statuses) statuses[iexpr] = expression.status;
+            if (expression.status != Status::SUCCESS) {
+                if (ret_val == Status::SUCCESS) ret_val = expression.status;
+                continue;
+            }
+
+            // Slots of the program's variables in the whole set
+            local_slots.clear();
+            for (const string& name : program.variables) {
+                auto found = variable_slots.emplace(name, (uint32_t)variables.size());
+                if (found.second) variables.push_back(name);
+                local_slots.push_back(found.first->second);
+                expression_variables.push_back(found.first->second);
+            }
+            expression.num_variables = (uint32_t)program.variables.size();
+            instructions += program.code.size();
+
+            stack.clear();
+            for (const Instruction& instr : program.code) {
+                SetNode node = {instr.code, instr.operand, 0, 0, NO_SLOT, NULL};
+                key.clear();
+                append_key(&key, instr.code);
+                if (instr.code == InstructionCode::PUSH_NUMBER) {
+                    // Keyed by bits, so that 0 and -0 stay apart
+                    uint64_t bits;
+                    memcpy(&bits, &program.constants[instr.operand], sizeof(bits));
+                    append_key(&key, bits);
+                } else if (instr.code == InstructionCode::PUSH_VARIABLE) {
+                    node.operand = local_slots[instr.operand];
+                    append_key(&key, node.operand);
+                } else {
+                    node.num_args = (uint32_t)instruction_args(instr);
+                    append_key(&key, instr.operand);
+                    for (size_t iarg = stack.size() - node.num_args; iarg < stack.size(); iarg++) {
+                        append_key(&key, stack[iarg]);
+                    }
+                    if (instr.code == InstructionCode::CALL_FUNCTION) {
+                        node.function = get_function(instr.operand);
+                        // Every call of an impure function gets a key of its own
+                        if (!node.function->pure) append_key(&key, nodes.size());
+                    }
+                }
+
+                auto found = node_ids.emplace(key, (uint32_t)nodes.size());
+                if (found.second) {
+                    if (instr.code == InstructionCode::PUSH_NUMBER) {
+                        node.operand = (uint32_t)constants.size();
+                        constants.push_back(program.constants[instr.operand]);
+                    }
+                    node.first_arg = (uint32_t)args.size();
+                    args.insert(args.end(), stack.end() - node.num_args, stack.end());
+                    nodes.push_back(node);
+                }
+                stack.resize(stack.size() - node.num_args);
+                stack.push_back(found.first->second);
+            }
+            expression.root = stack[0];
+            roots.emplace_back(expression.root, (uint32_t)iexpr);
+        }
+
+        sort(roots.begin(), roots.end());
+        assign_slots();
+        return ret_val;
+    }
+
+    // Gives each computed node a block of scratch space for batches. A
+    // block is reused once the last node reading it has been computed. The
+    // result of a node never shares a block with its arguments, so kernels
+    // see separate arrays.
+    void ExpressionSet::Impl::assign_slots() {
+        vector<uint32_t> last_use(nodes.size());
+        for (uint32_t inode = 0; inode < nodes.size(); inode++) {
+            last_use[inode] = inode;
+            const SetNode& node = nodes[inode];
+            for (uint32_t iarg = 0; iarg < node.num_args; iarg++) last_use[args[node.first_arg + iarg]] = inode;
+        }
+
+        vector<uint32_t> free_slots;
+        num_slots = 0;
+        for (uint32_t inode = 0; inode < nodes.size(); inode++) {
+            SetNode& node = nodes[inode];
+            if (node.code != InstructionCode::PUSH_VARIABLE) {
+                if (free_slots.empty()) {
+                    node.slot = (uint32_t)num_slots++;
+                } else {
+                    node.slot = free_slots.back();
+                    free_slots.pop_back();
+                }
+            }
+            // The same argument can appear twice, as in x*x, so only the
+            // first time it is seen counts
+            for (uint32_t iarg = 0; iarg < node.num_args; iarg++) {
+                SetNode& arg = nodes[args[node.first_arg + iarg]];
+                if (last_use[args[node.first_arg + iarg]] == inode && arg.slot != NO_SLOT) {
+                    free_slots.push_back(arg.slot);
+                    last_use[args[node.first_arg + iarg]] = NO_SLOT;
+                }
+            }
+            if (last_use[inode] == inode && node.slot != NO_SLOT) free_slots.push_back(node.slot);
+        }
+    }
+
+    // Looks up each variable in symbols, and sets the status of each
+    // expression that can not be evaluated, missing values being NULL
+    void ExpressionSet::Impl::resolve(const SymbolTable& symbols,
+                                      vector<const double*>* values,
+                                      Status statuses[]) const {
+        values->resize(variables.size());
+        for (size_t slot = 0; slot < variables.size(); slot++) (*values)[slot] = symbols.find(variables[slot]);
+
+        for (size_t iexpr = 0; iexpr < expressions.size(); iexpr++) {
+            const SetExpression& expression = expressions[iexpr];
+            statuses[iexpr] = expression.status;
+            for (uint32_t ivar = 0; ivar < expression.num_variables && statuses[iexpr] == Status::SUCCESS; ivar++) {
+                if ((*values)[expression_variables[expression.first_variable + ivar]] == NULL) {
+                    statuses[iexpr] = Status::UNBOUND_VARIABLE;
+                }
+            }
+        }
+    }
+
+    // Computes one node for one row, from the values of its arguments. A
+    // node whose arguments failed takes the status of the first failed
+    // argument, which is the error an expression evaluated on its own stops
+    // at. Missing variables read as NaN, only expressions that do not read
+    // them being used.
+    void ExpressionSet::Impl::eval_node(uint32_t inode,
+                                        const double* const values[],
+                                        double* node_values,
+                                        Status* node_statuses) const {
+        const SetNode& node = nodes[inode];
+        Status& node_status = node_statuses[inode];
+        node_status = Status::SUCCESS;
+        if (node.code == InstructionCode::PUSH_NUMBER) {
+            node_values[inode] = constants[node.operand];
+            return;
+        } else if (node.code == InstructionCode::PUSH_VARIABLE) {
+            const double* value = values[node.operand];
+            node_values[inode] = value ? *value : numeric_limits<double>::quiet_NaN();
+            return;
+        }
+
+        double inline_row[INLINE_CALL_ARGS];
+        vector<double> heap_row;
+        double* row = inline_row;
+        if (node.num_args > INLINE_CALL_ARGS) {
+            heap_row.resize(node.num_args);
+            row = heap_row.data();
+        }
+        for (uint32_t iarg = 0; iarg < node.num_args && node_status == Status::SUCCESS; iarg++) {
+            uint32_t arg = args[node.first_arg + iarg];
+            node_status = node_statuses[arg];
+            row[iarg] = node_values[arg];
+        }
+        if (node_status != Status::SUCCESS) return;
+
+        if (node.code == InstructionCode::APPLY_OPERATOR) {
+            node_status = g_operators[node.operand]->eval(row, node.num_args, &node_values[inode]);
+        } else {
+            node_status = node.function->eval(row, node.num_args, &node_values[inode]);
+        }
+    }
+
+    void ExpressionSet::Impl::eval_row(const double* const values[], double* node_values, Status* node_statuses) const {
+        for (uint32_t inode = 0; inode < nodes.size(); inode++) eval_node(inode, values, node_values, node_statuses);
+    }
+
+    // Sets the result and status of each expression from the values of the
+    // nodes. statuses holds those set by resolve.
+    //
+    // Returns: the first error in order of the expressions
+    Status ExpressionSet::Impl::collect_row(const double* node_values,
+                                            const Status* node_statuses,
+                                            double results[],
+                                            Status statuses[]) const {
+        Status ret_val = Status::SUCCESS;
+        for (size_t iexpr = 0; iexpr < expressions.size(); iexpr++) {
+            uint32_t root = expressions[iexpr].root;
+            if (statuses[iexpr] == Status::SUCCESS) statuses[iexpr] = node_statuses[root];
+            results[iexpr] = statuses[iexpr] == Status::SUCCESS ? node_values[root] : 0.0;
+            if (ret_val == Status::SUCCESS) ret_val = statuses[iexpr];
+        }
+        return ret_val;
+    }
+
+    // Computes every node across one block of rows, each into its slot of
+    // scratch, and copies out the results of the evaluated expressions.
+    // failed receives, for each node, whether it or any node it
+    // depends on reported an error in the block.
+    //
+    // Returns: true if no node failed
+    bool ExpressionSet::Impl::eval_block(const double* const columns[],
+                                         size_t first_row,
+                                         size_t count,
+                                         double* scratch,
+                                         bool* failed,
+                                         const vector<bool>& evaluated,
+                                         double* const out[]) const {
+        static const vector<double> missing_column(BATCH_BLOCK_SIZE, numeric_limits<double>::quiet_NaN());
+        SimdLevel level = get_simd_level();
+        const BatchOperation* kernels = get_batch_kernels(level);
+        const double* inline_args[INLINE_CALL_ARGS];
+        vector<const double*> heap_args;
+        bool block_ok = true;
+        auto node_block = [&](uint32_t inode) -> const double* {
+            const SetNode& node = nodes[inode];
+            if (node.code != InstructionCode::PUSH_VARIABLE) return scratch + node.slot * BATCH_BLOCK_SIZE;
+            return columns[node.operand] ? columns[node.operand] + first_row : missing_column.data();
+        };
+
+        size_t iroot = 0;
+        for (uint32_t inode = 0; inode < nodes.size(); inode++) {
+            const SetNode& node = nodes[inode];
+            double* top = node.slot == NO_SLOT ? NULL : scratch + node.slot * BATCH_BLOCK_SIZE;
+            failed[inode] = false;
+            if (node.code == InstructionCode::PUSH_NUMBER) {
+                double value = constants[node.operand];
+                for (size_t irow = 0; irow < count; irow++) top[irow] = value;
+            } else if (node.code != InstructionCode::PUSH_VARIABLE) {
+                const double** block_args = inline_args;
+                if (node.num_args > INLINE_CALL_ARGS) {
+                    heap_args.resize(node.num_args);
+                    block_args = heap_args.data();
+                }
+                for (uint32_t iarg = 0; iarg < node.num_args; iarg++) {
+                    uint32_t arg = args[node.first_arg + iarg];
+                    block_args[iarg] = node_block(arg);
+                    failed[inode] |= failed[arg];
+                }
+
+                Status op_val;
+                if (node.code == InstructionCode::APPLY_OPERATOR) {
+                    op_val = kernels[node.operand](block_args, count, top);
+                } else {
+                    ExpressionBatchFunction batch = node.function->batch[level];
+                    op_val = batch ? batch(block_args, node.num_args, count, top)
+                                   : call_function_rows(*node.function, block_args, node.num_args, count, top);
+                }
+                failed[inode] |= op_val != Status::SUCCESS;
+                block_ok &= !failed[inode];
+            }
+
+            // Results are copied while their block is still live
+            for (; iroot < roots.size() && roots[iroot].first == inode; iroot++) {
+                uint32_t iexpr = roots[iroot].second;
+                if (!evaluated[iexpr]) continue;
+                const double* values = node_block(inode);
+                double* expr_out = out[iexpr] + first_row;
+                for (size_t irow = 0; irow < count; irow++) expr_out[irow] = values[irow];
+            }
+        }
+        return block_ok;
+    }
+
+    ExpressionSet::ExpressionSet() : impl_(new Impl) {
+    }
+
+    ExpressionSet::~ExpressionSet() {
+    }
+
+    ExpressionSet::ExpressionSet(ExpressionSet&&) = default;
+    ExpressionSet& ExpressionSet::operator=(ExpressionSet&&) = default;
+
+    size_t ExpressionSet::size() const {
+        return impl_->expressions.size();
+    }
+
+    size_t ExpressionSet::num_variables() const {
+        return impl_->variables.size();
+    }
+
+    const std::string& ExpressionSet::variable_name(size_t slot) const {
+        return impl_->variables[slot];
+    }
+
+    SharingReport ExpressionSet::sharing() const {
+        SharingReport report = {impl_->roots.size(), impl_->instructions, impl_->nodes.size(), 0};
+        vector<uint32_t> uses(impl_->nodes.size());
+        for (uint32_t arg : impl_->args) uses[arg]++;
+        for (const auto& root : impl_->roots) uses[root.first]++;
+        for (uint32_t count : uses) report.shared_nodes += count > 1;
+        return report;
+    }
+
+    Status ExpressionSet::evaluate(const SymbolTable& symbols, double results[], Status statuses[]) const {
+        vector<Status> local_statuses;
+        if (statuses == NULL) {
+            local_statuses.resize(impl_->expressions.size());
+            statuses = local_statuses.data();
+        }
+        vector<const double*> values;
+        impl_->resolve(symbols, &values, statuses);
+
+        vector<double> node_values(impl_->nodes.size());
+        vector<Status> node_statuses(impl_->nodes.size());
+        impl_->eval_row(values.data(), node_values.data(), node_statuses.data());
+        return impl_->collect_row(node_values.data(), node_statuses.data(), results, statuses);
+    }
+
+    Status ExpressionSet::evaluate_batch(const SymbolTable& columns,
+                                         size_t n_rows,
+                                         double* const out[],
+                                         Status statuses[]) const {
+        vector<Status> local_statuses;
+        if (statuses == NULL) {
+            local_statuses.resize(impl_->expressions.size());
+            statuses = local_statuses.data();
+        }
+        vector<const double*> values;
+        impl_->resolve(columns, &values, statuses);
+
+        // Expressions that can be evaluated at all, whose status only
+        // changes when a row fails
+        vector<bool> evaluated(impl_->expressions.size());
+        for (size_t iexpr = 0; iexpr < impl_->expressions.size(); iexpr++) {
+            evaluated[iexpr] = statuses[iexpr] == Status::SUCCESS;
+        }
+
+        vector<double> scratch(impl_->num_slots * BATCH_BLOCK_SIZE);
+        unique_ptr<bool[]> failed(new bool[impl_->nodes.size()]);
+        vector<double> node_values;
+        vector<Status> node_statuses;
+        vector<const double*> row_values(values.size());
+        for (size_t block_row = 0; block_row < n_rows; block_row += BATCH_BLOCK_SIZE) {
+            size_t count = n_rows - block_row < BATCH_BLOCK_SIZE ? n_rows - block_row : BATCH_BLOCK_SIZE;
+            if (impl_->eval_block(values.data(), block_row, count, scratch.data(), failed.get(), evaluated, out)) {
+                continue;
+            }
+
+            // Something in this block failed. As evaluate_batch does, the
+            // expressions affected are redone one row at a time to find out
+            // which rows failed. The rows that did not fail keep their block
+            // results, as do the expressions not affected.
+            node_values.resize(impl_->nodes.size());
+            node_statuses.resize(impl_->nodes.size());
+            for (size_t irow = block_row; irow < block_row + count; irow++) {
+                for (size_t slot = 0; slot < values.size(); slot++) {
+                    row_values[slot] = values[slot] ? values[slot] + irow : NULL;
+                }
+                impl_->eval_row(row_values.data(), node_values.data(), node_statuses.data());
+                for (size_t iexpr = 0; iexpr < impl_->expressions.size(); iexpr++) {
+                    uint32_t root = impl_->expressions[iexpr].root;
+                    if (!evaluated[iexpr] || !failed[root] || node_statuses[root] == Status::SUCCESS) continue;
+                    out[iexpr][irow] = numeric_limits<double>::quiet_NaN();
+                    if (statuses[iexpr] == Status::SUCCESS) statuses[iexpr] = node_statuses[root];
+                }
+            }
+        }
+
+        Status ret_val = Status::SUCCESS;
+        for (size_t iexpr = 0; iexpr < impl_->expressions.size() && ret_val == Status::SUCCESS; iexpr++) {
+            ret_val = statuses[iexpr];
+        }
+        return ret_val;
+    }
+
+    struct IncrementalEvaluator::Impl {
+        const ExpressionSet::Impl& set;
+        vector<const double*> values;
+        vector<Status> bound_statuses; // Statuses set by resolve
+
+        // Nodes that read each variable, directly or through their
+        // arguments, in the order they are computed. Those of slot are
+        // dependents[first_dependent[slot]] to dependents[first_dependent[slot + 1]].
+        vector<uint32_t> dependents;
+        vector<uint32_t> first_dependent;
+
+        vector<double> node_values;
+        vector<Status> node_statuses;
+        vector<bool> changed;
+        vector<uint32_t> changed_slots;
+        bool all_changed;
+        vector<uint32_t> dirty;         // Scratch for the nodes to recompute
+        vector<Status> local_statuses; // Scratch for callers without a status array
+
+        explicit Impl(const ExpressionSet::Impl& set_impl) : set(set_impl), all_changed(true) {
+        }
+
+        void find_dependents();
+    };
+
+    // Finds the variables each node reads from those of its arguments, then
+    // lists the nodes reading each variable
+    void IncrementalEvaluator::Impl::find_dependents() {
+        vector<vector<uint32_t>> reads(set.nodes.size());
+        vector<uint32_t> counts(set.variables.size() + 1);
+        for (uint32_t inode = 0; inode < set.nodes.size(); inode++) {
+            const SetNode& node = set.nodes[inode];
+            vector<uint32_t>& node_reads = reads[inode];
+            if (node.code == InstructionCode::PUSH_VARIABLE) node_reads.push_back(node.operand);
+            for (uint32_t iarg = 0; iarg < node.num_args; iarg++) {
+                const vector<uint32_t>& arg_reads = reads[set.args[node.first_arg + iarg]];
+                node_reads.insert(node_reads.end(), arg_reads.begin(), arg_reads.end());
+            }
+            sort(node_reads.begin(), node_reads.end());
+            node_reads.erase(unique(node_reads.begin(), node_reads.end()), node_reads.end());
+            for (uint32_t slot : node_reads) counts[slot + 1]++;
+        }
+
+        first_dependent.assign(counts.size(), 0);
+        for (size_t slot = 0; slot < set.variables.size(); slot++) {
+            first_dependent[slot + 1] = first_dependent[slot] + counts[slot + 1];
+        }
+        dependents.resize(first_dependent.back());
+        vector<uint32_t> next(first_dependent.begin(), first_dependent.end() - 1);
+        for (uint32_t inode = 0; inode < set.nodes.size(); inode++) {
+            for (uint32_t slot : reads[inode]) dependents[next[slot]++] = inode;
+        }
+    }
+
+    IncrementalEvaluator::IncrementalEvaluator(const ExpressionSet& set, const SymbolTable& symbols)
+        : impl_(new Impl(*set.impl_)) {
+        impl_->find_dependents();
+        impl_->node_values.resize(impl_->set.nodes.size());
+        impl_->node_statuses.resize(impl_->set.nodes.size());
+        impl_->changed.resize(impl_->set.variables.size());
+        impl_->bound_statuses.resize(impl_->set.expressions.size());
+        impl_->local_statuses.resize(impl_->set.expressions.size());
+        bind(symbols);
+    }
+
+    IncrementalEvaluator::~IncrementalEvaluator() {
+    }
+
+    void IncrementalEvaluator::bind(const SymbolTable& symbols) {
+        impl_->set.resolve(symbols, &impl_->values, impl_->bound_statuses.data());
+        mark_all_changed();
+    }
+
+    Status IncrementalEvaluator::mark_changed(size_t slot) {
+        if (slot >= impl_->changed.size()) return Status::ERROR;
+        if (!impl_->changed[slot]) {
+            impl_->changed[slot] = true;
+            impl_->changed_slots.push_back((uint32_t)slot);
+        }
+        return Status::SUCCESS;
+    }
+
+    Status IncrementalEvaluator::mark_changed(const std::string& name) {
+        auto found = impl_->set.variable_slots.find(name);
+        return found == impl_->set.variable_slots.end() ? Status::ERROR : mark_changed(found->second);
+    }
+
+    void IncrementalEvaluator::mark_all_changed() {
+        impl_->all_changed = true;
+    }
+
+    Status IncrementalEvaluator::evaluate(double results[], Status statuses[], size_t* recomputed) {
+        Impl& impl = *impl_;
+        const ExpressionSet::Impl& set = impl.set;
+        size_t num_recomputed = 0;
+        if (impl.all_changed) {
+            set.eval_row(impl.values.data(), impl.node_values.data(), impl.node_statuses.data());
+            num_recomputed = set.nodes.size();
+        } else if (!impl.changed_slots.empty()) {
+            // The nodes of a single variable are already in order, those of
+            // several are merged
+            const uint32_t* dirty = impl.dependents.data() + impl.first_dependent[impl.changed_slots[0]];
+            num_recomputed = impl.first_dependent[impl.changed_slots[0] + 1] - impl.first_dependent[impl.changed_slots[0]];
+            if (impl.changed_slots.size() > 1) {
+                impl.dirty.clear();
+                for (uint32_t slot : impl.changed_slots) {
+                    impl.dirty.insert(impl.dirty.end(), impl.dependents.begin() + impl.first_dependent[slot],
+                                      impl.dependents.begin() + impl.first_dependent[slot + 1]);
+                }
+                sort(impl.dirty.begin(), impl.dirty.end());
+                impl.dirty.erase(unique(impl.dirty.begin(), impl.dirty.end()), impl.dirty.end());
+                dirty = impl.dirty.data();
+                num_recomputed = impl.dirty.size();
+            }
+            for (size_t i = 0; i < num_recomputed; i++) {
+                set.eval_node(dirty[i], impl.values.data(), impl.node_values.data(), impl.node_statuses.data());
+            }
+        }
+        impl.all_changed = false;
+        for (uint32_t slot : impl.changed_slots) impl.changed[slot] = false;
+        impl.changed_slots.clear();
+        if (recomputed) *recomputed = num_recomputed;
+
+        if (statuses == NULL) statuses = impl.local_statuses.data();
+        copy(impl.bound_statuses.begin(), impl.bound_statuses.end(), statuses);
+        return set.collect_row(impl.node_values.data(), impl.node_statuses.data(), results, statuses);
+    }
+
+    Status compile_expression_set(const std::vector<std::string>& expressions, ExpressionSet* set, Status statuses[]) {
+        unique_ptr<ExpressionSet::Impl> impl(new ExpressionSet::Impl);
+        Status ret_val = impl->build(expressions, statuses);
+        set->impl_ = std::move(impl);
+        return ret_val;
+    }
+} // namespace exprparse
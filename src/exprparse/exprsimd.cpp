@@ -0,0 +1,145 @@
+// exprsimd.cpp
+//
+// Runtime selection of the batch kernels for the cpu in use
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <atomic>
+
+#if defined(EXPRPARSE_SIMD_X86) && defined(_MSC_VER)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace exprparse {
+    // Asks the cpu, and the operating system, which instruction sets can be used
+    SimdLevel detect_simd_level() {
+#if defined(EXPRPARSE_SIMD_X86) && defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return SimdLevel::SIMD_AVX512;
+        if (__builtin_cpu_supports("avx2")) return SimdLevel::SIMD_AVX2;
+        return SimdLevel::SIMD_SSE2;
+#elif defined(EXPRPARSE_SIMD_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        bool os_saves_ymm = false, os_saves_zmm = false;
+        if (info[2] & (1 << 27)) {
+            // The os must save the vector registers on a context switch
+            unsigned long long xcr0 = _xgetbv(0);
+            os_saves_ymm = (xcr0 & 0x6) == 0x6;
+            os_saves_zmm = (xcr0 & 0xE6) == 0xE6;
+        }
+        __cpuidex(info, 7, 0);
+        if (os_saves_zmm && (info[1] & (1 << 16))) return SimdLevel::SIMD_AVX512;
+        if (os_saves_ymm && (info[1] & (1 << 5))) return SimdLevel::SIMD_AVX2;
+        return SimdLevel::SIMD_SSE2;
+#else
+        return SimdLevel::SIMD_SCALAR;
+#endif
+    }
+
+    SimdLevel get_max_simd_level() {
+        static const SimdLevel max_level = detect_simd_level();
+        return max_level;
+    }
+
+    // Level in use, or -1 until the first call to get_simd_level
+    std::atomic<int> g_simd_level(-1);
+
+    SimdLevel get_simd_level() {
+        int level = g_simd_level.load(std::memory_order_relaxed);
+        if (level < 0) {
+            level = get_max_simd_level();
+            g_simd_level.store(level, std::memory_order_relaxed);
+        }
+        return (SimdLevel)level;
+    }
+
+    Status set_simd_level(SimdLevel level) {
+        if (level < SimdLevel::SIMD_SCALAR || level > get_max_simd_level()) return Status::ERROR;
+        g_simd_level.store(level, std::memory_order_relaxed);
+        return Status::SUCCESS;
+    }
+
+    const BatchOperation* get_batch_kernels(SimdLevel level) {
+        switch (level) {
+#if defined(EXPRPARSE_SIMD_X86)
+        case SimdLevel::SIMD_AVX512:
+            return g_avx512_kernels;
+        case SimdLevel::SIMD_AVX2:
+            return g_avx2_kernels;
+        case SimdLevel::SIMD_SSE2:
+            return g_sse2_kernels;
+#endif
+        default:
+            return g_scalar_kernels;
+        }
+    }
+
+    const ExpressionBatchFunction* get_function_kernels(SimdLevel level) {
+        switch (level) {
+#if defined(EXPRPARSE_SIMD_X86)
+        case SimdLevel::SIMD_AVX512:
+            return g_avx512_function_kernels;
+        case SimdLevel::SIMD_AVX2:
+            return g_avx2_function_kernels;
+        case SimdLevel::SIMD_SSE2:
+            return g_sse2_function_kernels;
+#endif
+        default:
+            return g_scalar_function_kernels;
+        }
+    }
+
+    const FloatBatchOperation* get_float_batch_kernels(SimdLevel level) {
+        switch (level) {
+#if defined(EXPRPARSE_SIMD_X86)
+        case SimdLevel::SIMD_AVX512:
+            return g_avx512_float_kernels;
+        case SimdLevel::SIMD_AVX2:
+            return g_avx2_float_kernels;
+        case SimdLevel::SIMD_SSE2:
+            return g_sse2_float_kernels;
+#endif
+        default:
+            return g_scalar_float_kernels;
+        }
+    }
+
+    const FloatBatchFunction* get_float_function_kernels(SimdLevel level) {
+        switch (level) {
+#if defined(EXPRPARSE_SIMD_X86)
+        case SimdLevel::SIMD_AVX512:
+            return g_avx512_float_function_kernels;
+        case SimdLevel::SIMD_AVX2:
+            return g_avx2_float_function_kernels;
+        case SimdLevel::SIMD_SSE2:
+            return g_sse2_float_function_kernels;
+#endif
+        default:
+            return g_scalar_float_function_kernels;
+        }
+    }
+} // namespace exprparse
@@ -0,0 +1,201 @@
+// exprsimd_avx2.cpp
+//
+// AVX2 batch kernels, compiled with AVX2 enabled
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse_internal.h"
+#include <immintrin.h>
+
+namespace exprparse {
+    namespace {
+        struct SimdAVX2 {
+            typedef double scalar;
+            typedef __m256d vec;
+            typedef __m256i ivec;
+            typedef __m256d mask;
+            static const size_t WIDTH = 4;
+
+            static vec load(const double* p) {
+                return _mm256_loadu_pd(p);
+            }
+            static void store(double* p, vec a) {
+                _mm256_storeu_pd(p, a);
+            }
+            static vec set1(double a) {
+                return _mm256_set1_pd(a);
+            }
+            static vec add(vec a, vec b) {
+                return _mm256_add_pd(a, b);
+            }
+            static vec sub(vec a, vec b) {
+                return _mm256_sub_pd(a, b);
+            }
+            static vec mul(vec a, vec b) {
+                return _mm256_mul_pd(a, b);
+            }
+            static vec div(vec a, vec b) {
+                return _mm256_div_pd(a, b);
+            }
+            static vec abs(vec a) {
+                return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+            }
+            static vec sqrt(vec a) {
+                return _mm256_sqrt_pd(a);
+            }
+            static mask lt(vec a, vec b) {
+                return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+            }
+            static mask le(vec a, vec b) {
+                return _mm256_cmp_pd(a, b, _CMP_LE_OQ);
+            }
+            static mask isnan(vec a) {
+                return _mm256_cmp_pd(a, a, _CMP_UNORD_Q);
+            }
+            static mask mask_and(mask a, mask b) {
+                return _mm256_and_pd(a, b);
+            }
+            static mask mask_or(mask a, mask b) {
+                return _mm256_or_pd(a, b);
+            }
+            static bool any(mask m) {
+                return _mm256_movemask_pd(m) != 0;
+            }
+            static unsigned bits(mask m) {
+                return (unsigned)_mm256_movemask_pd(m);
+            }
+            static vec select(mask m, vec a, vec b) {
+                return _mm256_blendv_pd(b, a, m);
+            }
+            static ivec to_bits(vec a) {
+                return _mm256_castpd_si256(a);
+            }
+            static vec from_bits(ivec a) {
+                return _mm256_castsi256_pd(a);
+            }
+            static ivec iset1(long long a) {
+                return _mm256_set1_epi64x(a);
+            }
+            static ivec iand(ivec a, ivec b) {
+                return _mm256_and_si256(a, b);
+            }
+            static ivec ior(ivec a, ivec b) {
+                return _mm256_or_si256(a, b);
+            }
+            static ivec iadd(ivec a, ivec b) {
+                return _mm256_add_epi64(a, b);
+            }
+            static ivec isub(ivec a, ivec b) {
+                return _mm256_sub_epi64(a, b);
+            }
+            static ivec srl52(ivec a) {
+                return _mm256_srli_epi64(a, 52);
+            }
+            static ivec sll52(ivec a) {
+                return _mm256_slli_epi64(a, 52);
+            }
+        };
+
+        struct SimdAVX2Float {
+            typedef float scalar;
+            typedef __m256 vec;
+            typedef __m256 mask;
+            static const size_t WIDTH = 8;
+
+            static vec load(const float* p) {
+                return _mm256_loadu_ps(p);
+            }
+            static void store(float* p, vec a) {
+                _mm256_storeu_ps(p, a);
+            }
+            static vec set1(float a) {
+                return _mm256_set1_ps(a);
+            }
+            static vec add(vec a, vec b) {
+                return _mm256_add_ps(a, b);
+            }
+            static vec sub(vec a, vec b) {
+                return _mm256_sub_ps(a, b);
+            }
+            static vec mul(vec a, vec b) {
+                return _mm256_mul_ps(a, b);
+            }
+            static vec div(vec a, vec b) {
+                return _mm256_div_ps(a, b);
+            }
+            static vec abs(vec a) {
+                return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+            }
+            static vec sqrt(vec a) {
+                return _mm256_sqrt_ps(a);
+            }
+            static mask lt(vec a, vec b) {
+                return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+            }
+            static mask isnan(vec a) {
+                return _mm256_cmp_ps(a, a, _CMP_UNORD_Q);
+            }
+            static mask mask_and(mask a, mask b) {
+                return _mm256_and_ps(a, b);
+            }
+            static mask mask_or(mask a, mask b) {
+                return _mm256_or_ps(a, b);
+            }
+            static bool any(mask m) {
+                return _mm256_movemask_ps(m) != 0;
+            }
+            static vec select(mask m, vec a, vec b) {
+                return _mm256_blendv_ps(b, a, m);
+            }
+        };
+    } // namespace
+} // namespace exprparse
+
+#include "exprsimd_internal.h"
+
+namespace exprparse {
+    const BatchOperation g_avx2_kernels[NUM_OPERATORS] = { add_kernel<SimdAVX2>,         subtract_kernel<SimdAVX2>,
+                                                           multiply_kernel<SimdAVX2>,    divide_kernel<SimdAVX2>,
+                                                           power_kernel<SimdAVX2>,       unary_minus_kernel<SimdAVX2>,
+                                                           unary_plus_kernel<SimdAVX2> };
+
+    const ExpressionBatchFunction g_avx2_function_kernels[NUM_FUNCTION_KERNELS] = { sqrt_function_kernel<SimdAVX2>,
+                                                                                    abs_function_kernel<SimdAVX2>,
+                                                                                    min_function_kernel<SimdAVX2>,
+                                                                                    max_function_kernel<SimdAVX2>,
+                                                                                    sum_function_kernel<SimdAVX2> };
+
+    // Powers and sums have no float kernels, they are computed in double
+    const FloatBatchOperation g_avx2_float_kernels[NUM_OPERATORS] = { add_kernel<SimdAVX2Float>,
+                                                                      subtract_kernel<SimdAVX2Float>,
+                                                                      multiply_kernel<SimdAVX2Float>,
+                                                                      divide_kernel<SimdAVX2Float>,
+                                                                      NULL,
+                                                                      unary_minus_kernel<SimdAVX2Float>,
+                                                                      unary_plus_kernel<SimdAVX2Float> };
+
+    const FloatBatchFunction g_avx2_float_function_kernels[NUM_FUNCTION_KERNELS] = {
+        sqrt_function_kernel<SimdAVX2Float>, abs_function_kernel<SimdAVX2Float>, min_function_kernel<SimdAVX2Float>,
+        max_function_kernel<SimdAVX2Float>, NULL
+    };
+} // namespace exprparse
@@ -0,0 +1,208 @@
+// exprsimd_avx512.cpp
+//
+// AVX-512 batch kernels, compiled with AVX-512F enabled
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse_internal.h"
+#include <immintrin.h>
+
+namespace exprparse {
+    namespace {
+        // Only AVX-512F instructions are used, so the double bitwise
+        // operations from AVX-512DQ are done on integer vectors instead
+        struct SimdAVX512 {
+            typedef double scalar;
+            typedef __m512d vec;
+            typedef __m512i ivec;
+            typedef __mmask8 mask;
+            static const size_t WIDTH = 8;
+
+            static vec load(const double* p) {
+                return _mm512_loadu_pd(p);
+            }
+            static void store(double* p, vec a) {
+                _mm512_storeu_pd(p, a);
+            }
+            static vec set1(double a) {
+                return _mm512_set1_pd(a);
+            }
+            static vec add(vec a, vec b) {
+                return _mm512_add_pd(a, b);
+            }
+            static vec sub(vec a, vec b) {
+                return _mm512_sub_pd(a, b);
+            }
+            static vec mul(vec a, vec b) {
+                return _mm512_mul_pd(a, b);
+            }
+            static vec div(vec a, vec b) {
+                return _mm512_div_pd(a, b);
+            }
+            static vec abs(vec a) {
+                return _mm512_castsi512_pd(
+                _mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(0x7FFFFFFFFFFFFFFFLL)));
+            }
+            // The zero masked forms with every lane set give the same result.
+            // The plain forms pass GCC's builtins an undefined source, which
+            // it warns may be used uninitialized.
+            static vec sqrt(vec a) {
+                return _mm512_maskz_sqrt_pd((__mmask8)0xFF, a);
+            }
+            static mask lt(vec a, vec b) {
+                return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+            }
+            static mask le(vec a, vec b) {
+                return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ);
+            }
+            static mask isnan(vec a) {
+                return _mm512_cmp_pd_mask(a, a, _CMP_UNORD_Q);
+            }
+            static mask mask_and(mask a, mask b) {
+                return (mask)(a & b);
+            }
+            static mask mask_or(mask a, mask b) {
+                return (mask)(a | b);
+            }
+            static bool any(mask m) {
+                return m != 0;
+            }
+            static unsigned bits(mask m) {
+                return (unsigned)m;
+            }
+            static vec select(mask m, vec a, vec b) {
+                return _mm512_mask_blend_pd(m, b, a);
+            }
+            static ivec to_bits(vec a) {
+                return _mm512_castpd_si512(a);
+            }
+            static vec from_bits(ivec a) {
+                return _mm512_castsi512_pd(a);
+            }
+            static ivec iset1(long long a) {
+                return _mm512_set1_epi64(a);
+            }
+            static ivec iand(ivec a, ivec b) {
+                return _mm512_and_si512(a, b);
+            }
+            static ivec ior(ivec a, ivec b) {
+                return _mm512_or_si512(a, b);
+            }
+            static ivec iadd(ivec a, ivec b) {
+                return _mm512_add_epi64(a, b);
+            }
+            static ivec isub(ivec a, ivec b) {
+                return _mm512_sub_epi64(a, b);
+            }
+            static ivec srl52(ivec a) {
+                return _mm512_maskz_srli_epi64((__mmask8)0xFF, a, 52);
+            }
+            static ivec sll52(ivec a) {
+                return _mm512_maskz_slli_epi64((__mmask8)0xFF, a, 52);
+            }
+        };
+
+        struct SimdAVX512Float {
+            typedef float scalar;
+            typedef __m512 vec;
+            typedef __mmask16 mask;
+            static const size_t WIDTH = 16;
+
+            static vec load(const float* p) {
+                return _mm512_loadu_ps(p);
+            }
+            static void store(float* p, vec a) {
+                _mm512_storeu_ps(p, a);
+            }
+            static vec set1(float a) {
+                return _mm512_set1_ps(a);
+            }
+            static vec add(vec a, vec b) {
+                return _mm512_add_ps(a, b);
+            }
+            static vec sub(vec a, vec b) {
+                return _mm512_sub_ps(a, b);
+            }
+            static vec mul(vec a, vec b) {
+                return _mm512_mul_ps(a, b);
+            }
+            static vec div(vec a, vec b) {
+                return _mm512_div_ps(a, b);
+            }
+            static vec abs(vec a) {
+                return _mm512_castsi512_ps(
+                _mm512_and_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x7FFFFFFF)));
+            }
+            static vec sqrt(vec a) {
+                return _mm512_maskz_sqrt_ps((__mmask16)0xFFFF, a);
+            }
+            static mask lt(vec a, vec b) {
+                return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+            }
+            static mask isnan(vec a) {
+                return _mm512_cmp_ps_mask(a, a, _CMP_UNORD_Q);
+            }
+            static mask mask_and(mask a, mask b) {
+                return (mask)(a & b);
+            }
+            static mask mask_or(mask a, mask b) {
+                return (mask)(a | b);
+            }
+            static bool any(mask m) {
+                return m != 0;
+            }
+            static vec select(mask m, vec a, vec b) {
+                return _mm512_mask_blend_ps(m, b, a);
+            }
+        };
+    } // namespace
+} // namespace exprparse
+
+#include "exprsimd_internal.h"
+
+namespace exprparse {
+    const BatchOperation g_avx512_kernels[NUM_OPERATORS] = { add_kernel<SimdAVX512>,         subtract_kernel<SimdAVX512>,
+                                                             multiply_kernel<SimdAVX512>,    divide_kernel<SimdAVX512>,
+                                                             power_kernel<SimdAVX512>,       unary_minus_kernel<SimdAVX512>,
+                                                             unary_plus_kernel<SimdAVX512> };
+
+    const ExpressionBatchFunction g_avx512_function_kernels[NUM_FUNCTION_KERNELS] = { sqrt_function_kernel<SimdAVX512>,
+                                                                                      abs_function_kernel<SimdAVX512>,
+                                                                                      min_function_kernel<SimdAVX512>,
+                                                                                      max_function_kernel<SimdAVX512>,
+                                                                                      sum_function_kernel<SimdAVX512> };
+
+    // Powers and sums have no float kernels, they are computed in double
+    const FloatBatchOperation g_avx512_float_kernels[NUM_OPERATORS] = { add_kernel<SimdAVX512Float>,
+                                                                        subtract_kernel<SimdAVX512Float>,
+                                                                        multiply_kernel<SimdAVX512Float>,
+                                                                        divide_kernel<SimdAVX512Float>,
+                                                                        NULL,
+                                                                        unary_minus_kernel<SimdAVX512Float>,
+                                                                        unary_plus_kernel<SimdAVX512Float> };
+
+    const FloatBatchFunction g_avx512_float_function_kernels[NUM_FUNCTION_KERNELS] = {
+        sqrt_function_kernel<SimdAVX512Float>, abs_function_kernel<SimdAVX512Float>,
+        min_function_kernel<SimdAVX512Float>, max_function_kernel<SimdAVX512Float>, NULL
+    };
+} // namespace exprparse
@@ -0,0 +1,419 @@
+// exprsimd_internal.h
+//
+// Vectorized batch kernels, written once against a small vector interface
+// and compiled once per instruction set. Not part of the public api.
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// This header is included by each exprsimd_<isa>.cpp after it defines its
+// vector interface S, which must provide:
+//
+//  scalar               type of a lane, double or float
+//  vec, ivec, mask      vector of scalars, 64 bit integer vector and lane mask
+//  WIDTH                number of scalars in a vec
+//  load, store, set1    unaligned load/store and broadcast
+//  add, sub, mul, div   lane wise arithmetic
+//  abs                  clear the sign bit of each lane
+//  sqrt                 correctly rounded square root
+//  lt, le               ordered comparisons, false for NaN lanes
+//  isnan                mask of the NaN lanes
+//  mask_and, mask_or    combine masks
+//  any                  true if any lane of a mask is set
+//  bits                 one bit per lane of a mask, lane 0 in bit 0
+//  select(m, a, b)      a where m is set, b elsewhere
+//  to_bits, from_bits   reinterpret between vec and ivec
+//  iset1, iand, ior     integer broadcast and bitwise operations
+//  iadd, isub           64 bit integer arithmetic
+//  srl52, sll52         64 bit logical shifts by 52, the width of the mantissa
+//
+// Interfaces over floats leave out ivec and everything that uses it, along
+// with le and bits, which only the double power kernel needs.
+//
+// Everything is in an unnamed namespace. Each translation unit is compiled
+// with different instruction set flags, so no inline function here may be
+// shared with, or picked by the linker for, another translation unit.
+
+#ifndef EXPRSIMD_INTERNAL_H
+#define EXPRSIMD_INTERNAL_H
+
+#include "exprparse_internal.h"
+#include <cfloat>
+#include <cstddef>
+#include <math.h>
+
+namespace exprparse {
+    namespace {
+        // abs and sqrt for the rows after the last whole vector. Floats go
+        // through the double versions, which give the same results, as
+        // std::fabs and std::sqrt of a float are inline functions.
+        inline double scalar_abs(double a) {
+            return fabs(a);
+        }
+        inline float scalar_abs(float a) {
+            return (float)fabs((double)a);
+        }
+        inline double scalar_sqrt(double a) {
+            return sqrt(a);
+        }
+        inline float scalar_sqrt(float a) {
+            return (float)sqrt((double)a);
+        }
+
+        // Natural log of each lane. Only valid for normal, positive, finite
+        // lanes. This is the fdlibm algorithm, accurate to within 1 ulp.
+        template <class S>
+        inline typename S::vec vec_log(typename S::vec x) {
+            typedef typename S::vec vec;
+            typedef typename S::ivec ivec;
+            const vec one = S::set1(1.0);
+            const vec half = S::set1(0.5);
+
+            // Split x into 2^k * m, with m in [1, 2). The exponent field is
+            // turned into a double by placing it in the mantissa of 2^52.
+            ivec bits = S::to_bits(x);
+            ivec exponent = S::ior(S::srl52(bits), S::iset1(0x4330000000000000LL));
+            vec k = S::sub(S::from_bits(exponent), S::set1(4503599627370496.0 + 1023.0));
+            vec m = S::from_bits(S::ior(S::iand(bits, S::iset1(0x000FFFFFFFFFFFFFLL)), S::iset1(0x3FF0000000000000LL)));
+
+            // Move m into [sqrt(2)/2, sqrt(2))
+            typename S::mask big = S::lt(S::set1(1.41421356237309504880), m);
+            m = S::select(big, S::mul(m, half), m);
+            k = S::select(big, S::add(k, one), k);
+
+            vec f = S::sub(m, one);
+            vec s = S::div(f, S::add(S::set1(2.0), f));
+            vec z = S::mul(s, s);
+            vec w = S::mul(z, z);
+            vec t1 = S::mul(
+            w, S::add(S::set1(3.999999999940941908e-01),
+                      S::mul(w, S::add(S::set1(2.222219843214978396e-01), S::mul(w, S::set1(1.531383769920937332e-01))))));
+            vec t2 = S::mul(
+            z, S::add(S::set1(6.666666666666735130e-01),
+                      S::mul(w, S::add(S::set1(2.857142874366239149e-01),
+                                       S::mul(w, S::add(S::set1(1.818357216161805012e-01),
+                                                        S::mul(w, S::set1(1.479819860511658591e-01))))))));
+            vec r = S::add(t2, t1);
+            vec hfsq = S::mul(half, S::mul(f, f));
+
+            // k*ln2_hi - ((hfsq - (s*(hfsq+r) + k*ln2_lo)) - f)
+            vec low = S::add(S::mul(s, S::add(hfsq, r)), S::mul(k, S::set1(1.90821492927058770002e-10)));
+            return S::sub(S::mul(k, S::set1(6.93147180369123816490e-01)), S::sub(S::sub(hfsq, low), f));
+        }
+
+        // e raised to each lane. Only valid for lanes in (-708, 708). This is
+        // the fdlibm algorithm, accurate to within 1 ulp.
+        template <class S>
+        inline typename S::vec vec_exp(typename S::vec t) {
+            typedef typename S::vec vec;
+            typedef typename S::ivec ivec;
+            const vec one = S::set1(1.0);
+
+            // Round t/ln(2) to the nearest integer k by adding 1.5*2^52, which
+            // also leaves k in the low bits of the sum
+            const vec shifter = S::set1(6755399441055744.0);
+            vec kd = S::add(S::mul(t, S::set1(1.44269504088896338700e+00)), shifter);
+            ivec ki = S::isub(S::to_bits(kd), S::iset1(0x4338000000000000LL));
+            vec k = S::sub(kd, shifter);
+
+            vec hi = S::sub(t, S::mul(k, S::set1(6.93147180369123816490e-01)));
+            vec lo = S::mul(k, S::set1(1.90821492927058770002e-10));
+            vec r = S::sub(hi, lo);
+            vec r2 = S::mul(r, r);
+            vec p = S::add(S::set1(-1.65339022054652515390e-06), S::mul(r2, S::set1(4.13813679705723846039e-08)));
+            p = S::add(S::set1(6.61375632143793436117e-05), S::mul(r2, p));
+            p = S::add(S::set1(-2.77777777770155933842e-03), S::mul(r2, p));
+            p = S::add(S::set1(1.66666666666666019037e-01), S::mul(r2, p));
+            vec c = S::sub(r, S::mul(r2, p));
+
+            // 1 - ((lo - (r*c)/(2-c)) - hi)
+            vec y = S::sub(one, S::sub(S::sub(lo, S::div(S::mul(r, c), S::sub(S::set1(2.0), c))), hi));
+
+            // Scale by 2^k, built directly in the exponent field
+            vec scale = S::from_bits(S::sll52(S::iadd(ki, S::iset1(1023))));
+            return S::mul(y, scale);
+        }
+
+        // Lane wise operations, in both vector and scalar form. The scalar
+        // forms handle the rows left over at the end of a block.
+        template <class S>
+        struct AddOp {
+            static typename S::vec apply(typename S::vec a, typename S::vec b) {
+                return S::add(a, b);
+            }
+            static typename S::scalar apply(typename S::scalar a, typename S::scalar b) {
+                return a + b;
+            }
+        };
+
+        template <class S>
+        struct SubtractOp {
+            static typename S::vec apply(typename S::vec a, typename S::vec b) {
+                return S::sub(a, b);
+            }
+            static typename S::scalar apply(typename S::scalar a, typename S::scalar b) {
+                return a - b;
+            }
+        };
+
+        template <class S>
+        struct MultiplyOp {
+            static typename S::vec apply(typename S::vec a, typename S::vec b) {
+                return S::mul(a, b);
+            }
+            static typename S::scalar apply(typename S::scalar a, typename S::scalar b) {
+                return a * b;
+            }
+        };
+
+        template <class S, class Op>
+        Status binary_kernel(const typename S::scalar* const args[], const size_t& count, typename S::scalar* result) {
+            const typename S::scalar* lhs = args[0];
+            const typename S::scalar* rhs = args[1];
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) {
+                S::store(result + i, Op::apply(S::load(lhs + i), S::load(rhs + i)));
+            }
+            for (; i < count; i++) result[i] = Op::apply(lhs[i], rhs[i]);
+            return Status::SUCCESS;
+        }
+
+        template <class S>
+        Status add_kernel(const typename S::scalar* const args[], const size_t& count, typename S::scalar* result) {
+            return binary_kernel<S, AddOp<S> >(args, count, result);
+        }
+
+        template <class S>
+        Status subtract_kernel(const typename S::scalar* const args[],
+                               const size_t& count,
+                               typename S::scalar* result) {
+            return binary_kernel<S, SubtractOp<S> >(args, count, result);
+        }
+
+        template <class S>
+        Status multiply_kernel(const typename S::scalar* const args[],
+                               const size_t& count,
+                               typename S::scalar* result) {
+            return binary_kernel<S, MultiplyOp<S> >(args, count, result);
+        }
+
+        // Divides every row. The ALMOST_ZERO check is done on a whole vector
+        // at a time and the masks are combined, so there is no branch per row.
+        // Float lanes are compared with ALMOST_ZERO_FLOAT, which flags the same
+        // divisors.
+        template <class S>
+        Status divide_kernel(const typename S::scalar* const args[], const size_t& count, typename S::scalar* result) {
+            const typename S::scalar* lhs = args[0];
+            const typename S::scalar* rhs = args[1];
+            const bool is_float = sizeof(typename S::scalar) == sizeof(float);
+            const typename S::vec limit = S::set1(is_float ? ALMOST_ZERO_FLOAT : ALMOST_ZERO);
+            typename S::mask zero_found = S::lt(limit, limit);
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) {
+                typename S::vec divisor = S::load(rhs + i);
+                zero_found = S::mask_or(zero_found, S::lt(S::abs(divisor), limit));
+                S::store(result + i, S::div(S::load(lhs + i), divisor));
+            }
+            bool tail_zero = false;
+            for (; i < count; i++) {
+                tail_zero |= scalar_abs(rhs[i]) < ALMOST_ZERO;
+                result[i] = lhs[i] / rhs[i];
+            }
+            return (S::any(zero_found) || tail_zero) ? Status::DIVIDE_BY_ZERO : Status::SUCCESS;
+        }
+
+        // Raises S::WIDTH rows to a power as exp(y*log(x)). Lanes where x is
+        // not a normal positive number, or where the result would leave the
+        // normal range, use pow from the C library instead. result may be
+        // lhs.
+        template <class S>
+        inline void power_lanes(const double* lhs, const double* rhs, double* result) {
+            typedef typename S::vec vec;
+            vec x = S::load(lhs);
+            vec t = S::mul(S::load(rhs), vec_log<S>(x));
+            vec y = vec_exp<S>(t);
+            typename S::mask ok = S::mask_and(S::mask_and(S::le(S::set1(DBL_MIN), x), S::le(x, S::set1(DBL_MAX))),
+                                              S::lt(S::abs(t), S::set1(700.0)));
+            unsigned ok_lanes = S::bits(ok);
+            if (ok_lanes == (1u << S::WIDTH) - 1) {
+                S::store(result, y);
+                return;
+            }
+
+            // Recompute the lanes the vector path cannot handle. Nothing is
+            // stored until this is done.
+            double lanes[S::WIDTH];
+            S::store(lanes, y);
+            for (size_t lane = 0; lane < S::WIDTH; lane++) {
+                if (!(ok_lanes & (1u << lane))) lanes[lane] = pow(lhs[lane], rhs[lane]);
+            }
+            for (size_t lane = 0; lane < S::WIDTH; lane++) result[lane] = lanes[lane];
+        }
+
+        // Raises every row to a power with power_lanes, for doubles only. The
+        // rows after the last whole vector are padded out to one, so every
+        // row gives the same result wherever it is in the batch.
+        //
+        // Accuracy: where the vector path is used the relative error is at
+        // most (2 + |y*ln(x)|) * 2^-52, which is below 1.6e-13 everywhere.
+        // The error grows with |y*ln(x)| because the rounding error of the
+        // product is magnified by exp.
+        template <class S>
+        Status power_kernel(const double* const args[], const size_t& count, double* result) {
+            const double* lhs = args[0];
+            const double* rhs = args[1];
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) power_lanes<S>(lhs + i, rhs + i, result + i);
+            if (i < count) {
+                double tail_lhs[S::WIDTH], tail_rhs[S::WIDTH];
+                for (size_t lane = 0; lane < S::WIDTH; lane++) {
+                    tail_lhs[lane] = i + lane < count ? lhs[i + lane] : 1.0;
+                    tail_rhs[lane] = i + lane < count ? rhs[i + lane] : 1.0;
+                }
+                power_lanes<S>(tail_lhs, tail_rhs, tail_lhs);
+                for (size_t lane = 0; i + lane < count; lane++) result[i + lane] = tail_lhs[lane];
+            }
+            return Status::SUCCESS;
+        }
+
+        template <class S>
+        Status unary_minus_kernel(const typename S::scalar* const args[],
+                                  const size_t& count,
+                                  typename S::scalar* result) {
+            const typename S::scalar* arg = args[0];
+            const typename S::vec minus_one = S::set1(-1);
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) S::store(result + i, S::mul(minus_one, S::load(arg + i)));
+            for (; i < count; i++) result[i] = (typename S::scalar)-1 * arg[i];
+            return Status::SUCCESS;
+        }
+
+        template <class S>
+        Status unary_plus_kernel(const typename S::scalar* const args[],
+                                 const size_t& count,
+                                 typename S::scalar* result) {
+            const typename S::scalar* arg = args[0];
+            if (result == arg) return Status::SUCCESS;
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) S::store(result + i, S::load(arg + i));
+            for (; i < count; i++) result[i] = arg[i];
+            return Status::SUCCESS;
+        }
+
+        // Kernels for the built in functions. Each lane goes through the same
+        // operations as the scalar versions in exprfunctions.cpp, so all
+        // instruction sets give the same results.
+        template <class S>
+        Status sqrt_function_kernel(const typename S::scalar* const args[],
+                                    size_t,
+                                    size_t count,
+                                    typename S::scalar* result) {
+            const typename S::scalar* arg = args[0];
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) S::store(result + i, S::sqrt(S::load(arg + i)));
+            for (; i < count; i++) result[i] = scalar_sqrt(arg[i]);
+            return Status::SUCCESS;
+        }
+
+        template <class S>
+        Status abs_function_kernel(const typename S::scalar* const args[],
+                                   size_t,
+                                   size_t count,
+                                   typename S::scalar* result) {
+            const typename S::scalar* arg = args[0];
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) S::store(result + i, S::abs(S::load(arg + i)));
+            for (; i < count; i++) result[i] = scalar_abs(arg[i]);
+            return Status::SUCCESS;
+        }
+
+        // Keeps the smaller value, or the NaN, so a NaN anywhere in the
+        // arguments is the result. b != b tests for NaN without std::isnan,
+        // which is an inline function the linker could pick from another
+        // translation unit.
+        template <class S>
+        struct MinOp {
+            static typename S::vec apply(typename S::vec a, typename S::vec b) {
+                return S::select(S::mask_or(S::lt(b, a), S::isnan(b)), b, a);
+            }
+            static typename S::scalar apply(typename S::scalar a, typename S::scalar b) {
+                return (b < a || b != b) ? b : a;
+            }
+        };
+
+        template <class S>
+        struct MaxOp {
+            static typename S::vec apply(typename S::vec a, typename S::vec b) {
+                return S::select(S::mask_or(S::lt(a, b), S::isnan(b)), b, a);
+            }
+            static typename S::scalar apply(typename S::scalar a, typename S::scalar b) {
+                return (a < b || b != b) ? b : a;
+            }
+        };
+
+        // Combines the arguments of each row left to right with Op
+        template <class S, class Op>
+        Status fold_function_kernel(const typename S::scalar* const args[],
+                                    size_t num_args,
+                                    size_t count,
+                                    typename S::scalar* result) {
+            size_t i = 0;
+            for (; i + S::WIDTH <= count; i += S::WIDTH) {
+                typename S::vec value = S::load(args[0] + i);
+                for (size_t iarg = 1; iarg < num_args; iarg++) value = Op::apply(value, S::load(args[iarg] + i));
+                S::store(result + i, value);
+            }
+            for (; i < count; i++) {
+                typename S::scalar value = args[0][i];
+                for (size_t iarg = 1; iarg < num_args; iarg++) value = Op::apply(value, args[iarg][i]);
+                result[i] = value;
+            }
+            return Status::SUCCESS;
+        }
+
+        template <class S>
+        Status min_function_kernel(const typename S::scalar* const args[],
+                                   size_t num_args,
+                                   size_t count,
+                                   typename S::scalar* result) {
+            return fold_function_kernel<S, MinOp<S> >(args, num_args, count, result);
+        }
+
+        template <class S>
+        Status max_function_kernel(const typename S::scalar* const args[],
+                                   size_t num_args,
+                                   size_t count,
+                                   typename S::scalar* result) {
+            return fold_function_kernel<S, MaxOp<S> >(args, num_args, count, result);
+        }
+
+        template <class S>
+        Status sum_function_kernel(const typename S::scalar* const args[],
+                                   size_t num_args,
+                                   size_t count,
+                                   typename S::scalar* result) {
+            return fold_function_kernel<S, AddOp<S> >(args, num_args, count, result);
+        }
+    } // namespace
+} // namespace exprparse
+
+#endif // !EXPRSIMD_INTERNAL_H
@@ -0,0 +1,201 @@
+// exprsimd_sse2.cpp
+//
+// SSE2 batch kernels. SSE2 is part of x86-64, so these always run there.
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse_internal.h"
+#include <emmintrin.h>
+
+namespace exprparse {
+    namespace {
+        struct SimdSSE2 {
+            typedef double scalar;
+            typedef __m128d vec;
+            typedef __m128i ivec;
+            typedef __m128d mask;
+            static const size_t WIDTH = 2;
+
+            static vec load(const double* p) {
+                return _mm_loadu_pd(p);
+            }
+            static void store(double* p, vec a) {
+                _mm_storeu_pd(p, a);
+            }
+            static vec set1(double a) {
+                return _mm_set1_pd(a);
+            }
+            static vec add(vec a, vec b) {
+                return _mm_add_pd(a, b);
+            }
+            static vec sub(vec a, vec b) {
+                return _mm_sub_pd(a, b);
+            }
+            static vec mul(vec a, vec b) {
+                return _mm_mul_pd(a, b);
+            }
+            static vec div(vec a, vec b) {
+                return _mm_div_pd(a, b);
+            }
+            static vec abs(vec a) {
+                return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+            }
+            static vec sqrt(vec a) {
+                return _mm_sqrt_pd(a);
+            }
+            static mask lt(vec a, vec b) {
+                return _mm_cmplt_pd(a, b);
+            }
+            static mask le(vec a, vec b) {
+                return _mm_cmple_pd(a, b);
+            }
+            static mask isnan(vec a) {
+                return _mm_cmpunord_pd(a, a);
+            }
+            static mask mask_and(mask a, mask b) {
+                return _mm_and_pd(a, b);
+            }
+            static mask mask_or(mask a, mask b) {
+                return _mm_or_pd(a, b);
+            }
+            static bool any(mask m) {
+                return _mm_movemask_pd(m) != 0;
+            }
+            static unsigned bits(mask m) {
+                return (unsigned)_mm_movemask_pd(m);
+            }
+            static vec select(mask m, vec a, vec b) {
+                return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+            }
+            static ivec to_bits(vec a) {
+                return _mm_castpd_si128(a);
+            }
+            static vec from_bits(ivec a) {
+                return _mm_castsi128_pd(a);
+            }
+            static ivec iset1(long long a) {
+                return _mm_set1_epi64x(a);
+            }
+            static ivec iand(ivec a, ivec b) {
+                return _mm_and_si128(a, b);
+            }
+            static ivec ior(ivec a, ivec b) {
+                return _mm_or_si128(a, b);
+            }
+            static ivec iadd(ivec a, ivec b) {
+                return _mm_add_epi64(a, b);
+            }
+            static ivec isub(ivec a, ivec b) {
+                return _mm_sub_epi64(a, b);
+            }
+            static ivec srl52(ivec a) {
+                return _mm_srli_epi64(a, 52);
+            }
+            static ivec sll52(ivec a) {
+                return _mm_slli_epi64(a, 52);
+            }
+        };
+
+        struct SimdSSE2Float {
+            typedef float scalar;
+            typedef __m128 vec;
+            typedef __m128 mask;
+            static const size_t WIDTH = 4;
+
+            static vec load(const float* p) {
+                return _mm_loadu_ps(p);
+            }
+            static void store(float* p, vec a) {
+                _mm_storeu_ps(p, a);
+            }
+            static vec set1(float a) {
+                return _mm_set1_ps(a);
+            }
+            static vec add(vec a, vec b) {
+                return _mm_add_ps(a, b);
+            }
+            static vec sub(vec a, vec b) {
+                return _mm_sub_ps(a, b);
+            }
+            static vec mul(vec a, vec b) {
+                return _mm_mul_ps(a, b);
+            }
+            static vec div(vec a, vec b) {
+                return _mm_div_ps(a, b);
+            }
+            static vec abs(vec a) {
+                return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+            }
+            static vec sqrt(vec a) {
+                return _mm_sqrt_ps(a);
+            }
+            static mask lt(vec a, vec b) {
+                return _mm_cmplt_ps(a, b);
+            }
+            static mask isnan(vec a) {
+                return _mm_cmpunord_ps(a, a);
+            }
+            static mask mask_and(mask a, mask b) {
+                return _mm_and_ps(a, b);
+            }
+            static mask mask_or(mask a, mask b) {
+                return _mm_or_ps(a, b);
+            }
+            static bool any(mask m) {
+                return _mm_movemask_ps(m) != 0;
+            }
+            static vec select(mask m, vec a, vec b) {
+                return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+            }
+        };
+    } // namespace
+} // namespace exprparse
+
+#include "exprsimd_internal.h"
+
+namespace exprparse {
+    const BatchOperation g_sse2_kernels[NUM_OPERATORS] = { add_kernel<SimdSSE2>,         subtract_kernel<SimdSSE2>,
+                                                           multiply_kernel<SimdSSE2>,    divide_kernel<SimdSSE2>,
+                                                           power_kernel<SimdSSE2>,       unary_minus_kernel<SimdSSE2>,
+                                                           unary_plus_kernel<SimdSSE2> };
+
+    const ExpressionBatchFunction g_sse2_function_kernels[NUM_FUNCTION_KERNELS] = { sqrt_function_kernel<SimdSSE2>,
+                                                                                    abs_function_kernel<SimdSSE2>,
+                                                                                    min_function_kernel<SimdSSE2>,
+                                                                                    max_function_kernel<SimdSSE2>,
+                                                                                    sum_function_kernel<SimdSSE2> };
+
+    // Powers and sums have no float kernels, they are computed in double
+    const FloatBatchOperation g_sse2_float_kernels[NUM_OPERATORS] = { add_kernel<SimdSSE2Float>,
+                                                                      subtract_kernel<SimdSSE2Float>,
+                                                                      multiply_kernel<SimdSSE2Float>,
+                                                                      divide_kernel<SimdSSE2Float>,
+                                                                      NULL,
+                                                                      unary_minus_kernel<SimdSSE2Float>,
+                                                                      unary_plus_kernel<SimdSSE2Float> };
+
+    const FloatBatchFunction g_sse2_float_function_kernels[NUM_FUNCTION_KERNELS] = {
+        sqrt_function_kernel<SimdSSE2Float>, abs_function_kernel<SimdSSE2Float>, min_function_kernel<SimdSSE2Float>,
+        max_function_kernel<SimdSSE2Float>, NULL
+    };
+} // namespace exprparse
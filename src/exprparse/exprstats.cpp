@@ -0,0 +1,139 @@
+// exprstats.cpp
+//
+// Optional timing and counters of the parsing stages
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exprparse.h"
+#include "exprparse_internal.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+namespace exprparse {
+#if defined(EXPRPARSE_ENABLE_STATS)
+    namespace {
+        typedef struct AtomicStageStats {
+            atomic<uint64_t> count;
+            atomic<uint64_t> total_ns;
+            atomic<uint64_t> max_ns;
+            atomic<uint64_t> histogram[STATS_HISTOGRAM_BUCKETS];
+        } AtomicStageStats;
+
+        // Same layout as ParseStats. Being static, it starts out zeroed.
+        typedef struct AtomicParseStats {
+            AtomicStageStats stages[NUM_PARSE_STAGES];
+            atomic<uint64_t> tokens;
+            atomic<uint64_t> max_operator_depth;
+            atomic<uint64_t> statuses[NUM_STATUS_CODES];
+        } AtomicParseStats;
+
+        AtomicParseStats g_stats;
+
+        void update_max(atomic<uint64_t>& max, uint64_t value) {
+            uint64_t current = max.load(memory_order_relaxed);
+            while (value > current && !max.compare_exchange_weak(current, value, memory_order_relaxed)) {
+            }
+        }
+
+        // Index of the highest set bit, capped to the last bucket
+        size_t get_bucket(uint64_t ns) {
+            size_t bucket = 0;
+            while (ns >>= 1) bucket++;
+            return bucket < STATS_HISTOGRAM_BUCKETS ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
+        }
+    } // namespace
+
+    StageTimer::~StageTimer() {
+        if (stage_ == NUM_PARSE_STAGES) return;
+        uint64_t ns = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_).count();
+        AtomicStageStats& stage = g_stats.stages[stage_];
+        stage.count.fetch_add(1, memory_order_relaxed);
+        stage.total_ns.fetch_add(ns, memory_order_relaxed);
+        update_max(stage.max_ns, ns);
+        stage.histogram[get_bucket(ns)].fetch_add(1, memory_order_relaxed);
+    }
+
+    void record_tokens(size_t num_tokens) {
+        g_stats.tokens.fetch_add(num_tokens, memory_order_relaxed);
+    }
+
+    void record_operator_depth(size_t depth) {
+        update_max(g_stats.max_operator_depth, depth);
+    }
+
+    void record_status(Status status) {
+        if ((size_t)status < NUM_STATUS_CODES) g_stats.statuses[status].fetch_add(1, memory_order_relaxed);
+    }
+
+    bool is_stats_enabled() {
+        return true;
+    }
+
+    ParseStats get_parse_stats() {
+        ParseStats stats;
+        for (size_t istage = 0; istage < NUM_PARSE_STAGES; istage++) {
+            const AtomicStageStats& stage = g_stats.stages[istage];
+            stats.stages[istage].count = stage.count.load(memory_order_relaxed);
+            stats.stages[istage].total_ns = stage.total_ns.load(memory_order_relaxed);
+            stats.stages[istage].max_ns = stage.max_ns.load(memory_order_relaxed);
+            for (size_t ibucket = 0; ibucket < STATS_HISTOGRAM_BUCKETS; ibucket++)
+                stats.stages[istage].histogram[ibucket] = stage.histogram[ibucket].load(memory_order_relaxed);
+        }
+        stats.tokens = g_stats.tokens.load(memory_order_relaxed);
+        stats.max_operator_depth = g_stats.max_operator_depth.load(memory_order_relaxed);
+        for (size_t istatus = 0; istatus < NUM_STATUS_CODES; istatus++)
+            stats.statuses[istatus] = g_stats.statuses[istatus].load(memory_order_relaxed);
+        return stats;
+    }
+
+    void reset_parse_stats() {
+        for (AtomicStageStats& stage : g_stats.stages) {
+            stage.count.store(0, memory_order_relaxed);
+            stage.total_ns.store(0, memory_order_relaxed);
+            stage.max_ns.store(0, memory_order_relaxed);
+            for (atomic<uint64_t>& bucket : stage.histogram) bucket.store(0, memory_order_relaxed);
+        }
+        g_stats.tokens.store(0, memory_order_relaxed);
+        g_stats.max_operator_depth.store(0, memory_order_relaxed);
+        for (atomic<uint64_t>& count : g_stats.statuses) count.store(0, memory_order_relaxed);
+    }
+#else
+    bool is_stats_enabled() {
+        return false;
+    }
+
+    ParseStats get_parse_stats() {
+        ParseStats stats;
+        memset(&stats, 0, sizeof(stats));
+        return stats;
+    }
+
+    void reset_parse_stats() {
+    }
+#endif
+} // namespace exprparse
@@ -0,0 +1,356 @@
+// exprfuzz.cpp
+//
+// Differential fuzz target for the exprparse parsers
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Each input is parsed by IncrementalParser, which runs the tokenizer and
+// convert_tokens_to_rpn as separate stages and is the reference here, and
+// compared against:
+//
+//  - IncrementalParser fed the same input in three fragments
+//  - parse_expression, which reads well formed input in a single pass
+//  - compile_expression followed by evaluate, on the heap and on a caller
+//    provided stack, and evaluate_batch on one row
+//  - the same expression compiled to machine code by compile_native
+//  - evaluate_batch over several copies of the row with the widest vector
+//    kernels this cpu has, whose rows must all be the same
+//  - an ExpressionSet of just the expression, evaluated on its own and as
+//    a batch of one row
+//  - evaluate_bounds, whose interval must hold the result
+//
+// Every path must give the same Status and, on success, the same bits, or
+// NaN for both. The one exception is the vector kernels on an expression
+// with a power, which is computed as exp(y*log(x)) to within a relative
+// error of about 1e-13, see set_simd_level. Their result need only lie
+// within the interval of evaluate_bounds, which allows for that error. Any
+// difference aborts, which libFuzzer reports as a crash.
+//
+// Built with clang and EXPRPARSE_LIBFUZZER this is a libFuzzer target. Built
+// otherwise it has its own main, which runs the files named on the command
+// line, or random inputs made from expression fragments.
+
+#include "exprparse.h"
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace exprparse;
+
+namespace {
+    // Values of the variables inputs may use. Other names are unbound.
+    double g_x = 0.75, g_y = -2.0, g_z = 0.0;
+
+    const SymbolTable& get_symbols() {
+        static SymbolTable symbols = [] {
+            SymbolTable table;
+            table.bind("x", &g_x);
+            table.bind("y", &g_y);
+            table.bind("z", &g_z);
+            return table;
+        }();
+        return symbols;
+    }
+
+    // The sign of a NaN depends on where it was made, and constants are
+    // folded at compile time, so any two NaNs are the same
+    bool same_bits(double a, double b) {
+        return (std::isnan(a) && std::isnan(b)) || memcmp(&a, &b, sizeof(double)) == 0;
+    }
+
+    [[noreturn]] void mismatch(const string& input, const char* path, Status expected, Status status, double expected_value,
+                               double value) {
+        fprintf(stderr, "exprfuzz: %s differs from the reference on \"", path);
+        for (char c : input) fprintf(stderr, isprint((unsigned char)c) ? "%c" : "\\x%02x", (unsigned char)c);
+        fprintf(stderr, "\"\n");
+        fprintf(stderr, "  reference: %s, %.17g\n", get_status_string(expected).c_str(), expected_value);
+        fprintf(stderr, "  %s: %s, %.17g\n", path, get_status_string(status).c_str(), value);
+        abort();
+    }
+
+    void check(const string& input, const char* path, Status expected, double expected_value, Status status,
+               double value) {
+        if (status != expected || (expected == Status::SUCCESS && !same_bits(value, expected_value)))
+            mismatch(input, path, expected, status, expected_value, value);
+    }
+
+    // Same as above, for the NaN every failed row of a batch is set to
+    void check_row(const string& input, const char* path, Status expected, double expected_value, Status status,
+                   double row) {
+        if (expected != Status::SUCCESS && status == expected && !std::isnan(row))
+            mismatch(input, path, expected, status, expected_value, row);
+        check(input, path, expected, expected_value, status, row);
+    }
+
+    // Rows of the vector batch, enough for whole vectors of every width
+    // and a partial one
+    const size_t VECTOR_ROWS = 35;
+
+    // True if the expression may raise to a power with the ^ operator,
+    // whose vector kernels are not exact
+    bool has_power_operator(const string& input) {
+        return input.find('^') != string::npos || input.find("**") != string::npos;
+    }
+
+    void run_input(const string& input) {
+        const SymbolTable& symbols = get_symbols();
+
+        IncrementalParser reference;
+        double expected = 0.0;
+        reference.feed(input);
+        Status expected_status = reference.finish(symbols, &expected);
+
+        IncrementalParser fragments;
+        double value = 0.0;
+        fragments.feed(string_view(input).substr(0, input.size() / 3));
+        fragments.feed(string_view(input).substr(input.size() / 3, input.size() / 3));
+        fragments.feed(string_view(input).substr(2 * (input.size() / 3)));
+        Status status = fragments.finish(symbols, &value);
+        check(input, "fragments", expected_status, expected, status, value);
+
+        value = 0.0;
+        status = parse_expression(input, symbols, &value);
+        check(input, "parse_expression", expected_status, expected, status, value);
+
+        CompiledExpression compiled;
+        status = compile_expression(input, symbols, &compiled);
+        if (status != Status::SUCCESS) {
+            // Errors in the expression come first here, while the reference
+            // evaluates as it goes and may meet an unbound variable or a
+            // division by zero before the error
+            bool evaluated_first =
+                expected_status == Status::UNBOUND_VARIABLE || expected_status == Status::DIVIDE_BY_ZERO;
+            if (status != expected_status && !evaluated_first)
+                mismatch(input, "compile_expression", expected_status, status, expected, 0.0);
+            return;
+        }
+        value = 0.0;
+        status = compiled.evaluate(&value);
+        check(input, "evaluate", expected_status, expected, status, value);
+
+        vector<double> stack(compiled.stack_depth());
+        value = 0.0;
+        status = compiled.evaluate(&value, stack.data(), stack.size());
+        check(input, "evaluate on caller stack", expected_status, expected, status, value);
+
+        // Rows that fail are NaN in a batch
+        vector<const double*> columns;
+        vector<Interval> bounds;
+        for (size_t slot = 0; slot < compiled.num_variables(); slot++) {
+            const double* column = symbols.find(compiled.variable_name(slot));
+            columns.push_back(column);
+            bounds.push_back(Interval{ *column, *column });
+        }
+        double row = 0.0;
+        Status batch_status = evaluate_batch(compiled, columns.data(), 1, &row);
+        check_row(input, "evaluate_batch", expected_status, expected, batch_status, row);
+
+        CompiledExpression native = compiled;
+        if (native.compile_native() == Status::SUCCESS) {
+            value = 0.0;
+            status = native.evaluate(&value);
+            check(input, "compile_native", expected_status, expected, status, value);
+        }
+
+        Interval range;
+        if (evaluate_bounds(compiled, bounds.data(), &range) != Status::SUCCESS)
+            mismatch(input, "evaluate_bounds", expected_status, Status::ERROR, expected, 0.0);
+        bool outside = !(range.lo <= expected && expected <= range.hi);
+        if (expected_status == Status::SUCCESS && !std::isnan(expected) && outside)
+            mismatch(input, "evaluate_bounds", expected_status, expected_status, expected,
+                     range.lo > expected ? range.lo : range.hi);
+
+        vector<vector<double>> copies;
+        vector<const double*> vector_columns;
+        for (const double* column : columns) copies.emplace_back(VECTOR_ROWS, *column);
+        for (const vector<double>& copy : copies) vector_columns.push_back(copy.data());
+        vector<double> rows(VECTOR_ROWS);
+        set_simd_level(get_max_simd_level());
+        batch_status = evaluate_batch(compiled, vector_columns.data(), rows.size(), rows.data());
+        set_simd_level(SimdLevel::SIMD_SCALAR);
+        for (double vector_row : rows) {
+            if (!same_bits(vector_row, rows[0]))
+                mismatch(input, "evaluate_batch rows", expected_status, batch_status, rows[0], vector_row);
+        }
+        if (has_power_operator(input)) {
+            // The error of the power can be made larger by a later
+            // subtraction, or turn a zero divisor into a tiny one, so the
+            // row is only held to the bounds, which allow for the error
+            bool failed = batch_status != Status::SUCCESS || std::isnan(rows[0]);
+            if (failed ? !std::isnan(rows[0]) : !(range.lo <= rows[0] && rows[0] <= range.hi))
+                mismatch(input, "evaluate_batch vector", expected_status, batch_status, expected, rows[0]);
+        } else {
+            check_row(input, "evaluate_batch vector", expected_status, expected, batch_status, rows[0]);
+        }
+
+        ExpressionSet set;
+        Status set_status;
+        status = compile_expression_set({ input }, &set, &set_status);
+        check(input, "compile_expression_set", Status::SUCCESS, 0.0, status, 0.0);
+        value = 0.0;
+        status = set.evaluate(symbols, &value);
+        check(input, "ExpressionSet::evaluate", expected_status, expected, status, value);
+        row = 0.0;
+        double* set_out[] = { &row };
+        status = set.evaluate_batch(symbols, 1, set_out);
+        check_row(input, "ExpressionSet::evaluate_batch", expected_status, expected, status, row);
+    }
+
+    void setup() {
+        // Every input must be parsed, not found in the cache. Batches are
+        // run with the scalar kernels, which match evaluate bit for bit,
+        // other than the one run with the vector kernels.
+        set_expression_cache_capacity(0);
+        set_simd_level(SimdLevel::SIMD_SCALAR);
+    }
+} // namespace
+
+extern "C" int LLVMFuzzerInitialize(int*, char***) {
+    setup();
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    run_input(string((const char*)data, size));
+    return 0;
+}
+
+#if !defined(EXPRPARSE_LIBFUZZER)
+namespace {
+    template <size_t N>
+    const char* pick(mt19937_64& rng, const char* const (&choices)[N]) {
+        return choices[rng() % N];
+    }
+
+    const char* const g_operands[] = { "1", "2.5", "0", "1e3", ".5", "x", "y", "z", "1e400", "9999999999999999999999" };
+    const char* const g_operators[] = { "+", "-", "*", "/", "^", "**", " + ", "*-" };
+    const char* const g_functions[] = { "max", "min", "sqrt", "pow", "sum", "abs", "log", "hypot", "atan2", "floor" };
+
+    // Appends a well formed expression, which may still fail to evaluate
+    void append_expression(mt19937_64& rng, size_t depth, string* input) {
+        size_t choice = depth == 0 ? 0 : rng() % 5;
+        if (choice == 0) {
+            *input += pick(rng, g_operands);
+        } else if (choice == 1) {
+            bool square = rng() % 2 == 0;
+            *input += square ? "[" : "(";
+            append_expression(rng, depth - 1, input);
+            *input += square ? "]" : ")";
+        } else if (choice == 2) {
+            *input += "-";
+            append_expression(rng, depth - 1, input);
+        } else if (choice == 3) {
+            *input += pick(rng, g_functions);
+            *input += "(";
+            for (size_t arg = 0, n_args = 1 + rng() % 3; arg < n_args; arg++) {
+                if (arg > 0) *input += ",";
+                append_expression(rng, depth - 1, input);
+            }
+            *input += ")";
+        } else {
+            append_expression(rng, depth - 1, input);
+            *input += pick(rng, g_operators);
+            append_expression(rng, depth - 1, input);
+        }
+    }
+
+    // Pieces spliced in to break well formed expressions
+    const char* const g_pieces[] = { "1", "x", "w", " ", "+", "-", "*", "^", "(", ")",
+                                     "[", "]", ",", "max(", "$", "1e", "e", "_", "\t" };
+
+    // Returns a well formed expression, and half the time breaks it by
+    // replacing, inserting or removing a few bytes
+    string random_input(mt19937_64& rng) {
+        string input;
+        append_expression(rng, rng() % 6, &input);
+        if (rng() % 2 == 0) return input;
+        for (size_t n_edits = 1 + rng() % 3; n_edits > 0; n_edits--) {
+            size_t at = rng() % (input.size() + 1);
+            size_t choice = rng() % 4;
+            if (choice == 0 && at < input.size()) {
+                input.erase(at, 1);
+            } else if (choice == 1) {
+                input.insert(at, 1, (char)(rng() % 128));
+            } else {
+                input.insert(at, pick(rng, g_pieces));
+            }
+        }
+        return input;
+    }
+
+    bool read_file(const char* path, string* contents) {
+        FILE* file = fopen(path, "rb");
+        if (file == NULL) return false;
+        char buffer[4096];
+        size_t n;
+        contents->clear();
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) contents->append(buffer, n);
+        fclose(file);
+        return true;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t runs = 100000;
+    uint64_t seed = 23;
+    vector<const char*> files;
+    for (int iarg = 1; iarg < argc; iarg++) {
+        if (iarg + 1 < argc && strcmp(argv[iarg], "--runs") == 0) {
+            runs = strtoull(argv[++iarg], NULL, 10);
+        } else if (iarg + 1 < argc && strcmp(argv[iarg], "--seed") == 0) {
+            seed = strtoull(argv[++iarg], NULL, 10);
+        } else if (argv[iarg][0] == '-') {
+            fprintf(stderr, "usage: %s [--runs N] [--seed N] [FILE...]\n", argv[0]);
+            return 2;
+        } else {
+            files.push_back(argv[iarg]);
+        }
+    }
+
+    setup();
+    if (!files.empty()) {
+        string input;
+        for (const char* path : files) {
+            if (!read_file(path, &input)) {
+                fprintf(stderr, "exprfuzz: cannot read %s\n", path);
+                return 2;
+            }
+            run_input(input);
+        }
+        printf("exprfuzz: %zu files agree\n", files.size());
+        return 0;
+    }
+
+    mt19937_64 rng(seed);
+    for (size_t run = 0; run < runs; run++) run_input(random_input(rng));
+    printf("exprfuzz: %zu random inputs agree\n", runs);
+    return 0;
+}
+#endif
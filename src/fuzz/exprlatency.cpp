@@ -0,0 +1,267 @@
+// exprlatency.cpp
+//
+// Worst case parsing latency per input byte on hostile expressions
+//
+// MIT License
+//
+// Copyright (c) 2018 Alex Gary
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Parses families of inputs that stress one part of the parser each, such
+// as long runs of digits or of unary minus, at sizes growing by 4x up to
+// --max-bytes. Each input is timed --reps times through parse_expression,
+// compile_expression and IncrementalParser, and the worst time per byte
+// is reported for each size.
+//
+// Parsing is linear when the time per byte stays flat as inputs grow. The
+// order column is the slope of a least squares fit of the log of the median
+// time against the log of the size, for inputs of at least 4096 bytes. It
+// is near 1 for linear parsing and near 2 for quadratic, while caches and
+// page faults only bend it a little. The exit status is 1 if any order is
+// above --max-order.
+//
+// Families that nest brackets as deeply as they are long are parsed with
+// the nesting limit raised to --max-bytes, so they time parsing rather than
+// NESTING_TOO_DEEP. The parser recurses once per bracket, so the families
+// run on a thread with a stack to match.
+
+#include "exprparse.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+    string repeat(const string& piece, size_t n) {
+        string out;
+        out.reserve(piece.size() * n);
+        for (size_t i = 0; i < n; i++) out += piece;
+        return out;
+    }
+
+    // Builds an input of about n bytes
+    typedef string (*MakeInput)(size_t n);
+
+    typedef struct Family {
+        const char* name;
+        MakeInput make;
+        bool deep; // Nests brackets up to as deeply as the input is long
+    } Family;
+
+    const Family g_families[] = {
+        { "digits", [](size_t n) { return repeat("7", n); }, false },
+        { "fraction", [](size_t n) { return "0." + repeat("3", n); }, false },
+        { "exponent", [](size_t n) { return "1e" + repeat("9", n); }, false },
+        { "number_then_name", [](size_t n) { return repeat("1", n) + "x"; }, false },
+        { "name", [](size_t n) { return repeat("v", n); }, false },
+        { "whitespace", [](size_t n) { return repeat(" ", n) + "1"; }, false },
+        { "unary_minus", [](size_t n) { return repeat("-", n) + "1"; }, false },
+        { "unary_mixed", [](size_t n) { return repeat("-+", n / 2) + "1"; }, false },
+        { "power_chain", [](size_t n) { return repeat("1^", n / 2) + "1"; }, false },
+        { "sum_chain", [](size_t n) { return repeat("1+", n / 2) + "1"; }, false },
+        { "mixed_chain", [](size_t n) { return repeat("2*3-4/5^", n / 8) + "1"; }, false },
+        { "nested", [](size_t n) { return repeat("(", n / 2) + "1" + repeat(")", n / 2); }, true },
+        { "nested_calls", [](size_t n) { return repeat("abs(", n / 5) + "1" + repeat(")", n / 5); }, true },
+        { "unclosed", [](size_t n) { return repeat("(", n); }, true },
+        { "unopened", [](size_t n) { return "1" + repeat(")", n); }, false },
+        { "call_args", [](size_t n) { return "max(" + repeat("1,", n / 2) + "1)"; }, false },
+        { "call_in_args", [](size_t n) { return "max(" + repeat("min(1),", n / 7) + "1)"; }, false },
+        { "commas", [](size_t n) { return repeat(",", n); }, false },
+        { "operands", [](size_t n) { return repeat("1 ", n / 2); }, false },
+        { "operators", [](size_t n) { return "1" + repeat("*", n); }, false },
+        { "late_error", [](size_t n) { return repeat("1+", n / 2) + "$"; }, false },
+        { "late_syntax_error", [](size_t n) { return repeat("1+", n / 2) + ")"; }, false },
+        { "variables", [](size_t n) {
+              string out;
+              for (size_t i = 0; out.size() < n; i++) out += (i ? "+v" : "v") + to_string(i);
+              return out;
+          },
+          false },
+    };
+
+    typedef enum { PARSE, COMPILE, INCREMENTAL, NUM_PATHS } Path;
+
+    const char* const g_path_names[NUM_PATHS] = { "parse", "compile", "incremental" };
+
+    // Stack of the thread running the families, per level of nesting
+    // allowed. Unoptimized builds use a few hundred bytes.
+    const size_t STACK_BYTES_PER_LEVEL = 1024;
+
+    // Incremental input arrives in fragments of this many bytes, so tokens
+    // are often cut in two
+    const size_t FRAGMENT_SIZE = 61;
+
+    exprparse::Status run_path(Path path, const string& input) {
+        double result;
+        if (path == PARSE) return exprparse::parse_expression(input, &result);
+        if (path == COMPILE) {
+            exprparse::CompiledExpression compiled;
+            return exprparse::compile_expression(input, &compiled);
+        }
+        exprparse::IncrementalParser parser;
+        for (size_t first = 0; first < input.size(); first += FRAGMENT_SIZE) {
+            parser.feed(string_view(input).substr(first, FRAGMENT_SIZE));
+        }
+        return parser.finish(&result);
+    }
+
+    typedef struct Timing {
+        double worst; // Nanoseconds per byte
+        double median;
+        exprparse::Status status;
+    } Timing;
+
+    // Fits log(median time) = a + order * log(size), from the first size of
+    // at least 4096 bytes, as smaller ones are dominated by the fixed cost of
+    // a call
+    double fit_order(const vector<size_t>& sizes, const vector<Timing>& timings) {
+        vector<double> xs, ys;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            if (sizes[i] < 4096) continue;
+            double total_ns = max(timings[i].median, 1e-3) * (double)sizes[i];
+            xs.push_back(log((double)sizes[i]));
+            ys.push_back(log(total_ns));
+        }
+        double mean_x = 0.0, mean_y = 0.0;
+        for (size_t i = 0; i < xs.size(); i++) {
+            mean_x += xs[i] / (double)xs.size();
+            mean_y += ys[i] / (double)ys.size();
+        }
+        double sxy = 0.0, sxx = 0.0;
+        for (size_t i = 0; i < xs.size(); i++) {
+            sxy += (xs[i] - mean_x) * (ys[i] - mean_y);
+            sxx += (xs[i] - mean_x) * (xs[i] - mean_x);
+        }
+        return sxy / sxx;
+    }
+
+    Timing time_path(Path path, const string& input, int reps) {
+        vector<double> times;
+        Timing timing;
+        for (int rep = 0; rep < reps; rep++) {
+            auto start = chrono::steady_clock::now();
+            timing.status = run_path(path, input);
+            auto stop = chrono::steady_clock::now();
+            times.push_back((double)chrono::duration_cast<chrono::nanoseconds>(stop - start).count() /
+                            (double)input.size());
+        }
+        sort(times.begin(), times.end());
+        timing.worst = times.back();
+        timing.median = times[times.size() / 2];
+        return timing;
+    }
+
+    typedef struct Options {
+        size_t max_bytes;
+        int reps;
+        double max_order;
+        const char* only_family;
+        double worst_order; // Set by run_families
+    } Options;
+
+    // Times every family, printing a row per path, with arg an Options
+    void* run_families(void* arg) {
+        Options& options = *static_cast<Options*>(arg);
+        vector<size_t> sizes;
+        for (size_t n = 1024; n <= options.max_bytes; n *= 4) sizes.push_back(n);
+
+        printf("%-18s %-12s %-20s", "family", "path", "status");
+        for (size_t n : sizes) printf(" %9zuB", n);
+        printf(" %6s\n", "order");
+
+        options.worst_order = 0.0;
+        for (const Family& family : g_families) {
+            if (options.only_family != NULL && strcmp(family.name, options.only_family) != 0) continue;
+            exprparse::set_max_nesting_depth(family.deep ? options.max_bytes : exprparse::DEFAULT_MAX_NESTING_DEPTH);
+            vector<string> inputs;
+            for (size_t n : sizes) inputs.push_back(family.make(n));
+            for (int path = 0; path < NUM_PATHS; path++) {
+                vector<Timing> timings;
+                for (const string& input : inputs) timings.push_back(time_path((Path)path, input, options.reps));
+
+                double order = fit_order(sizes, timings);
+                options.worst_order = max(options.worst_order, order);
+
+                printf("%-18s %-12s %-20.20s", family.name, g_path_names[path],
+                       exprparse::get_status_string(timings.back().status).c_str());
+                for (const Timing& timing : timings) printf(" %8.1fns", timing.worst);
+                printf(" %6.2f%s\n", order, order > options.max_order ? " !" : "");
+            }
+        }
+        exprparse::set_max_nesting_depth(exprparse::DEFAULT_MAX_NESTING_DEPTH);
+        return NULL;
+    }
+
+    void usage(const char* program) {
+        fprintf(stderr, "usage: %s [--max-bytes N] [--reps N] [--max-order X] [--family NAME]\n", program);
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    options.max_bytes = 1 << 20;
+    options.reps = 5;
+    options.max_order = 1.5;
+    options.only_family = NULL;
+    for (int iarg = 1; iarg < argc; iarg++) {
+        if (iarg + 1 < argc && strcmp(argv[iarg], "--max-bytes") == 0) {
+            options.max_bytes = strtoull(argv[++iarg], NULL, 10);
+        } else if (iarg + 1 < argc && strcmp(argv[iarg], "--reps") == 0) {
+            options.reps = atoi(argv[++iarg]);
+        } else if (iarg + 1 < argc && strcmp(argv[iarg], "--max-order") == 0) {
+            options.max_order = atof(argv[++iarg]);
+        } else if (iarg + 1 < argc && strcmp(argv[iarg], "--family") == 0) {
+            options.only_family = argv[++iarg];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (options.max_bytes < 4 * 4096 || options.reps < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // Every input must be parsed, not found in the cache
+    exprparse::set_expression_cache_capacity(0);
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STACK_BYTES_PER_LEVEL * options.max_bytes + (1 << 20));
+    int error = pthread_create(&thread, &attr, run_families, &options);
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        fprintf(stderr, "%s: can not make a stack for nesting %zu deep: %s\n", argv[0], options.max_bytes,
+                strerror(error));
+        return 2;
+    }
+    pthread_join(thread, NULL);
+
+    printf("worst order %.2f, limit %.2f\n", options.worst_order, options.max_order);
+    return options.worst_order > options.max_order ? 1 : 0;
+}
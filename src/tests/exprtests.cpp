@@ -24,15 +24,41 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include "exprallocs.h"
+#include "exprconstexpr.h"
 #include "exprparse.h"
 #include "gtest/gtest.h"
 
+#include <atomic>
+#include <cfloat>
+#include <cmath>
 #include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <math.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
 namespace exprparse {
+    // Turns off the expression cache for the lifetime of the object, so that
+    // parse_expression goes through the tokenizer every time
+    class CacheDisabled {
+    public:
+        CacheDisabled() : capacity_(get_expression_cache_stats().capacity) {
+            set_expression_cache_capacity(0);
+        }
+
+        ~CacheDisabled() {
+            set_expression_cache_capacity(capacity_);
+        }
+
+    private:
+        size_t capacity_;
+    };
 
     void common_success_test_eval(string expression, double expected_value) {
         double result_value;
@@ -41,6 +67,12 @@ namespace exprparse {
         ret_val = parse_expression(expression, &result_value);
         EXPECT_EQ(ret_val, Status::SUCCESS);
         EXPECT_DOUBLE_EQ(result_value, expected_value);
+
+        CacheDisabled no_cache;
+        ParseArena arena(16);
+        ret_val = parse_expression(expression, &arena, &result_value);
+        EXPECT_EQ(ret_val, Status::SUCCESS);
+        EXPECT_DOUBLE_EQ(result_value, expected_value);
     }
 
     void common_error_test(string expression, Status expected_status) {
@@ -49,6 +81,11 @@ namespace exprparse {
         cerr << "[          ]     Expr = " << expression << endl;
         ret_val = parse_expression(expression, &result_value);
         EXPECT_EQ(ret_val, expected_status);
+
+        CacheDisabled no_cache;
+        ParseArena arena(16);
+        ret_val = parse_expression(expression, &arena, &result_value);
+        EXPECT_EQ(ret_val, expected_status);
     }
 
     TEST(ParseNumber, PositiveSpace) {
@@ -94,6 +131,27 @@ namespace exprparse {
         common_success_test_eval("-.1E+5", -.1E+5);
     }
 
+    TEST(ParseNumber, TrailingDecimal) {
+        common_success_test_eval("1.", 1.0);
+        common_success_test_eval("1.e2", 100.0);
+        common_success_test_eval("1.5e3", 1500.0);
+    }
+
+    TEST(ParseNumber, OutOfRange) {
+        common_success_test_eval("1e999", HUGE_VAL);
+        common_success_test_eval("1e-999", 0.0);
+    }
+
+    TEST(Tokenizer, Whitespace) {
+        common_success_test_eval("\t1 +\r\n2\f", 3.0);
+        common_success_test_eval("  2  **  3  ", 8.0);
+    }
+
+    TEST(Tokenizer, Brackets) {
+        common_success_test_eval("[1+2]*3", 9.0);
+        common_success_test_eval("[(1+2)*[3-1]]", 6.0);
+    }
+
     TEST(Operators, BinaryAdd) {
         common_success_test_eval("10.0 + 5.0", 15.0);
         common_success_test_eval("10.0+5.0", 15.0);
@@ -159,11 +217,13 @@ namespace exprparse {
     }
 
     TEST(InvalidExpression, UnknownToken) {
-        common_error_test("abc", Status::UNKNOWN_TOKEN);
         common_error_test("$", Status::UNKNOWN_TOKEN);
         common_error_test("&", Status::UNKNOWN_TOKEN);
         common_error_test("..1", Status::UNKNOWN_TOKEN);
         common_error_test("1e.1", Status::UNKNOWN_TOKEN);
+        common_error_test("1+\v2", Status::UNKNOWN_TOKEN);
+        common_error_test("2x", Status::UNKNOWN_TOKEN);
+        common_error_test("1e5e", Status::UNKNOWN_TOKEN);
 
     }
 
@@ -178,4 +238,2198 @@ namespace exprparse {
         common_error_test("3.0/", Status::TOO_FEW_ARGUMENTS);
         common_error_test("4.0^", Status::TOO_FEW_ARGUMENTS);
     }
+
+    TEST(InvalidExpression, ErrorOrder) {
+        // The division happens before the missing argument is needed
+        common_error_test("1/0+", Status::DIVIDE_BY_ZERO);
+        common_error_test("1 1/0", Status::DIVIDE_BY_ZERO);
+        common_error_test("+1/0", Status::DIVIDE_BY_ZERO);
+        common_error_test("2 3/0", Status::DIVIDE_BY_ZERO);
+    }
+
+    TEST(CompiledExpression, EvaluateMany) {
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("(12.0+4.0)^0.5/5.0", &compiled), Status::SUCCESS);
+        EXPECT_FALSE(compiled.empty());
+        EXPECT_EQ(compiled.unoptimized_size(), 7u);
+        EXPECT_EQ(compiled.size(), 1u); // Folded to a constant
+        for (int i = 0; i < 3; i++) {
+            double result_value = 0.0;
+            EXPECT_EQ(compiled.evaluate(&result_value), Status::SUCCESS);
+            EXPECT_DOUBLE_EQ(result_value, 0.8);
+        }
+
+        // Copies share the compiled program
+        CompiledExpression copy = compiled;
+        double result_value = 0.0;
+        EXPECT_EQ(copy.evaluate(&result_value), Status::SUCCESS);
+        EXPECT_DOUBLE_EQ(result_value, 0.8);
+    }
+
+    TEST(CompiledExpression, CompileErrors) {
+        CompiledExpression compiled;
+        EXPECT_EQ(compile_expression("((1-2)+1/2", &compiled), Status::UNMATCHED_BRACKETS);
+        EXPECT_TRUE(compiled.empty());
+        EXPECT_EQ(compile_expression("", &compiled), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(compile_expression("$", &compiled), Status::UNKNOWN_TOKEN);
+        EXPECT_EQ(compile_expression("1.0 2.0", &compiled), Status::TOO_MANY_ARGUMENTS);
+        EXPECT_EQ(compile_expression("3.0/", &compiled), Status::TOO_FEW_ARGUMENTS);
+        EXPECT_EQ(compile_expression("1/0+", &compiled), Status::TOO_FEW_ARGUMENTS);
+        EXPECT_TRUE(compiled.empty());
+
+        double result_value;
+        EXPECT_EQ(compiled.evaluate(&result_value), Status::EMPTY_EXPRESSION);
+    }
+
+    TEST(CompiledExpression, EvaluateErrors) {
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("5/(1-1)", &compiled), Status::SUCCESS);
+        for (int i = 0; i < 2; i++) {
+            double result_value;
+            EXPECT_EQ(compiled.evaluate(&result_value), Status::DIVIDE_BY_ZERO);
+        }
+    }
+
+    TEST(CompiledExpression, DeepExpression) {
+        // Deeper than the stack allocated evaluation buffer. The variable
+        // keeps it from being folded into a constant.
+        string expression;
+        for (int i = 0; i < 100; i++) expression += "1+(";
+        expression += "x";
+        for (int i = 0; i < 100; i++) expression += ")";
+
+        double x = 1.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression(expression, symbols, &compiled), Status::SUCCESS);
+        double result_value;
+        EXPECT_EQ(compiled.evaluate(&result_value), Status::SUCCESS);
+        EXPECT_DOUBLE_EQ(result_value, 101.0);
+    }
+
+    TEST(CompiledExpression, CallerStack) {
+        double x = 2.0, y = 0.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        symbols.bind("y", &y);
+        CompiledExpression compiled;
+        EXPECT_EQ(compiled.stack_depth(), 0u);
+        ASSERT_EQ(compile_expression("x", symbols, &compiled), Status::SUCCESS);
+        EXPECT_EQ(compiled.stack_depth(), 1u);
+        ASSERT_EQ(compile_expression("x*y + x/(y - 1)", symbols, &compiled), Status::SUCCESS);
+        EXPECT_EQ(compiled.stack_depth(), 4u);
+        // x y x+1 2 x y, just before the subtraction
+        ASSERT_EQ(compile_expression("max(x, y, x + 1, 2*(x - y))", symbols, &compiled), Status::SUCCESS);
+        EXPECT_EQ(compiled.stack_depth(), 6u);
+
+        // Far deeper than the buffer evaluate keeps on the stack
+        string expression;
+        for (int i = 0; i < 1000; i++) expression += "x/(";
+        expression += "y";
+        for (int i = 0; i < 1000; i++) expression += ")";
+        ASSERT_EQ(compile_expression(expression, symbols, &compiled), Status::SUCCESS);
+        ASSERT_EQ(compiled.stack_depth(), 1001u);
+        vector<double> stack(compiled.stack_depth());
+        double expected, result_value;
+        y = 1.0;
+        ASSERT_EQ(compiled.evaluate(&expected), Status::SUCCESS);
+
+        // Neither results nor errors allocate
+        size_t allocations = get_allocation_count();
+        EXPECT_EQ(compiled.evaluate(&result_value, stack.data(), stack.size()), Status::SUCCESS);
+        EXPECT_EQ(result_value, expected);
+        y = 0.0;
+        EXPECT_EQ(compiled.evaluate(&result_value, stack.data(), stack.size()), Status::DIVIDE_BY_ZERO);
+        EXPECT_EQ(compiled.evaluate(&result_value, stack.data(), stack.size() - 1), Status::ERROR);
+        EXPECT_EQ(get_allocation_count() - allocations, 0u);
+
+        CompiledExpression unbound;
+        ASSERT_EQ(compile_expression("x + z", symbols, &unbound), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(unbound.evaluate(&result_value, stack.data(), stack.size()), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(CompiledExpression().evaluate(&result_value, NULL, 0), Status::EMPTY_EXPRESSION);
+    }
+
+    void common_optimize_test(const string& expression, size_t expected_size) {
+        cerr << "[          ]     Expr = " << expression << endl;
+        double x = 0.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression(expression, symbols, &compiled), Status::SUCCESS);
+        EXPECT_EQ(compiled.size(), expected_size);
+        EXPECT_LE(compiled.size(), compiled.unoptimized_size());
+
+        // Results must match the unoptimized parse bit for bit, signed zeros included
+        for (double value : { 2.5, -3.0, 0.0, -0.0, 1e-300, (double)INFINITY, -(double)INFINITY, (double)NAN }) {
+            x = value;
+            double expected, actual;
+            Status expected_status = parse_expression(expression, symbols, &expected);
+            EXPECT_EQ(compiled.evaluate(&actual), expected_status) << "x = " << value;
+            if (expected_status != Status::SUCCESS) continue;
+            if (std::isnan(expected)) {
+                EXPECT_TRUE(std::isnan(actual)) << "x = " << value;
+            } else {
+                EXPECT_EQ(actual, expected) << "x = " << value;
+                EXPECT_EQ(signbit(actual), signbit(expected)) << "x = " << value;
+            }
+        }
+    }
+
+    TEST(CompiledExpression, ConstantFolding) {
+        common_optimize_test("2^10*(3+4)*x", 3);
+        common_optimize_test("-(2*3) + x", 3);
+        common_optimize_test("[1.5 + 2.25] * (3.125 - .5) / 7e-3", 1);
+        common_optimize_test("x*2*3", 5); // Not regrouped
+        common_optimize_test("x/(2-2)", 3); // Fails at evaluation
+        common_optimize_test("1/0 + x", 5);
+        common_optimize_test("(1/(1-1))*0 + x", 7);
+    }
+
+    TEST(CompiledExpression, Identities) {
+        common_optimize_test("+x", 1);
+        common_optimize_test("--x", 1);
+        common_optimize_test("-+-+x", 1);
+        common_optimize_test("---x", 2);
+        common_optimize_test("x*1", 1);
+        common_optimize_test("1*x", 1);
+        common_optimize_test("x/1", 1);
+        common_optimize_test("x^1", 1);
+        common_optimize_test("x-0", 1);
+        common_optimize_test("x+-0", 1);
+        common_optimize_test("-0+x", 1);
+        common_optimize_test("(x*(3-2))^(2/2) - (5-5)", 1);
+        common_optimize_test("x+0", 3); // -0 + 0 is +0
+        common_optimize_test("0+x", 3);
+        common_optimize_test("x-(-0)", 3);
+        common_optimize_test("1/x", 3);
+        common_optimize_test("1^x", 3);
+    }
+
+    void common_jit_test(const string& expression) {
+        cerr << "[          ]     Expr = " << expression << endl;
+        double x, y, z;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        symbols.bind("y", &y);
+        symbols.bind("z", &z);
+        CompiledExpression interpreted, native;
+        ASSERT_EQ(compile_expression(expression, symbols, &interpreted), Status::SUCCESS);
+        ASSERT_EQ(compile_expression(expression, symbols, &native), Status::SUCCESS);
+        ASSERT_EQ(native.compile_native(), Status::SUCCESS);
+        EXPECT_TRUE(native.is_native());
+        EXPECT_FALSE(interpreted.is_native());
+
+        const double values[] = { 2.5, -3.0, 0.0, -0.0, 1e-11, 7e300, INFINITY, -INFINITY, NAN, -NAN };
+        for (double x_value : values) {
+            for (double y_value : values) {
+                x = x_value;
+                y = y_value;
+                z = x_value * 0.5 + 1.0;
+                double expected = 1.0, actual = 2.0;
+                Status expected_status = interpreted.evaluate(&expected);
+                EXPECT_EQ(native.evaluate(&actual), expected_status) << "x = " << x << ", y = " << y;
+                // Which NaN comes out of an operation on two NaNs depends on
+                // operand order, which compilers are free to swap
+                if (std::isnan(expected) && std::isnan(actual)) continue;
+                EXPECT_EQ(memcmp(&expected, &actual, sizeof(double)), 0)
+                << "x = " << x << ", y = " << y << ": " << expected << " != " << actual;
+            }
+        }
+    }
+
+    TEST(Jit, MatchesInterpreter) {
+        if (!is_jit_supported()) {
+            CompiledExpression compiled;
+            ASSERT_EQ(compile_expression("1+2", &compiled), Status::SUCCESS);
+            EXPECT_EQ(compiled.compile_native(), Status::ERROR);
+            EXPECT_FALSE(compiled.is_native());
+            return;
+        }
+        common_jit_test("x");
+        common_jit_test("x+y");
+        common_jit_test("x-y*z");
+        common_jit_test("x/y");
+        common_jit_test("z/(x-x)");
+        common_jit_test("-x");
+        common_jit_test("-(x*y) - -z");
+        common_jit_test("x^y");
+        common_jit_test("z + x*(y + x^y) - z^2");
+        common_jit_test("3.2*(x+1) - y/2 + x^2 - x*y");
+        common_jit_test("x/y + y/x + 1/z");
+        // Uses every register, with a call to pow at the deepest point
+        common_jit_test("x+(y+(z+(x+(y+(z+(x+(y+(z+(x+(y+(z+(x^y))))))))))))");
+        common_jit_test("max(x, y, z) - sin(x)*min(y, 2)");
+        common_jit_test("x+(y+(z+(x+(y+(z+(x+(y+(z+(x+(y+(z+sum(x, y))))))))))))");
+        common_jit_test("sqrt(x) + hypot(y, z) / abs(x - y)");
+    }
+
+    TEST(Jit, Fallback) {
+        // Too deep for the registers, evaluated by the interpreter
+        string expression;
+        for (int i = 0; i < 20; i++) expression += "x+(";
+        expression += "x";
+        for (int i = 0; i < 20; i++) expression += ")";
+
+        double x = 1.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression(expression, symbols, &compiled), Status::SUCCESS);
+        EXPECT_EQ(compiled.compile_native(), Status::ERROR);
+        EXPECT_FALSE(compiled.is_native());
+        double result_value;
+        EXPECT_EQ(compiled.evaluate(&result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 21.0);
+
+        compiled = CompiledExpression();
+        EXPECT_EQ(compiled.compile_native(), Status::EMPTY_EXPRESSION);
+    }
+
+    TEST(Arena, Allocate) {
+        ParseArena arena(64);
+        char* first = static_cast<char*>(arena.allocate(3, 1));
+        double* second = static_cast<double*>(arena.allocate(sizeof(double), alignof(double)));
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(second) % alignof(double), 0u);
+        EXPECT_GT(reinterpret_cast<char*>(second), first);
+        arena.allocate(1000, 8); // Does not fit the first block
+        size_t capacity = arena.capacity();
+        EXPECT_GE(capacity, 1064u);
+
+        arena.reset();
+        EXPECT_EQ(arena.allocate(3, 1), first);
+        arena.allocate(1000, 8);
+        EXPECT_EQ(arena.capacity(), capacity);
+
+        char buffer[32];
+        ParseArena buffer_arena(buffer, sizeof(buffer));
+        EXPECT_EQ(buffer_arena.allocate(16, 1), buffer);
+        EXPECT_EQ(buffer_arena.capacity(), sizeof(buffer));
+    }
+
+    TEST(Arena, WarmParseDoesNotAllocate) {
+        // Long enough to outgrow the first block several times
+        string expression;
+        for (int i = 0; i < 300; i++) expression += "(" + to_string(i) + ".5 * long_variable_name_" + to_string(i % 3) + ") + ";
+        expression += "[1e3 ** -x]";
+
+        double x = 0.5, a = 1.0, b = 2.0, c = 3.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        symbols.bind("long_variable_name_0", &a);
+        symbols.bind("long_variable_name_1", &b);
+        symbols.bind("long_variable_name_2", &c);
+
+        CacheDisabled no_cache;
+        ParseArena arena;
+        double cold_result, warm_result;
+        ASSERT_EQ(parse_expression(expression, symbols, &arena, &cold_result), Status::SUCCESS);
+        size_t capacity = arena.capacity();
+
+        size_t allocations = get_allocation_count();
+        ASSERT_EQ(parse_expression(expression, symbols, &arena, &warm_result), Status::SUCCESS);
+        EXPECT_EQ(get_allocation_count() - allocations, 0u);
+        EXPECT_EQ(arena.capacity(), capacity);
+        EXPECT_EQ(warm_result, cold_result);
+
+        // Errors do not allocate either
+        string divide_by_zero = expression + " / 0";
+        string unbound = expression + " + y";
+        parse_expression(divide_by_zero, symbols, &arena, &warm_result);
+        allocations = get_allocation_count();
+        EXPECT_EQ(parse_expression(divide_by_zero, symbols, &arena, &warm_result), Status::DIVIDE_BY_ZERO);
+        EXPECT_EQ(parse_expression(unbound, symbols, &arena, &warm_result), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(get_allocation_count() - allocations, 0u);
+    }
+
+    TEST(Arena, ShortExpressionDoesNotAllocate) {
+        // Short expressions fit the buffer parse_expression keeps on the stack
+        string expression = "[1.5 + 2.25] * (3.125 - .5) / 7e-3 + x";
+        double x = 1.0, result;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        CacheDisabled no_cache;
+        size_t allocations = get_allocation_count();
+        EXPECT_EQ(parse_expression(expression, symbols, &result), Status::SUCCESS);
+        EXPECT_EQ(get_allocation_count() - allocations, 0u);
+    }
+
+    TEST(Arena, StringViewDoesNotCopy) {
+        // Expressions are read in place from a larger buffer, which is not
+        // null terminated after the expression
+        const char buffer[] = "2.5*(x+1)|garbage that follows";
+        const size_t length = 9;
+        double x = 3.0, result_value = 0.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        CacheDisabled no_cache;
+        ParseArena arena;
+        EXPECT_EQ(parse_expression(string_view(buffer, length), symbols, &arena, &result_value), Status::SUCCESS);
+
+        size_t allocations = get_allocation_count();
+        EXPECT_EQ(parse_expression(string_view(buffer, length), symbols, &arena, &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 10.0);
+        EXPECT_EQ(parse_expression(buffer, length, symbols, &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 10.0);
+        EXPECT_EQ(parse_expression(buffer, 3, &arena, &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 2.5);
+        EXPECT_EQ(get_allocation_count() - allocations, 0u);
+
+        EXPECT_EQ(parse_expression(buffer, 0, &result_value), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(parse_expression(buffer, length + 1, &result_value), Status::UNKNOWN_TOKEN);
+    }
+
+    TEST(Cache, HitsAndMisses) {
+        clear_expression_cache();
+        double result_value;
+        for (int i = 0; i < 3; i++) {
+            EXPECT_EQ(parse_expression("(12.0+4.0)^0.5/5.0", &result_value), Status::SUCCESS);
+            EXPECT_DOUBLE_EQ(result_value, 0.8);
+        }
+        ExpressionCacheStats stats = get_expression_cache_stats();
+        EXPECT_EQ(stats.misses, 1u);
+        EXPECT_EQ(stats.hits, 2u);
+        EXPECT_EQ(stats.size, 1u);
+        EXPECT_EQ(stats.capacity, 1024u);
+
+        // Failures are not kept, and still report the same errors
+        for (int i = 0; i < 2; i++) {
+            EXPECT_EQ(parse_expression("1/0+", &result_value), Status::DIVIDE_BY_ZERO);
+            EXPECT_EQ(parse_expression("1/0", &result_value), Status::DIVIDE_BY_ZERO);
+        }
+        stats = get_expression_cache_stats();
+        EXPECT_EQ(stats.misses, 4u);
+        EXPECT_EQ(stats.hits, 3u);
+        EXPECT_EQ(stats.size, 2u);
+
+        // Cached expressions look their variables up on every call
+        double x = 2.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        EXPECT_EQ(parse_expression("x*x", symbols, &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 4.0);
+        x = 3.0;
+        EXPECT_EQ(parse_expression("x*x", symbols, &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 9.0);
+        EXPECT_EQ(parse_expression("x*x", &result_value), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(parse_expression("x*x+", symbols, &result_value), Status::TOO_FEW_ARGUMENTS);
+
+        clear_expression_cache();
+        stats = get_expression_cache_stats();
+        EXPECT_EQ(stats.hits + stats.misses + stats.size, 0u);
+    }
+
+    TEST(Cache, Eviction) {
+        clear_expression_cache();
+        set_expression_cache_capacity(32);
+        double result_value;
+        for (int i = 0; i < 500; i++) {
+            EXPECT_EQ(parse_expression(to_string(i) + "+1", &result_value), Status::SUCCESS);
+            EXPECT_EQ(result_value, i + 1.0);
+        }
+        ExpressionCacheStats stats = get_expression_cache_stats();
+        EXPECT_EQ(stats.capacity, 32u);
+        EXPECT_LE(stats.size, 32u);
+        EXPECT_EQ(stats.misses, 500u);
+        EXPECT_EQ(stats.evictions, stats.misses - stats.size);
+
+        // Shrinking evicts straight away
+        set_expression_cache_capacity(16);
+        EXPECT_LE(get_expression_cache_stats().size, 16u);
+
+        set_expression_cache_capacity(0);
+        EXPECT_EQ(parse_expression("1+1", &result_value), Status::SUCCESS);
+        stats = get_expression_cache_stats();
+        EXPECT_EQ(stats.size, 0u);
+        EXPECT_EQ(stats.misses, 500u); // Not looked up while off
+
+        set_expression_cache_capacity(1024);
+        clear_expression_cache();
+    }
+
+    TEST(Cache, Threads) {
+        clear_expression_cache();
+        set_expression_cache_capacity(64);
+        const int num_threads = 4, num_calls = 2000;
+        vector<int> failures(num_threads, 0);
+        vector<thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([t, &failures]() {
+                for (int i = 0; i < num_calls; i++) {
+                    int key = (i * 7 + t) % 100; // More keys than the cache holds
+                    double result_value;
+                    if (parse_expression(to_string(key) + "*2", &result_value) != Status::SUCCESS ||
+                        result_value != key * 2.0)
+                        failures[t]++;
+                }
+            });
+        }
+        for (thread& th : threads) th.join();
+        for (int t = 0; t < num_threads; t++) EXPECT_EQ(failures[t], 0);
+
+        ExpressionCacheStats stats = get_expression_cache_stats();
+        EXPECT_EQ(stats.hits + stats.misses, (size_t)(num_threads * num_calls));
+        EXPECT_LE(stats.size, 64u);
+        set_expression_cache_capacity(1024);
+        clear_expression_cache();
+    }
+
+    // Feeds expression to an IncrementalParser cut at each of the given
+    // positions, and checks the outcome is the same as parse_expression's
+    void common_incremental_test(IncrementalParser& parser,
+                                 const SymbolTable& symbols,
+                                 const string& expression,
+                                 const vector<size_t>& cuts) {
+        double expected = 0.0, actual = 0.0;
+        Status expected_status = parse_expression(expression, symbols, &expected);
+
+        Status feed_status = Status::SUCCESS;
+        size_t start = 0;
+        for (size_t cut : cuts) {
+            feed_status = parser.feed(expression.data() + start, cut - start);
+            start = cut;
+        }
+        // Each fragment is copied and overwritten, to be sure nothing is kept
+        string last = expression.substr(start);
+        feed_status = parser.feed(last);
+        last.assign(last.size(), '#');
+
+        Status status = parser.finish(symbols, &actual);
+        string where = expression + " cut at";
+        for (size_t cut : cuts) where += " " + to_string(cut);
+        EXPECT_EQ(status, expected_status) << where;
+        if (feed_status != Status::SUCCESS) {
+            // feed stops at an unknown token, which finish still reports
+            // after brackets before it that are nested too deeply
+            Status feed_expected =
+            expected_status == Status::NESTING_TOO_DEEP ? Status::UNKNOWN_TOKEN : expected_status;
+            EXPECT_EQ(feed_status, feed_expected) << where;
+        }
+        if (status == Status::SUCCESS && expected_status == Status::SUCCESS) {
+            EXPECT_EQ(memcmp(&expected, &actual, sizeof(double)), 0) << where << ": " << expected << " != " << actual;
+        }
+    }
+
+    TEST(Incremental, MatchesParseExpression) {
+        CacheDisabled no_cache;
+        double x = 1.25, y_1 = -4.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        symbols.bind("y_1", &y_1);
+        const vector<string> expressions = { "1.5e+3*2",
+                                             "2**3",
+                                             "2 * * 3",
+                                             "2***3",
+                                             "x*y_1 + 2e-1",
+                                             "xe-1+x",
+                                             " 1 + -2 ",
+                                             "",
+                                             " ",
+                                             "(1+2",
+                                             "1 $ 2",
+                                             "3.5.2",
+                                             "1e",
+                                             "1e+",
+                                             "2x",
+                                             ".5+.25",
+                                             "10.0E+05*2.0-.2E+05",
+                                             "[1.5 + 2.25] * (3.125 - .5) / 7e-3",
+                                             "1/0",
+                                             "z + 1",
+                                             "-(-x)^2^-0.5",
+                                             "max (x, -2, y_1) + sum(1,2e-1)",
+                                             "sin(x)",
+                                             "sin x",
+                                             "max()" };
+
+        IncrementalParser parser;
+        for (const string& expression : expressions) {
+            common_incremental_test(parser, symbols, expression, {});
+            for (size_t i = 0; i <= expression.size(); i++) {
+                common_incremental_test(parser, symbols, expression, { i });
+                for (size_t j = i; j <= expression.size(); j++)
+                    common_incremental_test(parser, symbols, expression, { i, j });
+            }
+
+            // One character at a time
+            vector<size_t> cuts;
+            for (size_t i = 1; i < expression.size(); i++) cuts.push_back(i);
+            common_incremental_test(parser, symbols, expression, cuts);
+        }
+
+        // Nested past the limit, well formed or not, and with errors before
+        // and after the depth is reached
+        size_t max_depth = get_max_nesting_depth();
+        set_max_nesting_depth(8);
+        const vector<string> deep = { string(2000, '('),
+                                      string(9, '(') + "1" + string(9, ')'),
+                                      string(8, '(') + "1" + string(8, ')'),
+                                      "max(max(max(max(max(max(max(max(max(1)))))))))",
+                                      string(9, '[') + "1 $ 2",
+                                      string(9, '(') + "1 $ 2",
+                                      "1 $ " + string(9, '('),
+                                      string(4, '(') + "1 1" + string(5, '('),
+                                      string(9, '(') + ")" };
+        for (const string& expression : deep) {
+            common_incremental_test(parser, symbols, expression, {});
+            for (size_t i = 0; i <= expression.size(); i += 3) {
+                common_incremental_test(parser, symbols, expression, { i });
+            }
+        }
+        set_max_nesting_depth(max_depth);
+    }
+
+    TEST(Incremental, Reset) {
+        IncrementalParser parser;
+        double result_value;
+        EXPECT_EQ(parser.feed("1 $"), Status::UNKNOWN_TOKEN);
+        EXPECT_EQ(parser.feed("+ 2"), Status::UNKNOWN_TOKEN);
+        parser.reset();
+        EXPECT_EQ(parser.feed("12"), Status::SUCCESS);
+        EXPECT_EQ(parser.feed("3 + 1"), Status::SUCCESS);
+        EXPECT_EQ(parser.finish(&result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 124.0);
+
+        // finish leaves the parser ready for the next expression
+        EXPECT_EQ(parser.finish(&result_value), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(parser.feed("2^"), Status::SUCCESS);
+        EXPECT_EQ(parser.feed("10"), Status::SUCCESS);
+        EXPECT_EQ(parser.finish(&result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 1024.0);
+    }
+
+    TEST(Parser, MatchesSeparateStages) {
+        // parse_expression reads expressions in one pass, while
+        // IncrementalParser still tokenizes them first and then converts the
+        // tokens. Random strings of tokens, mostly malformed, must get the
+        // same status and result from both.
+        const char* pieces[] = { "1", "2.5", "0", "x", "y", " ", "+", "-", "-", "*", "/", "^", "**", "(",
+                                 "(", ")", ")", "[", "]", ",", "max", "sqrt", "atan2", "sum", "$" };
+        const size_t num_pieces = sizeof(pieces) / sizeof(pieces[0]);
+        double x = 0.75, y = -2.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        symbols.bind("y", &y);
+        CacheDisabled no_cache;
+        IncrementalParser parser;
+        srand(21);
+        size_t successes = 0;
+        for (int i = 0; i < 20000; i++) {
+            string expression;
+            for (int length = rand() % 14; length >= 0; length--) expression += pieces[rand() % num_pieces];
+            double expected = 0.0, actual = 0.0;
+            parser.feed(expression);
+            Status expected_status = parser.finish(symbols, &expected);
+            EXPECT_EQ(parse_expression(expression, symbols, &actual), expected_status) << expression;
+            if (expected_status == Status::SUCCESS) {
+                EXPECT_EQ(memcmp(&expected, &actual, sizeof(double)), 0) << expression;
+                successes++;
+            }
+        }
+        EXPECT_GT(successes, 200u);
+    }
+
+    TEST(Parser, LongChains) {
+        // Chains of operators are not parsed by recursion, so they have no
+        // limit
+        CacheDisabled no_cache;
+        double result_value;
+        string powers;
+        for (int i = 0; i < 100000; i++) powers += "1^";
+        EXPECT_EQ(parse_expression(powers + "2", &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 1.0);
+        EXPECT_EQ(parse_expression("2^" + powers + "2", &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 2.0);
+        string unary(100001, '-');
+        EXPECT_EQ(parse_expression(unary + "2^2", &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, -4.0);
+        EXPECT_EQ(parse_expression("2^" + unary + "1", &result_value), Status::SUCCESS);
+        EXPECT_EQ(result_value, 0.5);
+    }
+
+    TEST(Parser, NestingLimit) {
+        CacheDisabled no_cache;
+        EXPECT_EQ(get_max_nesting_depth(), DEFAULT_MAX_NESTING_DEPTH);
+        double result_value;
+        auto nested = [](const string& open, size_t depth) {
+            string expression;
+            for (size_t i = 0; i < depth; i++) expression += open;
+            expression += "1";
+            for (size_t i = 0; i < depth; i++) expression += ")";
+            return expression;
+        };
+        EXPECT_EQ(parse_expression(nested("(", DEFAULT_MAX_NESTING_DEPTH), &result_value), Status::SUCCESS);
+        EXPECT_EQ(parse_expression(nested("(", DEFAULT_MAX_NESTING_DEPTH + 1), &result_value),
+                  Status::NESTING_TOO_DEEP);
+        EXPECT_EQ(parse_expression(nested("abs(-", DEFAULT_MAX_NESTING_DEPTH), &result_value), Status::SUCCESS);
+        EXPECT_EQ(parse_expression(nested("abs(-", DEFAULT_MAX_NESTING_DEPTH + 1), &result_value),
+                  Status::NESTING_TOO_DEEP);
+        CompiledExpression compiled;
+        EXPECT_EQ(compile_expression(nested("[", 5000), &compiled), Status::NESTING_TOO_DEEP);
+        EXPECT_TRUE(compiled.empty());
+
+        set_max_nesting_depth(2);
+        EXPECT_EQ(parse_expression("((1)) + [2]", &result_value), Status::SUCCESS);
+        EXPECT_EQ(parse_expression("max((1), 2)", &result_value), Status::SUCCESS);
+        EXPECT_EQ(parse_expression("(((1)))", &result_value), Status::NESTING_TOO_DEEP);
+        EXPECT_EQ(parse_expression("max(((1)), 2)", &result_value), Status::NESTING_TOO_DEEP);
+        EXPECT_EQ(parse_expression("max(1, sqrt(sqrt(1)))", &result_value), Status::NESTING_TOO_DEEP);
+
+        // The limit is found as the expression is read, so errors before it
+        // are reported as usual
+        EXPECT_EQ(parse_expression("(((1) $", &result_value), Status::NESTING_TOO_DEEP);
+        EXPECT_EQ(parse_expression("1 $ (((1)))", &result_value), Status::UNKNOWN_TOKEN);
+        EXPECT_EQ(parse_expression("(1 2) + (((1)))", &result_value), Status::TOO_MANY_ARGUMENTS);
+
+        set_max_nesting_depth(DEFAULT_MAX_NESTING_DEPTH);
+        EXPECT_EQ(get_status_string(Status::NESTING_TOO_DEEP), "Brackets nested too deeply");
+    }
+
+    TEST(Stats, Counters) {
+        CacheDisabled cache_disabled;
+        reset_parse_stats();
+        double result_value;
+        ASSERT_EQ(parse_expression("1+(2*3)", &result_value), Status::SUCCESS);
+        ASSERT_EQ(parse_expression("1/0", &result_value), Status::DIVIDE_BY_ZERO);
+        ASSERT_EQ(parse_expression("1+", &result_value), Status::TOO_FEW_ARGUMENTS);
+        ASSERT_EQ(parse_expression("1 $", &result_value), Status::UNKNOWN_TOKEN);
+
+        ParseStats stats = get_parse_stats();
+        if (!is_stats_enabled()) {
+            EXPECT_EQ(stats.tokens, 0u);
+            EXPECT_EQ(stats.stages[STAGE_TOKENIZE].count, 0u);
+            EXPECT_EQ(stats.statuses[Status::SUCCESS], 0u);
+            return;
+        }
+        // Well-formed expressions are read in one pass, timed as the convert
+        // stage; only malformed ones are tokenized separately
+        EXPECT_EQ(stats.stages[STAGE_TOKENIZE].count, 2u);
+        EXPECT_EQ(stats.stages[STAGE_CONVERT_TO_RPN].count, 3u);
+        EXPECT_EQ(stats.stages[STAGE_EVALUATE].count, 3u);
+        EXPECT_EQ(stats.tokens, 7u + 3u + 2u);
+        EXPECT_EQ(stats.max_operator_depth, 3u); // + ( *
+        EXPECT_EQ(stats.statuses[Status::SUCCESS], 1u);
+        EXPECT_EQ(stats.statuses[Status::DIVIDE_BY_ZERO], 1u);
+        EXPECT_EQ(stats.statuses[Status::TOO_FEW_ARGUMENTS], 1u);
+        EXPECT_EQ(stats.statuses[Status::UNKNOWN_TOKEN], 1u);
+        for (const StageStats& stage : stats.stages) {
+            uint64_t in_histogram = 0;
+            for (uint64_t bucket : stage.histogram) in_histogram += bucket;
+            EXPECT_EQ(in_histogram, stage.count);
+            EXPECT_LE(stage.max_ns, stage.total_ns);
+        }
+
+        reset_parse_stats();
+        stats = get_parse_stats();
+        EXPECT_EQ(stats.stages[STAGE_TOKENIZE].count, 0u);
+        EXPECT_EQ(stats.max_operator_depth, 0u);
+        EXPECT_EQ(stats.statuses[Status::SUCCESS], 0u);
+    }
+
+    TEST(Stats, Threads) {
+        if (!is_stats_enabled()) return;
+        CacheDisabled cache_disabled;
+        reset_parse_stats();
+        const int num_threads = 4, num_calls = 1000;
+        vector<thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([]() {
+                double result_value;
+                for (int i = 0; i < num_calls; i++) parse_expression(i % 2 ? "2*(3+4)" : "1/0", &result_value);
+            });
+        }
+        for (thread& th : threads) th.join();
+
+        ParseStats stats = get_parse_stats();
+        EXPECT_EQ(stats.stages[STAGE_EVALUATE].count, (uint64_t)(num_threads * num_calls));
+        EXPECT_EQ(stats.tokens, (uint64_t)(num_threads * num_calls / 2 * (7 + 3)));
+        EXPECT_EQ(stats.statuses[Status::SUCCESS], (uint64_t)(num_threads * num_calls / 2));
+        EXPECT_EQ(stats.statuses[Status::DIVIDE_BY_ZERO], (uint64_t)(num_threads * num_calls / 2));
+    }
+
+    TEST(Variables, ParseWithSymbols) {
+        double x = 2.0, y_1 = 0.5;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        symbols.bind("_y1", &y_1);
+
+        double result_value;
+        EXPECT_EQ(parse_expression("3.2*(x+1)", symbols, &result_value), Status::SUCCESS);
+        EXPECT_DOUBLE_EQ(result_value, 3.2 * 3.0);
+        EXPECT_EQ(parse_expression("-x^_y1 - -x", symbols, &result_value), Status::SUCCESS);
+        EXPECT_DOUBLE_EQ(result_value, -pow(2.0, 0.5) + 2.0);
+        EXPECT_EQ(parse_expression("x/(_y1-0.5)", symbols, &result_value), Status::DIVIDE_BY_ZERO);
+    }
+
+    TEST(Variables, Unbound) {
+        common_error_test("abc", Status::UNBOUND_VARIABLE);
+        common_error_test("x+1", Status::UNBOUND_VARIABLE);
+        common_error_test("(x+1", Status::UNMATCHED_BRACKETS);
+
+        double x = 1.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        double result_value;
+        EXPECT_EQ(parse_expression("x+y", symbols, &result_value), Status::UNBOUND_VARIABLE);
+        symbols.unbind("x");
+        EXPECT_EQ(symbols.find("x"), (const double*)NULL);
+        EXPECT_EQ(parse_expression("x", symbols, &result_value), Status::UNBOUND_VARIABLE);
+    }
+
+    TEST(Variables, CompiledRebinding) {
+        double x = 0.0, y = 0.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+
+        CompiledExpression compiled;
+        EXPECT_EQ(compile_expression("x*y + x", symbols, &compiled), Status::UNBOUND_VARIABLE);
+        ASSERT_FALSE(compiled.empty());
+        ASSERT_EQ(compiled.num_variables(), 2u);
+        EXPECT_EQ(compiled.variable_name(0), "x");
+        EXPECT_EQ(compiled.variable_name(1), "y");
+
+        double result_value;
+        EXPECT_EQ(compiled.evaluate(&result_value), Status::UNBOUND_VARIABLE);
+
+        symbols.bind("y", &y);
+        ASSERT_EQ(compiled.bind(symbols), Status::SUCCESS);
+        for (int i = 0; i < 5; i++) {
+            x = i;
+            y = 0.5 * i;
+            EXPECT_EQ(compiled.evaluate(&result_value), Status::SUCCESS);
+            EXPECT_DOUBLE_EQ(result_value, x * y + x);
+        }
+    }
+
+    TEST(Variables, ManySlots) {
+        // Each name appears twice, the second time in reverse order, so
+        // slots are looked up both before and after there are many of them
+        const int n_names = 100;
+        vector<double> values(n_names);
+        SymbolTable symbols;
+        string expression = "0";
+        for (int i = 0; i < n_names; i++) {
+            values[i] = i;
+            symbols.bind("v" + to_string(i), &values[i]);
+            expression += "+v" + to_string(i);
+        }
+        for (int i = n_names - 1; i >= 0; i--) expression += "-2*v" + to_string(i);
+
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression(expression, symbols, &compiled), Status::SUCCESS);
+        ASSERT_EQ(compiled.num_variables(), (size_t)n_names);
+        for (int i = 0; i < n_names; i++) EXPECT_EQ(compiled.variable_name(i), "v" + to_string(i));
+
+        double result_value;
+        EXPECT_EQ(compiled.evaluate(&result_value), Status::SUCCESS);
+        EXPECT_DOUBLE_EQ(result_value, -(n_names * (n_names - 1) / 2.0));
+    }
+
+    TEST(Functions, BuiltIn) {
+        common_success_test_eval("sin(0)", 0.0);
+        common_success_test_eval("2*cos[0] + 1", 3.0);
+        common_success_test_eval("max(1, 5, 3)", 5.0);
+        common_success_test_eval("min(4, -2, 7)", -2.0);
+        common_success_test_eval("sum(1, 2, 3, 4)", 10.0);
+        common_success_test_eval("max(1)", 1.0);
+        common_success_test_eval("max (1, min(4, 2*3), -sum(1, 2))^2", 16.0);
+        common_success_test_eval("sqrt(16) + abs(-2) + pow(2, 3)", 14.0);
+        common_success_test_eval("4*atan2(1, 1)", 4.0 * atan2(1.0, 1.0));
+        common_success_test_eval("-max(-1, -2)", 1.0);
+        common_success_test_eval("sum(1, -2, +3)", 2.0);
+
+        // A NaN argument anywhere makes min and max NaN
+        double result_value;
+        EXPECT_EQ(parse_expression("max(1, sqrt(-1), 2)", &result_value), Status::SUCCESS);
+        EXPECT_TRUE(std::isnan(result_value));
+        EXPECT_EQ(parse_expression("min(sqrt(-1), 2)", &result_value), Status::SUCCESS);
+        EXPECT_TRUE(std::isnan(result_value));
+    }
+
+    TEST(Functions, CallErrors) {
+        common_error_test("max()", Status::TOO_FEW_ARGUMENTS);
+        common_error_test("atan2(1)", Status::TOO_FEW_ARGUMENTS);
+        common_error_test("max(1,)", Status::TOO_FEW_ARGUMENTS);
+        common_error_test("sin(1, 2)", Status::TOO_MANY_ARGUMENTS);
+        common_error_test("max(1 2)", Status::TOO_MANY_ARGUMENTS);
+        common_error_test("1, 2", Status::TOO_MANY_ARGUMENTS);
+        common_error_test("(1, 2)", Status::TOO_MANY_ARGUMENTS);
+        common_error_test("max((1, 2))", Status::TOO_MANY_ARGUMENTS);
+        common_error_test("nosuch(1)", Status::UNKNOWN_TOKEN);
+        common_error_test("max(1, 2", Status::UNMATCHED_BRACKETS);
+        common_error_test("sum(2, 1/0)", Status::DIVIDE_BY_ZERO);
+
+        // Without a bracket after it, the name of a function is a variable
+        double sin_value = 0.5;
+        SymbolTable symbols;
+        symbols.bind("sin", &sin_value);
+        double result_value;
+        EXPECT_EQ(parse_expression("sin + sin(sin)", symbols, &result_value), Status::SUCCESS);
+        EXPECT_DOUBLE_EQ(result_value, 0.5 + sin(0.5));
+    }
+
+    Status clamp_function(const double args[], size_t, double* result) {
+        if (args[1] > args[2]) return Status::ERROR;
+        *result = args[0] < args[1] ? args[1] : (args[0] > args[2] ? args[2] : args[0]);
+        return Status::SUCCESS;
+    }
+
+    Status count_args_function(const double[], size_t num_args, double* result) {
+        *result = (double)num_args;
+        return Status::SUCCESS;
+    }
+
+    Status count_args_batch(const double* const[], size_t num_args, size_t count, double* result) {
+        for (size_t i = 0; i < count; i++) result[i] = (double)num_args;
+        return Status::SUCCESS;
+    }
+
+    TEST(Functions, Register) {
+        // Functions stay registered, so only the first run adds them
+        static const bool registered = register_function("clamp", 3, 3, clamp_function) == Status::SUCCESS &&
+                                       register_function("nargs", 0, ANY_NUMBER_OF_ARGS, count_args_function,
+                                                         count_args_batch) == Status::SUCCESS;
+        EXPECT_TRUE(registered);
+        EXPECT_EQ(register_function("clamp", 1, 1, count_args_function), Status::ERROR);
+        EXPECT_EQ(register_function("max", 1, 1, count_args_function), Status::ERROR);
+        EXPECT_EQ(register_function("", 1, 1, count_args_function), Status::ERROR);
+        EXPECT_EQ(register_function("2x", 1, 1, count_args_function), Status::ERROR);
+        EXPECT_EQ(register_function("a b", 1, 1, count_args_function), Status::ERROR);
+        EXPECT_EQ(register_function("unused", 2, 1, count_args_function), Status::ERROR);
+        EXPECT_EQ(register_function("unused", 1, 1, NULL), Status::ERROR);
+
+        common_success_test_eval("clamp(5, 0, 2)", 2.0);
+        common_success_test_eval("clamp(-5, 0, 2) + 1", 1.0);
+        common_error_test("clamp(5, 2, 0)", Status::ERROR);
+        common_error_test("clamp(1, 2)", Status::TOO_FEW_ARGUMENTS);
+        common_error_test("clamp(1, 2, 3, 4)", Status::TOO_MANY_ARGUMENTS);
+        common_success_test_eval("nargs()", 0.0);
+        common_success_test_eval("nargs(1, 2, 3) * 2", 6.0);
+        common_success_test_eval("nargs(nargs(), nargs(1))", 2.0);
+
+        // Registered functions are called at runtime, built in ones on
+        // constants are folded
+        common_optimize_test("nargs(1, 2) + x", 5);
+        common_optimize_test("max(1, 2) + x", 3);
+        common_optimize_test("clamp(x, -1, 1)", 4);
+
+        // Native code calls them the same way, errors included
+        if (is_jit_supported()) {
+            common_jit_test("clamp(x, y, z) + nargs(x, y)");
+            common_jit_test("nargs()*x + nargs(x, y, z)");
+        }
+    }
+
+    TEST(Functions, Batch) {
+        // More arguments than fit in the inline argument arrays
+        string many_args = "nargs(x";
+        for (int i = 0; i < 20; i++) many_args += ", x";
+        many_args += ") + sum(x";
+        for (int i = 0; i < 20; i++) many_args += ", y*" + to_string(i);
+        many_args += ")";
+
+        const size_t n_rows = 1000;
+        vector<double> x(n_rows), y(n_rows), out(n_rows);
+        for (size_t i = 0; i < n_rows; i++) {
+            x[i] = 0.01 * i - 3.0;
+            y[i] = 0.5 + 0.25 * (i % 17);
+        }
+        x[5] = NAN;
+        y[500] = NAN;
+
+        double x_value, y_value;
+        SymbolTable symbols;
+        symbols.bind("x", &x_value);
+        symbols.bind("y", &y_value);
+        const double* columns[] = { x.data(), y.data() };
+        SimdLevel max_level = get_max_simd_level();
+        for (const string& expression : { string("sqrt(abs(x)) + max(x, y, 1) - min(y, x)*sum(x, y, x)"),
+                                          string("clamp(x, -1, y) + sin(x)*atan2(y, x)"),
+                                          many_args }) {
+            cerr << "[          ]     Expr = " << expression << endl;
+            CompiledExpression compiled;
+            ASSERT_EQ(compile_expression(expression, symbols, &compiled), Status::SUCCESS);
+            ASSERT_EQ(compiled.variable_name(0), "x");
+            for (int level = SimdLevel::SIMD_SCALAR; level <= max_level; level++) {
+                ASSERT_EQ(set_simd_level((SimdLevel)level), Status::SUCCESS);
+                ASSERT_EQ(evaluate_batch(compiled, columns, n_rows, out.data()), Status::SUCCESS);
+                for (size_t i = 0; i < n_rows; i++) {
+                    double expected;
+                    x_value = x[i];
+                    y_value = y[i];
+                    ASSERT_EQ(compiled.evaluate(&expected), Status::SUCCESS);
+                    if (std::isnan(expected))
+                        EXPECT_TRUE(std::isnan(out[i])) << "level " << level << " row " << i;
+                    else
+                        EXPECT_EQ(out[i], expected) << "level " << level << " row " << i;
+                }
+            }
+        }
+        set_simd_level(max_level);
+
+        // Rows where a function fails are NaN
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("clamp(1, x, 0)", &compiled), Status::SUCCESS);
+        EXPECT_EQ(evaluate_batch(compiled, columns, n_rows, out.data()), Status::ERROR);
+        for (size_t i = 0; i < n_rows; i++) {
+            if (x[i] > 0.0)
+                EXPECT_TRUE(std::isnan(out[i])) << "row " << i;
+            else
+                EXPECT_EQ(out[i], 0.0) << "row " << i;
+        }
+    }
+
+    TEST(Batch, MatchesRowByRow) {
+        const size_t n_rows = 1000; // Not a multiple of the block size
+        vector<double> x(n_rows), y(n_rows), out(n_rows);
+        for (size_t i = 0; i < n_rows; i++) {
+            x[i] = 0.01 * i - 3.0;
+            y[i] = 0.5 + 0.25 * (i % 17);
+        }
+
+        double x_value, y_value;
+        SymbolTable symbols;
+        symbols.bind("x", &x_value);
+        symbols.bind("y", &y_value);
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("3.2*(x+1) - y/2 + -x^2 + y**0.5", symbols, &compiled), Status::SUCCESS);
+
+        // The scalar kernels compute exactly what evaluate does
+        SimdLevel level = get_simd_level();
+        ASSERT_EQ(set_simd_level(SimdLevel::SIMD_SCALAR), Status::SUCCESS);
+        const double* columns[] = { x.data(), y.data() };
+        ASSERT_EQ(evaluate_batch(compiled, columns, n_rows, out.data()), Status::SUCCESS);
+        set_simd_level(level);
+        for (size_t i = 0; i < n_rows; i++) {
+            double expected;
+            x_value = x[i];
+            y_value = y[i];
+            ASSERT_EQ(compiled.evaluate(&expected), Status::SUCCESS);
+            EXPECT_EQ(out[i], expected);
+        }
+    }
+
+    TEST(Batch, DivideByZeroRows) {
+        const size_t n_rows = 600;
+        vector<double> x(n_rows), out(n_rows);
+        for (size_t i = 0; i < n_rows; i++) x[i] = (i % 100 == 42) ? 0.0 : (double)i;
+
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("1/x + 1", &compiled), Status::SUCCESS);
+        const double* columns[] = { x.data() };
+        EXPECT_EQ(evaluate_batch(compiled, columns, n_rows, out.data()), Status::DIVIDE_BY_ZERO);
+        for (size_t i = 0; i < n_rows; i++) {
+            if (x[i] == 0.0)
+                EXPECT_TRUE(std::isnan(out[i]));
+            else
+                EXPECT_DOUBLE_EQ(out[i], 1.0 / x[i] + 1.0);
+        }
+    }
+
+    TEST(Batch, ConstantsAndErrors) {
+        vector<double> out(10);
+        CompiledExpression compiled;
+        EXPECT_EQ(evaluate_batch(compiled, NULL, out.size(), out.data()), Status::EMPTY_EXPRESSION);
+
+        ASSERT_EQ(compile_expression("2^10", &compiled), Status::SUCCESS);
+        EXPECT_EQ(evaluate_batch(compiled, NULL, out.size(), out.data()), Status::SUCCESS);
+        for (double value : out) EXPECT_DOUBLE_EQ(value, 1024.0);
+
+        ASSERT_EQ(compile_expression("x*y", &compiled), Status::SUCCESS);
+        const double* columns[] = { out.data(), NULL };
+        EXPECT_EQ(evaluate_batch(compiled, columns, out.size(), out.data()), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(evaluate_batch(compiled, columns, 0, out.data()), Status::UNBOUND_VARIABLE);
+    }
+
+    // Values within [lo, hi] likely to be extremes of an expression: the
+    // ends, zeros, whole numbers and a few at random
+    vector<double> bounds_test_points(double lo, double hi) {
+        vector<double> points = { lo, hi };
+        for (double special : { 0.0, -0.0, 1.0, -1.0, 2.0, -2.0, 3.0, -3.0, 1e300, -1e300 }) {
+            if (lo <= special && special <= hi) points.push_back(special);
+        }
+        double a = std::isfinite(lo) ? lo : fmin(-1e6, hi), b = std::isfinite(hi) ? hi : fmax(1e6, lo);
+        if (!std::isfinite(a) || !std::isfinite(b)) return points;
+        for (int i = 0; i < 4; i++) points.push_back(a + (b - a) * (double)rand() / RAND_MAX);
+        return points;
+    }
+
+    double bounds_test_end() {
+        const double ends[] = { -INFINITY, -10.0, -3.0, -2.0, -1.0,  -0.5, -1e-11,  0.0,
+                                1e-11,     0.5,   1.0,  2.0,  2.5,  3.0,  10.0,   INFINITY };
+        if (rand() % 3 == 0) return 20.0 * (double)rand() / RAND_MAX - 10.0;
+        return ends[rand() % (sizeof(ends) / sizeof(ends[0]))];
+    }
+
+    TEST(Bounds, ContainEveryRow) {
+        const char* expressions[] = { "x + y",
+                                      "x - y",
+                                      "x * y",
+                                      "x / y",
+                                      "(x - 1) / (y + 2)",
+                                      "x * x - 1 / x",
+                                      "x ^ y",
+                                      "-x ^ 2 + x ^ 3",
+                                      "x ^ -1 + y ^ 0.5",
+                                      "(x - 5) ^ y",
+                                      "sqrt(x) + log(y)",
+                                      "exp(x) - cbrt(y)",
+                                      "asin(x) * acos(y)",
+                                      "atan(x) + tanh(y) + sinh(x)",
+                                      "cosh(x) - abs(y)",
+                                      "floor(x) + ceil(y) * round(x)",
+                                      "log2(x) + log10(y)",
+                                      "sin(x) + cos(y) + tan(x)",
+                                      "atan2(y, x)",
+                                      "hypot(x, sqrt(y))",
+                                      "pow(sqrt(x), y) * pow(y, x)",
+                                      "min(x, y, 1) + max(x, -y)",
+                                      "sum(x, y, x * y)" };
+        SimdLevel max_level = get_max_simd_level();
+        srand(22);
+        for (const char* expression : expressions) {
+            CompiledExpression compiled;
+            ASSERT_EQ(compile_expression(expression, &compiled), Status::SUCCESS);
+            for (int ibox = 0; ibox < 200; ibox++) {
+                Interval bounds[2];
+                for (Interval& bound : bounds) {
+                    double a = bounds_test_end(), b = bounds_test_end();
+                    bound.lo = a < b ? a : b;
+                    bound.hi = a < b ? b : a;
+                }
+                if (compiled.variable_name(0) == "y") swap(bounds[0], bounds[1]);
+                Interval result;
+                ASSERT_EQ(evaluate_bounds(compiled, bounds, &result), Status::SUCCESS);
+
+                vector<double> x_points = bounds_test_points(bounds[0].lo, bounds[0].hi);
+                vector<double> y_points = bounds_test_points(bounds[1].lo, bounds[1].hi);
+                vector<double> x, y;
+                for (double x_point : x_points) {
+                    for (double y_point : y_points) {
+                        x.push_back(x_point);
+                        y.push_back(y_point);
+                    }
+                }
+                const double* columns[] = { x.data(), y.data() };
+                vector<double> out(x.size());
+                for (int level : { (int)SimdLevel::SIMD_SCALAR, (int)max_level }) {
+                    set_simd_level((SimdLevel)level);
+                    evaluate_batch(compiled, columns, x.size(), out.data());
+                    for (size_t i = 0; i < x.size(); i++) {
+                        if (std::isnan(out[i])) continue;
+                        EXPECT_TRUE(result.lo <= out[i] && out[i] <= result.hi)
+                            << expression << " at " << x[i] << ", " << y[i] << " gives " << out[i] << " outside ["
+                            << result.lo << ", " << result.hi << "]";
+                    }
+                }
+            }
+        }
+        set_simd_level(max_level);
+    }
+
+    TEST(Bounds, DivideAndPower) {
+        double x_value = 0.0, y_value = 0.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x_value);
+        symbols.bind("y", &y_value);
+        auto bound = [](const string& expression, Interval x, Interval y = Interval{ 0.0, 0.0 }) {
+            CompiledExpression compiled;
+            EXPECT_EQ(compile_expression(expression, &compiled), Status::SUCCESS);
+            Interval bounds[] = { x, y };
+            Interval result = { NAN, NAN };
+            EXPECT_EQ(evaluate_bounds(compiled, bounds, &result), Status::SUCCESS);
+            return result;
+        };
+
+        // Divisors close enough to zero fail, so are left out
+        Interval result = bound("1/x", { 2.0, 4.0 });
+        EXPECT_EQ(result.lo, 0.25);
+        EXPECT_EQ(result.hi, 0.5);
+        result = bound("1/x", { -1.0, 1.0 });
+        EXPECT_LE(result.lo, -1e10);
+        EXPECT_GE(result.hi, 1e10);
+        EXPECT_TRUE(std::isfinite(result.lo) && std::isfinite(result.hi));
+        result = bound("1/x", { 0.0, 2.0 });
+        EXPECT_EQ(result.lo, 0.5);
+        EXPECT_GE(result.hi, 1e10);
+        result = bound("1/x", { 0.0, 0.0 });
+        EXPECT_GT(result.lo, result.hi);
+        result = bound("1/x + 5", { -1e-11, 1e-11 });
+        EXPECT_GT(result.lo, result.hi);
+
+        // Negative bases only have results for whole exponents
+        result = bound("x^2", { -3.0, 2.0 });
+        EXPECT_NEAR(result.lo, 0.0, 1e-11);
+        EXPECT_NEAR(result.hi, 9.0, 1e-11);
+        EXPECT_LE(result.hi, 9.0 + 1e-11);
+        result = bound("x^3", { -3.0, 2.0 });
+        EXPECT_NEAR(result.lo, -27.0, 1e-11);
+        EXPECT_NEAR(result.hi, 8.0, 1e-11);
+        result = bound("x^0.5", { -4.0, -1.0 });
+        EXPECT_GT(result.lo, result.hi);
+        result = bound("x^y", { -2.0, -2.0 }, { 2.5, 3.5 });
+        EXPECT_NEAR(result.lo, -8.0, 1e-11);
+        EXPECT_NEAR(result.hi, -8.0, 1e-11);
+        result = bound("x^y", { -2.0, -2.0 }, { 2.1, 2.9 });
+        EXPECT_GT(result.lo, result.hi);
+        result = bound("x^y", { -2.0, -1.0 }, { 1.0, 2.0 });
+        EXPECT_NEAR(result.lo, -2.0, 1e-11);
+        EXPECT_NEAR(result.hi, 4.0, 1e-11);
+
+        // pow(NaN, 0) is 1, though sqrt of a negative number is NaN
+        result = bound("sqrt(x)^y", { -4.0, -1.0 }, { -1.0, 1.0 });
+        EXPECT_NEAR(result.lo, 1.0, 1e-11);
+        EXPECT_NEAR(result.hi, 1.0, 1e-11);
+        x_value = -2.0;
+        EXPECT_EQ(parse_expression("sqrt(x)^y", symbols, &result.lo), Status::SUCCESS);
+        EXPECT_EQ(result.lo, 1.0);
+    }
+
+    Status unknown_bounds_function(const double args[], size_t, double* result) {
+        *result = args[0];
+        return Status::SUCCESS;
+    }
+
+    TEST(Bounds, BatchAndErrors) {
+        CompiledExpression compiled;
+        Interval result;
+        EXPECT_EQ(evaluate_bounds(compiled, NULL, &result), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(evaluate_bounds_batch(compiled, NULL, NULL, 0, NULL, NULL), Status::EMPTY_EXPRESSION);
+
+        ASSERT_EQ(compile_expression("2^10", &compiled), Status::SUCCESS);
+        EXPECT_EQ(evaluate_bounds(compiled, NULL, &result), Status::SUCCESS);
+        EXPECT_NEAR(result.lo, 1024.0, 1e-9);
+        EXPECT_NEAR(result.hi, 1024.0, 1e-9);
+
+        // Nothing is known of registered functions
+        register_function("unknown_bounds", 1, 1, unknown_bounds_function);
+        ASSERT_EQ(compile_expression("unknown_bounds(x) + 1", &compiled), Status::SUCCESS);
+        Interval x_bounds = { 0.0, 1.0 };
+        EXPECT_EQ(evaluate_bounds(compiled, &x_bounds, &result), Status::SUCCESS);
+        EXPECT_EQ(result.lo, -INFINITY);
+        EXPECT_EQ(result.hi, INFINITY);
+
+        ASSERT_EQ(compile_expression("x * (y - 2) / max(x, 1)", &compiled), Status::SUCCESS);
+        const double* lo_columns[] = { NULL, NULL };
+        EXPECT_EQ(evaluate_bounds_batch(compiled, lo_columns, lo_columns, 10, NULL, NULL), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(evaluate_bounds(compiled, NULL, &result), Status::UNBOUND_VARIABLE);
+
+        // 1000 blocks leaves a partial group of blocks
+        const size_t n_blocks = 1000;
+        vector<double> x_lo(n_blocks), x_hi(n_blocks), y_lo(n_blocks), y_hi(n_blocks);
+        for (size_t i = 0; i < n_blocks; i++) {
+            x_lo[i] = (double)i - 500.0;
+            x_hi[i] = x_lo[i] + (double)(i % 7);
+            y_lo[i] = sin((double)i);
+            y_hi[i] = i % 13 == 0 ? y_lo[i] - 1.0 : y_lo[i] + 0.5; // Some empty
+        }
+        lo_columns[0] = x_lo.data();
+        lo_columns[1] = y_lo.data();
+        const double* hi_columns[] = { x_hi.data(), y_hi.data() };
+        vector<double> out_lo(n_blocks), out_hi(n_blocks);
+        ASSERT_EQ(evaluate_bounds_batch(compiled, lo_columns, hi_columns, n_blocks, out_lo.data(), out_hi.data()),
+                  Status::SUCCESS);
+        for (size_t i = 0; i < n_blocks; i++) {
+            Interval bounds[] = { { x_lo[i], x_hi[i] }, { y_lo[i], y_hi[i] } };
+            ASSERT_EQ(evaluate_bounds(compiled, bounds, &result), Status::SUCCESS);
+            EXPECT_EQ(out_lo[i], result.lo) << i;
+            EXPECT_EQ(out_hi[i], result.hi) << i;
+            EXPECT_EQ(result.lo > result.hi, i % 13 == 0) << i;
+        }
+    }
+
+    // Evaluates expression over x and y with every instruction set this cpu
+    // supports and compares the results with the scalar kernels
+    void common_simd_test(const string& expression, const vector<double>& x, const vector<double>& y) {
+        cerr << "[          ]     Expr = " << expression << endl;
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression(expression, &compiled), Status::SUCCESS);
+        ASSERT_LE(compiled.num_variables(), 2u);
+        const double* columns[] = { x.data(), y.data() };
+        if (compiled.num_variables() > 0 && compiled.variable_name(0) == "y") swap(columns[0], columns[1]);
+
+        SimdLevel max_level = get_max_simd_level();
+        vector<double> expected(x.size()), out(x.size());
+        ASSERT_EQ(set_simd_level(SimdLevel::SIMD_SCALAR), Status::SUCCESS);
+        Status expected_status = evaluate_batch(compiled, columns, x.size(), expected.data());
+        for (int level = SimdLevel::SIMD_SSE2; level <= max_level; level++) {
+            ASSERT_EQ(set_simd_level((SimdLevel)level), Status::SUCCESS);
+            EXPECT_EQ(evaluate_batch(compiled, columns, x.size(), out.data()), expected_status);
+            for (size_t i = 0; i < x.size(); i++) {
+                if (std::isnan(expected[i]))
+                    EXPECT_TRUE(std::isnan(out[i])) << "level " << level << " row " << i;
+                else
+                    EXPECT_EQ(out[i], expected[i]) << "level " << level << " row " << i;
+            }
+        }
+        set_simd_level(max_level);
+    }
+
+    vector<double> simd_test_values(size_t n, double scale, double offset) {
+        vector<double> values(n);
+        for (size_t i = 0; i < n; i++) values[i] = scale * sin(0.37 * (double)i) + offset;
+        return values;
+    }
+
+    TEST(Simd, Levels) {
+        SimdLevel max_level = get_max_simd_level();
+        EXPECT_EQ(get_simd_level(), max_level);
+        EXPECT_EQ(set_simd_level(SimdLevel::SIMD_SCALAR), Status::SUCCESS);
+        EXPECT_EQ(get_simd_level(), SimdLevel::SIMD_SCALAR);
+        if (max_level < SimdLevel::SIMD_AVX512) {
+            EXPECT_EQ(set_simd_level((SimdLevel)(max_level + 1)), Status::ERROR);
+        }
+        EXPECT_EQ(set_simd_level(max_level), Status::SUCCESS);
+    }
+
+    TEST(Simd, OperatorsMatchScalar) {
+        // 1001 rows leaves a partial block, and a partial vector in it
+        vector<double> x = simd_test_values(1001, 100.0, 0.0);
+        vector<double> y = simd_test_values(1001, 3.0, 1.0);
+        x[17] = NAN;
+        y[33] = -INFINITY;
+        common_simd_test("x+y", x, y);
+        common_simd_test("x-y", x, y);
+        common_simd_test("x*y", x, y);
+        common_simd_test("-x", x, y);
+        common_simd_test("+x", x, y);
+        common_simd_test("-(x*y) + +y - x", x, y);
+    }
+
+    TEST(Simd, DivideByZeroMask) {
+        vector<double> x = simd_test_values(700, 10.0, 0.0);
+        vector<double> y = simd_test_values(700, 2.0, 0.0);
+        common_simd_test("x/y", x, y); // No zeros
+        for (size_t i : { 3, 256, 517, 699 }) y[i] = 1e-11;
+        y[100] = NAN;
+        common_simd_test("x/y", x, y);
+    }
+
+    TEST(Simd, PowerAccuracy) {
+        const size_t n_rows = 5000;
+        vector<double> x = simd_test_values(n_rows, 50.0, 50.5);
+        vector<double> y = simd_test_values(n_rows, 30.0, 0.0);
+        for (size_t i = 0; i < n_rows; i += 97) x[i] = -x[i]; // Negative bases
+        x[1] = 0.0;
+        x[2] = INFINITY;
+        y[3] = NAN;
+        y[4] = 800.0; // Overflows
+        x[5] = 1e-310; // Subnormal
+        y[6] = 2.0;
+
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("x^y", &compiled), Status::SUCCESS);
+        const double* columns[] = { x.data(), y.data() };
+        vector<double> out(n_rows);
+        for (int level = SimdLevel::SIMD_SCALAR; level <= get_max_simd_level(); level++) {
+            ASSERT_EQ(set_simd_level((SimdLevel)level), Status::SUCCESS);
+            ASSERT_EQ(evaluate_batch(compiled, columns, n_rows, out.data()), Status::SUCCESS);
+            for (size_t i = 0; i < n_rows; i++) {
+                double expected = pow(x[i], y[i]);
+                if (std::isnan(expected) || std::isinf(expected) || expected == 0.0) {
+                    EXPECT_TRUE(out[i] == expected || (std::isnan(out[i]) && std::isnan(expected)))
+                    << "level " << level << " row " << i;
+                } else {
+                    // Documented bound of the vector pow
+                    double bound = (2.0 + fabs(y[i] * log(fabs(x[i])))) * ldexp(1.0, -52);
+                    EXPECT_LE(fabs(out[i] - expected), bound * fabs(expected)) << "level " << level << " row " << i;
+                }
+            }
+        }
+        set_simd_level(get_max_simd_level());
+    }
+
+    // A row's result must not depend on the other rows in its block, or on
+    // where it falls in a vector, even for the vector pow
+    TEST(Simd, RowsIndependent) {
+        const size_t n_rows = 1001;
+        vector<double> x = simd_test_values(n_rows, 50.0, 50.5);
+        vector<double> y = simd_test_values(n_rows, 30.0, 0.0);
+        vector<double> z = simd_test_values(n_rows, 2.0, 3.0);
+        const vector<string> sources = { "x^y/z", "x^y" };
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression(sources[0], &compiled), Status::SUCCESS);
+        ExpressionSet set;
+        ASSERT_EQ(compile_expression_set(sources, &set), Status::SUCCESS);
+        SymbolTable set_columns;
+        set_columns.bind("x", x.data());
+        set_columns.bind("y", y.data());
+        set_columns.bind("z", z.data());
+        const double* columns[] = { x.data(), y.data(), z.data() };
+
+        ASSERT_EQ(set_simd_level(get_max_simd_level()), Status::SUCCESS);
+        vector<double> expected(n_rows), out(n_rows), set_out(n_rows), set_pow(n_rows);
+        ASSERT_EQ(evaluate_batch(compiled, columns, n_rows, expected.data()), Status::SUCCESS);
+
+        // Starting later moves every row to another lane and block
+        for (size_t first = 1; first <= 9; first++) {
+            const double* offset_columns[] = { x.data() + first, y.data() + first, z.data() + first };
+            ASSERT_EQ(evaluate_batch(compiled, offset_columns, n_rows - first, out.data()), Status::SUCCESS);
+            for (size_t i = first; i < n_rows; i++) {
+                ASSERT_EQ(out[i - first], expected[i]) << "first " << first << " row " << i;
+            }
+        }
+
+        // One failing row leaves the others as they were, for batches and
+        // for sets, which match evaluate_batch
+        for (size_t bad : { 0, 255, 256, 1000 }) {
+            double saved = z[bad];
+            z[bad] = 0.0;
+            EXPECT_EQ(evaluate_batch(compiled, columns, n_rows, out.data()), Status::DIVIDE_BY_ZERO);
+            double* set_outs[] = { set_out.data(), set_pow.data() };
+            EXPECT_EQ(set.evaluate_batch(set_columns, n_rows, set_outs), Status::DIVIDE_BY_ZERO);
+            for (size_t i = 0; i < n_rows; i++) {
+                if (i == bad) {
+                    EXPECT_TRUE(std::isnan(out[i]));
+                    EXPECT_TRUE(std::isnan(set_out[i]));
+                } else {
+                    ASSERT_EQ(out[i], expected[i]) << "bad " << bad << " row " << i;
+                    ASSERT_EQ(set_out[i], expected[i]) << "bad " << bad << " row " << i;
+                }
+            }
+            z[bad] = saved;
+        }
+    }
+
+    TEST(Precision, FloatBatchMatchesEvaluate) {
+        const size_t n_rows = 1001;
+        vector<double> x_wide = simd_test_values(n_rows, 100.0, 0.0);
+        vector<double> y_wide = simd_test_values(n_rows, 3.0, 1.0);
+        vector<float> x(x_wide.begin(), x_wide.end()), y(y_wide.begin(), y_wide.end()), out(n_rows);
+        x[17] = NAN;
+        y[33] = -INFINITY;
+        y[300] = 0.0f;
+
+        double x_value, y_value;
+        SymbolTable symbols;
+        symbols.bind("x", &x_value);
+        symbols.bind("y", &y_value);
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("x*y - x/y + sqrt(abs(x)) - -max(x, y) + min(x, 2) + sum(x, y, 0.1)", symbols,
+                                     &compiled),
+                  Status::SUCCESS);
+        const float* columns[] = { x.data(), y.data() };
+        for (int level = SimdLevel::SIMD_SCALAR; level <= get_max_simd_level(); level++) {
+            ASSERT_EQ(set_simd_level((SimdLevel)level), Status::SUCCESS);
+            EXPECT_EQ(evaluate_batch(compiled, columns, n_rows, out.data()), Status::DIVIDE_BY_ZERO);
+            for (size_t i = 0; i < n_rows; i++) {
+                float expected;
+                x_value = x[i];
+                y_value = y[i];
+                if (compiled.evaluate(&expected) != Status::SUCCESS) {
+                    EXPECT_TRUE(std::isnan(out[i])) << "level " << level << " row " << i;
+                } else if (std::isnan(expected)) {
+                    EXPECT_TRUE(std::isnan(out[i])) << "level " << level << " row " << i;
+                } else {
+                    EXPECT_EQ(out[i], expected) << "level " << level << " row " << i;
+                }
+            }
+        }
+        set_simd_level(get_max_simd_level());
+    }
+
+    TEST(Precision, FloatAccuracy) {
+        double x_value = 0.0, y_value = 0.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x_value);
+        symbols.bind("y", &y_value);
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("(x*y + x/y + 3.5*x) / (y*y + 1) + x^1.5", symbols, &compiled), Status::SUCCESS);
+
+        // Each of the seven operations rounds once, as do the inputs to float
+        double worst_float = 0.0, worst_double = 0.0;
+        for (size_t i = 0; i < 1000; i++) {
+            x_value = 0.5 + 0.37 * (double)i;
+            y_value = 0.5 + fmod(0.71 * (double)i, 3.0);
+            long double reference;
+            double wide;
+            float narrow;
+            ASSERT_EQ(compiled.evaluate(&reference), Status::SUCCESS);
+            ASSERT_EQ(compiled.evaluate(&wide), Status::SUCCESS);
+            ASSERT_EQ(compiled.evaluate(&narrow), Status::SUCCESS);
+            worst_float = fmax(worst_float, (double)fabsl((narrow - reference) / reference));
+            worst_double = fmax(worst_double, (double)fabsl((wide - reference) / reference));
+        }
+        EXPECT_LE(worst_float, 8 * FLT_EPSILON);
+        EXPECT_LE(worst_double, 8 * DBL_EPSILON);
+        EXPECT_GT(worst_float, 1e6 * worst_double);
+
+        // Subtracting nearly equal values loses the digits float cannot hold
+        ASSERT_EQ(compile_expression("(x + 100000000) - 100000000", symbols, &compiled), Status::SUCCESS);
+        x_value = 1.5;
+        long double reference;
+        double wide;
+        float narrow;
+        ASSERT_EQ(compiled.evaluate(&reference), Status::SUCCESS);
+        ASSERT_EQ(compiled.evaluate(&wide), Status::SUCCESS);
+        ASSERT_EQ(compiled.evaluate(&narrow), Status::SUCCESS);
+        EXPECT_EQ(reference, 1.5L);
+        EXPECT_EQ(wide, 1.5);
+        EXPECT_EQ(narrow, 0.0f);
+    }
+
+    TEST(Precision, FloatDivideByZero) {
+        // Near the 1e-10 threshold, which is not a float, float and double
+        // rows must fail alike
+        vector<float> y = { 0.0f, -0.0f, 1e-11f, 9.9999e-11f, 1e-10f, -1e-10f, 1.00001e-10f, 1e-9f, 2.0f, NAN };
+        vector<double> y_wide(y.begin(), y.end()), wide(y.size());
+        vector<float> out(y.size());
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("1/y", &compiled), Status::SUCCESS);
+        const float* columns[] = { y.data() };
+        const double* wide_columns[] = { y_wide.data() };
+        for (int level = SimdLevel::SIMD_SCALAR; level <= get_max_simd_level(); level++) {
+            ASSERT_EQ(set_simd_level((SimdLevel)level), Status::SUCCESS);
+            EXPECT_EQ(evaluate_batch(compiled, columns, y.size(), out.data()), Status::DIVIDE_BY_ZERO);
+            EXPECT_EQ(evaluate_batch(compiled, wide_columns, y.size(), wide.data()), Status::DIVIDE_BY_ZERO);
+            for (size_t i = 0; i < y.size(); i++) {
+                if (std::isnan(wide[i]))
+                    EXPECT_TRUE(std::isnan(out[i])) << "level " << level << " row " << i;
+                else
+                    EXPECT_EQ(out[i], (float)(1.0 / y[i])) << "level " << level << " row " << i;
+            }
+        }
+        set_simd_level(get_max_simd_level());
+        EXPECT_FALSE(std::isnan(out[4])); // 1e-10f is just above 1e-10
+        EXPECT_TRUE(std::isnan(out[3]));
+    }
+
+    void expect_same_results(const vector<double>& expected, const vector<double>& actual) {
+        ASSERT_EQ(expected.size(), actual.size());
+        for (size_t i = 0; i < expected.size(); i++) {
+            if (std::isnan(expected[i]))
+                EXPECT_TRUE(std::isnan(actual[i])) << "row " << i;
+            else
+                EXPECT_EQ(expected[i], actual[i]) << "row " << i;
+        }
+    }
+
+    TEST(Engine, MatchesEvaluateBatch) {
+        // Enough rows for several tasks per thread, and a partial last task
+        const size_t n_rows = 100003;
+        vector<double> x = simd_test_values(n_rows, 100.0, 0.0);
+        vector<double> y = simd_test_values(n_rows, 3.0, 0.0);
+        y[70000] = 0.0;
+        y[5000] = 0.0;
+
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("x/y - 2^y + -x*y", &compiled), Status::SUCCESS);
+        const double* columns[] = { x.data(), y.data() };
+        vector<double> expected(n_rows);
+        ASSERT_EQ(evaluate_batch(compiled, columns, n_rows, expected.data()), Status::DIVIDE_BY_ZERO);
+
+        for (size_t num_threads : { 1, 2, 3, 8 }) {
+            EvaluationEngine engine(num_threads);
+            EXPECT_EQ(engine.num_threads(), num_threads);
+            vector<double> out(n_rows);
+            EXPECT_EQ(engine.evaluate_batch(compiled, columns, n_rows, out.data()), Status::DIVIDE_BY_ZERO);
+            expect_same_results(expected, out);
+        }
+    }
+
+    TEST(Engine, ExpressionSet) {
+        const size_t n_rows = 20000;
+        vector<double> x = simd_test_values(n_rows, 10.0, 0.0);
+        vector<double> y = simd_test_values(n_rows, 2.0, 3.0);
+        x[12345] = 0.0;
+        SymbolTable columns;
+        columns.bind("x", x.data());
+        columns.bind("y", y.data());
+
+        vector<string> sources = { "x+y", "y/x", "x*z", "y^2 - x", "(x+1)/(y-y)" };
+        vector<CompiledExpression> expressions(sources.size());
+        for (size_t i = 0; i < sources.size(); i++)
+            ASSERT_EQ(compile_expression(sources[i], &expressions[i]), Status::SUCCESS);
+        expressions.push_back(CompiledExpression()); // Empty
+
+        vector<vector<double>> results(expressions.size(), vector<double>(n_rows));
+        vector<double*> out;
+        for (vector<double>& result : results) out.push_back(result.data());
+
+        EvaluationEngine engine(4);
+        vector<Status> statuses(expressions.size());
+        EXPECT_EQ(engine.evaluate_batch(expressions, columns, n_rows, out.data(), statuses.data()),
+                  Status::DIVIDE_BY_ZERO);
+        EXPECT_EQ(statuses[0], Status::SUCCESS);
+        EXPECT_EQ(statuses[1], Status::DIVIDE_BY_ZERO);
+        EXPECT_EQ(statuses[2], Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(statuses[3], Status::SUCCESS);
+        EXPECT_EQ(statuses[4], Status::DIVIDE_BY_ZERO);
+        EXPECT_EQ(statuses[5], Status::EMPTY_EXPRESSION);
+
+        for (size_t i : { 0, 1, 3, 4 }) {
+            const double* expr_columns[2];
+            for (size_t slot = 0; slot < expressions[i].num_variables(); slot++)
+                expr_columns[slot] = columns.find(expressions[i].variable_name(slot));
+            vector<double> expected(n_rows);
+            EXPECT_EQ(evaluate_batch(expressions[i], expr_columns, n_rows, expected.data()), statuses[i]);
+            expect_same_results(expected, results[i]);
+        }
+        EXPECT_TRUE(std::isnan(results[1][12345]));
+
+        // Without a status array only the first error is returned
+        EXPECT_EQ(engine.evaluate_batch(expressions, columns, n_rows, out.data()), Status::DIVIDE_BY_ZERO);
+    }
+
+    TEST(Engine, Errors) {
+        EvaluationEngine engine(2);
+        CompiledExpression compiled;
+        double out[4];
+        EXPECT_EQ(engine.evaluate_batch(compiled, NULL, 4, out), Status::EMPTY_EXPRESSION);
+        ASSERT_EQ(compile_expression("x+1", &compiled), Status::SUCCESS);
+        EXPECT_EQ(engine.evaluate_batch(compiled, NULL, 4, out), Status::UNBOUND_VARIABLE);
+        ASSERT_EQ(compile_expression("2*3", &compiled), Status::SUCCESS);
+        EXPECT_EQ(engine.evaluate_batch(compiled, NULL, 0, out), Status::SUCCESS);
+        EXPECT_EQ(engine.evaluate_batch(compiled, NULL, 4, out), Status::SUCCESS);
+        EXPECT_EQ(out[3], 6.0);
+    }
+
+    TEST(ExpressionSet, MatchesSeparateExpressions) {
+        // Three blocks, the last partial, with an error in the second
+        const size_t n_rows = 700;
+        vector<double> x = simd_test_values(n_rows, 10.0, 0.0);
+        vector<double> y = simd_test_values(n_rows + 1, 2.0, 3.0);
+        y.erase(y.begin());
+        x[300] = 0.0;
+        SymbolTable columns;
+        columns.bind("x", x.data());
+        columns.bind("y", y.data());
+
+        vector<string> sources = { "x*y + sqrt(x*x + y*y)",
+                                   "(x*y + 1) / x",
+                                   "sqrt(x*x + y*y) - (x*y + 1)",
+                                   "y^x - 1/x + max(x*y, y, 1/x)",
+                                   "x*y + z",
+                                   "2*x - (x*y + 1)/x + hypot(x, y)",
+                                   "",
+                                   "x + (1",
+                                   "(1/(x-x)) * 0 + y",
+                                   "x*y + sqrt(x*x + y*y)",
+                                   "x" };
+        ExpressionSet set;
+        vector<Status> compile_statuses(sources.size());
+        EXPECT_EQ(compile_expression_set(sources, &set, compile_statuses.data()), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(set.size(), sources.size());
+        ASSERT_EQ(set.num_variables(), 3u);
+        EXPECT_EQ(set.variable_name(0), "x");
+        EXPECT_EQ(set.variable_name(2), "z");
+
+        vector<vector<double>> results(sources.size(), vector<double>(n_rows, -1.0));
+        vector<double*> out;
+        for (vector<double>& result : results) out.push_back(result.data());
+        vector<Status> statuses(sources.size());
+        EXPECT_EQ(set.evaluate_batch(columns, n_rows, out.data(), statuses.data()), Status::DIVIDE_BY_ZERO);
+
+        // Every row of every expression against the expression on its own,
+        // both over the batch and one row at a time
+        vector<double> row_results(sources.size());
+        vector<Status> row_statuses(sources.size());
+        double x_value, y_value;
+        SymbolTable row_symbols;
+        row_symbols.bind("x", &x_value);
+        row_symbols.bind("y", &y_value);
+        for (size_t i = 0; i < sources.size(); i++) {
+            CompiledExpression compiled;
+            EXPECT_EQ(compile_expression(sources[i], &compiled), compile_statuses[i]) << sources[i];
+            vector<double> expected(n_rows, -1.0);
+            const double* expr_columns[3];
+            for (size_t slot = 0; slot < compiled.num_variables(); slot++)
+                expr_columns[slot] = columns.find(compiled.variable_name(slot));
+            Status expected_status = compiled.empty() ? compile_statuses[i]
+                                                      : evaluate_batch(compiled, expr_columns, n_rows, expected.data());
+            EXPECT_EQ(statuses[i], expected_status) << sources[i];
+            expect_same_results(expected, results[i]);
+        }
+        for (size_t row : { 0, 299, 300, 301, 699 }) {
+            x_value = x[row];
+            y_value = y[row];
+            EXPECT_NE(set.evaluate(row_symbols, row_results.data(), row_statuses.data()), Status::SUCCESS);
+            for (size_t i = 0; i < sources.size(); i++) {
+                CompiledExpression compiled;
+                compile_expression(sources[i], row_symbols, &compiled);
+                double expected = 0.0;
+                Status expected_status = compiled.empty() ? compile_statuses[i] : compiled.evaluate(&expected);
+                EXPECT_EQ(row_statuses[i], expected_status) << sources[i] << " row " << row;
+                if (expected_status == Status::SUCCESS) {
+                    EXPECT_EQ(row_results[i], expected) << sources[i];
+                }
+            }
+        }
+        EXPECT_EQ(row_statuses[1], Status::SUCCESS);
+        EXPECT_TRUE(std::isnan(results[1][300]));
+        EXPECT_EQ(statuses[4], Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(statuses[6], Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(statuses[7], Status::UNMATCHED_BRACKETS);
+        EXPECT_EQ(statuses[8], Status::DIVIDE_BY_ZERO);
+
+        // Without a status array only the first error is returned
+        EXPECT_EQ(set.evaluate_batch(columns, n_rows, out.data()), Status::DIVIDE_BY_ZERO);
+    }
+
+    static size_t g_impure_calls = 0;
+
+    Status impure_function(const double args[], size_t, double* result) {
+        g_impure_calls++;
+        *result = args[0];
+        return Status::SUCCESS;
+    }
+
+    TEST(ExpressionSet, Sharing) {
+        ExpressionSet set;
+        vector<string> sources = { "(a+b)*c", "(a+b)*c + 1", "(a + b) * d", "a+b" };
+        ASSERT_EQ(compile_expression_set(sources, &set), Status::SUCCESS);
+        SharingReport report = set.sharing();
+        EXPECT_EQ(report.expressions, 4u);
+        EXPECT_EQ(report.instructions, 5u + 7u + 5u + 3u);
+        // a b + c * 1 + d *
+        EXPECT_EQ(report.nodes, 9u);
+        // a+b and (a+b)*c
+        EXPECT_EQ(report.shared_nodes, 2u);
+
+        // Calls to registered functions are never merged
+        static const bool registered = register_function("impure", 1, 1, impure_function) == Status::SUCCESS;
+        EXPECT_TRUE(registered);
+        ASSERT_EQ(compile_expression_set({ "impure(x) + sqrt(x)", "impure(x) + sqrt(x)", "" }, &set),
+                  Status::EMPTY_EXPRESSION);
+        report = set.sharing();
+        EXPECT_EQ(report.expressions, 2u);
+        EXPECT_EQ(report.nodes, 6u);
+        EXPECT_EQ(report.shared_nodes, 2u);
+
+        double x = 4.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        double results[3];
+        Status statuses[3];
+        g_impure_calls = 0;
+        EXPECT_EQ(set.evaluate(symbols, results, statuses), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(g_impure_calls, 2u);
+        EXPECT_EQ(results[0], 6.0);
+        EXPECT_EQ(results[1], 6.0);
+        EXPECT_EQ(statuses[2], Status::EMPTY_EXPRESSION);
+
+        // An empty set
+        ASSERT_EQ(compile_expression_set({}, &set), Status::SUCCESS);
+        EXPECT_EQ(set.size(), 0u);
+        EXPECT_EQ(set.evaluate_batch(symbols, 10, NULL), Status::SUCCESS);
+    }
+
+    TEST(ExpressionSet, Incremental) {
+        vector<string> sources = { "a*b + c", "(a*b + c) / d", "sqrt(d*d + e)", "e - 1", "2*3", "a + q", "" };
+        ExpressionSet set;
+        ASSERT_EQ(compile_expression_set(sources, &set), Status::EMPTY_EXPRESSION);
+        double a = 1.5, b = 2.0, c = -1.0, d = 4.0, e = 9.0;
+        SymbolTable symbols;
+        symbols.bind("a", &a);
+        symbols.bind("b", &b);
+        symbols.bind("c", &c);
+        symbols.bind("d", &d);
+        symbols.bind("e", &e);
+
+        IncrementalEvaluator evaluator(set, symbols);
+        const size_t n = sources.size();
+        vector<double> results(n), expected(n);
+        vector<Status> statuses(n), expected_statuses(n);
+        auto check = [&](Status expected_val) {
+            EXPECT_EQ(set.evaluate(symbols, expected.data(), expected_statuses.data()), expected_val);
+            for (size_t i = 0; i < n; i++) {
+                EXPECT_EQ(statuses[i], expected_statuses[i]) << sources[i];
+                EXPECT_EQ(results[i], expected[i]) << sources[i];
+            }
+        };
+
+        // Everything is computed the first time
+        size_t recomputed = 0;
+        EXPECT_EQ(evaluator.evaluate(results.data(), statuses.data(), &recomputed), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(recomputed, set.sharing().nodes);
+        check(Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(statuses[5], Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(statuses[6], Status::EMPTY_EXPRESSION);
+
+        // Nothing changed
+        EXPECT_EQ(evaluator.evaluate(results.data(), statuses.data(), &recomputed), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(recomputed, 0u);
+        check(Status::UNBOUND_VARIABLE);
+
+        // c, a*b + c and (a*b + c) / d
+        c = 3.0;
+        EXPECT_EQ(evaluator.mark_changed("c"), Status::SUCCESS);
+        evaluator.evaluate(results.data(), statuses.data(), &recomputed);
+        EXPECT_EQ(recomputed, 3u);
+        check(Status::UNBOUND_VARIABLE);
+
+        // Errors come and go with the values
+        d = 0.0;
+        EXPECT_EQ(evaluator.mark_changed(set.num_variables()), Status::ERROR);
+        EXPECT_EQ(evaluator.mark_changed("d"), Status::SUCCESS);
+        EXPECT_EQ(evaluator.mark_changed("d"), Status::SUCCESS);
+        evaluator.evaluate(results.data(), statuses.data(), &recomputed);
+        // d, (a*b + c) / d, d*d, d*d + e and its sqrt
+        EXPECT_EQ(recomputed, 5u);
+        EXPECT_EQ(statuses[1], Status::DIVIDE_BY_ZERO);
+        check(Status::DIVIDE_BY_ZERO);
+        d = 2.0;
+        e = 5.0;
+        a = -2.0;
+        evaluator.mark_changed("d");
+        evaluator.mark_changed("e");
+        evaluator.mark_changed("a");
+        evaluator.evaluate(results.data(), statuses.data(), &recomputed);
+        EXPECT_EQ(recomputed, 11u);
+        check(Status::UNBOUND_VARIABLE);
+
+        // Binding q makes the last expression work
+        double q = 10.0;
+        symbols.bind("q", &q);
+        evaluator.bind(symbols);
+        EXPECT_EQ(evaluator.evaluate(results.data(), statuses.data(), &recomputed), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(recomputed, set.sharing().nodes);
+        EXPECT_EQ(results[5], 8.0);
+        check(Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(evaluator.mark_changed("nosuch"), Status::ERROR);
+    }
+
+    // Compiled at compile time, for ConstExpr.Evaluate
+    static constexpr auto g_ct_polynomial = ct_compile("3*x^2 - 2*x*y + y/4 - 1");
+    static constexpr auto g_ct_ratio = ct_compile("(a + b) / (a - b) ** -c");
+    static constexpr auto g_ct_calls = ct_compile("max(x, -y, 2) + abs(x - y) * sum(x, y, 0.5) - min[x]");
+    static constexpr auto g_ct_constant = ct_compile("--2 * [1.5e1 + .5]");
+
+    // Checked by the compiler
+    static_assert(ct_eval("2*(3+4)^2") == 98.0, "");
+    static_assert(ct_eval("2^3^2") == 512.0, "");
+    static_assert(ct_eval("-2^2") == -4.0, "");
+    static_assert(ct_eval("8/4/2 - 1 - 1") == -1.0, "");
+    static_assert(ct_eval("max(1, 7, 3) + sum(1, 2)") == 10.0, "");
+    static_assert(g_ct_polynomial.num_variables == 2 && g_ct_polynomial.slot("y") == 1, "");
+    static_assert(g_ct_constant.num_variables == 0, "");
+
+    TEST(ConstExpr, MatchesParseExpression) {
+        using namespace literals;
+        constexpr double literal = "2*(3+4)^2 * 1.5"_expr;
+        EXPECT_EQ(literal, 147.0);
+
+        const char* expressions[] = { "1+2*3-4/5",
+                                      "2 ** 3 ** 2",
+                                      "-3^2 + +-4",
+                                      "(((1.25)))*[2-7]/(3)",
+                                      "1e308 * 10",
+                                      "-1e308 - 1e308",
+                                      "0.1 + 0.2",
+                                      "123456789012345678901234567890 / 7",
+                                      "4.9e-324 * 0.5 + 1e-320",
+                                      "1.7976931348623157e308 + 1e292",
+                                      "2^-1074 + 2^1023 * 2 - 2^1024",
+                                      "(-8)^(1/3)",
+                                      "(-2)^-3 + (-0.5)^1075",
+                                      "0^-1 - 0^0",
+                                      "max(3, min(1, 2), -abs(-7))" };
+        for (const char* expression : expressions) {
+            double expected;
+            ASSERT_EQ(parse_expression(expression, &expected), Status::SUCCESS) << expression;
+            double value = ct_eval(expression);
+            if (std::isnan(expected))
+                EXPECT_TRUE(std::isnan(value)) << expression;
+            else
+                EXPECT_EQ(value, expected) << expression;
+        }
+
+        // Whole powers, up to those too large to square, are rounded
+        // correctly, and the C library pow only rarely is not
+        EXPECT_EQ(ct_eval("1.05^200"), pow(1.05, 200));
+        size_t differ = 0, total = 0;
+        for (double x = 0.5; x < 2; x += 0.00713) {
+            for (int n = -8000; n <= 8000; n += 37) {
+                char expression[64];
+                snprintf(expression, sizeof(expression), "%.17g ^ %d", x, n);
+                double expected = pow(x, n);
+                double value = ct_eval(expression);
+                if (value != expected) {
+                    EXPECT_LE(fabs(value - expected), nextafter(fabs(expected), INFINITY) - fabs(expected))
+                    << expression;
+                    differ++;
+                }
+                total++;
+            }
+        }
+        EXPECT_LE(differ, total / 1000);
+
+        // Non integer powers, and whole powers of numbers close to 1 too
+        // large to square, may be one unit in the last place off
+        EXPECT_NEAR(ct_eval("1.0000001^123456789"), pow(1.0000001, 123456789), ldexp(2.3e5, -52));
+        for (double x = 0.01; x < 50; x *= 1.37) {
+            for (double y = -30.3; y < 30; y += 2.9) {
+                char expression[64];
+                snprintf(expression, sizeof(expression), "%.17g ^ %.17g", x, y);
+                double expected = pow(x, y);
+                EXPECT_LE(fabs(ct_eval(expression) - expected), ldexp(fabs(expected), -52)) << expression;
+            }
+        }
+
+        // Numbers are converted to the nearest double
+        const char* numbers[] = { "9007199254740993",
+                                  "9007199254740995",
+                                  "2.4703282292062327e-324",
+                                  "2.4703282292062328e-324",
+                                  "2.2250738585072011e-308",
+                                  "1.7976931348623158e308",
+                                  "1.7976931348623159e308",
+                                  "0.1000000000000000055511151231257827021181583404541015625",
+                                  "0.1000000000000000055511151231257827021181583404541015626",
+                                  "123456789012345678901234567890123456789e-50",
+                                  "0.000000000000000000000000000000000000001e330",
+                                  "1e23",
+                                  "8.5e-311" };
+        for (const char* number : numbers) EXPECT_EQ(ct_eval(number), strtod(number, NULL)) << number;
+        srand(7);
+        for (int i = 0; i < 1000; i++) {
+            char expression[64];
+            double number = ldexp((double)rand() / RAND_MAX, rand() % 2000 - 1000);
+            snprintf(expression, sizeof(expression), "%.*e", rand() % 18, number);
+            EXPECT_EQ(ct_eval(expression), strtod(expression, NULL)) << expression;
+        }
+    }
+
+    TEST(ConstExpr, Errors) {
+        // ct_compile fails the build when it is a constant, so errors are
+        // checked with programs made at runtime
+        const char* expressions[] = { "",       " ",     "1 +",     "2 3",      "(1+2",     "1+2)",     "1 $ 2",
+                                      "1 + 2x", "1e.1",  "abs(1,2)", "max()",    "1, 2",     "()",
+                                      "(1)(2)", "+ (* 2", "max(,1)", "x + 1 (" };
+        for (const char* expression : expressions) {
+            CompiledExpression compiled;
+            Status expected = compile_expression(expression, &compiled);
+            ConstantProgram<64> program = ct_detail::compile<64>(expression);
+            EXPECT_EQ(program.status, expected) << expression;
+            EXPECT_EQ(program.size, 0u) << expression;
+            EXPECT_TRUE(std::isnan(ct_eval(expression))) << expression;
+        }
+        // Only some functions can be called at compile time
+        EXPECT_EQ(ct_detail::compile<64>("1 + sin(1)").status, Status::UNKNOWN_TOKEN);
+        ConstantProgram<sizeof("1 + 2 + 3")> program = ct_compile("1 + 2 + 3");
+        EXPECT_EQ(program.status, Status::SUCCESS);
+        EXPECT_TRUE(std::isnan(ct_eval("1/0")));
+        EXPECT_TRUE(std::isnan(ct_eval("x + 1")));
+    }
+
+    TEST(ConstExpr, Evaluate) {
+        const double values[] = { 0.0, 1.0, -2.5, 3.0, 1e-11, 1e300, -7.25, NAN };
+        for (double x : values) {
+            for (double y : values) {
+                SymbolTable symbols;
+                symbols.bind("x", &x);
+                symbols.bind("y", &y);
+                symbols.bind("a", &x);
+                symbols.bind("b", &y);
+                symbols.bind("c", &y);
+                struct {
+                    const char* expression;
+                    Status (*evaluate)(double*, double, double);
+                } cases[] = {
+                    { "3*x^2 - 2*x*y + y/4 - 1",
+                      [](double* result, double x, double y) { return ct_evaluate<g_ct_polynomial>(result, x, y); } },
+                    { "(a + b) / (a - b) ** -c",
+                      [](double* result, double a, double b) { return ct_evaluate<g_ct_ratio>(result, a, b, b); } },
+                    { "max(x, -y, 2) + abs(x - y) * sum(x, y, 0.5) - min[x]",
+                      [](double* result, double x, double y) { return ct_evaluate<g_ct_calls>(result, x, y); } },
+                };
+                for (const auto& test : cases) {
+                    CompiledExpression compiled;
+                    ASSERT_EQ(compile_expression(test.expression, symbols, &compiled), Status::SUCCESS);
+                    double expected = 0.0;
+                    double result = 1.0;
+                    Status status = compiled.evaluate(&expected);
+                    EXPECT_EQ(test.evaluate(&result, x, y), status) << test.expression << " " << x << " " << y;
+                    if (std::isnan(expected))
+                        EXPECT_TRUE(std::isnan(result)) << test.expression << " " << x << " " << y;
+                    else
+                        EXPECT_EQ(result, expected) << test.expression << " " << x << " " << y;
+                }
+            }
+        }
+
+        double result = 0.0;
+        EXPECT_EQ(ct_evaluate<g_ct_constant>(&result), Status::SUCCESS);
+        EXPECT_EQ(result, 31.0);
+    }
+
+    vector<string> bytecode_test_expressions() {
+        return { "3*x^2 - 2*x*y + y/4 - 1", "", "max(x, -y, 2) + sqrt(abs(x - y)) * sum(x, y, 0.5)",
+                 "2 + 3 * 4", "x / (y - y)", "-[x] ** 0.5 + hypot(x, 1e3)", "y" };
+    }
+
+    // Writes a catalog of bytecode_test_expressions
+    string write_test_bytecode() {
+        vector<CompiledExpression> compiled(bytecode_test_expressions().size());
+        for (size_t i = 0; i < compiled.size(); i++) compile_expression(bytecode_test_expressions()[i], &compiled[i]);
+        string bytecode;
+        EXPECT_EQ(write_bytecode(compiled, &bytecode), Status::SUCCESS);
+        return bytecode;
+    }
+
+    // Checks that every expression of the catalog gives the results of
+    // compiling its source
+    void expect_catalog_matches(const BytecodeCatalog& catalog) {
+        vector<string> sources = bytecode_test_expressions();
+        ASSERT_EQ(catalog.size(), sources.size());
+        const double values[] = { 0.0, 1.5, -2.0, 1e10 };
+        for (size_t i = 0; i < sources.size(); i++) {
+            CompiledExpression compiled;
+            compile_expression(sources[i], &compiled);
+            ASSERT_EQ(catalog.num_variables(i), compiled.num_variables()) << sources[i];
+            for (double x : values) {
+                for (double y : values) {
+                    SymbolTable symbols;
+                    symbols.bind("x", &x);
+                    symbols.bind("y", &y);
+                    compiled.bind(symbols);
+                    const double* bindings[2];
+                    for (size_t slot = 0; slot < catalog.num_variables(i); slot++) {
+                        EXPECT_EQ(catalog.variable_name(i, slot), compiled.variable_name(slot));
+                        bindings[slot] = symbols.find(string(catalog.variable_name(i, slot)));
+                    }
+                    double expected, result;
+                    Status expected_status = compiled.evaluate(&expected);
+                    EXPECT_EQ(catalog.evaluate(i, bindings, &result), expected_status) << sources[i];
+                    if (expected_status != Status::SUCCESS) continue;
+                    if (std::isnan(expected))
+                        EXPECT_TRUE(std::isnan(result)) << sources[i];
+                    else
+                        EXPECT_EQ(result, expected) << sources[i] << " " << x << " " << y;
+                }
+            }
+        }
+    }
+
+    TEST(Bytecode, RoundTrip) {
+        string bytecode = write_test_bytecode();
+        BytecodeCatalog catalog;
+        ASSERT_EQ(catalog.load(bytecode.data(), bytecode.size()), Status::SUCCESS);
+        expect_catalog_matches(catalog);
+
+        double result;
+        double x = 2.0;
+        const double* bindings[] = { &x, &x };
+        EXPECT_EQ(catalog.evaluate(1, bindings, &result), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(catalog.evaluate(7, bindings, &result), Status::ERROR);
+        EXPECT_EQ(catalog.evaluate(6, NULL, &result), Status::UNBOUND_VARIABLE);
+
+        // Evaluating straight from the bytecode does not allocate
+        size_t allocations = get_allocation_count();
+        EXPECT_EQ(catalog.evaluate(0, bindings, &result), Status::SUCCESS);
+        EXPECT_EQ(get_allocation_count(), allocations);
+        EXPECT_EQ(result, 3 * 4.0 - 8.0 + 0.5 - 1);
+
+        // Copies work like the expressions they were written from
+        CompiledExpression compiled;
+        EXPECT_EQ(catalog.get_expression(1, &compiled), Status::EMPTY_EXPRESSION);
+        EXPECT_TRUE(compiled.empty());
+        ASSERT_EQ(catalog.get_expression(2, &compiled), Status::SUCCESS);
+        EXPECT_EQ(compiled.evaluate(&result), Status::UNBOUND_VARIABLE);
+        double y = -1.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        symbols.bind("y", &y);
+        ASSERT_EQ(compiled.bind(symbols), Status::SUCCESS);
+        EXPECT_EQ(compiled.evaluate(&result), Status::SUCCESS);
+        EXPECT_EQ(result, 2.0 + sqrt(3.0) * 1.5);
+
+        // Bytecode that is not aligned is copied
+        string shifted = " " + bytecode;
+        BytecodeCatalog unaligned;
+        ASSERT_EQ(unaligned.load(shifted.data() + 1, bytecode.size()), Status::SUCCESS);
+        expect_catalog_matches(unaligned);
+
+        vector<CompiledExpression> none;
+        ASSERT_EQ(write_bytecode(none, &bytecode), Status::SUCCESS);
+        ASSERT_EQ(catalog.load(bytecode.data(), bytecode.size()), Status::SUCCESS);
+        EXPECT_EQ(catalog.size(), 0u);
+    }
+
+    TEST(Bytecode, LoadFile) {
+        string bytecode = write_test_bytecode();
+        string path = testing::TempDir() + "exprtests_catalog.bin";
+        FILE* file = fopen(path.c_str(), "wb");
+        ASSERT_TRUE(file != NULL);
+        ASSERT_EQ(fwrite(bytecode.data(), 1, bytecode.size(), file), bytecode.size());
+        fclose(file);
+
+        BytecodeCatalog catalog;
+        ASSERT_EQ(catalog.load_file(path), Status::SUCCESS);
+        expect_catalog_matches(catalog);
+        ASSERT_EQ(catalog.load_file(path), Status::SUCCESS); // Maps the file again
+        expect_catalog_matches(catalog);
+        remove(path.c_str());
+        EXPECT_EQ(catalog.load_file(path), Status::ERROR);
+        EXPECT_EQ(catalog.size(), 0u);
+    }
+
+    TEST(Bytecode, Validation) {
+        string bytecode = write_test_bytecode();
+        BytecodeCatalog catalog;
+        for (size_t size = 0; size < bytecode.size(); size++)
+            EXPECT_EQ(catalog.load(bytecode.data(), size), Status::ERROR) << size;
+
+        string corrupt = bytecode;
+        corrupt[8] = 2; // Version
+        EXPECT_EQ(catalog.load(corrupt.data(), corrupt.size()), Status::ERROR);
+        EXPECT_EQ(catalog.size(), 0u);
+
+        // Functions are looked up by name when loading
+        corrupt = bytecode;
+        size_t name = corrupt.rfind("hypot");
+        ASSERT_NE(name, string::npos);
+        corrupt[name] = 'k';
+        EXPECT_EQ(catalog.load(corrupt.data(), corrupt.size()), Status::UNKNOWN_TOKEN);
+
+        // Whatever a byte is changed to, the catalog is either rejected or
+        // safe to evaluate
+        double x = 1.25;
+        const double* bindings[] = { &x, &x, &x, &x };
+        for (size_t pos = 0; pos < bytecode.size(); pos++) {
+            for (int value : { 0x00, 0x01, 0x07, 0x80, 0xff }) {
+                corrupt = bytecode;
+                corrupt[pos] = (char)value;
+                if (catalog.load(corrupt.data(), corrupt.size()) != Status::SUCCESS) continue;
+                for (size_t i = 0; i < catalog.size(); i++) {
+                    double result;
+                    if (catalog.num_variables(i) <= 4) catalog.evaluate(i, bindings, &result);
+                }
+            }
+        }
+    }
+
+    TEST(Registry, PublishFindRemove) {
+        double x = 2.0;
+        SymbolTable symbols;
+        symbols.bind("x", &x);
+        ExpressionRegistry registry;
+        ExpressionRegistry::Reader reader(registry);
+        double result;
+        uint64_t version, first_version;
+
+        EXPECT_EQ(registry.publish(7, "x*3", symbols), Status::SUCCESS);
+        EXPECT_EQ(reader.evaluate(7, &result), Status::SUCCESS);
+        EXPECT_EQ(result, 6.0);
+        ASSERT_TRUE(reader.find(7, &first_version) != NULL);
+
+        // Failed publishes leave the current version in place
+        EXPECT_EQ(registry.publish(7, "x*(3", symbols), Status::UNMATCHED_BRACKETS);
+        EXPECT_EQ(registry.publish(7, "y", symbols), Status::UNBOUND_VARIABLE);
+        EXPECT_EQ(registry.publish(7, CompiledExpression()), Status::EMPTY_EXPRESSION);
+        EXPECT_EQ(reader.evaluate(7, &result), Status::SUCCESS);
+        EXPECT_EQ(result, 6.0);
+
+        CompiledExpression compiled;
+        ASSERT_EQ(compile_expression("x + 1", symbols, &compiled), Status::SUCCESS);
+        EXPECT_EQ(registry.publish(7, compiled), Status::SUCCESS);
+        const CompiledExpression* found = reader.find(7, &version);
+        ASSERT_TRUE(found != NULL);
+        EXPECT_GT(version, first_version);
+        EXPECT_EQ(found->evaluate(&result), Status::SUCCESS);
+        EXPECT_EQ(result, 3.0);
+        reader.release();
+
+        EXPECT_EQ(registry.remove(7), Status::SUCCESS);
+        EXPECT_EQ(registry.remove(7), Status::ERROR);
+        EXPECT_TRUE(reader.find(7) == NULL);
+        EXPECT_EQ(reader.evaluate(7, &result), Status::ERROR);
+        EXPECT_EQ(registry.size(), 0u);
+
+        // Enough ids to rebuild the table several times, with some removed
+        for (uint64_t id = 0; id < 2000; id++)
+            ASSERT_EQ(registry.publish(id << 32, to_string(id) + " + x", symbols), Status::SUCCESS);
+        for (uint64_t id = 0; id < 2000; id += 3) ASSERT_EQ(registry.remove(id << 32), Status::SUCCESS);
+        EXPECT_EQ(registry.size(), 1333u);
+        for (uint64_t id = 0; id < 2000; id++) {
+            Status status = reader.evaluate(id << 32, &result);
+            if (id % 3 == 0) {
+                EXPECT_EQ(status, Status::ERROR) << id;
+            } else {
+                EXPECT_EQ(status, Status::SUCCESS) << id;
+                EXPECT_EQ(result, (double)id + 2.0) << id;
+            }
+        }
+        EXPECT_EQ(registry.reclaim(), 0u);
+    }
+
+    TEST(Registry, FreesVersionsOnceReleased) {
+        SymbolTable symbols;
+        ExpressionRegistry registry;
+        ASSERT_EQ(registry.publish(1, "1", symbols), Status::SUCCESS);
+
+        // A reader holding a version keeps it, and everything replaced after
+        // it, from being freed
+        ExpressionRegistry::Reader holder(registry);
+        ExpressionRegistry::Reader other(registry);
+        const CompiledExpression* held = holder.find(1);
+        ASSERT_TRUE(held != NULL);
+        ASSERT_EQ(registry.publish(1, "2", symbols), Status::SUCCESS);
+        ASSERT_EQ(registry.publish(1, "3", symbols), Status::SUCCESS);
+        ASSERT_EQ(registry.remove(1), Status::SUCCESS);
+        EXPECT_EQ(registry.reclaim(), 3u);
+
+        double result;
+        EXPECT_EQ(held->evaluate(&result), Status::SUCCESS);
+        EXPECT_EQ(result, 1.0);
+        EXPECT_EQ(other.evaluate(1, &result), Status::ERROR);
+        EXPECT_EQ(registry.reclaim(), 3u);
+
+        holder.release();
+        EXPECT_EQ(registry.reclaim(), 0u);
+    }
+
+    TEST(Registry, Threads) {
+        // Readers check that each id only ever moves to later versions, whose
+        // value is the number of times the id was published
+        const size_t num_ids = 64, num_readers = 4, num_writers = 2, num_publishes = 3000;
+        double scale = 1.0;
+        SymbolTable symbols;
+        symbols.bind("scale", &scale);
+        ExpressionRegistry registry;
+        for (uint64_t id = 0; id < num_ids; id++) ASSERT_EQ(registry.publish(id, "0*scale", symbols), Status::SUCCESS);
+
+        atomic<bool> done(false);
+        vector<int> failures(num_readers + num_writers, 0);
+        vector<thread> threads;
+        for (size_t t = 0; t < num_readers; t++) {
+            threads.emplace_back([&, t]() {
+                ExpressionRegistry::Reader reader(registry);
+                vector<uint64_t> last_version(num_ids, 0);
+                vector<double> last_value(num_ids, 0.0);
+                while (!done.load()) {
+                    for (uint64_t id = 0; id < num_ids; id++) {
+                        uint64_t version;
+                        double value;
+                        const CompiledExpression* compiled = reader.find(id, &version);
+                        if (compiled == NULL) continue; // Removed for a moment by its writer
+                        if (compiled->evaluate(&value) != Status::SUCCESS || version < last_version[id] ||
+                            value < last_value[id])
+                            failures[t]++;
+                        last_version[id] = version;
+                        last_value[id] = value;
+                    }
+                    reader.release();
+                }
+            });
+        }
+        for (size_t w = 0; w < num_writers; w++) {
+            threads.emplace_back([&, w]() {
+                // Each writer owns the ids equal to w modulo num_writers
+                vector<size_t> count(num_ids, 0);
+                for (size_t i = 0; i < num_publishes; i++) {
+                    uint64_t id = (i * 7 % (num_ids / num_writers)) * num_writers + w;
+                    string expression = to_string(++count[id]) + "*scale";
+                    if (i % 5 == 0 && registry.remove(id) != Status::SUCCESS) failures[num_readers + w]++;
+                    if (registry.publish(id, expression, symbols) != Status::SUCCESS) failures[num_readers + w]++;
+                }
+            });
+        }
+        for (size_t t = num_readers; t < threads.size(); t++) threads[t].join();
+        done.store(true);
+        for (size_t t = 0; t < num_readers; t++) threads[t].join();
+        for (size_t t = 0; t < failures.size(); t++) EXPECT_EQ(failures[t], 0) << t;
+        EXPECT_EQ(registry.size(), num_ids);
+        EXPECT_EQ(registry.reclaim(), 0u);
+    }
 } // namespace exprparse